@@ -0,0 +1,698 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#include "common.h"
+#include "bsp.h"
+#include "BatchRenderer.h"
+#include "MemoryRegistry.h"
+
+
+// Per command data, fetched once per draw through the base instance.
+struct DrawInstance
+{
+	float fOffset[3];    // Landmark plus chapter offset of the map.
+	float fLightmapLayer; // Layer of the map's atlas in the lightmap array.
+	float fTextureLayer;  // Layer of the texture in its texture array.
+};
+
+// Attribute locations shared by the shader and Render().
+#define ATTRIB_POSITION  0
+#define ATTRIB_TEXCOORD  1
+#define ATTRIB_LIGHTMAP  2
+#define ATTRIB_OFFSET    3
+#define ATTRIB_TEXLAYER  4
+
+static const char *szVertexShader =
+	"#version 130\n"
+	"in vec3 aPosition;\n"
+	"in vec2 aTexCoord;\n"
+	"in vec2 aLightCoord;\n"
+	"in vec4 aOffset;\n"
+	"in float aTexLayer;\n"
+	"out vec3 vTexCoord;\n"
+	"out vec3 vLightCoord;\n"
+	"void main() {\n"
+	"	vTexCoord   = vec3(aTexCoord, aTexLayer);\n"
+	"	vLightCoord = vec3(aLightCoord, aOffset.w);\n"
+	"	gl_Position = gl_ModelViewProjectionMatrix * vec4(aPosition + aOffset.xyz, 1.0);\n"
+	"}\n";
+
+static const char *szFragmentShader =
+	"#version 130\n"
+	"uniform sampler2DArray uTextures;\n"
+	"uniform sampler2DArray uLightmaps;\n"
+	"in vec3 vTexCoord;\n"
+	"in vec3 vLightCoord;\n"
+	"void main() {\n"
+	"	gl_FragColor = texture(uTextures, vTexCoord) * texture(uLightmaps, vLightCoord);\n"
+	"}\n";
+
+
+/**
+ * Compile a single shader stage, printing the log on failure.
+ */
+static GLuint CompileShader(GLenum eType, const char *szSource)
+{
+	GLuint uShader = glCreateShader(eType);
+	glShaderSource(uShader, 1, &szSource, NULL);
+	glCompileShader(uShader);
+
+	GLint iStatus;
+	glGetShaderiv(uShader, GL_COMPILE_STATUS, &iStatus);
+
+	if (iStatus != GL_TRUE) {
+		char szLog[1024];
+		glGetShaderInfoLog(uShader, sizeof(szLog), NULL, szLog);
+		std::cerr << "Can't compile batch shader: " << szLog << std::endl;
+		glDeleteShader(uShader);
+		return 0;
+	}
+
+	return uShader;
+
+}//end CompileShader()
+
+
+/**
+ * Number of mipmap levels used by the loaders for a texture of this size.
+ */
+static int MipLevels(int iWidth, int iHeight)
+{
+	int iLevels = 1;
+
+	while (iLevels < MIPLEVELS && (iWidth >> iLevels) > 0 && (iHeight >> iLevels) > 0) {
+		iLevels++;
+	}
+
+	return iLevels;
+
+}//end MipLevels()
+
+
+/**
+ * Constructor.
+ */
+BatchRenderer::BatchRenderer()
+{
+	this->m_uLightmapArray   = 0;
+	this->m_uVertexBuffer    = 0;
+	this->m_uInstanceBuffer  = 0;
+	this->m_uIndirectBuffer  = 0;
+	this->m_uProgram         = 0;
+	this->m_iLegacyDrawCalls = 0;
+	this->m_uNextCopy        = 0;
+
+}//end BatchRenderer::BatchRenderer()
+
+
+/**
+ * Destructor.
+ */
+BatchRenderer::~BatchRenderer()
+{
+	this->Clear();
+
+	if (this->m_uProgram != 0) {
+		glDeleteProgram(this->m_uProgram);
+	}
+
+}//end BatchRenderer::~BatchRenderer()
+
+
+/**
+ * Multi-draw indirect, texture storage, image copies and base instances are
+ * all core in GL 4.3.
+ */
+bool BatchRenderer::IsSupported()
+{
+	return GLEW_VERSION_4_3 ? true : false;
+
+}//end BatchRenderer::IsSupported()
+
+
+/**
+ * Build the texture arrays, world buffer and indirect commands.
+ * \param vMaps     Maps to batch. Their landmark offsets are resolved here.
+ * \param bDeferred Leave the copies to Continue() instead of making them now.
+ */
+bool BatchRenderer::Build(const std::vector<BSP*> &vMaps, bool bDeferred)
+{
+	this->Clear();
+
+	if (this->m_uProgram == 0 && !this->CreateProgram()) {
+		return false;
+	}
+
+	// Collect every draw of every map. Offsets are resolved in map order, the
+	// same order the per-map path resolves them in.
+	std::vector<std::vector<BSPDRAW> > vMapDraws(vMaps.size());
+	std::vector<VERTEX> vMapOffsets(vMaps.size());
+	std::vector<GLuint> vLightmaps;
+	std::vector<int>    vLightmapLayer(vMaps.size(), -1);
+
+	for (size_t i = 0; i < vMaps.size(); i++) {
+		vMapOffsets[i] = vMaps[i]->GetRenderOffset();
+		vMaps[i]->GetDraws(vMapDraws[i]);
+
+		if (!vMapDraws[i].empty()) {
+			vLightmapLayer[i] = (int)vLightmaps.size();
+			vLightmaps.push_back(vMaps[i]->GetLightmapTexture());
+		}
+
+		this->m_iLegacyDrawCalls += (int)vMapDraws[i].size();
+	}
+
+	// Nothing resident yet, draw nothing.
+	if (vLightmaps.empty()) {
+		return true;
+	}
+
+	// Assign every used texture a layer in the array matching its size and
+	// level count, which differ from the full size when mips were dropped.
+	// Textures that were never found share a blank 1x1 array.
+	std::map<std::pair<std::pair<int, int>, int>, int> mArrayBySize;
+	std::vector<std::pair<int, int> > vLayerByTexture; // (array, layer) by texture id, (-1, -1) when unused
+
+	for (size_t i = 0; i < vMapDraws.size(); i++) {
+		for (size_t j = 0; j < vMapDraws[i].size(); j++) {
+			size_t uTexture = (size_t)vMapDraws[i][j].texture;
+
+			if (uTexture >= vLayerByTexture.size()) {
+				vLayerByTexture.resize(uTexture + 1, std::make_pair(-1, -1));
+			}
+
+			if (vLayerByTexture[uTexture].first >= 0) {
+				continue;
+			}
+
+			const TEXTURE &t = *vMapDraws[i][j].tex;
+			std::pair<std::pair<int, int>, int> size(std::make_pair(0, 0), 1);
+
+			if (t.texId != 0) {
+				size.first  = std::make_pair(t.w >> t.mipDrop, t.h >> t.mipDrop);
+				size.second = std::min(MipLevels(t.w, t.h) - t.mipDrop, MipLevels(size.first.first, size.first.second));
+			}
+
+			if (mArrayBySize.count(size) == 0) {
+				TextureArray a;
+				a.iWidth  = size.first.first  != 0 ? size.first.first  : 1;
+				a.iHeight = size.first.second != 0 ? size.first.second : 1;
+				a.iLevels = size.second;
+				a.uTexId  = 0;
+				mArrayBySize[size] = (int)this->m_vArrays.size();
+				this->m_vArrays.push_back(a);
+			}
+
+			TextureArray &a = this->m_vArrays[mArrayBySize[size]];
+			vLayerByTexture[uTexture] = std::make_pair(mArrayBySize[size], (int)a.vSources.size());
+			a.vSources.push_back(t.texId);
+			a.vTextures.push_back(&t);
+		}
+	}
+
+	// The texture arrays are filled straight from the already uploaded 2D textures.
+	for (size_t i = 0; i < this->m_vArrays.size(); i++) {
+		TextureArray &a = this->m_vArrays[i];
+
+		glGenTextures(1, &a.uTexId);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, a.uTexId);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, a.iLevels - 1);
+		glTexStorage3D(GL_TEXTURE_2D_ARRAY, a.iLevels, GL_RGBA8, a.iWidth, a.iHeight, (GLsizei)a.vSources.size());
+
+		size_t uLayerBytes = 0;
+		for (int level = 0; level < a.iLevels; level++) {
+			uLayerBytes += (size_t)(a.iWidth >> level) * (a.iHeight >> level) * 4;
+		}
+		g_gpuMemory.TrackTexture(a.uTexId, MemoryRegistry::CATEGORY_BATCH, "batch", uLayerBytes * a.vSources.size());
+
+		for (size_t layer = 0; layer < a.vSources.size(); layer++) {
+			if (a.vSources[layer] == 0) {
+				const GLubyte white[4] = {255, 255, 255, 255};
+				glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, (GLint)layer, 1, 1, 1, GL_RGBA, GL_UNSIGNED_BYTE, white);
+				continue;
+			}
+
+			PendingCopy c;
+			c.eKind   = COPY_LAYER;
+			c.iArray  = (int)i;
+			c.uLayer  = layer;
+			c.uBuffer = 0;
+			c.uOffset = 0;
+			c.uBytes  = uLayerBytes;
+			this->m_vCopies.push_back(c);
+		}
+	}
+
+	// Kept to follow streamed mip levels.
+	this->m_vLayerByTexture = vLayerByTexture;
+
+	// Every lightmap atlas becomes one layer.
+	glGenTextures(1, &this->m_uLightmapArray);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, this->m_uLightmapArray);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexStorage3D(GL_TEXTURE_2D_ARRAY, 1, GL_RGB8, 1024, 1024, (GLsizei)vLightmaps.size());
+	g_gpuMemory.TrackTexture(this->m_uLightmapArray, MemoryRegistry::CATEGORY_BATCH, "batch", (size_t)1024 * 1024 * 3 * vLightmaps.size());
+
+	for (size_t layer = 0; layer < vLightmaps.size(); layer++) {
+		PendingCopy c;
+		c.eKind   = COPY_LIGHTMAP;
+		c.iArray  = -1;
+		c.uLayer  = layer;
+		c.uBuffer = 0;
+		c.uOffset = 0;
+		c.uBytes  = (size_t)1024 * 1024 * 3;
+		this->m_vCopies.push_back(c);
+	}
+
+	// Kept to follow animated light styles.
+	this->m_vLightmapLayer   = vLightmapLayer;
+	this->m_vLightmapSources = vLightmaps;
+
+	// Build the commands grouped by texture array, and lay the vertices of
+	// each draw out in the world buffer in the same order.
+	std::vector<std::vector<std::pair<size_t, size_t> > > vArrayDraws(this->m_vArrays.size());
+	GLsizeiptr iTotalVerts = 0;
+
+	for (size_t i = 0; i < vMapDraws.size(); i++) {
+		for (size_t j = 0; j < vMapDraws[i].size(); j++) {
+			vArrayDraws[vLayerByTexture[vMapDraws[i][j].texture].first].push_back(std::make_pair(i, j));
+			iTotalVerts += vMapDraws[i][j].vertCount;
+		}
+	}
+
+	glGenBuffers(1, &this->m_uVertexBuffer);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, this->m_uVertexBuffer);
+	glBufferData(GL_COPY_WRITE_BUFFER, iTotalVerts * sizeof(VECFINAL), NULL, GL_STATIC_DRAW);
+	g_gpuMemory.TrackBuffer(this->m_uVertexBuffer, MemoryRegistry::CATEGORY_BATCH, "batch", iTotalVerts * sizeof(VECFINAL));
+
+	std::vector<DrawArraysIndirectCommand> &vCommands = this->m_vCommands;
+	std::vector<DrawInstance>              vInstances;
+	GLuint uFirstVertex = 0;
+
+	for (size_t a = 0; a < vArrayDraws.size(); a++) {
+		DrawGroup group;
+		group.iArray        = (int)a;
+		group.uFirstCommand = vCommands.size();
+		group.iCommands     = (int)vArrayDraws[a].size();
+		group.iActive       = group.iCommands;
+
+		for (size_t k = 0; k < vArrayDraws[a].size(); k++) {
+			size_t iMap = vArrayDraws[a][k].first;
+			const BSPDRAW &d = vMapDraws[iMap][vArrayDraws[a][k].second];
+
+			PendingCopy c;
+			c.eKind   = COPY_VERTICES;
+			c.iArray  = -1;
+			c.uLayer  = 0;
+			c.uBuffer = d.bufObject;
+			c.uOffset = uFirstVertex * sizeof(VECFINAL);
+			c.uBytes  = d.vertCount * sizeof(VECFINAL);
+			this->m_vCopies.push_back(c);
+
+			DrawArraysIndirectCommand cmd;
+			cmd.count         = d.vertCount;
+			cmd.instanceCount = 1;
+			cmd.first         = uFirstVertex;
+			cmd.baseInstance  = (GLuint)vCommands.size();
+			vCommands.push_back(cmd);
+			this->m_vCommandMaps.push_back(iMap);
+
+			DrawInstance inst;
+			inst.fOffset[0]     = vMapOffsets[iMap].x;
+			inst.fOffset[1]     = vMapOffsets[iMap].y;
+			inst.fOffset[2]     = vMapOffsets[iMap].z;
+			inst.fLightmapLayer = (float)vLightmapLayer[iMap];
+			inst.fTextureLayer  = (float)vLayerByTexture[d.texture].second;
+			vInstances.push_back(inst);
+
+			uFirstVertex += d.vertCount;
+		}
+
+		this->m_vGroups.push_back(group);
+	}
+
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+	glGenBuffers(1, &this->m_uInstanceBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, this->m_uInstanceBuffer);
+	glBufferData(GL_ARRAY_BUFFER, vInstances.size() * sizeof(DrawInstance), &vInstances[0], GL_STATIC_DRAW);
+	g_gpuMemory.TrackBuffer(this->m_uInstanceBuffer, MemoryRegistry::CATEGORY_BATCH, "batch", vInstances.size() * sizeof(DrawInstance));
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	glGenBuffers(1, &this->m_uIndirectBuffer);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, this->m_uIndirectBuffer);
+	glBufferData(GL_DRAW_INDIRECT_BUFFER, vCommands.size() * sizeof(DrawArraysIndirectCommand), &vCommands[0], GL_DYNAMIC_DRAW);
+	g_gpuMemory.TrackBuffer(this->m_uIndirectBuffer, MemoryRegistry::CATEGORY_BATCH, "batch", vCommands.size() * sizeof(DrawArraysIndirectCommand));
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+
+	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+	if (!bDeferred) {
+		this->Continue(0);
+	}
+
+	return true;
+
+}//end BatchRenderer::Build()
+
+
+/**
+ * Make the copies a deferred build has left, in order. The maps must not
+ * change in between, a new Build() follows every change.
+ * \param uBytes Bytes to copy at most, at least one copy is made. 0 for all of them.
+ * \return True once the batch can be drawn.
+ */
+bool BatchRenderer::Continue(size_t uBytes)
+{
+	size_t uCopied = 0;
+
+	while (this->m_uNextCopy < this->m_vCopies.size() && (uBytes == 0 || uCopied < uBytes)) {
+		const PendingCopy &c = this->m_vCopies[this->m_uNextCopy++];
+
+		if (c.eKind == COPY_LAYER) {
+			this->CopyLayer(this->m_vArrays[c.iArray], c.uLayer, true);
+		} else if (c.eKind == COPY_LIGHTMAP) {
+			glCopyImageSubData(this->m_vLightmapSources[c.uLayer], GL_TEXTURE_2D, 0, 0, 0, 0,
+			                   this->m_uLightmapArray, GL_TEXTURE_2D_ARRAY, 0, 0, 0, (GLint)c.uLayer,
+			                   1024, 1024, 1);
+		} else {
+			glBindBuffer(GL_COPY_READ_BUFFER, c.uBuffer);
+			glBindBuffer(GL_COPY_WRITE_BUFFER, this->m_uVertexBuffer);
+			glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, c.uOffset, c.uBytes);
+		}
+
+		uCopied += c.uBytes;
+	}
+
+	glBindBuffer(GL_COPY_READ_BUFFER, 0);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+	return this->IsReady();
+
+}//end BatchRenderer::Continue()
+
+
+/**
+ * Draw the batched world.
+ * \param pMask Optional flag per map passed to Build, maps flagged 0 are
+ *              skipped. The indirect buffer is only rewritten when the
+ *              mask changes.
+ * \return Number of draw calls issued.
+ */
+int BatchRenderer::Render(const std::vector<char> *pMask)
+{
+	if (this->m_vGroups.empty() || !this->IsReady()) {
+		return 0;
+	}
+
+	this->ApplyMask(pMask);
+
+	// The per-map path leaves its client arrays enabled.
+	glClientActiveTexture(GL_TEXTURE1);
+	glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+	glClientActiveTexture(GL_TEXTURE0);
+	glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+	glDisableClientState(GL_VERTEX_ARRAY);
+
+	glUseProgram(this->m_uProgram);
+
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, this->m_uLightmapArray);
+
+	glBindBuffer(GL_ARRAY_BUFFER, this->m_uVertexBuffer);
+	glEnableVertexAttribArray(ATTRIB_POSITION);
+	glEnableVertexAttribArray(ATTRIB_TEXCOORD);
+	glEnableVertexAttribArray(ATTRIB_LIGHTMAP);
+	glVertexAttribPointer(ATTRIB_POSITION, 3, GL_FLOAT, GL_FALSE, sizeof(VECFINAL), (void*)0);
+	glVertexAttribPointer(ATTRIB_TEXCOORD, 2, GL_FLOAT, GL_FALSE, sizeof(VECFINAL), (char*)NULL+4*3);
+	glVertexAttribPointer(ATTRIB_LIGHTMAP, 2, GL_FLOAT, GL_FALSE, sizeof(VECFINAL), (char*)NULL+4*5);
+
+	glBindBuffer(GL_ARRAY_BUFFER, this->m_uInstanceBuffer);
+	glEnableVertexAttribArray(ATTRIB_OFFSET);
+	glEnableVertexAttribArray(ATTRIB_TEXLAYER);
+	glVertexAttribPointer(ATTRIB_OFFSET,   4, GL_FLOAT, GL_FALSE, sizeof(DrawInstance), (void*)0);
+	glVertexAttribPointer(ATTRIB_TEXLAYER, 1, GL_FLOAT, GL_FALSE, sizeof(DrawInstance), (char*)NULL+4*4);
+	glVertexAttribDivisor(ATTRIB_OFFSET,   1);
+	glVertexAttribDivisor(ATTRIB_TEXLAYER, 1);
+
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, this->m_uIndirectBuffer);
+	glActiveTexture(GL_TEXTURE0);
+
+	int iDrawCalls = 0;
+
+	for (size_t i = 0; i < this->m_vGroups.size(); i++) {
+		const DrawGroup &group = this->m_vGroups[i];
+
+		if (group.iActive == 0) {
+			continue;
+		}
+
+		glBindTexture(GL_TEXTURE_2D_ARRAY, this->m_vArrays[group.iArray].uTexId);
+		glMultiDrawArraysIndirect(GL_TRIANGLES, (char*)NULL + group.uFirstCommand * sizeof(DrawArraysIndirectCommand), group.iActive, 0);
+		iDrawCalls++;
+	}
+
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	glVertexAttribDivisor(ATTRIB_OFFSET,   0);
+	glVertexAttribDivisor(ATTRIB_TEXLAYER, 0);
+
+	for (GLuint i = ATTRIB_POSITION; i <= ATTRIB_TEXLAYER; i++) {
+		glDisableVertexAttribArray(i);
+	}
+
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+	glUseProgram(0);
+
+	return iDrawCalls;
+
+}//end BatchRenderer::Render()
+
+
+/**
+ * Copy a changed rectangle of a map's lightmap atlas into its layer.
+ * \param iMap Index of the map in the vector passed to Build.
+ */
+void BatchRenderer::UpdateLightmap(size_t iMap, int x, int y, int w, int h)
+{
+	if (iMap >= this->m_vLightmapLayer.size() || this->m_vLightmapLayer[iMap] < 0) {
+		return;
+	}
+
+	int iLayer = this->m_vLightmapLayer[iMap];
+
+	glCopyImageSubData(this->m_vLightmapSources[iLayer], GL_TEXTURE_2D, 0, x, y, 0,
+	                   this->m_uLightmapArray, GL_TEXTURE_2D_ARRAY, 0, x, y, iLayer,
+	                   w, h, 1);
+
+}//end BatchRenderer::UpdateLightmap()
+
+
+/**
+ * Copy the levels streamed into textures since Build into their layers.
+ * \param vTextures Ids in g_textures, see MipStreamer::Update().
+ */
+void BatchRenderer::UpdateTextures(const std::vector<int> &vTextures)
+{
+	for (size_t i = 0; i < vTextures.size(); i++) {
+		if ((size_t)vTextures[i] >= this->m_vLayerByTexture.size() || this->m_vLayerByTexture[vTextures[i]].first < 0) {
+			continue;
+		}
+
+		TextureArray   &a = this->m_vArrays[this->m_vLayerByTexture[vTextures[i]].first];
+		size_t     uLayer = (size_t)this->m_vLayerByTexture[vTextures[i]].second;
+		const TEXTURE  &t = *a.vTextures[uLayer];
+
+		// Reloaded to another size since Build, the next Build picks it up.
+		if (a.vSources[uLayer] == 0 || (t.w >> t.mipDrop) != a.iWidth || (t.h >> t.mipDrop) != a.iHeight) {
+			continue;
+		}
+
+		this->CopyLayer(a, uLayer, false);
+	}
+
+}//end BatchRenderer::UpdateTextures()
+
+
+/**
+ * Copy the levels a layer's texture has, and fill the ones still being
+ * streamed in with its average colour.
+ * \param a      Array of the layer.
+ * \param uLayer Layer to copy.
+ * \param bFill  Fill the missing levels too.
+ */
+void BatchRenderer::CopyLayer(TextureArray &a, size_t uLayer, bool bFill)
+{
+	const TEXTURE &t = *a.vTextures[uLayer];
+
+	for (int level = 0; level < a.iLevels; level++) {
+		int iWidth  = std::max(a.iWidth >> level, 1);
+		int iHeight = std::max(a.iHeight >> level, 1);
+
+		if (level >= t.baseLevel) {
+			glCopyImageSubData(a.vSources[uLayer], GL_TEXTURE_2D, level, 0, 0, 0,
+			                   a.uTexId, GL_TEXTURE_2D_ARRAY, level, 0, 0, (GLint)uLayer,
+			                   iWidth, iHeight, 1);
+		} else if (bFill) {
+			std::vector<GLubyte> vPixels((size_t)iWidth * iHeight * 4, 255);
+
+			for (size_t p = 0; p < vPixels.size(); p += 4) {
+				vPixels[p]     = t.avg[0];
+				vPixels[p + 1] = t.avg[1];
+				vPixels[p + 2] = t.avg[2];
+			}
+
+			glBindTexture(GL_TEXTURE_2D_ARRAY, a.uTexId);
+			glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, (GLint)uLayer, iWidth, iHeight, 1, GL_RGBA, GL_UNSIGNED_BYTE, &vPixels[0]);
+		}
+	}
+
+}//end BatchRenderer::CopyLayer()
+
+
+/**
+ * Rewrite the indirect buffer with only the commands of masked in maps.
+ * Each group keeps its range, its surviving commands are packed at the front.
+ */
+void BatchRenderer::ApplyMask(const std::vector<char> *pMask)
+{
+	std::vector<char> vEmpty;
+	const std::vector<char> &vMask = pMask ? *pMask : vEmpty;
+
+	if (vMask == this->m_vMask) {
+		return;
+	}
+
+	this->m_vMask = vMask;
+
+	std::vector<DrawArraysIndirectCommand> vCompact(this->m_vCommands.size());
+
+	for (size_t i = 0; i < this->m_vGroups.size(); i++) {
+		DrawGroup &group = this->m_vGroups[i];
+		group.iActive = 0;
+
+		for (int k = 0; k < group.iCommands; k++) {
+			size_t c    = group.uFirstCommand + k;
+			size_t iMap = this->m_vCommandMaps[c];
+
+			if (vMask.empty() || (iMap < vMask.size() && vMask[iMap] != 0)) {
+				vCompact[group.uFirstCommand + group.iActive] = this->m_vCommands[c];
+				group.iActive++;
+			}
+		}
+	}
+
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, this->m_uIndirectBuffer);
+	glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, vCompact.size() * sizeof(DrawArraysIndirectCommand), &vCompact[0]);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+
+}//end BatchRenderer::ApplyMask()
+
+
+/**
+ * Release all GL objects.
+ */
+void BatchRenderer::Clear()
+{
+	for (size_t i = 0; i < this->m_vArrays.size(); i++) {
+		g_gpuMemory.ReleaseTexture(this->m_vArrays[i].uTexId);
+		glDeleteTextures(1, &this->m_vArrays[i].uTexId);
+	}
+
+	if (this->m_uLightmapArray != 0) {
+		g_gpuMemory.ReleaseTexture(this->m_uLightmapArray);
+		glDeleteTextures(1, &this->m_uLightmapArray);
+	}
+
+	GLuint buffers[3] = {this->m_uVertexBuffer, this->m_uInstanceBuffer, this->m_uIndirectBuffer};
+	for (int i = 0; i < 3; i++) {
+		g_gpuMemory.ReleaseBuffer(buffers[i]);
+	}
+	glDeleteBuffers(3, buffers);
+
+	this->m_vArrays.clear();
+	this->m_vLayerByTexture.clear();
+	this->m_vGroups.clear();
+	this->m_vCommands.clear();
+	this->m_vCommandMaps.clear();
+	this->m_vCopies.clear();
+	this->m_vMask.clear();
+	this->m_vLightmapLayer.clear();
+	this->m_vLightmapSources.clear();
+	this->m_uLightmapArray   = 0;
+	this->m_uVertexBuffer    = 0;
+	this->m_uInstanceBuffer  = 0;
+	this->m_uIndirectBuffer  = 0;
+	this->m_iLegacyDrawCalls = 0;
+	this->m_uNextCopy        = 0;
+
+}//end BatchRenderer::Clear()
+
+
+/**
+ * Compile and link the array shader.
+ */
+bool BatchRenderer::CreateProgram()
+{
+	GLuint uVertex   = CompileShader(GL_VERTEX_SHADER,   szVertexShader);
+	GLuint uFragment = CompileShader(GL_FRAGMENT_SHADER, szFragmentShader);
+
+	if (uVertex == 0 || uFragment == 0) {
+		return false;
+	}
+
+	this->m_uProgram = glCreateProgram();
+	glAttachShader(this->m_uProgram, uVertex);
+	glAttachShader(this->m_uProgram, uFragment);
+	glBindAttribLocation(this->m_uProgram, ATTRIB_POSITION, "aPosition");
+	glBindAttribLocation(this->m_uProgram, ATTRIB_TEXCOORD, "aTexCoord");
+	glBindAttribLocation(this->m_uProgram, ATTRIB_LIGHTMAP, "aLightCoord");
+	glBindAttribLocation(this->m_uProgram, ATTRIB_OFFSET,   "aOffset");
+	glBindAttribLocation(this->m_uProgram, ATTRIB_TEXLAYER, "aTexLayer");
+	glLinkProgram(this->m_uProgram);
+
+	glDeleteShader(uVertex);
+	glDeleteShader(uFragment);
+
+	GLint iStatus;
+	glGetProgramiv(this->m_uProgram, GL_LINK_STATUS, &iStatus);
+
+	if (iStatus != GL_TRUE) {
+		char szLog[1024];
+		glGetProgramInfoLog(this->m_uProgram, sizeof(szLog), NULL, szLog);
+		std::cerr << "Can't link batch shader: " << szLog << std::endl;
+		glDeleteProgram(this->m_uProgram);
+		this->m_uProgram = 0;
+		return false;
+	}
+
+	glUseProgram(this->m_uProgram);
+	glUniform1i(glGetUniformLocation(this->m_uProgram, "uTextures"),  0);
+	glUniform1i(glGetUniformLocation(this->m_uProgram, "uLightmaps"), 1);
+	glUseProgram(0);
+
+	return true;
+
+}//end BatchRenderer::CreateProgram()
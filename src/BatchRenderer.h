@@ -0,0 +1,187 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#ifndef BATCHRENDERER_H
+#define BATCHRENDERER_H
+
+#include <vector>
+#include <map>
+#include <utility>
+#include <cstddef>
+
+class BSP;
+struct TEXTURE;
+
+// Bytes a deferred build copies per frame, see BatchRenderer::Continue().
+#define BATCH_COPY_BYTES (32*1024*1024)
+
+
+/**
+ * Renders every loaded map with a handful of glMultiDrawArraysIndirect calls.
+ *
+ * World textures are copied into GL_TEXTURE_2D_ARRAYs grouped by size, and
+ * every map's lightmap atlas becomes one layer of a lightmap array. All map
+ * vertices are copied into a single buffer, and each (map, texture) pair
+ * becomes one indirect command whose base instance selects its offset and
+ * layers. One multi-draw is issued per texture array.
+ *
+ * A deferred build lays the arrays and buffers out at once and copies the
+ * layers and vertices into them over the next frames, so a map streamed in
+ * doesn't stall the frame on a copy of the whole world. The maps are drawn
+ * one by one until it is done.
+ */
+class BatchRenderer
+{
+public:
+	/** Constructor */
+	BatchRenderer();
+
+	/** Destructor */
+	~BatchRenderer();
+
+	/** Check if the GL context has everything the batched path needs. */
+	static bool IsSupported();
+
+	/**
+	 * Build the texture arrays, world buffer and indirect commands.
+	 * \param vMaps     Maps to batch. Their landmark offsets are resolved here.
+	 * \param bDeferred Leave the copies to Continue() instead of making them now.
+	 */
+	bool Build(const std::vector<BSP*> &vMaps, bool bDeferred = false);
+
+	/**
+	 * Make the copies a deferred build has left, in order.
+	 * \param uBytes Bytes to copy at most, at least one copy is made. 0 for all of them.
+	 * \return True once the batch can be drawn.
+	 */
+	bool Continue(size_t uBytes);
+
+	/** Check if every copy of the last build was made, so Render() draws the world. */
+	bool IsReady() const { return this->m_uNextCopy == this->m_vCopies.size(); }
+
+	/**
+	 * Draw the batched world.
+	 * \param pMask Optional flag per map passed to Build, maps flagged 0 are
+	 *              skipped. The indirect buffer is only rewritten when the
+	 *              mask changes.
+	 * \return Number of draw calls issued.
+	 */
+	int Render(const std::vector<char> *pMask = NULL);
+
+	/**
+	 * Copy a changed rectangle of a map's lightmap atlas into its layer.
+	 * \param iMap Index of the map in the vector passed to Build.
+	 */
+	void UpdateLightmap(size_t iMap, int x, int y, int w, int h);
+
+	/**
+	 * Copy the levels streamed into textures since Build into their layers.
+	 * \param vTextures Ids in g_textures, see MipStreamer::Update().
+	 */
+	void UpdateTextures(const std::vector<int> &vTextures);
+
+	/** Number of draw calls issued per frame by the batched path. */
+	int GetDrawCalls() const { return (int)this->m_vGroups.size(); }
+
+	/** Number of draw calls the per-map path would issue for the same maps. */
+	int GetLegacyDrawCalls() const { return this->m_iLegacyDrawCalls; }
+
+private:
+	/** Release all GL objects. */
+	void Clear();
+
+	/** Compile and link the array shader. */
+	bool CreateProgram();
+
+	/** One texture array, holding every texture of a given size. */
+	struct TextureArray
+	{
+		int          iWidth;      /** Width of each layer. */
+		int          iHeight;     /** Height of each layer. */
+		int          iLevels;     /** Mipmap levels per layer. */
+		unsigned int uTexId;      /** GL texture array object. */
+		std::vector<unsigned int> vSources; /** 2D textures copied into each layer. */
+		std::vector<const TEXTURE*> vTextures; /** Their entries, for the levels they have. */
+	};
+
+	/** Copy the levels a layer's texture has, and fill the others with its average colour. */
+	void CopyLayer(TextureArray &a, size_t uLayer, bool bFill);
+
+	/** Layout of one GL_DRAW_INDIRECT_BUFFER entry. */
+	struct DrawArraysIndirectCommand
+	{
+		unsigned int count;
+		unsigned int instanceCount;
+		unsigned int first;
+		unsigned int baseInstance;
+	};
+
+	/** Commands drawn with one glMultiDrawArraysIndirect call. */
+	struct DrawGroup
+	{
+		int    iArray;        /** Index into m_vArrays. */
+		size_t uFirstCommand; /** First command in the indirect buffer. */
+		int    iCommands;     /** Number of commands. */
+		int    iActive;       /** Commands left after applying the map mask. */
+	};
+
+	/** Rewrite the indirect buffer with only the commands of masked in maps. */
+	void ApplyMask(const std::vector<char> *pMask);
+
+	/** What a copy of a build fills. */
+	enum CopyKind
+	{
+		COPY_LAYER,    /** A layer of a texture array, from its 2D texture. */
+		COPY_LIGHTMAP, /** A layer of the lightmap array, from a map's atlas. */
+		COPY_VERTICES  /** A range of the world buffer, from a draw's buffer. */
+	};
+
+	/** One copy into the batch, made by Continue(). */
+	struct PendingCopy
+	{
+		CopyKind     eKind;
+		int          iArray;  /** Texture array of a layer copy. */
+		size_t       uLayer;  /** Layer, of the texture or lightmap array. */
+		unsigned int uBuffer; /** Source buffer of a vertex copy. */
+		size_t       uOffset; /** Where it goes in the world buffer, in bytes. */
+		size_t       uBytes;  /** Size of the copy. */
+	};
+
+	std::vector<TextureArray> m_vArrays;      /** Texture arrays, one per size. */
+	std::vector<std::pair<int, int> > m_vLayerByTexture; /** (array, layer) by texture id, (-1, -1) when unused. */
+	std::vector<DrawGroup>    m_vGroups;      /** Multi-draws issued per frame. */
+	std::vector<DrawArraysIndirectCommand> m_vCommands; /** Every command, in group order. */
+	std::vector<size_t>       m_vCommandMaps; /** Map index of each command. */
+	std::vector<PendingCopy>  m_vCopies;      /** Copies of the last build, in order. */
+	size_t                    m_uNextCopy;    /** First copy not made yet. */
+	std::vector<char>         m_vMask;        /** Mask the indirect buffer was written with, empty for all maps. */
+	unsigned int m_uLightmapArray;            /** Every map's lightmap atlas, one per layer. */
+	std::vector<int>          m_vLightmapLayer;   /** Layer of each map, -1 when not batched. */
+	std::vector<unsigned int> m_vLightmapSources; /** Atlas copied into each layer. */
+	unsigned int m_uVertexBuffer;             /** Vertices of every map. */
+	unsigned int m_uInstanceBuffer;           /** Offset and layers of every command. */
+	unsigned int m_uIndirectBuffer;           /** DrawArraysIndirectCommand of every command. */
+	unsigned int m_uProgram;                  /** Array shader program. */
+	int          m_iLegacyDrawCalls;          /** Draws the per-map path would issue. */
+
+};//end BatchRenderer
+
+#endif //BATCHRENDERER_H
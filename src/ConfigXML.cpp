@@ -37,6 +37,47 @@ ConfigXML::ConfigXML()
 	this->m_bFullscreen    = false;
 	this->m_bMultisampling = false;
 	this->m_bVsync         = true;
+	this->m_bBatching      = true;
+	this->m_bStreaming     = false;
+	this->m_fStreamRadius  = 8192.0f;
+	this->m_fStreamHysteresis = 2048.0f;
+	this->m_iStreamBudget  = 512;
+	this->m_bLod           = true;
+	this->m_fLodPixels[0]  = 256.0f;
+	this->m_fLodPixels[1]  = 64.0f;
+	this->m_bOcclusion     = true;
+	this->m_iOccluderMaps  = 8;
+	this->m_iGpuBudget     = 0;
+	this->m_bKeepHostGeometry = false;
+	this->m_bTextureCache  = true;
+	this->m_szTextureCache = "texcache";
+	this->m_bHotReload     = true;
+	this->m_iUploadRing    = 32;
+	this->m_bPicking       = true;
+	this->m_iJobThreads    = 0;
+	this->m_bDynamicResolution = false;
+	this->m_fFrameTarget   = 16.6f;
+	this->m_fMinScale      = 0.5f;
+	this->m_fMaxScale      = 1.0f;
+	this->m_bLightStyles   = true;
+	this->m_iLightBudget   = 64;
+	this->m_bMipStreaming  = true;
+	this->m_iMipBudget     = 512;
+	this->m_fMipBias       = 1.0f;
+	this->m_fMipKeep       = 10.0f;
+	this->m_bFrontToBack   = false;
+	this->m_iCaptureFps    = 30;
+	this->m_iCaptureRing   = 3;
+	this->m_iTilePort      = 8080;
+	this->m_iTileSize      = 256;
+	this->m_bTileIsometric = false;
+	this->m_iTileMaxZoom   = 8;
+	this->m_iTileQueue     = 64;
+	this->m_iTileThreads   = 8;
+	this->m_iTilesPerFrame = 4;
+	this->m_iTileMemory    = 64;
+	this->m_iTileDisk      = 512;
+	this->m_szTileCache    = "tilecache";
 
 	this->m_szGamePaths.push_back(HALFLIFE_DEFAULT_GAMEPATH);
 	this->m_szGamePaths.push_back(CSTRIKE_DEFAULT_GAMEPATH);
@@ -97,6 +138,133 @@ XMLError ConfigXML::LoadProgramConfig()
 	window->QueryBoolAttribute    ("multisampling", &this->m_bMultisampling);
 	window->QueryBoolAttribute    ("vsync",         &this->m_bVsync        );
 
+	XMLElement *renderer = rootNode->FirstChildElement("renderer");
+
+	if (renderer != nullptr) {
+		renderer->QueryBoolAttribute("batching", &this->m_bBatching);
+	}
+
+	XMLElement *streaming = rootNode->FirstChildElement("streaming");
+
+	if (streaming != nullptr) {
+		streaming->QueryBoolAttribute    ("enabled",    &this->m_bStreaming       );
+		streaming->QueryFloatAttribute   ("radius",     &this->m_fStreamRadius    );
+		streaming->QueryFloatAttribute   ("hysteresis", &this->m_fStreamHysteresis);
+		streaming->QueryUnsignedAttribute("budget",     &this->m_iStreamBudget    );
+	}
+
+	XMLElement *lod = rootNode->FirstChildElement("lod");
+
+	if (lod != nullptr) {
+		lod->QueryBoolAttribute ("enabled", &this->m_bLod         );
+		lod->QueryFloatAttribute("level1",  &this->m_fLodPixels[0]);
+		lod->QueryFloatAttribute("level2",  &this->m_fLodPixels[1]);
+	}
+
+	XMLElement *occlusion = rootNode->FirstChildElement("occlusion");
+
+	if (occlusion != nullptr) {
+		occlusion->QueryBoolAttribute    ("enabled",   &this->m_bOcclusion   );
+		occlusion->QueryUnsignedAttribute("occluders", &this->m_iOccluderMaps);
+	}
+
+	XMLElement *memory = rootNode->FirstChildElement("memory");
+
+	if (memory != nullptr) {
+		memory->QueryUnsignedAttribute("budget",   &this->m_iGpuBudget       );
+		memory->QueryBoolAttribute    ("keephost", &this->m_bKeepHostGeometry);
+	}
+
+	XMLElement *texturecache = rootNode->FirstChildElement("texturecache");
+
+	if (texturecache != nullptr) {
+		texturecache->QueryBoolAttribute("enabled", &this->m_bTextureCache);
+
+		if (texturecache->Attribute("path") != nullptr) {
+			this->m_szTextureCache = texturecache->Attribute("path");
+		}
+	}
+
+	XMLElement *hotreload = rootNode->FirstChildElement("hotreload");
+
+	if (hotreload != nullptr) {
+		hotreload->QueryBoolAttribute("enabled", &this->m_bHotReload);
+	}
+
+	XMLElement *uploads = rootNode->FirstChildElement("uploads");
+
+	if (uploads != nullptr) {
+		uploads->QueryUnsignedAttribute("ring", &this->m_iUploadRing);
+	}
+
+	XMLElement *picking = rootNode->FirstChildElement("picking");
+
+	if (picking != nullptr) {
+		picking->QueryBoolAttribute("enabled", &this->m_bPicking);
+	}
+
+	XMLElement *jobs = rootNode->FirstChildElement("jobs");
+
+	if (jobs != nullptr) {
+		jobs->QueryUnsignedAttribute("threads", &this->m_iJobThreads);
+	}
+
+	XMLElement *resolution = rootNode->FirstChildElement("resolution");
+
+	if (resolution != nullptr) {
+		resolution->QueryBoolAttribute ("dynamic", &this->m_bDynamicResolution);
+		resolution->QueryFloatAttribute("target",  &this->m_fFrameTarget      );
+		resolution->QueryFloatAttribute("min",     &this->m_fMinScale         );
+		resolution->QueryFloatAttribute("max",     &this->m_fMaxScale         );
+	}
+
+	XMLElement *lightstyles = rootNode->FirstChildElement("lightstyles");
+
+	if (lightstyles != nullptr) {
+		lightstyles->QueryBoolAttribute    ("enabled", &this->m_bLightStyles);
+		lightstyles->QueryUnsignedAttribute("budget",  &this->m_iLightBudget);
+	}
+
+	XMLElement *mipstreaming = rootNode->FirstChildElement("mipstreaming");
+
+	if (mipstreaming != nullptr) {
+		mipstreaming->QueryBoolAttribute    ("enabled", &this->m_bMipStreaming);
+		mipstreaming->QueryUnsignedAttribute("budget",  &this->m_iMipBudget   );
+		mipstreaming->QueryFloatAttribute   ("bias",    &this->m_fMipBias     );
+		mipstreaming->QueryFloatAttribute   ("keep",    &this->m_fMipKeep     );
+	}
+
+	XMLElement *draworder = rootNode->FirstChildElement("draworder");
+
+	if (draworder != nullptr) {
+		draworder->QueryBoolAttribute("frontToBack", &this->m_bFrontToBack);
+	}
+
+	XMLElement *capture = rootNode->FirstChildElement("capture");
+
+	if (capture != nullptr) {
+		capture->QueryUnsignedAttribute("fps",  &this->m_iCaptureFps );
+		capture->QueryUnsignedAttribute("ring", &this->m_iCaptureRing);
+	}
+
+	XMLElement *tileserver = rootNode->FirstChildElement("tileserver");
+
+	if (tileserver != nullptr) {
+		tileserver->QueryUnsignedAttribute("port",      &this->m_iTilePort     );
+		tileserver->QueryUnsignedAttribute("size",      &this->m_iTileSize     );
+		tileserver->QueryBoolAttribute    ("isometric", &this->m_bTileIsometric);
+		tileserver->QueryUnsignedAttribute("maxZoom",   &this->m_iTileMaxZoom  );
+		tileserver->QueryUnsignedAttribute("queue",     &this->m_iTileQueue    );
+		tileserver->QueryUnsignedAttribute("threads",   &this->m_iTileThreads  );
+		tileserver->QueryUnsignedAttribute("perFrame",  &this->m_iTilesPerFrame);
+		tileserver->QueryUnsignedAttribute("memory",    &this->m_iTileMemory   );
+		tileserver->QueryUnsignedAttribute("disk",      &this->m_iTileDisk     );
+
+		if (tileserver->Attribute("path") != nullptr) {
+			this->m_szTileCache = tileserver->Attribute("path");
+		}
+	}
+
 
 	XMLElement *gamepaths = rootNode->FirstChildElement("gamepaths");
 
@@ -238,6 +406,95 @@ XMLError ConfigXML::WriteDefaultProgramConfig()
 	window->SetAttribute("multisampling", this->m_bMultisampling);
 	window->SetAttribute("vsync",         this->m_bVsync        );
 
+	// Renderer settings.
+	XMLElement *renderer = this->m_xmlProgramConfig.NewElement("renderer");
+	renderer->SetAttribute("batching", this->m_bBatching);
+
+	// Map streaming settings.
+	XMLElement *streaming = this->m_xmlProgramConfig.NewElement("streaming");
+	streaming->SetAttribute("enabled",    this->m_bStreaming       );
+	streaming->SetAttribute("radius",     this->m_fStreamRadius    );
+	streaming->SetAttribute("hysteresis", this->m_fStreamHysteresis);
+	streaming->SetAttribute("budget",     this->m_iStreamBudget    );
+
+	// Level of detail settings.
+	XMLElement *lod = this->m_xmlProgramConfig.NewElement("lod");
+	lod->SetAttribute("enabled", this->m_bLod         );
+	lod->SetAttribute("level1",  this->m_fLodPixels[0]);
+	lod->SetAttribute("level2",  this->m_fLodPixels[1]);
+
+	// Occlusion culling settings.
+	XMLElement *occlusion = this->m_xmlProgramConfig.NewElement("occlusion");
+	occlusion->SetAttribute("enabled",   this->m_bOcclusion   );
+	occlusion->SetAttribute("occluders", this->m_iOccluderMaps);
+
+	// GPU memory settings.
+	XMLElement *memory = this->m_xmlProgramConfig.NewElement("memory");
+	memory->SetAttribute("budget",   this->m_iGpuBudget       );
+	memory->SetAttribute("keephost", this->m_bKeepHostGeometry);
+
+	// Decoded texture cache settings.
+	XMLElement *texturecache = this->m_xmlProgramConfig.NewElement("texturecache");
+	texturecache->SetAttribute("enabled", this->m_bTextureCache);
+	texturecache->SetAttribute("path",    this->m_szTextureCache.c_str());
+
+	// Hot reload settings.
+	XMLElement *hotreload = this->m_xmlProgramConfig.NewElement("hotreload");
+	hotreload->SetAttribute("enabled", this->m_bHotReload);
+
+	// Texture upload settings.
+	XMLElement *uploads = this->m_xmlProgramConfig.NewElement("uploads");
+	uploads->SetAttribute("ring", this->m_iUploadRing);
+
+	// Picking settings.
+	XMLElement *picking = this->m_xmlProgramConfig.NewElement("picking");
+	picking->SetAttribute("enabled", this->m_bPicking);
+
+	// Job system settings.
+	XMLElement *jobs = this->m_xmlProgramConfig.NewElement("jobs");
+	jobs->SetAttribute("threads", this->m_iJobThreads);
+
+	// Dynamic resolution settings.
+	XMLElement *resolution = this->m_xmlProgramConfig.NewElement("resolution");
+	resolution->SetAttribute("dynamic", this->m_bDynamicResolution);
+	resolution->SetAttribute("target",  this->m_fFrameTarget      );
+	resolution->SetAttribute("min",     this->m_fMinScale         );
+	resolution->SetAttribute("max",     this->m_fMaxScale         );
+
+	// Light style settings.
+	XMLElement *lightstyles = this->m_xmlProgramConfig.NewElement("lightstyles");
+	lightstyles->SetAttribute("enabled", this->m_bLightStyles);
+	lightstyles->SetAttribute("budget",  this->m_iLightBudget);
+
+	// Mip streaming settings.
+	XMLElement *mipstreaming = this->m_xmlProgramConfig.NewElement("mipstreaming");
+	mipstreaming->SetAttribute("enabled", this->m_bMipStreaming);
+	mipstreaming->SetAttribute("budget",  this->m_iMipBudget   );
+	mipstreaming->SetAttribute("bias",    this->m_fMipBias     );
+	mipstreaming->SetAttribute("keep",    this->m_fMipKeep     );
+
+	// Draw order settings.
+	XMLElement *draworder = this->m_xmlProgramConfig.NewElement("draworder");
+	draworder->SetAttribute("frontToBack", this->m_bFrontToBack);
+
+	// Frame capture settings.
+	XMLElement *capture = this->m_xmlProgramConfig.NewElement("capture");
+	capture->SetAttribute("fps",  this->m_iCaptureFps );
+	capture->SetAttribute("ring", this->m_iCaptureRing);
+
+	// Tile server settings.
+	XMLElement *tileserver = this->m_xmlProgramConfig.NewElement("tileserver");
+	tileserver->SetAttribute("port",      this->m_iTilePort     );
+	tileserver->SetAttribute("size",      this->m_iTileSize     );
+	tileserver->SetAttribute("isometric", this->m_bTileIsometric);
+	tileserver->SetAttribute("maxZoom",   this->m_iTileMaxZoom  );
+	tileserver->SetAttribute("queue",     this->m_iTileQueue    );
+	tileserver->SetAttribute("threads",   this->m_iTileThreads  );
+	tileserver->SetAttribute("perFrame",  this->m_iTilesPerFrame);
+	tileserver->SetAttribute("memory",    this->m_iTileMemory   );
+	tileserver->SetAttribute("disk",      this->m_iTileDisk     );
+	tileserver->SetAttribute("path",      this->m_szTileCache.c_str());
+
 	// Collection of game paths.
 	XMLElement *gamepaths = this->m_xmlProgramConfig.NewElement("gamepaths");
 
@@ -253,6 +510,22 @@ XMLError ConfigXML::WriteDefaultProgramConfig()
 	// Add elements to the document.
 	this->m_xmlProgramConfig.InsertFirstChild(rootNode);
 		rootNode->InsertFirstChild(window);
+		rootNode->InsertEndChild(renderer);
+		rootNode->InsertEndChild(streaming);
+		rootNode->InsertEndChild(lod);
+		rootNode->InsertEndChild(occlusion);
+		rootNode->InsertEndChild(memory);
+		rootNode->InsertEndChild(texturecache);
+		rootNode->InsertEndChild(hotreload);
+		rootNode->InsertEndChild(uploads);
+		rootNode->InsertEndChild(picking);
+		rootNode->InsertEndChild(jobs);
+		rootNode->InsertEndChild(resolution);
+		rootNode->InsertEndChild(lightstyles);
+		rootNode->InsertEndChild(mipstreaming);
+		rootNode->InsertEndChild(draworder);
+		rootNode->InsertEndChild(capture);
+		rootNode->InsertEndChild(tileserver);
 		rootNode->InsertEndChild(gamepaths);
 			gamepaths->InsertFirstChild(hlgamepath);
 			gamepaths->InsertEndChild(csgamepath);
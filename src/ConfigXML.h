@@ -114,6 +114,46 @@ public:
 	bool                      m_bFullscreen;     /** Fullscreen or Windowed mode. */
 	bool                      m_bMultisampling;  /** Enable or disable multisampling. */
 	bool                      m_bVsync;          /** Enable or disable Vsync. */
+	bool                      m_bBatching;       /** Draw the world with texture arrays and multi-draw indirect. */
+	bool                      m_bStreaming;      /** Load and evict maps as the camera moves. */
+	float                     m_fStreamRadius;   /** Load maps closer than this to the camera. */
+	float                     m_fStreamHysteresis; /** Extra distance before a loaded map can be evicted. */
+	unsigned int              m_iStreamBudget;   /** Memory budget for streamed maps, in MB. */
+	bool                      m_bLod;            /** Draw simplified meshes for maps that are small on screen. */
+	float                     m_fLodPixels[2];   /** Screen size in pixels below which LOD 1 and 2 are used. */
+	bool                      m_bOcclusion;      /** Cull maps and draws hidden behind nearer maps. */
+	unsigned int              m_iOccluderMaps;   /** Nearest maps whose large faces are used as occluders. */
+	unsigned int              m_iGpuBudget;      /** GPU memory budget in MB, textures drop mips past it. 0 for none. */
+	bool                      m_bKeepHostGeometry; /** Keep map triangles in host memory after upload, for features reading them back. */
+	bool                      m_bTextureCache;   /** Keep decoded textures on disk between runs. */
+	std::string               m_szTextureCache;  /** Directory of the texture cache. */
+	bool                      m_bHotReload;      /** Reload maps, WADs and the map config when they change on disk. */
+	unsigned int              m_iUploadRing;     /** Size of the texture upload ring in MB, 0 to upload synchronously. */
+	bool                      m_bPicking;        /** Keep a BVH of every map for picking and spatial queries. */
+	unsigned int              m_iJobThreads;     /** Threads for culling and loading jobs, the main thread included. 0 for one per core. */
+	bool                      m_bDynamicResolution; /** Scale the rendered resolution to hold a GPU frame time. */
+	float                     m_fFrameTarget;    /** GPU frame time to hold, in ms. */
+	float                     m_fMinScale;       /** Lowest resolution scale per axis. */
+	float                     m_fMaxScale;       /** Highest resolution scale per axis. */
+	bool                      m_bLightStyles;    /** Animate switchable and flickering lights. */
+	unsigned int              m_iLightBudget;    /** Lightmap bytes uploaded per frame for light styles, in KB. 0 for none. */
+	bool                      m_bMipStreaming;   /** Load textures with their smallest mips only and stream the others in when close. */
+	unsigned int              m_iMipBudget;      /** Texture bytes streamed in per frame, in KB. */
+	float                     m_fMipBias;        /** Mip levels streamed in ahead of the one the distance needs. */
+	float                     m_fMipKeep;        /** Seconds a streamed in mip level stays unused before it is freed. */
+	bool                      m_bFrontToBack;    /** Draw maps nearest first and faces in BSP tree order, without batching. */
+	unsigned int              m_iCaptureFps;     /** Frame rate of captured videos, and of the light styles while capturing. */
+	unsigned int              m_iCaptureRing;    /** Frames a capture readback has before it is mapped. */
+	unsigned int              m_iTilePort;       /** Port of the tile server on 127.0.0.1. */
+	unsigned int              m_iTileSize;       /** Tile width and height in pixels. */
+	bool                      m_bTileIsometric;  /** Isometric tiles instead of top down. */
+	unsigned int              m_iTileMaxZoom;    /** Deepest zoom level served. */
+	unsigned int              m_iTileQueue;      /** Tiles waiting to be rendered, more are answered 503. */
+	unsigned int              m_iTileThreads;    /** Connections served at once. */
+	unsigned int              m_iTilesPerFrame;  /** Tiles rendered per frame at most. */
+	unsigned int              m_iTileMemory;     /** Tile cache in memory, in MB. */
+	unsigned int              m_iTileDisk;       /** Tile cache on disk, in MB. */
+	std::string               m_szTileCache;     /** Directory of the tile cache, empty for none. */
 	std::vector<std::string>  m_szGamePaths;     /** Locations of the game files. */
 	// Map config.
 	std::vector<ChapterEntry> m_vChapterEntries; /** Vector of chapters, containing maps. */
@@ -0,0 +1,229 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#include "common.h"
+#include "FileWatcher.h"
+#include <sys/stat.h>
+
+#if defined(__linux__)
+	#include <sys/inotify.h>
+	#include <unistd.h>
+	#include <fcntl.h>
+#endif
+
+// A file must stay unchanged this long before it is reported, in ms.
+#define SETTLE_TICKS 250
+// How often files are polled without inotify, in ms.
+#define SCAN_TICKS   500
+
+
+/**
+ * Constructor
+ */
+FileWatcher::FileWatcher()
+{
+	this->m_uLastScan = 0;
+	this->m_iNotify   = -1;
+
+#if defined(__linux__)
+	this->m_iNotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+	if (this->m_iNotify == -1) {
+		std::cout << "inotify not available, polling files for changes." << std::endl;
+	}
+#endif
+
+}//end FileWatcher::FileWatcher()
+
+
+/**
+ * Destructor
+ */
+FileWatcher::~FileWatcher()
+{
+#if defined(__linux__)
+	if (this->m_iNotify != -1) {
+		close(this->m_iNotify);
+	}
+#endif
+
+}//end FileWatcher::~FileWatcher()
+
+
+/**
+ * Start watching a file.
+ * \param szPath Path of the file, it doesn't need to exist yet.
+ */
+void FileWatcher::Watch(const std::string &szPath)
+{
+	for (size_t i = 0; i < this->m_vFiles.size(); i++) {
+		if (this->m_vFiles[i].szPath == szPath) {
+			return;
+		}
+	}
+
+	WatchedFile f;
+	size_t iSlash = szPath.find_last_of("/\\");
+
+	f.szPath    = szPath;
+	f.szDir     = iSlash == std::string::npos ? "." : szPath.substr(0, iSlash);
+	f.szName    = iSlash == std::string::npos ? szPath : szPath.substr(iSlash + 1);
+	f.tTime     = 0;
+	f.iSize     = -1;
+	f.uSeenAt   = 0;
+	f.bPending  = false;
+	Stat(szPath, f.tTime, f.iSize);
+	f.tSeenTime = f.tTime;
+	f.iSeenSize = f.iSize;
+
+#if defined(__linux__)
+	// Editors and compilers often write a new file and rename it over the
+	// old one, so the directory is watched rather than the file.
+	if (this->m_iNotify != -1) {
+		int iWatch = inotify_add_watch(this->m_iNotify, f.szDir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+
+		if (iWatch != -1) {
+			this->m_mDirs[iWatch] = f.szDir;
+		} else {
+			std::cout << "Can't watch " << f.szDir << " for changes." << std::endl;
+		}
+	}
+#endif
+
+	this->m_vFiles.push_back(f);
+
+}//end FileWatcher::Watch()
+
+
+/**
+ * Collect the files that changed since the last call.
+ * \param vChanged Receives the paths, as passed to Watch().
+ */
+void FileWatcher::Poll(std::vector<std::string> &vChanged)
+{
+	unsigned int uNow = SDL_GetTicks();
+	vChanged.clear();
+
+#if defined(__linux__)
+	if (this->m_iNotify != -1) {
+		char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+		ssize_t iLength;
+
+		while ((iLength = read(this->m_iNotify, buffer, sizeof(buffer))) > 0) {
+			for (char *p = buffer; p < buffer + iLength; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len) {
+				const struct inotify_event *event = (const struct inotify_event*)p;
+				std::map<int, std::string>::const_iterator dir = this->m_mDirs.find(event->wd);
+
+				if (dir == this->m_mDirs.end() || event->len == 0) {
+					continue;
+				}
+
+				for (size_t i = 0; i < this->m_vFiles.size(); i++) {
+					if (this->m_vFiles[i].szDir == dir->second && this->m_vFiles[i].szName == event->name) {
+						this->Touch(i, uNow, true);
+					}
+				}
+			}
+		}
+	}
+#endif
+
+	// Without inotify, every file is checked now and then.
+	if (this->m_iNotify == -1 && uNow - this->m_uLastScan >= SCAN_TICKS) {
+		this->m_uLastScan = uNow;
+
+		for (size_t i = 0; i < this->m_vFiles.size(); i++) {
+			this->Touch(i, uNow, false);
+		}
+	}
+
+	// Report the files that stopped changing.
+	for (size_t i = 0; i < this->m_vFiles.size(); i++) {
+		WatchedFile &f = this->m_vFiles[i];
+
+		if (!f.bPending) {
+			continue;
+		}
+
+		time_t tTime;
+		long long iSize;
+
+		if (!Stat(f.szPath, tTime, iSize)) {
+			continue;
+		}
+
+		if (tTime != f.tSeenTime || iSize != f.iSeenSize) {
+			f.tSeenTime = tTime;
+			f.iSeenSize = iSize;
+			f.uSeenAt   = uNow;
+		} else if (uNow - f.uSeenAt >= SETTLE_TICKS) {
+			f.tTime    = tTime;
+			f.iSize    = iSize;
+			f.bPending = false;
+			vChanged.push_back(f.szPath);
+		}
+	}
+
+}//end FileWatcher::Poll()
+
+
+/**
+ * Stat a file, false when it doesn't exist.
+ */
+bool FileWatcher::Stat(const std::string &szPath, time_t &tTime, long long &iSize)
+{
+	struct stat st;
+
+	if (stat(szPath.c_str(), &st) != 0) {
+		return false;
+	}
+
+	tTime = st.st_mtime;
+	iSize = st.st_size;
+	return true;
+
+}//end FileWatcher::Stat()
+
+
+/**
+ * Note a file as possibly changed.
+ * \param iFile  Index of the file.
+ * \param uNow   Current tick.
+ * \param bForce Changed for sure, even when time and size look the same.
+ */
+void FileWatcher::Touch(size_t iFile, unsigned int uNow, bool bForce)
+{
+	WatchedFile &f = this->m_vFiles[iFile];
+	time_t tTime;
+	long long iSize;
+
+	if (!Stat(f.szPath, tTime, iSize)) {
+		return;
+	}
+
+	if (bForce || tTime != f.tTime || iSize != f.iSize) {
+		f.tSeenTime = tTime;
+		f.iSeenSize = iSize;
+		f.uSeenAt   = uNow;
+		f.bPending  = true;
+	}
+
+}//end FileWatcher::Touch()
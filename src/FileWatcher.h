@@ -0,0 +1,87 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#ifndef FILEWATCHER_H
+#define FILEWATCHER_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <ctime>
+
+
+/**
+ * Reports files that changed on disk.
+ *
+ * On Linux the directories of the watched files are watched with inotify,
+ * elsewhere the files are polled for a new modification time or size. A
+ * file is only reported once it stopped changing for a moment, so a map
+ * still being written by the compiler isn't picked up half done.
+ */
+class FileWatcher
+{
+public:
+	/** Constructor */
+	FileWatcher();
+
+	/** Destructor */
+	~FileWatcher();
+
+	/**
+	 * Start watching a file.
+	 * \param szPath Path of the file, it doesn't need to exist yet.
+	 */
+	void Watch(const std::string &szPath);
+
+	/**
+	 * Collect the files that changed since the last call.
+	 * \param vChanged Receives the paths, as passed to Watch().
+	 */
+	void Poll(std::vector<std::string> &vChanged);
+
+private:
+	/** Stat a file, false when it doesn't exist. */
+	static bool Stat(const std::string &szPath, time_t &tTime, long long &iSize);
+
+	/** Note a file as possibly changed. */
+	void Touch(size_t iFile, unsigned int uNow, bool bForce);
+
+	struct WatchedFile
+	{
+		std::string  szPath;      /** Path as passed to Watch(). */
+		std::string  szDir;       /** Directory of the file. */
+		std::string  szName;      /** File name, without the directory. */
+		time_t       tTime;       /** Modification time last reported. */
+		long long    iSize;       /** Size last reported. */
+		time_t       tSeenTime;   /** Modification time last seen. */
+		long long    iSeenSize;   /** Size last seen. */
+		unsigned int uSeenAt;     /** Tick the file last changed. */
+		bool         bPending;    /** Changed, waiting for the file to settle. */
+	};
+
+	std::vector<WatchedFile>   m_vFiles;    /** Every watched file. */
+	unsigned int               m_uLastScan; /** Tick of the last polling scan. */
+	int                        m_iNotify;   /** inotify descriptor, -1 when polling. */
+	std::map<int, std::string> m_mDirs;     /** inotify watch descriptor to directory. */
+
+};//end FileWatcher
+
+#endif //FILEWATCHER_H
@@ -0,0 +1,412 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <SDL.h>
+#include "FrameCapture.h"
+#include "MemoryRegistry.h"
+#include "PngWriter.h"
+
+// Frame buffers besides the ring's, so the writer can lag a little before
+// the GL thread waits on it.
+#define CAPTURE_SPARE_FRAMES 4
+
+// Stalled frames printed, the rest are only counted.
+#define CAPTURE_MAX_LISTED_STALLS 16
+
+// Wait for a fence in steps of this, in nanoseconds.
+#define CAPTURE_WAIT_STEP 100000000
+
+
+/**
+ * Nothing is created until Start().
+ */
+FrameCapture::FrameCapture(const std::string &szPath, int iFps, int iRing)
+{
+	this->m_szPath   = szPath;
+	this->m_bY4m     = szPath.size() > 4 && szPath.compare(szPath.size() - 4, 4, ".y4m") == 0;
+	this->m_iFps     = std::max(iFps, 1);
+	this->m_iRing    = std::min(std::max(iRing, 1), CAPTURE_MAX_RING);
+	this->m_iWidth   = 0;
+	this->m_iHeight  = 0;
+	this->m_uRead    = 0;
+	this->m_uWritten = 0;
+	this->m_bStarted = false;
+	this->m_bFailed  = false;
+	this->m_bQuit    = false;
+
+	for (int i = 0; i < CAPTURE_MAX_RING; i++) {
+		this->m_uBuffers[i] = 0;
+		this->m_fences[i]   = 0;
+		this->m_uNumbers[i] = 0;
+	}
+
+}//end FrameCapture::FrameCapture()
+
+
+/**
+ * Finish and free the frames.
+ */
+FrameCapture::~FrameCapture()
+{
+	this->Finish();
+
+	for (size_t i = 0; i < this->m_vFrames.size(); i++) {
+		delete this->m_vFrames[i];
+	}
+
+}//end FrameCapture::~FrameCapture()
+
+
+/**
+ * Pixel pack buffers read back without waiting, fences tell when they can
+ * be mapped.
+ */
+bool FrameCapture::IsSupported()
+{
+	return GLEW_ARB_pixel_buffer_object && GLEW_ARB_sync;
+
+}//end FrameCapture::IsSupported()
+
+
+/**
+ * Y4M frames are stored 4:4:4, so any size works. PNG files are numbered
+ * from 0 after the prefix.
+ */
+bool FrameCapture::Start(int iWidth, int iHeight)
+{
+	this->m_iWidth  = iWidth;
+	this->m_iHeight = iHeight;
+
+	if (this->m_bY4m) {
+		this->m_file.open(this->m_szPath.c_str(), std::ios::binary);
+
+		if (!this->m_file) {
+			std::cout << "Can't write " << this->m_szPath << ", frames aren't captured." << std::endl;
+			return false;
+		}
+
+		this->m_file << "YUV4MPEG2 W" << iWidth << " H" << iHeight << " F" << this->m_iFps << ":1 Ip A1:1 C444\n";
+	}
+
+	size_t uBytes = (size_t)iWidth * iHeight * 4;
+
+	glGenBuffers(this->m_iRing, this->m_uBuffers);
+
+	for (int i = 0; i < this->m_iRing; i++) {
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, this->m_uBuffers[i]);
+		glBufferData(GL_PIXEL_PACK_BUFFER, uBytes, NULL, GL_STREAM_READ);
+	}
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	g_gpuMemory.SetUsage(this, MemoryRegistry::CATEGORY_FRAMEBUFFER, "Frame capture", uBytes * this->m_iRing);
+
+	for (int i = 0; i < this->m_iRing + CAPTURE_SPARE_FRAMES; i++) {
+		Frame *pFrame = new Frame();
+		pFrame->vPixels.resize(uBytes);
+		pFrame->uNumber = 0;
+		this->m_vFrames.push_back(pFrame);
+		this->m_vFree.push_back(pFrame);
+	}
+
+	g_hostMemory.SetUsage(this, MemoryRegistry::CATEGORY_FRAMEBUFFER, "Frame capture", uBytes * this->m_vFrames.size());
+
+	this->m_bQuit    = false;
+	this->m_bStarted = true;
+	this->m_writer   = std::thread(&FrameCapture::WriterMain, this);
+
+	std::cout << "Capturing " << iWidth << "x" << iHeight << " frames to " << this->m_szPath
+		<< (this->m_bY4m ? "" : "_*.png") << " through " << this->m_iRing << " pixel buffers." << std::endl;
+	return true;
+
+}//end FrameCapture::Start()
+
+
+/**
+ * Start reading the back buffer into the next slot, after retiring the
+ * frame that was in it.
+ */
+void FrameCapture::Read()
+{
+	if (!this->m_bStarted) {
+		return;
+	}
+
+	unsigned int uSlot = this->m_uRead % this->m_iRing;
+
+	if (this->m_fences[uSlot] != 0) {
+		this->Retire(uSlot);
+	}
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, this->m_uBuffers[uSlot]);
+	glReadBuffer(GL_BACK);
+	glReadPixels(0, 0, this->m_iWidth, this->m_iHeight, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	this->m_fences[uSlot]   = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	this->m_uNumbers[uSlot] = this->m_uRead;
+	this->m_uRead++;
+
+}//end FrameCapture::Read()
+
+
+/**
+ * Only waits when the GPU is a whole ring behind, or the writer is.
+ */
+void FrameCapture::Retire(unsigned int uSlot)
+{
+	GLsync fence = this->m_fences[uSlot];
+	Uint64 uStart = SDL_GetPerformanceCounter();
+
+	GLenum eResult = glClientWaitSync(fence, 0, 0);
+
+	if (eResult == GL_TIMEOUT_EXPIRED) {
+		do {
+			eResult = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, CAPTURE_WAIT_STEP);
+		} while (eResult == GL_TIMEOUT_EXPIRED);
+
+		Stall stall;
+		stall.uFrame  = this->m_uNumbers[uSlot];
+		stall.fMs     = (float)((SDL_GetPerformanceCounter() - uStart) * 1000.0 / SDL_GetPerformanceFrequency());
+		stall.bWriter = false;
+		this->m_vStalls.push_back(stall);
+	}
+
+	glDeleteSync(fence);
+	this->m_fences[uSlot] = 0;
+
+	Frame *pFrame = NULL;
+	{
+		std::unique_lock<std::mutex> lock(this->m_mutex);
+
+		if (this->m_vFree.empty()) {
+			uStart = SDL_GetPerformanceCounter();
+
+			while (this->m_vFree.empty()) {
+				this->m_written.wait(lock);
+			}
+
+			Stall stall;
+			stall.uFrame  = this->m_uNumbers[uSlot];
+			stall.fMs     = (float)((SDL_GetPerformanceCounter() - uStart) * 1000.0 / SDL_GetPerformanceFrequency());
+			stall.bWriter = true;
+			this->m_vStalls.push_back(stall);
+		}
+
+		pFrame = this->m_vFree.back();
+		this->m_vFree.pop_back();
+	}
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, this->m_uBuffers[uSlot]);
+	const unsigned char *pData = (const unsigned char*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, pFrame->vPixels.size(), GL_MAP_READ_BIT);
+
+	if (pData != NULL) {
+		memcpy(&pFrame->vPixels[0], pData, pFrame->vPixels.size());
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	} else {
+		memset(&pFrame->vPixels[0], 0, pFrame->vPixels.size());
+	}
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	pFrame->uNumber = this->m_uNumbers[uSlot];
+
+	{
+		std::lock_guard<std::mutex> lock(this->m_mutex);
+		this->m_dQueue.push_back(pFrame);
+	}
+
+	this->m_queued.notify_one();
+
+}//end FrameCapture::Retire()
+
+
+/**
+ * Retire the slots oldest first, so frames stay in order, then let the
+ * writer drain the queue and free the buffers.
+ */
+void FrameCapture::Finish()
+{
+	if (!this->m_bStarted) {
+		return;
+	}
+
+	for (int i = 0; i < this->m_iRing; i++) {
+		unsigned int uSlot = (this->m_uRead + i) % this->m_iRing;
+
+		if (this->m_fences[uSlot] != 0) {
+			this->Retire(uSlot);
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(this->m_mutex);
+		this->m_bQuit = true;
+	}
+
+	this->m_queued.notify_one();
+	this->m_writer.join();
+	this->m_bStarted = false;
+
+	if (this->m_bY4m) {
+		this->m_file.close();
+	}
+
+	glDeleteBuffers(this->m_iRing, this->m_uBuffers);
+	g_gpuMemory.SetUsage(this, MemoryRegistry::CATEGORY_FRAMEBUFFER, "Frame capture", 0);
+	g_hostMemory.SetUsage(this, MemoryRegistry::CATEGORY_FRAMEBUFFER, "Frame capture", 0);
+
+	this->PrintStats(std::cout);
+
+}//end FrameCapture::Finish()
+
+
+/**
+ * Write queued frames in order until Finish() and an empty queue.
+ */
+void FrameCapture::WriterMain()
+{
+	std::unique_lock<std::mutex> lock(this->m_mutex);
+
+	while (true) {
+		while (this->m_dQueue.empty() && !this->m_bQuit) {
+			this->m_queued.wait(lock);
+		}
+
+		if (this->m_dQueue.empty()) {
+			break;
+		}
+
+		Frame *pFrame = this->m_dQueue.front();
+		this->m_dQueue.pop_front();
+		bool bFailed = this->m_bFailed;
+		lock.unlock();
+
+		// After an error the frames are dropped, but still handed back.
+		bool bWritten = !bFailed && this->Write(*pFrame);
+
+		lock.lock();
+
+		if (bWritten) {
+			this->m_uWritten++;
+		} else if (!bFailed) {
+			this->m_bFailed = true;
+			std::cout << "Can't write frame " << pFrame->uNumber << " to " << this->m_szPath << ", capture stopped." << std::endl;
+		}
+
+		this->m_vFree.push_back(pFrame);
+		this->m_written.notify_one();
+	}
+
+}//end FrameCapture::WriterMain()
+
+
+/**
+ * Rows come bottom first from glReadPixels and are written top first. Y4M
+ * gets BT.601 studio range planes, PNG files RGB.
+ */
+bool FrameCapture::Write(const Frame &frame)
+{
+	int iWidth = this->m_iWidth, iHeight = this->m_iHeight;
+	size_t uPlane = (size_t)iWidth * iHeight;
+
+	if (this->m_bY4m) {
+		std::vector<unsigned char> vPlanes(uPlane * 3);
+		unsigned char *pY = &vPlanes[0], *pU = pY + uPlane, *pV = pU + uPlane;
+
+		for (int y = 0; y < iHeight; y++) {
+			const unsigned char *pRow = &frame.vPixels[(size_t)(iHeight - 1 - y) * iWidth * 4];
+
+			for (int x = 0; x < iWidth; x++, pRow += 4) {
+				int r = pRow[0], g = pRow[1], b = pRow[2];
+				*pY++ = (unsigned char)((( 66 * r + 129 * g +  25 * b + 128) >> 8) +  16);
+				*pU++ = (unsigned char)(((-38 * r -  74 * g + 112 * b + 128) >> 8) + 128);
+				*pV++ = (unsigned char)(((112 * r -  94 * g -  18 * b + 128) >> 8) + 128);
+			}
+		}
+
+		this->m_file << "FRAME\n";
+		this->m_file.write((const char*)&vPlanes[0], vPlanes.size());
+		return this->m_file.good();
+	}
+
+	std::vector<unsigned char> vRgb(uPlane * 3);
+	unsigned char *pOut = &vRgb[0];
+
+	for (int y = 0; y < iHeight; y++) {
+		const unsigned char *pRow = &frame.vPixels[(size_t)(iHeight - 1 - y) * iWidth * 4];
+
+		for (int x = 0; x < iWidth; x++, pRow += 4) {
+			*pOut++ = pRow[0];
+			*pOut++ = pRow[1];
+			*pOut++ = pRow[2];
+		}
+	}
+
+	char szNumber[16];
+	sprintf(szNumber, "_%06u.png", frame.uNumber);
+	return PngWriter::Save(this->m_szPath + szNumber, &vRgb[0], iWidth, iHeight, 3);
+
+}//end FrameCapture::Write()
+
+
+/**
+ * Totals, then the frames that stalled.
+ */
+void FrameCapture::PrintStats(std::ostream &out)
+{
+	unsigned int uWritten;
+	{
+		std::lock_guard<std::mutex> lock(this->m_mutex);
+		uWritten = this->m_uWritten;
+	}
+
+	size_t uReadback = 0, uWriter = 0;
+	float fReadbackMs = 0.0f, fWriterMs = 0.0f;
+
+	for (size_t i = 0; i < this->m_vStalls.size(); i++) {
+		if (this->m_vStalls[i].bWriter) {
+			uWriter++;
+			fWriterMs += this->m_vStalls[i].fMs;
+		} else {
+			uReadback++;
+			fReadbackMs += this->m_vStalls[i].fMs;
+		}
+	}
+
+	char szLine[200];
+	sprintf(szLine, "Frame capture: %u frames read, %u written, %u readback stalls (%.1f ms), %u writer stalls (%.1f ms).",
+		this->m_uRead, uWritten, (unsigned int)uReadback, fReadbackMs, (unsigned int)uWriter, fWriterMs);
+	out << szLine << std::endl;
+
+	for (size_t i = 0; i < this->m_vStalls.size() && i < CAPTURE_MAX_LISTED_STALLS; i++) {
+		const Stall &stall = this->m_vStalls[i];
+		sprintf(szLine, "  frame %u waited %.2f ms for the %s", stall.uFrame, stall.fMs, stall.bWriter ? "writer" : "readback");
+		out << szLine << std::endl;
+	}
+
+	if (this->m_vStalls.size() > CAPTURE_MAX_LISTED_STALLS) {
+		out << "  and " << this->m_vStalls.size() - CAPTURE_MAX_LISTED_STALLS << " more." << std::endl;
+	}
+
+}//end FrameCapture::PrintStats()
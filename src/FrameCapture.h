@@ -0,0 +1,145 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#ifndef FRAMECAPTURE_H
+#define FRAMECAPTURE_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <fstream>
+#include <ostream>
+#include <GL/glew.h>
+
+// Most frames kept in the ring, more only add latency.
+#define CAPTURE_MAX_RING 8
+
+
+/**
+ * Records the rendered frames to a Y4M video or a PNG sequence.
+ *
+ * Each frame is read from the back buffer into the next of a ring of pixel
+ * pack buffers, which returns without waiting for the GPU. A fence marks
+ * when the copy is done, and the buffer is only mapped when its slot comes
+ * around again, a few frames later. The pixels are copied out and handed
+ * to a writer thread, which flips, converts and writes them.
+ *
+ * A readback stall is a frame where the fence wasn't signalled yet when
+ * its buffer was needed, so the GL thread had to wait. A writer stall is
+ * when every frame buffer was still queued for writing. Both are counted
+ * and the frames they happened on are printed.
+ */
+class FrameCapture
+{
+public:
+	/**
+	 * Constructor
+	 * \param szPath Y4M file when it ends with .y4m, else the prefix of numbered PNG files.
+	 * \param iFps   Frame rate written in the Y4M header.
+	 * \param iRing  Frames between reading a frame and mapping it.
+	 */
+	FrameCapture(const std::string &szPath, int iFps, int iRing);
+
+	/** Destructor, writes what is left. */
+	~FrameCapture();
+
+	/** Check for pixel buffer objects and fences. */
+	static bool IsSupported();
+
+	/**
+	 * Create the ring, open the output and start the writer.
+	 * \return False when the output can't be written.
+	 */
+	bool Start(int iWidth, int iHeight);
+
+	/** Read the current frame. Call with the finished frame in the back buffer, before swapping. */
+	void Read();
+
+	/** Write the frames still in the ring and stop the writer. */
+	void Finish();
+
+	/** Frames read so far. */
+	unsigned int GetFrameCount() const { return this->m_uRead; }
+
+	/** Frame rate of the video. */
+	int GetFps() const { return this->m_iFps; }
+
+	/** Print frames written and stalls. */
+	void PrintStats(std::ostream &out);
+
+private:
+	/** A frame on its way to the writer. */
+	struct Frame
+	{
+		std::vector<unsigned char> vPixels; /** RGBA rows, bottom first as read. */
+		unsigned int               uNumber; /** Frame number. */
+	};
+
+	/** A frame that made the GL thread wait. */
+	struct Stall
+	{
+		unsigned int uFrame;   /** Frame number. */
+		float        fMs;      /** Time waited. */
+		bool         bWriter;  /** Waited for the writer instead of the GPU. */
+	};
+
+	/**
+	 * Map a slot's buffer and queue its pixels.
+	 * \param uSlot Slot of the ring.
+	 */
+	void Retire(unsigned int uSlot);
+
+	/** Loop of the writer thread. */
+	void WriterMain();
+
+	/** Write one frame, on the writer thread. False on an error. */
+	bool Write(const Frame &frame);
+
+	std::string                m_szPath;       /** Output file or prefix. */
+	bool                       m_bY4m;         /** Y4M video instead of PNG files. */
+	int                        m_iFps;         /** Frame rate. */
+	int                        m_iRing;        /** Slots in the ring. */
+	int                        m_iWidth;       /** Frame width. */
+	int                        m_iHeight;      /** Frame height. */
+	GLuint                     m_uBuffers[CAPTURE_MAX_RING]; /** Pixel pack buffers. */
+	GLsync                     m_fences[CAPTURE_MAX_RING];   /** Set when a buffer's copy is done, 0 when free. */
+	unsigned int               m_uNumbers[CAPTURE_MAX_RING]; /** Frame in each buffer. */
+	unsigned int               m_uRead;        /** Frames read. */
+	unsigned int               m_uWritten;     /** Frames written, guarded by m_mutex. */
+	bool                       m_bStarted;     /** Start() succeeded and Finish() wasn't called. */
+	bool                       m_bFailed;      /** Writing failed, guarded by m_mutex. */
+	std::vector<Stall>         m_vStalls;      /** Frames that waited. */
+	std::vector<Frame*>        m_vFrames;      /** Every frame buffer. */
+	std::vector<Frame*>        m_vFree;        /** Frame buffers not queued, guarded by m_mutex. */
+	std::deque<Frame*>         m_dQueue;       /** Frames to write, guarded by m_mutex. */
+	std::mutex                 m_mutex;
+	std::condition_variable    m_queued;       /** Signalled when a frame is queued or on Finish(). */
+	std::condition_variable    m_written;      /** Signalled when a frame buffer is free again. */
+	bool                       m_bQuit;        /** Set by Finish(). */
+	std::thread                m_writer;       /** Writer thread. */
+	std::ofstream              m_file;         /** Y4M file. */
+
+};//end FrameCapture
+
+#endif //FRAMECAPTURE_H
@@ -0,0 +1,96 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#include <GL/glew.h>
+#include "Frustum.h"
+
+/**
+ * Constructor.
+ */
+Frustum::Frustum()
+{
+	for (int i = 0; i < 16; i++) {
+		this->m_fClip[i] = (i % 5 == 0) ? 1.0f : 0.0f;
+	}
+
+	for (int i = 0; i < 6; i++) {
+		this->m_fPlanes[i][0] = this->m_fPlanes[i][1] = this->m_fPlanes[i][2] = 0.0f;
+		this->m_fPlanes[i][3] = 1.0f;
+	}
+
+}//end Frustum::Frustum()
+
+
+/**
+ * Read the projection and modelview matrices, and extract the planes.
+ */
+void Frustum::Extract()
+{
+	float fProjection[16], fModelview[16];
+	glGetFloatv(GL_PROJECTION_MATRIX, fProjection);
+	glGetFloatv(GL_MODELVIEW_MATRIX,  fModelview);
+
+	for (int col = 0; col < 4; col++) {
+		for (int row = 0; row < 4; row++) {
+			this->m_fClip[col * 4 + row] =
+				fProjection[0 * 4 + row] * fModelview[col * 4 + 0] +
+				fProjection[1 * 4 + row] * fModelview[col * 4 + 1] +
+				fProjection[2 * 4 + row] * fModelview[col * 4 + 2] +
+				fProjection[3 * 4 + row] * fModelview[col * 4 + 3];
+		}
+	}
+
+	// Each plane is the last row of the clip matrix plus or minus another row.
+	for (int i = 0; i < 6; i++) {
+		int   iRow  = i / 2;
+		float fSign = (i % 2 == 0) ? 1.0f : -1.0f;
+
+		for (int j = 0; j < 4; j++) {
+			this->m_fPlanes[i][j] = this->m_fClip[j * 4 + 3] + fSign * this->m_fClip[j * 4 + iRow];
+		}
+	}
+
+}//end Frustum::Extract()
+
+
+/**
+ * Check if an axis aligned box is at least partly inside the frustum.
+ * \param fMins Minimum corner (x, y, z).
+ * \param fMaxs Maximum corner (x, y, z).
+ */
+bool Frustum::TestAABB(const float fMins[3], const float fMaxs[3]) const
+{
+	for (int i = 0; i < 6; i++) {
+		const float *p = this->m_fPlanes[i];
+
+		// Corner furthest along the plane normal.
+		float x = p[0] >= 0.0f ? fMaxs[0] : fMins[0];
+		float y = p[1] >= 0.0f ? fMaxs[1] : fMins[1];
+		float z = p[2] >= 0.0f ? fMaxs[2] : fMins[2];
+
+		if (p[0] * x + p[1] * y + p[2] * z + p[3] < 0.0f) {
+			return false;
+		}
+	}
+
+	return true;
+
+}//end Frustum::TestAABB()
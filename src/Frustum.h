@@ -0,0 +1,54 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#ifndef FRUSTUM_H
+#define FRUSTUM_H
+
+
+/**
+ * View frustum planes, extracted from the current GL matrices.
+ */
+class Frustum
+{
+public:
+	/** Constructor */
+	Frustum();
+
+	/** Read the projection and modelview matrices, and extract the planes. */
+	void Extract();
+
+	/**
+	 * Check if an axis aligned box is at least partly inside the frustum.
+	 * \param fMins Minimum corner (x, y, z).
+	 * \param fMaxs Maximum corner (x, y, z).
+	 */
+	bool TestAABB(const float fMins[3], const float fMaxs[3]) const;
+
+	/** Combined projection * modelview matrix, column major. */
+	const float *GetClipMatrix() const { return this->m_fClip; }
+
+private:
+	float m_fClip[16];      /** Projection * modelview. */
+	float m_fPlanes[6][4];  /** Left, right, bottom, top, near, far. */
+
+};//end Frustum
+
+#endif //FRUSTUM_H
@@ -0,0 +1,529 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#include "common.h"
+#include "bsp.h"
+#include "wad.h"
+#include "TextureRegistry.h"
+#include "entities.h"
+#include "MapStreamer.h"
+#include "VirtualFileSystem.h"
+#include "World.h"
+#include "HotReloader.h"
+
+
+/**
+ * Start watching and the worker thread.
+ * \param pWorld    Loaded world, whose maps are replaced in place.
+ * \param pStreamer Streamer of the maps, or NULL when not streaming.
+ */
+HotReloader::HotReloader(World *pWorld, MapStreamer *pStreamer)
+	: m_vMaps(pWorld->GetMaps())
+{
+	ConfigXML *pConfig             = pWorld->GetConfig();
+	const std::string &szMapConfig = pWorld->GetMapConfigPath();
+	const std::vector<BSP*> &vMaps = pWorld->GetMaps();
+
+	this->m_pConfig     = pConfig;
+	this->m_szMapConfig = szMapConfig;
+	this->m_pState      = pWorld->GetState();
+	this->m_pStreamer   = pStreamer;
+	this->m_bQuit       = false;
+
+	GetPlacements(*pConfig, this->m_vPlacements);
+	assert(this->m_vPlacements.size() == vMaps.size());
+
+	for (size_t i = 0; i < vMaps.size(); i++) {
+		this->m_watcher.Watch(vMaps[i]->GetFilePath());
+	}
+
+	for (size_t i = 0; i < pConfig->m_vWads.size(); i++) {
+		this->m_vWadPaths.push_back(this->m_pState->fileSystem->Locate(pConfig->m_vWads[i] + ".wad"));
+
+		if (!this->m_vWadPaths.back().empty()) {
+			this->m_watcher.Watch(this->m_vWadPaths.back());
+		}
+	}
+
+	this->m_watcher.Watch(szMapConfig);
+
+	this->m_thread = std::thread(&HotReloader::WorkerThread, this);
+
+}//end HotReloader::HotReloader()
+
+
+/**
+ * Stop the worker thread and drop unfinished reloads.
+ */
+HotReloader::~HotReloader()
+{
+	{
+		std::lock_guard<std::mutex> lock(this->m_mutex);
+		this->m_bQuit = true;
+	}
+
+	this->m_cond.notify_all();
+	this->m_thread.join();
+
+	for (size_t i = 0; i < this->m_qRequests.size(); i++) {
+		delete this->m_qRequests[i].pFresh;
+	}
+
+	for (size_t i = 0; i < this->m_qDone.size(); i++) {
+		delete this->m_qDone[i].pFresh;
+	}
+
+	for (size_t i = 0; i < this->m_qWaiting.size(); i++) {
+		delete this->m_qWaiting[i].pFresh;
+	}
+
+}//end HotReloader::~HotReloader()
+
+
+/**
+ * Pick up changed files and swap in reloaded maps.
+ * Must be called from the GL thread.
+ * \return True when textures or maps changed, batches need a rebuild.
+ */
+bool HotReloader::Update()
+{
+	bool bChanged = false;
+	std::vector<std::string> vChanged;
+
+	this->m_watcher.Poll(vChanged);
+
+	// Files may have moved inside a changed PAK, or been added to override one.
+	for (size_t i = 0; i < vChanged.size(); i++) {
+		if (vChanged[i] != this->m_szMapConfig) {
+			this->m_pState->fileSystem->Mount(this->m_pConfig->m_szGamePaths);
+			break;
+		}
+	}
+
+	for (size_t i = 0; i < vChanged.size(); i++) {
+		if (vChanged[i] == this->m_szMapConfig) {
+			bChanged |= this->ReloadMapConfig();
+		}
+
+		for (size_t j = 0; j < this->m_vWadPaths.size(); j++) {
+			if (vChanged[i] == this->m_vWadPaths[j]) {
+				bChanged |= this->ReloadWad(this->m_pConfig->m_vWads[j] + ".wad");
+			}
+		}
+
+		// The same map can be placed by several chapters.
+		for (size_t j = 0; j < this->m_vMaps.size(); j++) {
+			if (vChanged[i] == this->m_vMaps[j]->GetFilePath()) {
+				this->ReloadMap(j);
+				bChanged = true;
+			}
+		}
+	}
+
+	// Swap in the maps the worker finished, unless the streamer is loading them.
+	{
+		std::lock_guard<std::mutex> lock(this->m_mutex);
+
+		while (!this->m_qDone.empty()) {
+			this->m_qWaiting.push_back(this->m_qDone.front());
+			this->m_qDone.pop_front();
+		}
+	}
+
+	std::deque<Reload> qBusy;
+
+	while (!this->m_qWaiting.empty()) {
+		Reload r = this->m_qWaiting.front();
+		this->m_qWaiting.pop_front();
+
+		BSP *pOld = this->m_vMaps[r.iMap];
+
+		if (this->m_pStreamer != NULL && this->m_pStreamer->IsBusy(pOld)) {
+			qBusy.push_back(r);
+			continue;
+		}
+
+		// A map that became resident meanwhile needs its geometry now. The
+		// fresh map is uploaded even when unused, so the embedded textures
+		// it reserved get uploaded too.
+		if (pOld->IsResident() && !r.pFresh->IsLoaded()) {
+			r.pFresh->LoadGeometry();
+		}
+
+		r.pFresh->Upload();
+
+		if (!pOld->IsResident()) {
+			r.pFresh->Unload();
+		}
+
+		// The old map keeps its address, the fresh one leaves with the old contents.
+		pOld->Swap(*r.pFresh);
+		delete r.pFresh;
+
+		if (this->m_pStreamer != NULL) {
+			this->m_pStreamer->Refresh();
+		}
+
+		bChanged = true;
+		std::cout << "Reloaded " << pOld->GetMapId() << " in " << SDL_GetTicks() - r.uStart << " ms." << std::endl;
+	}
+
+	this->m_qWaiting.swap(qBusy);
+
+	bChanged |= this->ReleaseTextures();
+
+	return bChanged;
+
+}//end HotReloader::Update()
+
+
+/**
+ * Probe a changed map and queue its geometry load.
+ * \param iMap Index of the map.
+ */
+void HotReloader::ReloadMap(size_t iMap)
+{
+	BSP *pOld = this->m_vMaps[iMap];
+	const Placement &p = this->m_vPlacements[iMap];
+	const std::string szId = pOld->GetMapId();
+
+	// Kept to roll back to, when the new file turns out to be broken.
+	WORLDSTATE *pState = this->m_pState;
+	std::map<std::string, std::vector<std::pair<VERTEX, std::string> > > mLandmarks;
+	std::vector<std::string> vHidden;
+	{
+		std::lock_guard<std::mutex> lock(pState->entitiesMutex);
+		mLandmarks = pState->landmarks;
+
+		if (pState->dontRenderModel.count(szId) != 0) {
+			vHidden = pState->dontRenderModel[szId];
+		}
+	}
+
+	std::map<std::string, int> mSlots = detachEntities(pState, szId);
+	BSP *pFresh = new BSP("maps/" + p.sMapEntry.m_szName + ".bsp", p.sMapEntry, pState);
+	pFresh->SetReloaded();
+
+	if (!pFresh->IsValid()) {
+		{
+			std::lock_guard<std::mutex> lock(pState->entitiesMutex);
+			pState->landmarks.swap(mLandmarks);
+			pState->dontRenderModel[szId] = vHidden;
+		}
+		delete pFresh;
+
+		std::cout << "Can't reload " << szId << ", keeping the old one." << std::endl;
+		return;
+	}
+
+	// Back into the same spot of each landmark, so neighbours still pair up.
+	reattachEntities(pState, szId, mSlots);
+	pFresh->SetChapterOffset(p.fChapterOffset[0], p.fChapterOffset[1], p.fChapterOffset[2]);
+	invalidateOffsets(pState, szId);
+	this->PlaceMaps();
+
+	Reload r;
+	r.iMap   = iMap;
+	r.pFresh = pFresh;
+	r.bLoad  = pOld->IsResident() || (this->m_pStreamer != NULL && this->m_pStreamer->IsBusy(pOld));
+	r.uStart = SDL_GetTicks();
+	{
+		std::lock_guard<std::mutex> lock(this->m_mutex);
+		this->m_qRequests.push_back(r);
+	}
+
+	this->m_cond.notify_one();
+
+}//end HotReloader::ReloadMap()
+
+
+/**
+ * Re-upload the textures of a changed WAD.
+ * \param szWad File name of the WAD.
+ */
+bool HotReloader::ReloadWad(const std::string &szWad)
+{
+	unsigned int uStart = SDL_GetTicks();
+	std::vector<int> vStale;
+
+	if (wadLoad(*this->m_pState->fileSystem, szWad, true, &vStale) == -1) {
+		std::cout << "Can't reload " << szWad << ", keeping the old textures." << std::endl;
+		return false;
+	}
+
+	std::cout << "Reloaded " << szWad << " in " << SDL_GetTicks() - uStart << " ms." << std::endl;
+
+	// UVs are normalised by the texture size, so loaded maps using a
+	// resized texture are reloaded, like those using one whose name moved
+	// to another texture. The others get it on their next load.
+	for (size_t i = 0; i < this->m_vMaps.size() && !vStale.empty(); i++) {
+		BSP *pMap  = this->m_vMaps[i];
+		bool bBusy = this->m_pStreamer != NULL && this->m_pStreamer->IsBusy(pMap);
+
+		if (!bBusy && !pMap->IsLoaded()) {
+			continue;
+		}
+
+		// A map the streamer is loading can't be looked at, it may have read the old size.
+		bool bUses = bBusy;
+		const std::vector<TEXSTUFF> &vTris = pMap->GetTexturedTris();
+
+		for (size_t j = 0; !bUses && j < vTris.size(); j++) {
+			bUses = std::find(vStale.begin(), vStale.end(), vTris[j].texture) != vStale.end();
+		}
+
+		if (bUses) {
+			this->ReloadMap(i);
+		}
+	}
+
+	this->m_vReleasable.insert(this->m_vReleasable.end(), vStale.begin(), vStale.end());
+
+	return true;
+
+}//end HotReloader::ReloadWad()
+
+
+/**
+ * Apply offsets from a changed map config.
+ * Maps can only be moved, adding or removing them needs a restart.
+ */
+bool HotReloader::ReloadMapConfig()
+{
+	ConfigXML config;
+	std::vector<Placement> vPlacements;
+
+	if (config.LoadMapConfig(this->m_szMapConfig.c_str()) != XML_SUCCESS) {
+		std::cout << "Can't reload " << this->m_szMapConfig << ", keeping the old one." << std::endl;
+		return false;
+	}
+
+	GetPlacements(config, vPlacements);
+
+	bool bSameMaps = vPlacements.size() == this->m_vPlacements.size();
+
+	for (size_t i = 0; bSameMaps && i < vPlacements.size(); i++) {
+		bSameMaps = vPlacements[i].sMapEntry.m_szName == this->m_vPlacements[i].sMapEntry.m_szName;
+	}
+
+	if (!bSameMaps) {
+		std::cout << "Maps were added or removed in " << this->m_szMapConfig << ", restart to pick them up." << std::endl;
+		return false;
+	}
+
+	bool bChanged = false;
+
+	for (size_t i = 0; i < vPlacements.size(); i++) {
+		const MapEntry &sNew = vPlacements[i].sMapEntry;
+		const MapEntry &sOld = this->m_vPlacements[i].sMapEntry;
+		BSP *pMap = this->m_vMaps[i];
+
+		if (memcmp(vPlacements[i].fChapterOffset, this->m_vPlacements[i].fChapterOffset, sizeof(vPlacements[i].fChapterOffset)) != 0) {
+			pMap->SetChapterOffset(vPlacements[i].fChapterOffset[0], vPlacements[i].fChapterOffset[1], vPlacements[i].fChapterOffset[2]);
+			bChanged = true;
+		}
+
+		// Landmark offsets are applied while parsing the entities.
+		if (sNew.m_szOffsetTargetName != sOld.m_szOffsetTargetName || sNew.m_fOffsetX != sOld.m_fOffsetX || sNew.m_fOffsetY != sOld.m_fOffsetY || sNew.m_fOffsetZ != sOld.m_fOffsetZ) {
+			std::map<std::string, int> mSlots = detachEntities(this->m_pState, pMap->GetMapId());
+			pMap->ReloadEntities(sNew);
+			reattachEntities(this->m_pState, pMap->GetMapId(), mSlots);
+			invalidateOffsets(this->m_pState, pMap->GetMapId());
+			bChanged = true;
+		}
+	}
+
+	// WADs new to the config can be loaded straight away.
+	for (size_t i = 0; i < config.m_vWads.size(); i++) {
+		if (std::find(this->m_pConfig->m_vWads.begin(), this->m_pConfig->m_vWads.end(), config.m_vWads[i]) != this->m_pConfig->m_vWads.end()) {
+			continue;
+		}
+
+		if (wadLoad(*this->m_pState->fileSystem, config.m_vWads[i] + ".wad") == -1) {
+			continue;
+		}
+
+		this->m_pConfig->m_vWads.push_back(config.m_vWads[i]);
+		this->m_vWadPaths.push_back(this->m_pState->fileSystem->Locate(config.m_vWads[i] + ".wad"));
+		this->m_watcher.Watch(this->m_vWadPaths.back());
+		bChanged = true;
+	}
+
+	this->m_vPlacements = vPlacements;
+
+	if (bChanged) {
+		this->PlaceMaps();
+		std::cout << "Reloaded " << this->m_szMapConfig << "." << std::endl;
+	}
+
+	return bChanged;
+
+}//end HotReloader::ReloadMapConfig()
+
+
+
+/**
+ * Free the textures reloads left behind: ids no name finds any more, once
+ * no loaded map uses them. Waits while maps are being loaded or swapped
+ * in, as they may have found one by its pixels.
+ * \return True when a texture was freed.
+ */
+bool HotReloader::ReleaseTextures()
+{
+	bool bBusy = !this->m_qWaiting.empty();
+
+	// Maps loaded by the streamer after their reload leave textures too.
+	for (size_t i = 0; i < this->m_vMaps.size(); i++) {
+		if (this->m_pStreamer != NULL && this->m_pStreamer->IsBusy(this->m_vMaps[i])) {
+			bBusy = true;
+		} else {
+			this->m_vMaps[i]->TakeReplacedTextures(this->m_vReleasable);
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(this->m_mutex);
+		bBusy |= !this->m_qRequests.empty() || !this->m_qDone.empty();
+	}
+
+	if (bBusy || this->m_vReleasable.empty()) {
+		return false;
+	}
+
+	std::sort(this->m_vReleasable.begin(), this->m_vReleasable.end());
+	this->m_vReleasable.erase(std::unique(this->m_vReleasable.begin(), this->m_vReleasable.end()), this->m_vReleasable.end());
+
+	std::vector<int> vInUse;
+	bool bFreed = false;
+
+	for (size_t i = 0; i < this->m_vReleasable.size(); i++) {
+		int  iId    = this->m_vReleasable[i];
+		bool bNamed = false;
+		{
+			std::lock_guard<std::mutex> lock(texturesMutex);
+			bNamed = g_textures.IsNamed(iId);
+		}
+
+		// Still found by a name, it isn't left behind.
+		if (bNamed) {
+			continue;
+		}
+
+		bool bUsed = false;
+
+		for (size_t j = 0; !bUsed && j < this->m_vMaps.size(); j++) {
+			const std::vector<TEXSTUFF> &vTris = this->m_vMaps[j]->GetTexturedTris();
+
+			for (size_t k = 0; !bUsed && this->m_vMaps[j]->IsLoaded() && k < vTris.size(); k++) {
+				bUsed = vTris[k].texture == iId;
+			}
+		}
+
+		if (bUsed) {
+			vInUse.push_back(iId);
+		} else {
+			releaseTexture(iId);
+			bFreed = true;
+		}
+	}
+
+	this->m_vReleasable.swap(vInUse);
+
+	return bFreed;
+
+}//end HotReloader::ReleaseTextures()
+
+
+/**
+ * Resolve every landmark offset again, in config order, like the first
+ * frame does. Offsets that weren't invalidated are kept.
+ */
+void HotReloader::PlaceMaps()
+{
+	for (size_t i = 0; i < this->m_vMaps.size(); i++) {
+		this->m_vMaps[i]->GetRenderOffset();
+	}
+
+	if (this->m_pStreamer != NULL) {
+		this->m_pStreamer->Refresh();
+	}
+
+}//end HotReloader::PlaceMaps()
+
+
+/**
+ * Body of the worker thread.
+ */
+void HotReloader::WorkerThread()
+{
+	while (true) {
+		Reload r;
+		{
+			std::unique_lock<std::mutex> lock(this->m_mutex);
+
+			while (!this->m_bQuit && this->m_qRequests.empty()) {
+				this->m_cond.wait(lock);
+			}
+
+			if (this->m_bQuit) {
+				return;
+			}
+
+			r = this->m_qRequests.front();
+			this->m_qRequests.pop_front();
+		}
+
+		if (r.bLoad) {
+			r.pFresh->LoadGeometry();
+		}
+
+		std::lock_guard<std::mutex> lock(this->m_mutex);
+		this->m_qDone.push_back(r);
+	}
+
+}//end HotReloader::WorkerThread()
+
+
+/**
+ * Collect the rendered maps of a config, as main() creates them.
+ */
+void HotReloader::GetPlacements(const ConfigXML &config, std::vector<Placement> &vPlacements)
+{
+	vPlacements.clear();
+
+	for (size_t i = 0; i < config.m_vChapterEntries.size(); i++) {
+		const ChapterEntry &sChapterEntry = config.m_vChapterEntries[i];
+
+		for (size_t j = 0; j < sChapterEntry.m_vMapEntries.size(); j++) {
+			if (!sChapterEntry.m_bRender || !sChapterEntry.m_vMapEntries[j].m_bRender) {
+				continue;
+			}
+
+			Placement p;
+			p.sMapEntry         = sChapterEntry.m_vMapEntries[j];
+			p.fChapterOffset[0] = sChapterEntry.m_fOffsetX;
+			p.fChapterOffset[1] = sChapterEntry.m_fOffsetY;
+			p.fChapterOffset[2] = sChapterEntry.m_fOffsetZ;
+			vPlacements.push_back(p);
+		}
+	}
+
+}//end HotReloader::GetPlacements()
@@ -0,0 +1,132 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#ifndef HOTRELOADER_H
+#define HOTRELOADER_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "ConfigXML.h"
+#include "FileWatcher.h"
+
+class BSP;
+class MapStreamer;
+class World;
+struct WORLDSTATE;
+
+
+/**
+ * Reloads maps, WADs and the map config when they change on disk.
+ *
+ * A changed map is probed on the GL thread, so its landmarks and offsets
+ * are in place straight away, then its geometry is loaded on a worker
+ * thread and swapped into the existing BSP once uploaded. Only the
+ * changed map is reloaded, the maps placed from it just move. A changed
+ * WAD re-uploads its textures into the same texture objects, and loaded
+ * maps using one whose size changed are reloaded, their UVs being
+ * normalised by it. Textures shared with other names get new objects
+ * instead, reloading the maps using them too. A changed PAK reloads every
+ * map and WAD inside it. A changed map config applies new chapter and
+ * landmark offsets. Textures left behind by a reload are freed once no
+ * name or map uses them.
+ */
+class HotReloader
+{
+public:
+	/**
+	 * Start watching and the worker thread.
+	 * \param pWorld    Loaded world, whose maps are replaced in place.
+	 * \param pStreamer Streamer of the maps, or NULL when not streaming.
+	 */
+	HotReloader(World *pWorld, MapStreamer *pStreamer);
+
+	/** Stop the worker thread and drop unfinished reloads. */
+	~HotReloader();
+
+	/**
+	 * Pick up changed files and swap in reloaded maps.
+	 * Must be called from the GL thread.
+	 * \return True when textures or maps changed, batches need a rebuild.
+	 */
+	bool Update();
+
+private:
+	/** Probe a changed map and queue its geometry load. */
+	void ReloadMap(size_t iMap);
+
+	/** Re-upload the textures of a changed WAD. */
+	bool ReloadWad(const std::string &szWad);
+
+	/** Apply offsets from a changed map config. */
+	bool ReloadMapConfig();
+
+	/** Free the textures reloads left behind, once no map uses them. */
+	bool ReleaseTextures();
+
+
+	/** Resolve every landmark offset again, in config order. */
+	void PlaceMaps();
+
+	/** Body of the worker thread. */
+	void WorkerThread();
+
+	struct Placement
+	{
+		MapEntry sMapEntry;         /** Config entry of the map. */
+		float    fChapterOffset[3]; /** Offset of its chapter. */
+	};
+
+	struct Reload
+	{
+		size_t       iMap;    /** Index of the map being replaced. */
+		BSP         *pFresh;  /** The reloaded map. */
+		bool         bLoad;   /** Load geometry too, the old map is in use. */
+		unsigned int uStart;  /** Tick the change was picked up. */
+	};
+
+	/** Collect the rendered maps of a config, as main() creates them. */
+	static void GetPlacements(const ConfigXML &config, std::vector<Placement> &vPlacements);
+
+	ConfigXML                *m_pConfig;     /** Program and map config. */
+	std::string               m_szMapConfig; /** Path of the map config. */
+	std::vector<BSP*>        &m_vMaps;       /** The maps. */
+	WORLDSTATE               *m_pState;      /** Landmarks, hidden models and offsets of the maps. */
+	std::vector<Placement>    m_vPlacements; /** Config of each map. */
+	MapStreamer              *m_pStreamer;   /** Streamer, or NULL. */
+	FileWatcher               m_watcher;     /** Watches maps, WADs and the map config. */
+	std::vector<std::string>  m_vWadPaths;   /** Path of each WAD in the config. */
+	std::deque<Reload>        m_qWaiting;    /** Loaded, waiting for the streamer to let go of the map. */
+	std::vector<int>          m_vReleasable; /** Texture ids reloads moved away from. */
+
+	std::thread               m_thread;      /** Worker thread. */
+	std::mutex                m_mutex;       /** Guards the queues and m_bQuit. */
+	std::condition_variable   m_cond;        /** Wakes the worker thread. */
+	std::deque<Reload>        m_qRequests;   /** Maps waiting for their geometry. */
+	std::deque<Reload>        m_qDone;       /** Maps ready to swap in. */
+	bool                      m_bQuit;       /** Ask the worker thread to stop. */
+
+};//end HotReloader
+
+#endif //HOTRELOADER_H
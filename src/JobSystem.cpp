@@ -0,0 +1,279 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#include "JobSystem.h"
+
+#include <algorithm>
+
+
+/**
+ * Constructor, starts the workers.
+ * \param iThreads Threads running jobs, the caller included. 0 for one per core, 1 runs everything on the caller.
+ */
+JobSystem::JobSystem(int iThreads)
+{
+	if (iThreads <= 0) {
+		iThreads = std::max((int)std::thread::hardware_concurrency(), 1);
+	}
+
+	this->m_iQueued = 0;
+	this->m_bQuit   = false;
+
+	for (int i = 0; i < iThreads; i++) {
+		Queue *pQueue = new Queue();
+		pQueue->uRun    = 0;
+		pQueue->uStolen = 0;
+		this->m_vQueues.push_back(pQueue);
+	}
+
+	for (int i = 1; i < iThreads; i++) {
+		this->m_vThreads.push_back(std::thread(&JobSystem::WorkerMain, this, i));
+	}
+
+}//end JobSystem::JobSystem()
+
+
+/**
+ * Destructor, runs what is left and stops the workers.
+ */
+JobSystem::~JobSystem()
+{
+	while (this->RunOne(0)) {
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(this->m_mutex);
+		this->m_bQuit = true;
+	}
+
+	this->m_wake.notify_all();
+
+	for (size_t i = 0; i < this->m_vThreads.size(); i++) {
+		this->m_vThreads[i].join();
+	}
+
+	for (size_t i = 0; i < this->m_vQueues.size(); i++) {
+		delete this->m_vQueues[i];
+	}
+
+}//end JobSystem::~JobSystem()
+
+
+/**
+ * Deque of the calling thread.
+ */
+int JobSystem::GetQueueIndex() const
+{
+	std::thread::id id = std::this_thread::get_id();
+
+	for (size_t i = 0; i < this->m_vThreads.size(); i++) {
+		if (this->m_vThreads[i].get_id() == id) {
+			return (int)i + 1;
+		}
+	}
+
+	return 0;
+
+}//end JobSystem::GetQueueIndex()
+
+
+/**
+ * Queue a job.
+ * \param job      Work to run, on any thread.
+ * \param pCounter Counted until the job has run, may be NULL.
+ */
+void JobSystem::Submit(const std::function<void()> &job, JobCounter *pCounter)
+{
+	// Nobody else runs jobs.
+	if (this->m_vThreads.empty()) {
+		job();
+		this->m_vQueues[0]->uRun++;
+		return;
+	}
+
+	if (pCounter != NULL) {
+		pCounter->m_iPending++;
+	}
+
+	Job j;
+	j.func     = job;
+	j.pCounter = pCounter;
+
+	Queue *pQueue = this->m_vQueues[this->GetQueueIndex()];
+	{
+		std::lock_guard<std::mutex> lock(pQueue->mutex);
+		pQueue->dJobs.push_back(j);
+	}
+
+	// Taking the lock orders this with a worker deciding to sleep.
+	{
+		std::lock_guard<std::mutex> lock(this->m_mutex);
+		this->m_iQueued++;
+	}
+
+	this->m_wake.notify_one();
+
+}//end JobSystem::Submit()
+
+
+/**
+ * Run one job: the newest of the own deque, or else the oldest of another.
+ * \return False when every deque was empty.
+ */
+bool JobSystem::RunOne(int iIndex)
+{
+	Job  job;
+	bool bFound  = false;
+	bool bStolen = false;
+	int  iCount  = (int)this->m_vQueues.size();
+
+	for (int k = 0; k < iCount && !bFound; k++) {
+		Queue *pQueue = this->m_vQueues[(iIndex + k) % iCount];
+		std::lock_guard<std::mutex> lock(pQueue->mutex);
+
+		if (pQueue->dJobs.empty()) {
+			continue;
+		}
+
+		if (k == 0) {
+			job = pQueue->dJobs.back();
+			pQueue->dJobs.pop_back();
+		} else {
+			job = pQueue->dJobs.front();
+			pQueue->dJobs.pop_front();
+			bStolen = true;
+		}
+
+		bFound = true;
+	}
+
+	if (!bFound) {
+		return false;
+	}
+
+	this->m_iQueued--;
+	job.func();
+
+	if (job.pCounter != NULL) {
+		job.pCounter->m_iPending--;
+	}
+
+	this->m_vQueues[iIndex]->uRun++;
+
+	if (bStolen) {
+		this->m_vQueues[iIndex]->uStolen++;
+	}
+
+	return true;
+
+}//end JobSystem::RunOne()
+
+
+/**
+ * Loop of worker iIndex, sleeping while every deque is empty.
+ */
+void JobSystem::WorkerMain(int iIndex)
+{
+	for (;;) {
+		if (this->RunOne(iIndex)) {
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(this->m_mutex);
+
+		while (this->m_iQueued == 0 && !this->m_bQuit) {
+			this->m_wake.wait(lock);
+		}
+
+		if (this->m_bQuit) {
+			return;
+		}
+	}
+
+}//end JobSystem::WorkerMain()
+
+
+/**
+ * Run jobs until every job of a group has run. Jobs of other groups may
+ * run meanwhile, the calling thread is never idle while there is work.
+ */
+void JobSystem::Wait(JobCounter &counter)
+{
+	int iIndex = this->GetQueueIndex();
+
+	while (!counter.IsDone()) {
+		if (!this->RunOne(iIndex)) {
+			std::this_thread::yield();
+		}
+	}
+
+}//end JobSystem::Wait()
+
+
+/**
+ * Split [0, uCount) into ranges of uGrain, run them as jobs and wait.
+ * \param func Called with (first, end) of each range.
+ */
+void JobSystem::ParallelFor(size_t uCount, size_t uGrain, const std::function<void(size_t, size_t)> &func)
+{
+	uGrain = std::max(uGrain, (size_t)1);
+
+	if (uCount <= uGrain || this->m_vThreads.empty()) {
+		if (uCount != 0) {
+			func(0, uCount);
+		}
+		return;
+	}
+
+	JobCounter counter;
+
+	for (size_t uFirst = 0; uFirst < uCount; uFirst += uGrain) {
+		this->Submit(std::bind(func, uFirst, std::min(uFirst + uGrain, uCount)), &counter);
+	}
+
+	this->Wait(counter);
+
+}//end JobSystem::ParallelFor()
+
+
+/**
+ * Print jobs run and stolen per thread, since the last call.
+ */
+void JobSystem::PrintStats(std::ostream &out)
+{
+	unsigned int uRun = 0, uStolen = 0;
+
+	for (size_t i = 0; i < this->m_vQueues.size(); i++) {
+		uRun    += this->m_vQueues[i]->uRun;
+		uStolen += this->m_vQueues[i]->uStolen;
+	}
+
+	out << "Jobs: " << uRun << " run on " << this->m_vQueues.size() << " threads, " << uStolen << " stolen." << std::endl;
+	out << "  Per thread:";
+
+	for (size_t i = 0; i < this->m_vQueues.size(); i++) {
+		out << " " << this->m_vQueues[i]->uRun.exchange(0);
+		this->m_vQueues[i]->uStolen = 0;
+	}
+
+	out << std::endl;
+
+}//end JobSystem::PrintStats()
@@ -0,0 +1,134 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#ifndef JOBSYSTEM_H
+#define JOBSYSTEM_H
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <ostream>
+#include <cstddef>
+
+
+/** Counts the jobs of a group still to finish, to wait on them. */
+class JobCounter
+{
+public:
+	/** Constructor */
+	JobCounter() : m_iPending(0) {}
+
+	/** Check if every job of the group has run. */
+	bool IsDone() const { return this->m_iPending == 0; }
+
+private:
+	friend class JobSystem;
+
+	JobCounter(const JobCounter &);
+	JobCounter &operator=(const JobCounter &);
+
+	std::atomic<int> m_iPending; /** Jobs submitted and not finished. */
+
+};//end JobCounter
+
+
+/**
+ * Small work stealing job system.
+ *
+ * One worker thread per core besides the calling thread, each with its own
+ * deque. A thread pops its newest job first, and steals the oldest job of
+ * another deque when its own is empty. Threads that are not workers (the
+ * main thread, loaders) submit to a shared deque and help run jobs while
+ * they wait, so waiting never blocks a core.
+ */
+class JobSystem
+{
+public:
+	/**
+	 * Constructor, starts the workers.
+	 * \param iThreads Threads running jobs, the caller included. 0 for one per core, 1 runs everything on the caller.
+	 */
+	JobSystem(int iThreads = 0);
+
+	/** Destructor, runs what is left and stops the workers. */
+	~JobSystem();
+
+	/** Threads running jobs, the caller included. */
+	int GetThreadCount() const { return (int)this->m_vQueues.size(); }
+
+	/**
+	 * Queue a job.
+	 * \param job      Work to run, on any thread.
+	 * \param pCounter Counted until the job has run, may be NULL.
+	 */
+	void Submit(const std::function<void()> &job, JobCounter *pCounter);
+
+	/** Run jobs until every job of a group has run. */
+	void Wait(JobCounter &counter);
+
+	/**
+	 * Split [0, uCount) into ranges of uGrain, run them as jobs and wait.
+	 * \param func Called with (first, end) of each range.
+	 */
+	void ParallelFor(size_t uCount, size_t uGrain, const std::function<void(size_t, size_t)> &func);
+
+	/** Print jobs run and stolen per thread, since the last call. */
+	void PrintStats(std::ostream &out);
+
+private:
+	struct Job
+	{
+		std::function<void()> func;
+		JobCounter           *pCounter;
+	};
+
+	/** Deque of one thread, index 0 is shared by every thread that isn't a worker. */
+	struct Queue
+	{
+		std::mutex                mutex;
+		std::deque<Job>           dJobs;
+		std::atomic<unsigned int> uRun;    /** Jobs run by this thread. */
+		std::atomic<unsigned int> uStolen; /** Of those, taken from another deque. */
+	};
+
+	/** Loop of worker iIndex. */
+	void WorkerMain(int iIndex);
+
+	/** Run one job, from the own deque or stolen. False when there was none. */
+	bool RunOne(int iIndex);
+
+	/** Deque of the calling thread. */
+	int GetQueueIndex() const;
+
+	std::vector<Queue*>      m_vQueues;  /** One per thread. */
+	std::vector<std::thread> m_vThreads; /** Workers, worker i uses deque i + 1. */
+	std::mutex               m_mutex;    /** Guards sleeping. */
+	std::condition_variable  m_wake;     /** Signalled when jobs are queued or on shutdown. */
+	std::atomic<int>         m_iQueued;  /** Jobs in every deque. */
+	bool                     m_bQuit;    /** Set on shutdown. */
+
+};//end JobSystem
+
+#endif //JOBSYSTEM_H
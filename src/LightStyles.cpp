@@ -0,0 +1,217 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#include "LightStyles.h"
+
+#include <algorithm>
+#include <iomanip>
+
+LightmapUpdates g_lightmapUpdates;
+
+// Patterns each letter lasts, in milliseconds.
+#define LIGHTSTYLE_FRAME_MS 100
+
+// Styles 0-11, as set by the game for every map.
+static const char *szStandardPatterns[] = {
+	"m",                                             // 0 normal
+	"mmnmmommommnonmmonqnmmo",                       // 1 flicker A
+	"abcdefghijklmnopqrstuvwxyzyxwvutsrqponmlkjihgfedcba", // 2 slow strong pulse
+	"mmmmmaaaaammmmmaaaaaabcdefgabcdefg",            // 3 candle A
+	"mamamamamama",                                  // 4 fast strobe
+	"jklmnopqrstuvwxyzyxwvutsrqponmlkj",             // 5 gentle pulse
+	"nmonqnmomnmomomno",                             // 6 flicker B
+	"mmmaaaabcdefgmmmmaaaaaaaaabcdefgmmmaaaa",       // 7 candle B
+	"mmmaaammmaaammmabcdefaaaammmmabcdefmmmaaaa",    // 8 candle C
+	"aaaaaaaazzzzzzzz",                              // 9 slow strobe
+	"mmamammmmammamamaaamammma",                     // 10 fluorescent flicker
+	"abcdefghijklmnopqrrqponmlkjihgfedcba"           // 11 slow pulse, not to black
+};
+
+
+/**
+ * Constructor, sets the standard patterns.
+ */
+LightStyles::LightStyles()
+{
+	this->Reset();
+
+}//end LightStyles::LightStyles()
+
+
+/**
+ * Back to the standard patterns, switchable lights on.
+ */
+void LightStyles::Reset()
+{
+	int iStandard = (int)(sizeof(szStandardPatterns) / sizeof(szStandardPatterns[0]));
+
+	for (int i = 0; i < MAX_LIGHTSTYLES; i++) {
+		this->SetPattern(i, i < iStandard ? szStandardPatterns[i] : "m");
+	}
+
+}//end LightStyles::Reset()
+
+
+/**
+ * Set the pattern of a style, from a light entity.
+ * \param iStyle    Style number, out of range ones are ignored.
+ * \param szPattern Letters from 'a' to 'z', empty for normal brightness.
+ */
+void LightStyles::SetPattern(int iStyle, const std::string &szPattern)
+{
+	if (iStyle < 0 || iStyle >= MAX_LIGHTSTYLES) {
+		return;
+	}
+
+	std::string &szOwn = this->m_szPatterns[iStyle];
+	szOwn = szPattern.empty() ? "m" : szPattern;
+
+	for (size_t i = 0; i < szOwn.size(); i++) {
+		if (szOwn[i] < 'a' || szOwn[i] > 'z') {
+			szOwn[i] = 'm';
+		}
+	}
+
+	this->m_bAnimated[iStyle] = szOwn.find_first_not_of(szOwn[0]) != std::string::npos;
+
+}//end LightStyles::SetPattern()
+
+
+/**
+ * Check if a style changes over time.
+ */
+bool LightStyles::IsAnimated(int iStyle) const
+{
+	return iStyle >= 0 && iStyle < MAX_LIGHTSTYLES && this->m_bAnimated[iStyle];
+
+}//end LightStyles::IsAnimated()
+
+
+/**
+ * Brightness of a style at a time, LIGHTSTYLE_NORMAL being normal.
+ * \param iStyle Style number.
+ * \param uMs    Time in milliseconds.
+ */
+int LightStyles::GetValue(int iStyle, unsigned int uMs) const
+{
+	if (iStyle < 0 || iStyle >= MAX_LIGHTSTYLES) {
+		return LIGHTSTYLE_NORMAL;
+	}
+
+	const std::string &szPattern = this->m_szPatterns[iStyle];
+
+	return (szPattern[(uMs / LIGHTSTYLE_FRAME_MS) % szPattern.size()] - 'a') * 22;
+
+}//end LightStyles::GetValue()
+
+
+/**
+ * Constructor
+ */
+LightmapUpdates::LightmapUpdates()
+{
+	this->m_uBudget     = 0;
+	this->m_uTime       = 0;
+	this->m_uFrameBytes = 0;
+	this->m_uFrames     = 0;
+	this->m_uRects      = 0;
+	this->m_uBytes      = 0;
+	this->m_uPeakBytes  = 0;
+	this->m_uDeferred   = 0;
+	this->m_uBusyFrames = 0;
+	this->m_bFrameBusy  = false;
+
+}//end LightmapUpdates::LightmapUpdates()
+
+
+/**
+ * Start a frame, with a fresh budget.
+ * \param uMs Time light styles are evaluated at.
+ */
+void LightmapUpdates::BeginFrame(unsigned int uMs)
+{
+	this->m_uTime       = uMs;
+	this->m_uFrameBytes = 0;
+	this->m_bFrameBusy  = false;
+	this->m_uFrames++;
+
+}//end LightmapUpdates::BeginFrame()
+
+
+/**
+ * Take bytes from this frame's budget for one rectangle. The first
+ * rectangle of a frame always fits, so a small budget can't starve.
+ * \return False when over budget, the rectangle is counted as deferred.
+ */
+bool LightmapUpdates::Consume(size_t uBytes)
+{
+	if (this->m_uBudget != 0 && this->m_uFrameBytes != 0 && this->m_uFrameBytes + uBytes > this->m_uBudget) {
+		this->m_uDeferred++;
+
+		if (!this->m_bFrameBusy) {
+			this->m_bFrameBusy = true;
+			this->m_uBusyFrames++;
+		}
+
+		return false;
+	}
+
+	this->m_uFrameBytes += uBytes;
+	this->m_uBytes      += uBytes;
+	this->m_uPeakBytes   = std::max(this->m_uPeakBytes, this->m_uFrameBytes);
+	this->m_uRects++;
+
+	return true;
+
+}//end LightmapUpdates::Consume()
+
+
+/**
+ * Print uploads and deferrals since the last call.
+ */
+void LightmapUpdates::PrintStats(std::ostream &out)
+{
+	std::streamsize iPrecision = out.precision();
+	out << std::fixed << std::setprecision(2);
+
+	out << "Light styles: " << this->m_uRects << " lightmap rectangles, " << this->m_uBytes / 1024.0 << " KB in " << this->m_uFrames << " frames";
+
+	if (this->m_uFrames != 0) {
+		out << " (" << this->m_uBytes / 1024.0 / this->m_uFrames << " KB per frame, peak " << this->m_uPeakBytes / 1024.0 << " KB)";
+	}
+
+	out << "." << std::endl;
+
+	if (this->m_uBudget != 0) {
+		out << "  Budget " << this->m_uBudget / 1024.0 << " KB per frame, " << this->m_uDeferred << " rectangles deferred in " << this->m_uBusyFrames << " frames." << std::endl;
+	}
+
+	out.unsetf(std::ios_base::floatfield);
+	out.precision(iPrecision);
+
+	this->m_uFrames     = 0;
+	this->m_uRects      = 0;
+	this->m_uBytes      = 0;
+	this->m_uPeakBytes  = 0;
+	this->m_uDeferred   = 0;
+	this->m_uBusyFrames = 0;
+
+}//end LightmapUpdates::PrintStats()
@@ -0,0 +1,128 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#ifndef LIGHTSTYLES_H
+#define LIGHTSTYLES_H
+
+#include <string>
+#include <ostream>
+#include <cstddef>
+
+// Styles a map can use, 0-11 are the standard animated ones and 32 and up
+// are switchable lights.
+#define MAX_LIGHTSTYLES 64
+
+// Unused style slot of a face.
+#define LIGHTSTYLE_NONE 255
+
+// Value of 'm', the normal brightness. 'a' is dark and 'z' about double.
+#define LIGHTSTYLE_NORMAL (('m' - 'a') * 22)
+
+
+/**
+ * Light style patterns of one map, in the GoldSrc format: one letter per
+ * tenth of a second, from 'a' (dark) to 'z' (double brightness).
+ */
+class LightStyles
+{
+public:
+	/** Constructor, sets the standard patterns. */
+	LightStyles();
+
+	/** Back to the standard patterns, switchable lights on. */
+	void Reset();
+
+	/**
+	 * Set the pattern of a style, from a light entity.
+	 * \param iStyle    Style number, out of range ones are ignored.
+	 * \param szPattern Letters from 'a' to 'z', empty for normal brightness.
+	 */
+	void SetPattern(int iStyle, const std::string &szPattern);
+
+	/** Check if a style changes over time. */
+	bool IsAnimated(int iStyle) const;
+
+	/**
+	 * Brightness of a style at a time, LIGHTSTYLE_NORMAL being normal.
+	 * \param iStyle Style number.
+	 * \param uMs    Time in milliseconds.
+	 */
+	int GetValue(int iStyle, unsigned int uMs) const;
+
+private:
+	std::string m_szPatterns[MAX_LIGHTSTYLES];
+	bool        m_bAnimated[MAX_LIGHTSTYLES];
+
+};//end LightStyles
+
+
+/**
+ * Per frame budget and statistics of animated lightmap uploads, shared by
+ * every map. Main thread only.
+ */
+class LightmapUpdates
+{
+public:
+	/** Constructor */
+	LightmapUpdates();
+
+	/**
+	 * Set the bytes uploaded per frame.
+	 * \param uBytes Budget, 0 for none.
+	 */
+	void SetBudget(size_t uBytes) { this->m_uBudget = uBytes; }
+
+	/**
+	 * Start a frame, with a fresh budget.
+	 * \param uMs Time light styles are evaluated at.
+	 */
+	void BeginFrame(unsigned int uMs);
+
+	/** Time light styles are evaluated at this frame. */
+	unsigned int GetTime() const { return this->m_uTime; }
+
+	/**
+	 * Take bytes from this frame's budget for one rectangle. The first
+	 * rectangle of a frame always fits, so a small budget can't starve.
+	 * \return False when over budget, the rectangle is counted as deferred.
+	 */
+	bool Consume(size_t uBytes);
+
+	/** Print uploads and deferrals since the last call. */
+	void PrintStats(std::ostream &out);
+
+private:
+	size_t       m_uBudget;      /** Bytes per frame, 0 for none. */
+	unsigned int m_uTime;        /** Time of the current frame. */
+	size_t       m_uFrameBytes;  /** Uploaded this frame. */
+	unsigned int m_uFrames;      /** Frames since the last stats. */
+	unsigned int m_uRects;       /** Rectangles uploaded. */
+	size_t       m_uBytes;       /** Bytes uploaded. */
+	size_t       m_uPeakBytes;   /** Most bytes in one frame. */
+	unsigned int m_uDeferred;    /** Rectangles left for a later frame. */
+	unsigned int m_uBusyFrames;  /** Frames that ran out of budget. */
+	bool         m_bFrameBusy;   /** This frame ran out of budget. */
+
+};//end LightmapUpdates
+
+extern LightmapUpdates g_lightmapUpdates;
+
+#endif //LIGHTSTYLES_H
@@ -0,0 +1,339 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#include "common.h"
+#include "bsp.h"
+#include "Frustum.h"
+#include "MemoryRegistry.h"
+#include "MapStreamer.h"
+
+/**
+ * Start the loader thread.
+ * \param vMaps       Probed maps, with their landmark offsets resolvable.
+ * \param fRadius     Load maps closer than this to the camera.
+ * \param fHysteresis Extra distance before a loaded map can be evicted.
+ * \param uBudget     Memory budget for resident maps, in bytes.
+ */
+MapStreamer::MapStreamer(const std::vector<BSP*> &vMaps, float fRadius, float fHysteresis, size_t uBudget)
+{
+	this->m_fRadius       = fRadius;
+	this->m_fHysteresis   = fHysteresis;
+	this->m_uBudget       = uBudget;
+	this->m_uResident     = 0;
+	this->m_bQuit         = false;
+	this->m_uLoads        = 0;
+	this->m_uEvictions    = 0;
+	this->m_uLoadTicks    = 0;
+	this->m_uUploadTicks  = 0;
+	this->m_uPeakResident = 0;
+
+	// Bounds are resolved in config order, like the renderer does.
+	for (size_t i = 0; i < vMaps.size(); i++) {
+		StreamedMap m;
+		VERTEX mins, maxs;
+		vMaps[i]->GetBounds(mins, maxs);
+
+		m.pMap         = vMaps[i];
+		m.fMins[0]     = mins.x; m.fMins[1] = mins.y; m.fMins[2] = mins.z;
+		m.fMaxs[0]     = maxs.x; m.fMaxs[1] = maxs.y; m.fMaxs[2] = maxs.z;
+		m.eState       = vMaps[i]->IsResident() ? MAP_RESIDENT : MAP_UNLOADED;
+		m.uLastVisible = 0;
+		m.uQueuedAt    = 0;
+		this->m_uResident += vMaps[i]->GetResidentBytes();
+		this->m_vMaps.push_back(m);
+	}
+
+	this->m_thread = std::thread(&MapStreamer::LoaderThread, this);
+
+}//end MapStreamer::MapStreamer()
+
+
+/**
+ * Stop the loader thread and wait for it.
+ */
+MapStreamer::~MapStreamer()
+{
+	{
+		std::lock_guard<std::mutex> lock(this->m_mutex);
+		this->m_bQuit = true;
+	}
+
+	this->m_cond.notify_all();
+	this->m_thread.join();
+
+}//end MapStreamer::~MapStreamer()
+
+
+/**
+ * Queue loads, upload finished maps and evict maps over the budget.
+ * Must be called from the GL thread.
+ * \param fCamera   Camera position.
+ * \param fExtra    Added to the radius (view extent in isometric mode).
+ * \param frustum   Current view frustum, used to track visibility.
+ * \return True when the set of resident maps changed.
+ */
+bool MapStreamer::Update(const float fCamera[3], float fExtra, const Frustum &frustum)
+{
+	bool bChanged = false;
+	unsigned int uNow = SDL_GetTicks();
+	float fLoadRadius  = this->m_fRadius + fExtra;
+	float fEvictRadius = fLoadRadius + this->m_fHysteresis;
+
+	// Upload whatever the loader thread finished.
+	std::deque<int> qLoaded;
+	{
+		std::lock_guard<std::mutex> lock(this->m_mutex);
+		qLoaded.swap(this->m_qLoaded);
+	}
+
+	for (size_t i = 0; i < qLoaded.size(); i++) {
+		StreamedMap &m = this->m_vMaps[qLoaded[i]];
+		unsigned int uStart = SDL_GetTicks();
+
+		m.pMap->Upload();
+
+		if (!m.pMap->IsResident()) {
+			m.eState = MAP_FAILED;
+			continue;
+		}
+
+		m.eState = MAP_RESIDENT;
+		this->m_uResident    += m.pMap->GetResidentBytes();
+		this->m_uUploadTicks += SDL_GetTicks() - uStart;
+		this->m_uLoadTicks   += SDL_GetTicks() - m.uQueuedAt;
+		this->m_uLoads++;
+		bChanged = true;
+
+		std::cout << "Streamed in " << m.pMap->GetMapId() << " (" << m.pMap->GetResidentBytes() / (1024 * 1024) << " MB, " << SDL_GetTicks() - m.uQueuedAt << " ms)." << std::endl;
+	}
+
+	// Track visibility, and queue every unloaded map in range, nearest first.
+	std::vector<std::pair<float, int> > vWanted;
+
+	for (size_t i = 0; i < this->m_vMaps.size(); i++) {
+		StreamedMap &m = this->m_vMaps[i];
+
+		if (frustum.TestAABB(m.fMins, m.fMaxs)) {
+			m.uLastVisible = uNow;
+		}
+
+		float fDistance = this->Distance((int)i, fCamera);
+
+		if (m.eState == MAP_UNLOADED && fDistance < fLoadRadius) {
+			vWanted.push_back(std::make_pair(fDistance, (int)i));
+		}
+	}
+
+	if (!vWanted.empty()) {
+		std::sort(vWanted.begin(), vWanted.end());
+		{
+			std::lock_guard<std::mutex> lock(this->m_mutex);
+
+			for (size_t i = 0; i < vWanted.size(); i++) {
+				this->m_vMaps[vWanted[i].second].eState    = MAP_QUEUED;
+				this->m_vMaps[vWanted[i].second].uQueuedAt = uNow;
+				this->m_qRequests.push_back(vWanted[i].second);
+			}
+		}
+		this->m_cond.notify_one();
+	}
+
+	// Evict the least recently visible maps until back under the budget.
+	// Maps past the hysteresis band go first, then maps in the band that
+	// aren't visible right now. Maps inside the radius always stay.
+	// Textures count against the budget too, but stay loaded once seen,
+	// so they only leave less room for maps. So does the batch, its second
+	// copy of the used textures and world vertices.
+	size_t uTextures = g_gpuMemory.GetCategoryTotal(MemoryRegistry::CATEGORY_TEXTURE) + g_gpuMemory.GetCategoryTotal(MemoryRegistry::CATEGORY_BATCH);
+
+	while (this->m_uResident + uTextures > this->m_uBudget) {
+		int iVictim = -1;
+
+		for (int pass = 0; pass < 2 && iVictim == -1; pass++) {
+			for (size_t i = 0; i < this->m_vMaps.size(); i++) {
+				const StreamedMap &m = this->m_vMaps[i];
+
+				if (m.eState != MAP_RESIDENT) {
+					continue;
+				}
+
+				float fDistance = this->Distance((int)i, fCamera);
+				bool bEvictable = pass == 0 ? fDistance > fEvictRadius : (fDistance >= fLoadRadius && m.uLastVisible != uNow);
+
+				if (bEvictable && (iVictim == -1 || m.uLastVisible < this->m_vMaps[iVictim].uLastVisible)) {
+					iVictim = (int)i;
+				}
+			}
+		}
+
+		if (iVictim == -1) {
+			break;
+		}
+
+		StreamedMap &m = this->m_vMaps[iVictim];
+		this->m_uResident -= m.pMap->GetResidentBytes();
+		m.pMap->Unload();
+		m.eState = MAP_UNLOADED;
+		this->m_uEvictions++;
+		bChanged = true;
+
+		std::cout << "Evicted " << m.pMap->GetMapId() << "." << std::endl;
+	}
+
+	this->m_uPeakResident = std::max(this->m_uPeakResident, this->m_uResident + uTextures);
+
+	return bChanged;
+
+}//end MapStreamer::Update()
+
+
+/**
+ * Change the hysteresis distance at runtime.
+ */
+void MapStreamer::SetHysteresis(float fHysteresis)
+{
+	this->m_fHysteresis = std::max(0.0f, fHysteresis);
+
+}//end MapStreamer::SetHysteresis()
+
+
+/**
+ * Print residency statistics.
+ */
+void MapStreamer::PrintStats() const
+{
+	int iResident = 0, iQueued = 0;
+
+	for (size_t i = 0; i < this->m_vMaps.size(); i++) {
+		if (this->m_vMaps[i].eState == MAP_RESIDENT) iResident++;
+		if (this->m_vMaps[i].eState == MAP_QUEUED) iQueued++;
+	}
+
+	const float fMB = 1024.0f * 1024.0f;
+
+	std::cout << "Streaming: " << iResident << "/" << this->m_vMaps.size() << " maps resident, "
+	          << iQueued << " loading, "
+	          << this->m_uResident / fMB << " MB maps + " << g_gpuMemory.GetCategoryTotal(MemoryRegistry::CATEGORY_TEXTURE) / fMB << " MB textures/"
+	          << this->m_uBudget / fMB << " MB (peak " << this->m_uPeakResident / fMB << " MB), "
+	          << this->m_uLoads << " loads, " << this->m_uEvictions << " evictions";
+
+	if (this->m_uLoads > 0) {
+		std::cout << ", avg " << this->m_uLoadTicks / this->m_uLoads << " ms per load ("
+		          << this->m_uUploadTicks / this->m_uLoads << " ms upload)";
+	}
+
+	std::cout << ", radius " << this->m_fRadius << ", hysteresis " << this->m_fHysteresis << "." << std::endl;
+
+}//end MapStreamer::PrintStats()
+
+
+/**
+ * Whether the loader thread may still be working on a map.
+ * \param pMap The map.
+ */
+bool MapStreamer::IsBusy(const BSP *pMap) const
+{
+	for (size_t i = 0; i < this->m_vMaps.size(); i++) {
+		if (this->m_vMaps[i].pMap == pMap) {
+			return this->m_vMaps[i].eState == MAP_QUEUED;
+		}
+	}
+
+	return false;
+
+}//end MapStreamer::IsBusy()
+
+
+/**
+ * Re-read bounds, residency and sizes of every idle map, after maps
+ * were reloaded in place or their offsets changed. Failed maps are
+ * retried. Must be called from the GL thread.
+ */
+void MapStreamer::Refresh()
+{
+	this->m_uResident = 0;
+
+	for (size_t i = 0; i < this->m_vMaps.size(); i++) {
+		StreamedMap &m = this->m_vMaps[i];
+		VERTEX mins, maxs;
+		m.pMap->GetBounds(mins, maxs);
+
+		m.fMins[0] = mins.x; m.fMins[1] = mins.y; m.fMins[2] = mins.z;
+		m.fMaxs[0] = maxs.x; m.fMaxs[1] = maxs.y; m.fMaxs[2] = maxs.z;
+
+		if (m.eState != MAP_QUEUED) {
+			m.eState = m.pMap->IsResident() ? MAP_RESIDENT : MAP_UNLOADED;
+		}
+
+		this->m_uResident += m.pMap->GetResidentBytes();
+	}
+
+}//end MapStreamer::Refresh()
+
+
+/**
+ * Body of the loader thread.
+ */
+void MapStreamer::LoaderThread()
+{
+	while (true) {
+		int iMap;
+		{
+			std::unique_lock<std::mutex> lock(this->m_mutex);
+
+			while (!this->m_bQuit && this->m_qRequests.empty()) {
+				this->m_cond.wait(lock);
+			}
+
+			if (this->m_bQuit) {
+				return;
+			}
+
+			iMap = this->m_qRequests.front();
+			this->m_qRequests.pop_front();
+		}
+
+		// Geometry loading only touches the map itself and the locked texture table.
+		this->m_vMaps[iMap].pMap->LoadGeometry();
+
+		std::lock_guard<std::mutex> lock(this->m_mutex);
+		this->m_qLoaded.push_back(iMap);
+	}
+
+}//end MapStreamer::LoaderThread()
+
+
+/**
+ * Distance from a point to a map's bounds.
+ */
+float MapStreamer::Distance(int iMap, const float fCamera[3]) const
+{
+	const StreamedMap &m = this->m_vMaps[iMap];
+	float fSquared = 0.0f;
+
+	for (int i = 0; i < 3; i++) {
+		float d = std::max(std::max(m.fMins[i] - fCamera[i], 0.0f), fCamera[i] - m.fMaxs[i]);
+		fSquared += d * d;
+	}
+
+	return sqrt(fSquared);
+
+}//end MapStreamer::Distance()
@@ -0,0 +1,138 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#ifndef MAPSTREAMER_H
+#define MAPSTREAMER_H
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+class BSP;
+class Frustum;
+
+
+/**
+ * Loads maps in the background as the camera approaches them, and evicts
+ * the least recently visible ones when over the memory budget.
+ *
+ * Maps closer than the radius are loaded. Maps are only evicted once they
+ * are further than radius + hysteresis, so a camera moving along the edge
+ * of the radius doesn't keep loading and evicting the same maps. Maps
+ * inside the radius are never evicted.
+ */
+class MapStreamer
+{
+public:
+	/**
+	 * Start the loader thread.
+	 * \param vMaps       Probed maps, with their landmark offsets resolvable.
+	 * \param fRadius     Load maps closer than this to the camera.
+	 * \param fHysteresis Extra distance before a loaded map can be evicted.
+	 * \param uBudget     Memory budget for resident maps, in bytes.
+	 */
+	MapStreamer(const std::vector<BSP*> &vMaps, float fRadius, float fHysteresis, size_t uBudget);
+
+	/** Stop the loader thread and wait for it. */
+	~MapStreamer();
+
+	/**
+	 * Queue loads, upload finished maps and evict maps over the budget.
+	 * Must be called from the GL thread.
+	 * \param fCamera   Camera position.
+	 * \param fExtra    Added to the radius (view extent in isometric mode).
+	 * \param frustum   Current view frustum, used to track visibility.
+	 * \return True when the set of resident maps changed.
+	 */
+	bool Update(const float fCamera[3], float fExtra, const Frustum &frustum);
+
+	/** Change the hysteresis distance at runtime. */
+	void SetHysteresis(float fHysteresis);
+
+	/** Current hysteresis distance. */
+	float GetHysteresis() const { return this->m_fHysteresis; }
+
+	/** Print residency statistics. */
+	void PrintStats() const;
+
+	/**
+	 * Whether the loader thread may still be working on a map.
+	 * \param pMap The map.
+	 */
+	bool IsBusy(const BSP *pMap) const;
+
+	/**
+	 * Re-read bounds, residency and sizes of every idle map, after maps
+	 * were reloaded in place or their offsets changed. Failed maps are
+	 * retried. Must be called from the GL thread.
+	 */
+	void Refresh();
+
+private:
+	/** Body of the loader thread. */
+	void LoaderThread();
+
+	/** Distance from a point to a map's bounds. */
+	float Distance(int iMap, const float fCamera[3]) const;
+
+	enum MapState
+	{
+		MAP_UNLOADED, /** Only entities and bounds are known. */
+		MAP_QUEUED,   /** Being loaded by the loader thread, or waiting for upload. */
+		MAP_RESIDENT, /** Uploaded and rendering. */
+		MAP_FAILED    /** Could not be loaded, never retried. */
+	};
+
+	struct StreamedMap
+	{
+		BSP          *pMap;         /** The map. */
+		float         fMins[3];     /** World bounds. */
+		float         fMaxs[3];     /** World bounds. */
+		MapState      eState;       /** Residency state. */
+		unsigned int  uLastVisible; /** Tick the map was last inside the frustum. */
+		unsigned int  uQueuedAt;    /** Tick the load was requested. */
+	};
+
+	std::vector<StreamedMap> m_vMaps;       /** Every map, in config order. */
+	float                    m_fRadius;     /** Load radius. */
+	float                    m_fHysteresis; /** Extra distance before eviction. */
+	size_t                   m_uBudget;     /** Memory budget, in bytes. */
+	size_t                   m_uResident;   /** Bytes used by resident maps. */
+
+	std::thread              m_thread;      /** Loader thread. */
+	std::mutex               m_mutex;       /** Guards the queues and m_bQuit. */
+	std::condition_variable  m_cond;        /** Wakes the loader thread. */
+	std::deque<int>          m_qRequests;   /** Maps waiting to be loaded. */
+	std::deque<int>          m_qLoaded;     /** Maps loaded, waiting for upload. */
+	bool                     m_bQuit;       /** Ask the loader thread to stop. */
+
+	// Statistics.
+	unsigned int m_uLoads;        /** Maps loaded since startup. */
+	unsigned int m_uEvictions;    /** Maps evicted since startup. */
+	unsigned int m_uLoadTicks;    /** Total ms from request to upload. */
+	unsigned int m_uUploadTicks;  /** Total ms spent uploading. */
+	size_t       m_uPeakResident; /** Highest resident byte count, textures included. */
+
+};//end MapStreamer
+
+#endif //MAPSTREAMER_H
@@ -0,0 +1,317 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#include <algorithm>
+#include <iomanip>
+#include "MemoryRegistry.h"
+
+MemoryRegistry g_gpuMemory("GPU memory");
+MemoryRegistry g_hostMemory("Host memory");
+
+static const char *szCategoryNames[MemoryRegistry::CATEGORY_COUNT] = {"Textures", "Lightmaps", "Geometry", "Batch", "Entities", "Framebuffers"};
+
+// Textures at or below this size are never downscaled.
+#define MIN_DOWNSCALE_SIZE 64
+
+// Just over the budget, only textures with more texels than this shrink.
+// The threshold halves on each side as the overshoot doubles.
+#define LARGE_TEXTURE_AREA (256 * 256)
+
+/**
+ * Size of an RGBA mip chain, starting at a given level.
+ */
+static size_t MipChainBytes(int iWidth, int iHeight, int iFirst, int iLevels)
+{
+	size_t uBytes = 0;
+
+	for (int i = iFirst; i < iLevels; i++) {
+		uBytes += (size_t)(iWidth >> i) * (iHeight >> i) * 4;
+	}
+
+	return uBytes;
+
+}//end MipChainBytes()
+
+
+/**
+ * Constructor.
+ * \param szName Shown in reports.
+ */
+MemoryRegistry::MemoryRegistry(const char *szName)
+{
+	this->m_szName = szName;
+
+	for (int i = 0; i < CATEGORY_COUNT; i++) {
+		this->m_uCategoryBytes[i] = 0;
+	}
+
+	this->m_uTotal       = 0;
+	this->m_uPeak        = 0;
+	this->m_uBudget      = 0;
+	this->m_uSavedBytes  = 0;
+	this->m_iDroppedMips = 0;
+	this->m_iDownscaled  = 0;
+
+}//end MemoryRegistry::MemoryRegistry()
+
+
+/**
+ * Record a texture allocation, replacing any previous one with that name.
+ * \param uId       GL texture name.
+ * \param eCategory What the texture holds.
+ * \param szOwner   Map or WAD it belongs to.
+ * \param uBytes    Size of every level.
+ */
+void MemoryRegistry::TrackTexture(unsigned int uId, Category eCategory, const std::string &szOwner, size_t uBytes)
+{
+	this->Track(std::make_pair(0, uId), eCategory, szOwner, uBytes);
+
+}//end MemoryRegistry::TrackTexture()
+
+
+/**
+ * Record a buffer allocation, see TrackTexture().
+ */
+void MemoryRegistry::TrackBuffer(unsigned int uId, Category eCategory, const std::string &szOwner, size_t uBytes)
+{
+	this->Track(std::make_pair(1, uId), eCategory, szOwner, uBytes);
+
+}//end MemoryRegistry::TrackBuffer()
+
+
+/**
+ * Forget a deleted texture.
+ */
+void MemoryRegistry::ReleaseTexture(unsigned int uId)
+{
+	this->Release(std::make_pair(0, uId));
+
+}//end MemoryRegistry::ReleaseTexture()
+
+
+/**
+ * Forget a deleted buffer.
+ */
+void MemoryRegistry::ReleaseBuffer(unsigned int uId)
+{
+	this->Release(std::make_pair(1, uId));
+
+}//end MemoryRegistry::ReleaseBuffer()
+
+
+/**
+ * Set the bytes held for an owner, replacing the previous figure.
+ * \param pScope    Object holding the memory, so owners held twice are told apart.
+ * \param eCategory What the memory holds.
+ * \param szOwner   Map or WAD it belongs to.
+ * \param uBytes    Bytes held now, 0 once released.
+ */
+void MemoryRegistry::SetUsage(const void *pScope, Category eCategory, const std::string &szOwner, size_t uBytes)
+{
+	std::lock_guard<std::mutex> lock(this->m_mutex);
+
+	UsageKey key(std::make_pair(pScope, (int)eCategory), szOwner);
+	std::map<UsageKey, size_t>::iterator it = this->m_mUsage.find(key);
+	size_t uOld = it == this->m_mUsage.end() ? 0 : it->second;
+
+	this->m_uCategoryBytes[eCategory] += uBytes - uOld;
+	this->m_uTotal                    += uBytes - uOld;
+
+	if ((this->m_mOwnerBytes[szOwner] += uBytes - uOld) == 0) {
+		this->m_mOwnerBytes.erase(szOwner);
+	}
+
+	if (uBytes == 0) {
+		if (it != this->m_mUsage.end()) {
+			this->m_mUsage.erase(it);
+		}
+	} else {
+		this->m_mUsage[key] = uBytes;
+	}
+
+	if (this->m_uTotal > this->m_uPeak) {
+		this->m_uPeak = this->m_uTotal;
+	}
+
+}//end MemoryRegistry::SetUsage()
+
+
+/**
+ * Record an allocation under a key.
+ */
+void MemoryRegistry::Track(const std::pair<int, unsigned int> &key, Category eCategory, const std::string &szOwner, size_t uBytes)
+{
+	if (key.second == 0) {
+		return;
+	}
+
+	this->Release(key);
+
+	std::lock_guard<std::mutex> lock(this->m_mutex);
+
+	Allocation a;
+	a.eCategory = eCategory;
+	a.szOwner   = szOwner;
+	a.uBytes    = uBytes;
+	this->m_mAllocations[key] = a;
+
+	this->m_mOwnerBytes[szOwner]      += uBytes;
+	this->m_uCategoryBytes[eCategory] += uBytes;
+	this->m_uTotal                    += uBytes;
+
+	if (this->m_uTotal > this->m_uPeak) {
+		this->m_uPeak = this->m_uTotal;
+	}
+
+}//end MemoryRegistry::Track()
+
+
+/**
+ * Forget an allocation.
+ */
+void MemoryRegistry::Release(const std::pair<int, unsigned int> &key)
+{
+	std::lock_guard<std::mutex> lock(this->m_mutex);
+
+	std::map<std::pair<int, unsigned int>, Allocation>::iterator it = this->m_mAllocations.find(key);
+
+	if (it == this->m_mAllocations.end()) {
+		return;
+	}
+
+	const Allocation &a = it->second;
+	this->m_uCategoryBytes[a.eCategory] -= a.uBytes;
+	this->m_uTotal                      -= a.uBytes;
+
+	if ((this->m_mOwnerBytes[a.szOwner] -= a.uBytes) == 0) {
+		this->m_mOwnerBytes.erase(a.szOwner);
+	}
+
+	this->m_mAllocations.erase(it);
+
+}//end MemoryRegistry::Release()
+
+
+/**
+ * Bytes currently allocated.
+ */
+size_t MemoryRegistry::GetTotal() const
+{
+	std::lock_guard<std::mutex> lock(this->m_mutex);
+	return this->m_uTotal;
+
+}//end MemoryRegistry::GetTotal()
+
+
+/**
+ * Bytes currently allocated in a category.
+ */
+size_t MemoryRegistry::GetCategoryTotal(Category eCategory) const
+{
+	std::lock_guard<std::mutex> lock(this->m_mutex);
+	return this->m_uCategoryBytes[eCategory];
+
+}//end MemoryRegistry::GetCategoryTotal()
+
+
+/**
+ * Number of top mip levels a new RGBA texture should skip to fit the
+ * budget, from the total when it is uploaded. This is a per-upload size
+ * threshold, textures already resident are not demoted: just over the
+ * budget only those above 256x256 shrink, down to that size, and the
+ * threshold falls as the total grows further past the budget. Only
+ * textures larger than 64x64 are downscaled, and they never go below that.
+ * \param iWidth  Width of level 0.
+ * \param iHeight Height of level 0.
+ * \param iLevels Levels available.
+ */
+int MemoryRegistry::MipsToDrop(int iWidth, int iHeight, int iLevels)
+{
+	std::lock_guard<std::mutex> lock(this->m_mutex);
+
+	if (this->m_uBudget == 0) {
+		return 0;
+	}
+
+	size_t uFull = this->m_uTotal + MipChainBytes(iWidth, iHeight, 0, iLevels);
+
+	if (uFull <= this->m_uBudget) {
+		return 0;
+	}
+
+	double fOver      = (double)uFull / this->m_uBudget;
+	double fThreshold = std::max(LARGE_TEXTURE_AREA / (fOver * fOver), (double)MIN_DOWNSCALE_SIZE * MIN_DOWNSCALE_SIZE);
+	int    iDrop      = 0;
+
+	while (iDrop + 1 < iLevels &&
+	       (iWidth >> iDrop) > MIN_DOWNSCALE_SIZE && (iHeight >> iDrop) > MIN_DOWNSCALE_SIZE &&
+	       (double)(iWidth >> iDrop) * (iHeight >> iDrop) > fThreshold &&
+	       this->m_uTotal + MipChainBytes(iWidth, iHeight, iDrop, iLevels) > this->m_uBudget) {
+		iDrop++;
+	}
+
+	if (iDrop > 0) {
+		this->m_iDroppedMips += iDrop;
+		this->m_iDownscaled++;
+		this->m_uSavedBytes  += MipChainBytes(iWidth, iHeight, 0, iLevels) - MipChainBytes(iWidth, iHeight, iDrop, iLevels);
+	}
+
+	return iDrop;
+
+}//end MemoryRegistry::MipsToDrop()
+
+
+/**
+ * Print totals by category and by owner.
+ */
+void MemoryRegistry::Print(std::ostream &out) const
+{
+	std::lock_guard<std::mutex> lock(this->m_mutex);
+	const double MB = 1024.0 * 1024.0;
+	std::streamsize iPrecision = out.precision();
+
+	out << std::fixed << std::setprecision(2);
+	out << this->m_szName << ": " << this->m_uTotal / MB << " MB in " << this->m_mAllocations.size() + this->m_mUsage.size() << " objects, peak " << this->m_uPeak / MB << " MB";
+
+	if (this->m_uBudget != 0) {
+		out << ", budget " << this->m_uBudget / MB << " MB";
+	}
+
+	out << "." << std::endl;
+
+	for (int i = 0; i < CATEGORY_COUNT; i++) {
+		if (this->m_uCategoryBytes[i] != 0) {
+			out << "  " << szCategoryNames[i] << ": " << this->m_uCategoryBytes[i] / MB << " MB" << std::endl;
+		}
+	}
+
+	for (std::map<std::string, size_t>::const_iterator it = this->m_mOwnerBytes.begin(); it != this->m_mOwnerBytes.end(); it++) {
+		out << "  " << it->first << ": " << it->second / MB << " MB" << std::endl;
+	}
+
+	if (this->m_iDownscaled != 0) {
+		out << "  " << this->m_iDownscaled << " textures downscaled by " << this->m_iDroppedMips << " levels, saving " << this->m_uSavedBytes / MB << " MB." << std::endl;
+	}
+
+	out.unsetf(std::ios_base::floatfield);
+	out.precision(iPrecision);
+
+}//end MemoryRegistry::Print()
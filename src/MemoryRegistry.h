@@ -0,0 +1,157 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#ifndef MEMORYREGISTRY_H
+#define MEMORYREGISTRY_H
+
+#include <string>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <cstddef>
+
+
+/**
+ * Tracks the size of every GL texture and buffer, by category and by owner.
+ *
+ * Allocations are keyed by their GL name, so releasing only needs the name.
+ * An optional budget makes new textures drop their top mip levels instead
+ * of growing past it.
+ *
+ * Host memory is tracked by a second registry, where each subsystem sets
+ * the bytes it currently holds with SetUsage() rather than naming every
+ * allocation.
+ */
+class MemoryRegistry
+{
+public:
+	/** What an allocation holds. */
+	enum Category
+	{
+		CATEGORY_TEXTURE,     /** World textures, from WADs or embedded in maps. */
+		CATEGORY_LIGHTMAP,    /** Lightmap atlases. */
+		CATEGORY_GEOMETRY,    /** Vertex buffers of the maps. */
+		CATEGORY_BATCH,       /** Texture arrays and buffers of the batched path. */
+		CATEGORY_ENTITIES,    /** Landmarks and hidden models parsed from the entities. */
+		CATEGORY_FRAMEBUFFER, /** Offscreen render targets. */
+		CATEGORY_COUNT
+	};
+
+	/**
+	 * Constructor
+	 * \param szName Shown in reports.
+	 */
+	MemoryRegistry(const char *szName);
+
+	/**
+	 * Record a texture allocation, replacing any previous one with that name.
+	 * \param uId       GL texture name.
+	 * \param eCategory What the texture holds.
+	 * \param szOwner   Map or WAD it belongs to.
+	 * \param uBytes    Size of every level.
+	 */
+	void TrackTexture(unsigned int uId, Category eCategory, const std::string &szOwner, size_t uBytes);
+
+	/** Record a buffer allocation, see TrackTexture(). */
+	void TrackBuffer(unsigned int uId, Category eCategory, const std::string &szOwner, size_t uBytes);
+
+	/** Forget a deleted texture. */
+	void ReleaseTexture(unsigned int uId);
+
+	/** Forget a deleted buffer. */
+	void ReleaseBuffer(unsigned int uId);
+
+	/**
+	 * Set the bytes held for an owner, replacing the previous figure.
+	 * \param pScope    Object holding the memory, so owners held twice are told apart.
+	 * \param eCategory What the memory holds.
+	 * \param szOwner   Map or WAD it belongs to.
+	 * \param uBytes    Bytes held now, 0 once released.
+	 */
+	void SetUsage(const void *pScope, Category eCategory, const std::string &szOwner, size_t uBytes);
+
+	/** Set the budget in bytes, 0 for none. */
+	void SetBudget(size_t uBudget) { this->m_uBudget = uBudget; }
+
+	/** Budget in bytes, 0 for none. */
+	size_t GetBudget() const { return this->m_uBudget; }
+
+	/** Bytes currently allocated. */
+	size_t GetTotal() const;
+
+	/** Bytes currently allocated in a category. */
+	size_t GetCategoryTotal(Category eCategory) const;
+
+	/**
+	 * Number of top mip levels a new RGBA texture should skip to fit the
+	 * budget, decided when it is uploaded from the total at that time. It
+	 * is a size threshold, textures already resident keep their levels:
+	 * the further over the budget, the smaller the textures that are
+	 * downscaled. Only textures larger than 64x64 are downscaled, and they
+	 * never go below that.
+	 * \param iWidth  Width of level 0.
+	 * \param iHeight Height of level 0.
+	 * \param iLevels Levels available.
+	 */
+	int MipsToDrop(int iWidth, int iHeight, int iLevels);
+
+	/** Print totals by category and by owner. */
+	void Print(std::ostream &out) const;
+
+private:
+	/** Record an allocation under a key. */
+	void Track(const std::pair<int, unsigned int> &key, Category eCategory, const std::string &szOwner, size_t uBytes);
+
+	/** Forget an allocation. */
+	void Release(const std::pair<int, unsigned int> &key);
+
+	/** One texture or buffer. */
+	struct Allocation
+	{
+		Category    eCategory; /** What it holds. */
+		std::string szOwner;   /** Map or WAD it belongs to. */
+		size_t      uBytes;    /** Size. */
+	};
+
+	typedef std::pair<std::pair<const void*, int>, std::string> UsageKey;
+
+	const char        *m_szName; /** Shown in reports. */
+	mutable std::mutex m_mutex; /** Guards everything below. */
+	std::map<std::pair<int, unsigned int>, Allocation> m_mAllocations; /** Keyed by (0 texture / 1 buffer, GL name). */
+	std::map<UsageKey, size_t> m_mUsage;           /** Bytes set with SetUsage(), keyed by (scope, category, owner). */
+	std::map<std::string, size_t> m_mOwnerBytes;   /** Bytes per owner. */
+	size_t m_uCategoryBytes[CATEGORY_COUNT];       /** Bytes per category. */
+	size_t m_uTotal;                               /** Bytes of every allocation. */
+	size_t m_uPeak;                                /** Highest total seen. */
+	size_t m_uBudget;                              /** Budget in bytes, 0 for none. */
+	size_t m_uSavedBytes;                          /** Bytes saved by dropped mips. */
+	int    m_iDroppedMips;                         /** Levels dropped so far. */
+	int    m_iDownscaled;                          /** Textures downscaled so far. */
+
+};//end MemoryRegistry
+
+/** Registry of GL allocations. */
+extern MemoryRegistry g_gpuMemory;
+
+/** Registry of host memory held by the loaders and maps. */
+extern MemoryRegistry g_hostMemory;
+
+#endif //MEMORYREGISTRY_H
@@ -0,0 +1,625 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#include "common.h"
+#include "bsp.h"
+#include "wad.h"
+#include "lod.h"
+#include "MemoryRegistry.h"
+#include "TextureCache.h"
+#include "VirtualFileSystem.h"
+#include "MipStreamer.h"
+#include <cmath>
+#include <iomanip>
+
+// Decodes queued or waiting for upload at once, bounding their staging memory.
+#define MIPSTREAM_IN_FLIGHT 16
+
+MipStreamer g_mipStreamer;
+
+
+/**
+ * Constructor, streaming stays off until Init().
+ */
+MipStreamer::MipStreamer()
+{
+	this->m_bEnabled     = false;
+	this->m_uFrameBudget = 0;
+	this->m_fBias        = 0.0f;
+	this->m_uKeepMs      = 0;
+	this->m_iInFlight    = 0;
+	this->m_bQuit        = false;
+	this->m_uUploads     = 0;
+	this->m_uUploadBytes = 0;
+	this->m_uEvictions   = 0;
+	this->m_uEvictBytes  = 0;
+	this->m_uFailed      = 0;
+	this->m_uOverBudget  = 0;
+	this->m_uBusyFrames  = 0;
+
+}//end MipStreamer::MipStreamer()
+
+
+/**
+ * Destructor, stops the worker thread. Staging memory goes with the process.
+ */
+MipStreamer::~MipStreamer()
+{
+	if (this->m_thread.joinable()) {
+		{
+			std::lock_guard<std::mutex> lock(this->m_mutex);
+			this->m_bQuit = true;
+		}
+
+		this->m_cond.notify_all();
+		this->m_thread.join();
+	}
+
+}//end MipStreamer::~MipStreamer()
+
+
+/**
+ * Turn streaming on and start the worker thread.
+ * \param uFrameBudget Bytes uploaded per frame.
+ * \param fBias        Levels asked for ahead of the one the distance needs.
+ * \param uKeepMs      Time a level nobody asks for stays uploaded.
+ */
+void MipStreamer::Init(size_t uFrameBudget, float fBias, unsigned int uKeepMs)
+{
+	this->m_bEnabled     = true;
+	this->m_uFrameBudget = uFrameBudget;
+	this->m_fBias        = fBias;
+	this->m_uKeepMs      = uKeepMs;
+	this->m_bQuit        = false;
+	this->m_thread       = std::thread(&MipStreamer::WorkerThread, this);
+
+}//end MipStreamer::Init()
+
+
+/**
+ * Stop the worker thread and drop pending levels.
+ */
+void MipStreamer::Shutdown()
+{
+	if (!this->m_thread.joinable()) {
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(this->m_mutex);
+		this->m_bQuit = true;
+	}
+
+	this->m_cond.notify_all();
+	this->m_thread.join();
+
+	for (size_t i = 0; i < this->m_qRequests.size(); i++) {
+		g_textureUploader.Release(this->m_qRequests[i].staging);
+	}
+
+	for (size_t i = 0; i < this->m_qDone.size(); i++) {
+		g_textureUploader.Release(this->m_qDone[i].staging);
+	}
+
+	this->m_qRequests.clear();
+	this->m_qDone.clear();
+	this->m_iInFlight = 0;
+
+}//end MipStreamer::Shutdown()
+
+
+/**
+ * Take a texture just uploaded from GetFirstMip(), or again after a reload.
+ * \param iTexture Id in g_textures.
+ * \param pTexture Its entry, with texId, mipDrop and baseLevel set.
+ * \param source   Where its pixels are.
+ */
+void MipStreamer::Register(int iTexture, TEXTURE *pTexture, const MipSource &source)
+{
+	if (!this->m_bEnabled || iTexture < 0) {
+		return;
+	}
+
+	if ((size_t)iTexture >= this->m_vTextures.size()) {
+		Streamed blank;
+		blank.pTexture    = NULL;
+		blank.iTopMip     = 0;
+		blank.iWanted     = MIPLEVELS;
+		blank.uGeneration = 0;
+		blank.bQueued     = false;
+		blank.bFailed     = false;
+
+		for (int i = 0; i < MIPLEVELS; i++) {
+			blank.uUsed[i] = 0;
+		}
+
+		this->m_vTextures.resize(iTexture + 1, blank);
+	}
+
+	Streamed &s = this->m_vTextures[iTexture];
+
+	int iTop = pTexture->mipDrop + pTexture->baseLevel;
+
+	if (s.pTexture == NULL) {
+		this->m_vStreamed.push_back(iTexture);
+	} else if (s.iTopMip < iTop) {
+		// Reloaded, the levels streamed in from the old pixels go.
+		glBindTexture(GL_TEXTURE_2D, pTexture->texId);
+
+		for (int iLevel = std::max(s.iTopMip - pTexture->mipDrop, 0); iLevel < pTexture->baseLevel; iLevel++) {
+			glTexImage2D(GL_TEXTURE_2D, iLevel, GL_RGBA, 0, 0, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+		}
+	}
+
+	// Decodes still in flight belong to the old pixels.
+	s.pTexture = pTexture;
+	s.source   = source;
+	s.iTopMip  = iTop;
+	s.iWanted  = MIPLEVELS;
+	s.bQueued  = false;
+	s.bFailed  = false;
+	s.uGeneration++;
+
+	for (int i = 0; i < MIPLEVELS; i++) {
+		s.uUsed[i] = 0;
+	}
+
+}//end MipStreamer::Register()
+
+
+/**
+ * Stop streaming a texture, before its texture object is freed. Decodes
+ * still in flight are dropped when they come back.
+ * \param iTexture Id in g_textures.
+ */
+void MipStreamer::Unregister(int iTexture)
+{
+	if ((size_t)iTexture >= this->m_vTextures.size() || this->m_vTextures[iTexture].pTexture == NULL) {
+		return;
+	}
+
+	Streamed &s = this->m_vTextures[iTexture];
+	s.pTexture = NULL;
+	s.iWanted  = MIPLEVELS;
+	s.bQueued  = false;
+	s.uGeneration++;
+
+	this->m_vStreamed.erase(std::find(this->m_vStreamed.begin(), this->m_vStreamed.end(), iTexture));
+
+}//end MipStreamer::Unregister()
+
+
+/**
+ * Read a texture from another copy of the same pixels in the same file,
+ * after the file changed and they moved. Decodes still in flight read the
+ * old offsets and are dropped. The levels already uploaded stay.
+ * \param iTexture Id in g_textures, ignored when it is read from another file.
+ * \param source   Where its pixels are now.
+ */
+void MipStreamer::MoveSource(int iTexture, const MipSource &source)
+{
+	if ((size_t)iTexture >= this->m_vTextures.size() || this->m_vTextures[iTexture].pTexture == NULL) {
+		return;
+	}
+
+	Streamed &s = this->m_vTextures[iTexture];
+
+	if (s.source.pFileSystem != source.pFileSystem || s.source.szFile != source.szFile || s.source.uHash != source.uHash) {
+		return;
+	}
+
+	s.source.uOffset = source.uOffset;
+	s.source.uSize   = source.uSize;
+	s.bQueued        = false;
+	s.bFailed        = false;
+	s.uGeneration++;
+
+}//end MipStreamer::MoveSource()
+
+
+/**
+ * Ask for the levels the drawn clusters of a map need, from their distance.
+ * \param pMap     A resident map.
+ * \param pVisible Flag per cluster, NULL when all are drawn.
+ * \param view     Camera position and scale.
+ */
+void MipStreamer::RequestMap(BSP *pMap, const std::vector<char> *pVisible, const LODVIEW &view)
+{
+	if (!this->m_bEnabled) {
+		return;
+	}
+
+	const std::vector<TEXSTUFF> &vClusters = pMap->GetTexturedTris();
+	VERTEX       o   = pMap->GetRenderOffset();
+	unsigned int now = SDL_GetTicks();
+
+	for (size_t j = 0; j < vClusters.size(); j++) {
+		const TEXSTUFF &c = vClusters[j];
+
+		if (!c.renderable || (pVisible != NULL && !(*pVisible)[j]) || (size_t)c.texture >= this->m_vTextures.size()) {
+			continue;
+		}
+
+		Streamed &s = this->m_vTextures[c.texture];
+
+		if (s.pTexture == NULL) {
+			continue;
+		}
+
+		// Texels per pixel of the nearest point, at one texel per unit.
+		float fTexels = 1.0f / view.scale;
+
+		if (!view.isometric) {
+			float fMins[3] = {c.mins.x + o.x, c.mins.y + o.y, c.mins.z + o.z};
+			float fMaxs[3] = {c.maxs.x + o.x, c.maxs.y + o.y, c.maxs.z + o.z};
+			float fDistance = 0.0f;
+
+			for (int k = 0; k < 3; k++) {
+				float d = std::max(std::max(fMins[k] - view.camera[k], view.camera[k] - fMaxs[k]), 0.0f);
+				fDistance += d * d;
+			}
+
+			fTexels = std::max(sqrtf(fDistance), 1.0f) / view.scale;
+		}
+
+		int iMip = (int)floorf(log2f(fTexels) - this->m_fBias);
+		iMip = std::min(std::max(iMip, 0), MIPLEVELS - 1);
+		s.uUsed[iMip] = now;
+
+		if (iMip < s.iWanted) {
+			if (s.iWanted == MIPLEVELS) {
+				this->m_vWanted.push_back(c.texture);
+			}
+
+			s.iWanted = iMip;
+		}
+	}
+
+}//end MipStreamer::RequestMap()
+
+
+/**
+ * Queue the levels asked for, upload decoded ones and free unused ones.
+ * \param vChanged Gets the ids of textures that got levels.
+ * \param bWait    Wait for every level asked for, past the budget.
+ */
+void MipStreamer::Update(std::vector<int> &vChanged, bool bWait)
+{
+	if (!this->m_bEnabled) {
+		return;
+	}
+
+	unsigned int now = SDL_GetTicks();
+
+	// Most detail needed first, levels over the memory budget are not asked for.
+	this->m_vCandidates.clear();
+
+	for (size_t i = 0; i < this->m_vWanted.size(); i++) {
+		Streamed &s  = this->m_vTextures[this->m_vWanted[i]];
+
+		// Unregistered since it was asked for
+		if (s.pTexture == NULL) {
+			continue;
+		}
+
+		int iTarget  = std::max(s.iWanted, s.pTexture->mipDrop);
+		s.iWanted    = MIPLEVELS;
+
+		if (iTarget >= s.iTopMip || s.bQueued || s.bFailed) {
+			continue;
+		}
+
+		size_t uBudget = g_gpuMemory.GetBudget();
+
+		if (uBudget != 0 && g_gpuMemory.GetTotal() + LevelBytes(*s.pTexture, iTarget) - LevelBytes(*s.pTexture, s.iTopMip) > uBudget) {
+			this->m_uOverBudget++;
+			continue;
+		}
+
+		this->m_vCandidates.push_back(std::make_pair(iTarget, this->m_vWanted[i]));
+	}
+
+	this->m_vWanted.clear();
+	std::sort(this->m_vCandidates.begin(), this->m_vCandidates.end());
+
+	{
+		std::lock_guard<std::mutex> lock(this->m_mutex);
+
+		for (size_t i = 0; i < this->m_vCandidates.size() && (bWait || this->m_iInFlight < MIPSTREAM_IN_FLIGHT); i++) {
+			int       iTexture = this->m_vCandidates[i].second;
+			Streamed &s        = this->m_vTextures[iTexture];
+
+			Decode d;
+			d.iTexture    = iTexture;
+			d.uGeneration = s.uGeneration;
+			d.iFirstMip   = this->m_vCandidates[i].first;
+			d.iEndMip     = s.iTopMip;
+			d.iWidth      = s.pTexture->w;
+			d.iHeight     = s.pTexture->h;
+			d.source      = s.source;
+			this->m_qRequests.push_back(d);
+
+			s.bQueued = true;
+			this->m_iInFlight++;
+		}
+	}
+
+	this->m_cond.notify_one();
+
+	// Decoded levels, within the budget but at least one texture per frame.
+	size_t uUploaded = 0;
+
+	while (true) {
+		Decode d;
+		{
+			std::unique_lock<std::mutex> lock(this->m_mutex);
+
+			while (bWait && this->m_qDone.empty() && this->m_iInFlight > 0) {
+				this->m_doneCond.wait(lock);
+			}
+
+			if (this->m_qDone.empty()) {
+				break;
+			}
+
+			if (!bWait && uUploaded != 0 && uUploaded >= this->m_uFrameBudget) {
+				this->m_uBusyFrames++;
+				break;
+			}
+
+			// Swapped out rather than copied, heap staging memory must not move away from pData.
+			std::swap(d, this->m_qDone.front());
+			this->m_qDone.pop_front();
+			this->m_iInFlight--;
+		}
+
+		Streamed &s = this->m_vTextures[d.iTexture];
+
+		if (d.uGeneration != s.uGeneration || d.staging.GetData() == NULL) {
+			// Asking again would only fail again, until it is registered or moved.
+			if (d.uGeneration == s.uGeneration) {
+				s.bQueued = false;
+				s.bFailed = true;
+				this->m_uFailed++;
+			}
+
+			g_textureUploader.Release(d.staging);
+			continue;
+		}
+
+		uUploaded += this->Upload(d);
+		vChanged.push_back(d.iTexture);
+	}
+
+	// Top levels nobody asked for in a while go.
+	for (size_t i = 0; i < this->m_vStreamed.size(); i++) {
+		Streamed &s = this->m_vTextures[this->m_vStreamed[i]];
+
+		if (s.bQueued || s.iTopMip >= std::max(MIPSTREAM_FIRST_MIP, s.pTexture->mipDrop)) {
+			continue;
+		}
+
+		unsigned int uLast = 0;
+
+		for (int m = 0; m <= s.iTopMip; m++) {
+			uLast = std::max(uLast, s.uUsed[m]);
+		}
+
+		if (now - uLast > this->m_uKeepMs) {
+			this->Evict(this->m_vStreamed[i]);
+		}
+	}
+
+}//end MipStreamer::Update()
+
+
+/**
+ * Upload decoded levels and lower the base level to them.
+ * \return Bytes uploaded.
+ */
+size_t MipStreamer::Upload(Decode &d)
+{
+	Streamed &s  = this->m_vTextures[d.iTexture];
+	TEXTURE  *t  = s.pTexture;
+	size_t    uFirst = mipChainOffset(t->w, t->h, d.iFirstMip), uBytes = 0;
+
+	glBindTexture(GL_TEXTURE_2D, t->texId);
+
+	for (int mip = d.iFirstMip; mip < d.iEndMip; mip++) {
+		g_textureUploader.UploadLevel(d.staging, mipChainOffset(t->w, t->h, mip) - uFirst, mip - t->mipDrop, GL_RGBA, t->w >> mip, t->h >> mip);
+		uBytes += (size_t)(t->w >> mip) * (t->h >> mip) * 4;
+		this->m_uUploads++;
+	}
+
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, d.iFirstMip - t->mipDrop);
+	g_textureUploader.Release(d.staging);
+	g_gpuMemory.TrackTexture(t->texId, MemoryRegistry::CATEGORY_TEXTURE, s.source.szOwner, LevelBytes(*t, d.iFirstMip));
+
+	{
+		std::lock_guard<std::mutex> lock(texturesMutex);
+		t->baseLevel = d.iFirstMip - t->mipDrop;
+	}
+
+	s.iTopMip = d.iFirstMip;
+	s.bQueued = false;
+	this->m_uUploadBytes += uBytes;
+
+	return uBytes;
+
+}//end MipStreamer::Upload()
+
+
+/**
+ * Free the top mip of a texture, raising its base level.
+ */
+void MipStreamer::Evict(int iTexture)
+{
+	Streamed &s     = this->m_vTextures[iTexture];
+	TEXTURE  *t     = s.pTexture;
+	int       iLevel = s.iTopMip - t->mipDrop;
+
+	// A level of size zero has no storage left.
+	glBindTexture(GL_TEXTURE_2D, t->texId);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, iLevel + 1);
+	glTexImage2D(GL_TEXTURE_2D, iLevel, GL_RGBA, 0, 0, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+
+	this->m_uEvictions++;
+	this->m_uEvictBytes += (size_t)(t->w >> s.iTopMip) * (t->h >> s.iTopMip) * 4;
+	s.iTopMip++;
+	g_gpuMemory.TrackTexture(t->texId, MemoryRegistry::CATEGORY_TEXTURE, s.source.szOwner, LevelBytes(*t, s.iTopMip));
+
+	std::lock_guard<std::mutex> lock(texturesMutex);
+	t->baseLevel = iLevel + 1;
+
+}//end MipStreamer::Evict()
+
+
+/**
+ * Body of the worker thread: decodes requests one at a time.
+ */
+void MipStreamer::WorkerThread()
+{
+	std::vector<unsigned char> vChain;
+
+	while (true) {
+		Decode d;
+		{
+			std::unique_lock<std::mutex> lock(this->m_mutex);
+
+			while (!this->m_bQuit && this->m_qRequests.empty()) {
+				this->m_cond.wait(lock);
+			}
+
+			if (this->m_bQuit) {
+				return;
+			}
+
+			d = this->m_qRequests.front();
+			this->m_qRequests.pop_front();
+		}
+
+		if (!this->DecodeLevels(d, vChain)) {
+			g_textureUploader.Release(d.staging);
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(this->m_mutex);
+			this->m_qDone.push_back(Decode());
+			std::swap(this->m_qDone.back(), d);
+		}
+
+		this->m_doneCond.notify_one();
+	}
+
+}//end MipStreamer::WorkerThread()
+
+
+/**
+ * Read and decode the levels of a request into its staging memory.
+ * \param d      The request, its staging memory is reserved here.
+ * \param vChain Scratch memory for the whole mip chain.
+ * \return False when the pixels can't be read anymore.
+ */
+bool MipStreamer::DecodeLevels(Decode &d, std::vector<unsigned char> &vChain)
+{
+	const unsigned char *pChain = NULL;
+	CachedTexture cached;
+
+	if (g_textureCache.Load(d.source.uHash, cached) && cached.GetWidth() == d.iWidth && cached.GetHeight() == d.iHeight && cached.GetLevels() == MIPLEVELS) {
+		pChain = cached.GetMip(0);
+	} else {
+		VfsFile file;
+
+		if (!d.source.pFileSystem->Open(d.source.szFile, file) || d.source.uOffset > file.GetSize() || d.source.uSize > file.GetSize() - d.source.uOffset) {
+			return false;
+		}
+
+		// The file changed since the texture was registered, its pixels may be elsewhere now.
+		if (TextureCache::Hash(file.GetData() + d.source.uOffset, d.source.uSize) != d.source.uHash) {
+			return false;
+		}
+
+		unsigned char avg[3];
+		vChain.resize(mipChainOffset(d.iWidth, d.iHeight, MIPLEVELS));
+
+		if (!decodeMiptex(file.GetData() + d.source.uOffset, d.source.uSize, &vChain[0], avg)) {
+			return false;
+		}
+
+		// Next time the whole chain comes from the cache, at load and here.
+		g_textureCache.Store(d.source.uHash, d.iWidth, d.iHeight, &vChain[0], MIPLEVELS, avg);
+		pChain = &vChain[0];
+	}
+
+	size_t uFirst = mipChainOffset(d.iWidth, d.iHeight, d.iFirstMip);
+	size_t uEnd   = mipChainOffset(d.iWidth, d.iHeight, d.iEndMip);
+
+	g_textureUploader.Reserve(uEnd - uFirst, d.staging);
+	memcpy(d.staging.GetData(), pChain + uFirst, uEnd - uFirst);
+
+	return true;
+
+}//end MipStreamer::DecodeLevels()
+
+
+/**
+ * Bytes of the levels of a texture from a mip down, after its mipDrop.
+ */
+size_t MipStreamer::LevelBytes(const TEXTURE &t, int iMip)
+{
+	size_t uBytes = 0;
+
+	for (int mip = std::max(iMip, t.mipDrop); mip < MIPLEVELS; mip++) {
+		uBytes += (size_t)(t.w >> mip) * (t.h >> mip) * 4;
+	}
+
+	return uBytes;
+
+}//end MipStreamer::LevelBytes()
+
+
+/**
+ * Print uploads, evictions and the levels resident.
+ */
+void MipStreamer::PrintStats(std::ostream &out) const
+{
+	if (!this->m_bEnabled) {
+		return;
+	}
+
+	const double MB = 1024.0 * 1024.0;
+	int iTop[MIPLEVELS] = {0};
+
+	for (size_t i = 0; i < this->m_vStreamed.size(); i++) {
+		iTop[this->m_vTextures[this->m_vStreamed[i]].iTopMip]++;
+	}
+
+	std::streamsize iPrecision = out.precision();
+	out << std::fixed << std::setprecision(2);
+	out << "Mip streaming: " << this->m_uUploads << " levels in (" << this->m_uUploadBytes / MB << " MB), "
+	    << this->m_uEvictions << " freed (" << this->m_uEvictBytes / MB << " MB), "
+	    << this->m_uFailed << " failed, " << this->m_uOverBudget << " over the memory budget, "
+	    << this->m_uBusyFrames << " frames over the upload budget." << std::endl;
+	out << "Textures down to mip 0/1/2/3: " << iTop[0] << "/" << iTop[1] << "/" << iTop[2] << "/" << iTop[3] << "." << std::endl;
+	out.unsetf(std::ios::floatfield);
+	out.precision(iPrecision);
+
+}//end MipStreamer::PrintStats()
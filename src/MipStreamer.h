@@ -0,0 +1,217 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#ifndef MIPSTREAMER_H
+#define MIPSTREAMER_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <ostream>
+#include <cstddef>
+#include "TextureUploader.h"
+
+class VirtualFileSystem;
+
+class BSP;
+struct TEXTURE;
+struct LODVIEW;
+
+// Textures are first uploaded from this mip down, the smallest two.
+#define MIPSTREAM_FIRST_MIP 2
+
+
+/**
+ * Where the pixels of a texture can be read again: its miptex inside a
+ * WAD or BSP of the file system, and the texture cache key of it.
+ */
+struct MipSource
+{
+	const VirtualFileSystem *pFileSystem; /** File system of the world it was loaded for. */
+	std::string        szFile;  /** File system path of the WAD or BSP. */
+	size_t             uOffset; /** Start of the miptex in it. */
+	size_t             uSize;   /** Size of the miptex, palette included. */
+	unsigned long long uHash;   /** TextureCache::Hash() of the miptex. */
+	std::string        szOwner; /** Memory registry owner of the texture. */
+};
+
+
+/**
+ * Streams the top mip levels of textures in as the camera gets close to
+ * the faces using them, and drops them again when they go unused.
+ *
+ * Loaders only decode and upload the smallest levels, from
+ * MIPSTREAM_FIRST_MIP down, and clamp GL_TEXTURE_BASE_LEVEL to them. Every
+ * frame the drawn clusters ask for the level their distance needs. A
+ * worker thread reads and decodes the missing levels (from the texture
+ * cache when it has them) into staging memory, and the GL thread uploads
+ * them within a byte budget per frame, lowering the base level. Levels
+ * nobody asked for in a while are freed, so texture memory follows what
+ * is being looked at instead of everything loaded.
+ */
+class MipStreamer
+{
+public:
+	/** Constructor, streaming stays off until Init(). */
+	MipStreamer();
+
+	/** Destructor, stops the worker thread. */
+	~MipStreamer();
+
+	/**
+	 * Turn streaming on and start the worker thread, before any texture loads.
+	 * \param uFrameBudget Bytes uploaded per frame, at least one level goes each frame.
+	 * \param fBias        Levels asked for ahead of the one the distance needs.
+	 * \param uKeepMs      Time a level nobody asks for stays uploaded.
+	 */
+	void Init(size_t uFrameBudget, float fBias, unsigned int uKeepMs);
+
+	/** Stop the worker thread and drop pending levels. Must be called from the GL thread. */
+	void Shutdown();
+
+	/** Check if textures are streamed. */
+	bool IsEnabled() const { return this->m_bEnabled; }
+
+	/** First mip loaders decode and upload, 0 when not streaming. */
+	int GetFirstMip() const { return this->m_bEnabled ? MIPSTREAM_FIRST_MIP : 0; }
+
+	/**
+	 * Take a texture just uploaded from GetFirstMip(), or again after a reload.
+	 * Must be called from the GL thread.
+	 * \param iTexture Id in g_textures.
+	 * \param pTexture Its entry, with texId, mipDrop and baseLevel set.
+	 * \param source   Where its pixels are.
+	 */
+	void Register(int iTexture, TEXTURE *pTexture, const MipSource &source);
+
+	/**
+	 * Stop streaming a texture, before its texture object is freed.
+	 * Must be called from the GL thread.
+	 * \param iTexture Id in g_textures.
+	 */
+	void Unregister(int iTexture);
+
+	/**
+	 * Read a texture from another copy of the same pixels in the same file,
+	 * after the file changed and they moved. Must be called from the GL thread.
+	 * \param iTexture Id in g_textures, ignored when it is read from another file.
+	 * \param source   Where its pixels are now.
+	 */
+	void MoveSource(int iTexture, const MipSource &source);
+
+	/**
+	 * Ask for the levels the drawn clusters of a map need. Must be called from the GL thread.
+	 * \param pMap     A resident map.
+	 * \param pVisible Flag per cluster, NULL when all are drawn.
+	 * \param view     Camera position and scale.
+	 */
+	void RequestMap(BSP *pMap, const std::vector<char> *pVisible, const LODVIEW &view);
+
+	/**
+	 * Queue the levels asked for, upload decoded ones and free unused ones.
+	 * Must be called from the GL thread, once per frame.
+	 * \param vChanged Gets the ids of textures that got levels, for copies of them.
+	 * \param bWait    Wait for every level asked for and upload it, past the
+	 *                 budget, so the frame doesn't depend on decode timing.
+	 */
+	void Update(std::vector<int> &vChanged, bool bWait = false);
+
+	/** Print uploads, evictions and the levels resident. */
+	void PrintStats(std::ostream &out) const;
+
+private:
+	/** State of a streamed texture. */
+	struct Streamed
+	{
+		TEXTURE      *pTexture;           /** Entry in g_textures, NULL when not streamed. */
+		MipSource     source;             /** Where its pixels are. */
+		int           iTopMip;            /** Highest detail mip uploaded. */
+		int           iWanted;            /** Mip asked for this frame, MIPLEVELS when none. */
+		unsigned int  uGeneration;        /** Bumped by Register(), stale decodes are dropped. */
+		bool          bQueued;            /** A decode is queued or in flight. */
+		bool          bFailed;            /** Its source couldn't be read, not asked for again until it changes. */
+		unsigned int  uUsed[4];           /** Tick each mip was last asked for. */
+	};
+
+	/** Levels decoded by the worker, waiting for the GL thread. */
+	struct Decode
+	{
+		int           iTexture;    /** Id in g_textures. */
+		unsigned int  uGeneration; /** Of the texture when queued. */
+		int           iFirstMip;   /** Levels iFirstMip up to iEndMip... */
+		int           iEndMip;     /** ...not included, the top uploaded one. */
+		int           iWidth;      /** Size of mip 0. */
+		int           iHeight;
+		MipSource     source;      /** Where to read them. */
+		StagingBuffer staging;     /** The levels, one after the other. Empty when decoding failed. */
+	};
+
+	/** Body of the worker thread. */
+	void WorkerThread();
+
+	/** Read and decode the levels of a request into its staging memory. */
+	bool DecodeLevels(Decode &d, std::vector<unsigned char> &vChain);
+
+	/** Upload decoded levels. \return Bytes uploaded. */
+	size_t Upload(Decode &d);
+
+	/** Free the top mip of a texture, raising its base level. */
+	void Evict(int iTexture);
+
+	/** Bytes of the levels of a texture from a mip down, after its mipDrop. */
+	static size_t LevelBytes(const TEXTURE &t, int iMip);
+
+	bool                     m_bEnabled;     /** Set by Init(). */
+	size_t                   m_uFrameBudget; /** Bytes uploaded per frame. */
+	float                    m_fBias;        /** Levels asked for ahead. */
+	unsigned int             m_uKeepMs;      /** Time unused levels stay. */
+	std::vector<Streamed>    m_vTextures;    /** By texture id. */
+	std::vector<int>         m_vStreamed;    /** Ids with a state. */
+	std::vector<int>         m_vWanted;      /** Ids asked for this frame. */
+	std::vector<std::pair<int, int> > m_vCandidates; /** Reused by Update(). */
+
+	std::thread              m_thread;       /** Runs WorkerThread(). */
+	std::mutex               m_mutex;        /** Guards the queues and m_bQuit. */
+	std::condition_variable  m_cond;         /** Wakes the worker. */
+	std::condition_variable  m_doneCond;     /** Wakes Update() waiting for decodes. */
+	std::deque<Decode>       m_qRequests;    /** For the worker. */
+	std::deque<Decode>       m_qDone;        /** For the GL thread. */
+	int                      m_iInFlight;    /** Requests not uploaded yet. */
+	bool                     m_bQuit;        /** Stops the worker. */
+
+	// Statistics
+	unsigned int             m_uUploads;     /** Levels streamed in. */
+	size_t                   m_uUploadBytes; /** Bytes streamed in. */
+	unsigned int             m_uEvictions;   /** Levels freed. */
+	size_t                   m_uEvictBytes;  /** Bytes freed. */
+	unsigned int             m_uFailed;      /** Decodes that failed. */
+	unsigned int             m_uOverBudget;  /** Levels skipped for the GPU memory budget. */
+	unsigned int             m_uBusyFrames;  /** Frames that ran out of upload budget. */
+
+};//end MipStreamer
+
+/** Shared texture mip streamer. */
+extern MipStreamer g_mipStreamer;
+
+#endif //MIPSTREAMER_H
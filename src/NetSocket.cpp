@@ -0,0 +1,263 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include "NetSocket.h"
+
+#if defined(_WIN32)
+	#include <winsock2.h>
+	#include <ws2tcpip.h>
+	typedef int socklen_t;
+	#define closesocket_ closesocket
+#else
+	#include <sys/socket.h>
+	#include <sys/select.h>
+	#include <sys/time.h>
+	#include <netinet/in.h>
+	#include <netinet/tcp.h>
+	#include <arpa/inet.h>
+	#include <netdb.h>
+	#include <unistd.h>
+	#include <signal.h>
+	#define closesocket_ close
+#endif
+
+
+NetSocket::NetSocket()
+{
+	this->m_iSocket = -1;
+
+}//end NetSocket::NetSocket()
+
+
+NetSocket::~NetSocket()
+{
+	this->Close();
+
+}//end NetSocket::~NetSocket()
+
+
+/**
+ * Writes to a closed connection fail with an error instead of killing the
+ * process.
+ */
+bool NetSocket::Startup()
+{
+#if defined(_WIN32)
+	WSADATA data;
+	return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+#else
+	signal(SIGPIPE, SIG_IGN);
+	return true;
+#endif
+
+}//end NetSocket::Startup()
+
+
+/**
+ * Only reachable from this machine. The address can be reused at once, so
+ * a restarted server doesn't wait for old connections to time out.
+ */
+bool NetSocket::Listen(unsigned short uPort)
+{
+	this->Close();
+	this->m_iSocket = (intptr_t)socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+	if (this->m_iSocket == -1) {
+		return false;
+	}
+
+	int iReuse = 1;
+	setsockopt(this->m_iSocket, SOL_SOCKET, SO_REUSEADDR, (const char*)&iReuse, sizeof(iReuse));
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family      = AF_INET;
+	addr.sin_port        = htons(uPort);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (bind(this->m_iSocket, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(this->m_iSocket, SOMAXCONN) != 0) {
+		this->Close();
+		return false;
+	}
+
+	return true;
+
+}//end NetSocket::Listen()
+
+
+bool NetSocket::Accept(NetSocket &client, int iTimeoutMs)
+{
+	fd_set set;
+	FD_ZERO(&set);
+	FD_SET(this->m_iSocket, &set);
+
+	struct timeval tv;
+	tv.tv_sec  = iTimeoutMs / 1000;
+	tv.tv_usec = (iTimeoutMs % 1000) * 1000;
+
+	if (select((int)this->m_iSocket + 1, &set, NULL, NULL, &tv) <= 0) {
+		return false;
+	}
+
+	intptr_t iClient = (intptr_t)accept(this->m_iSocket, NULL, NULL);
+
+	if (iClient == -1) {
+		return false;
+	}
+
+	client.Close();
+	client.m_iSocket = iClient;
+	client.SetNoDelay();
+	return true;
+
+}//end NetSocket::Accept()
+
+
+/**
+ * Tries every address the name resolves to, in order.
+ */
+bool NetSocket::Connect(const std::string &szHost, unsigned short uPort)
+{
+	this->Close();
+
+	struct addrinfo hints, *pResult = NULL;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family   = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	char szPort[8];
+	sprintf(szPort, "%u", (unsigned int)uPort);
+
+	if (getaddrinfo(szHost.c_str(), szPort, &hints, &pResult) != 0) {
+		return false;
+	}
+
+	for (struct addrinfo *p = pResult; p != NULL; p = p->ai_next) {
+		this->m_iSocket = (intptr_t)socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+
+		if (this->m_iSocket == -1) {
+			continue;
+		}
+
+		if (connect(this->m_iSocket, p->ai_addr, (socklen_t)p->ai_addrlen) == 0) {
+			break;
+		}
+
+		this->Close();
+	}
+
+	freeaddrinfo(pResult);
+
+	if (this->m_iSocket == -1) {
+		return false;
+	}
+
+	this->SetNoDelay();
+	return true;
+
+}//end NetSocket::Connect()
+
+
+bool NetSocket::SendAll(const void *pData, size_t uSize)
+{
+	const char *p = (const char*)pData;
+
+	while (uSize > 0) {
+		int iSent = (int)send(this->m_iSocket, p, (int)uSize, 0);
+
+		if (iSent <= 0) {
+			return false;
+		}
+
+		p     += iSent;
+		uSize -= iSent;
+	}
+
+	return true;
+
+}//end NetSocket::SendAll()
+
+
+int NetSocket::Recv(void *pData, size_t uSize)
+{
+	int iReceived = (int)recv(this->m_iSocket, (char*)pData, (int)uSize, 0);
+
+	if (iReceived >= 0) {
+		return iReceived;
+	}
+
+#if defined(_WIN32)
+	return WSAGetLastError() == WSAETIMEDOUT ? NETSOCKET_TIMEOUT : -1;
+#else
+	return errno == EAGAIN || errno == EWOULDBLOCK ? NETSOCKET_TIMEOUT : -1;
+#endif
+
+}//end NetSocket::Recv()
+
+
+void NetSocket::SetTimeout(int iMs)
+{
+#if defined(_WIN32)
+	DWORD uMs = iMs;
+	setsockopt(this->m_iSocket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&uMs, sizeof(uMs));
+#else
+	struct timeval tv;
+	tv.tv_sec  = iMs / 1000;
+	tv.tv_usec = (iMs % 1000) * 1000;
+	setsockopt(this->m_iSocket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+#endif
+
+}//end NetSocket::SetTimeout()
+
+
+void NetSocket::Close()
+{
+	if (this->m_iSocket != -1) {
+		closesocket_(this->m_iSocket);
+		this->m_iSocket = -1;
+	}
+
+}//end NetSocket::Close()
+
+
+unsigned short NetSocket::GetPort() const
+{
+	struct sockaddr_in addr;
+	socklen_t uSize = sizeof(addr);
+
+	if (getsockname(this->m_iSocket, (struct sockaddr*)&addr, &uSize) != 0) {
+		return 0;
+	}
+
+	return ntohs(addr.sin_port);
+
+}//end NetSocket::GetPort()
+
+
+void NetSocket::SetNoDelay()
+{
+	int iNoDelay = 1;
+	setsockopt(this->m_iSocket, IPPROTO_TCP, TCP_NODELAY, (const char*)&iNoDelay, sizeof(iNoDelay));
+
+}//end NetSocket::SetNoDelay()
@@ -0,0 +1,99 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#ifndef NETSOCKET_H
+#define NETSOCKET_H
+
+#include <string>
+#include <cstddef>
+#include <stdint.h>
+
+// Recv() result when the timeout passed without data.
+#define NETSOCKET_TIMEOUT -2
+
+
+/**
+ * Blocking TCP socket, the little of BSD sockets and Winsock the tile
+ * server and its load test need. Listening sockets only bind to the
+ * loopback address. Not copyable, closed when destroyed.
+ */
+class NetSocket
+{
+public:
+	/** Constructor, not connected. */
+	NetSocket();
+
+	/** Destructor, closes the socket. */
+	~NetSocket();
+
+	/** Start the socket library once per process, and ignore SIGPIPE. */
+	static bool Startup();
+
+	/**
+	 * Listen on 127.0.0.1.
+	 * \param uPort Port, 0 picks a free one.
+	 */
+	bool Listen(unsigned short uPort);
+
+	/**
+	 * Wait for a connection.
+	 * \param client     Gets the connection.
+	 * \param iTimeoutMs Longest wait, so the caller can check for shutdown.
+	 * \return False on timeout or error.
+	 */
+	bool Accept(NetSocket &client, int iTimeoutMs);
+
+	/** Connect to a host name or address. */
+	bool Connect(const std::string &szHost, unsigned short uPort);
+
+	/** Send everything, false when the connection is gone. */
+	bool SendAll(const void *pData, size_t uSize);
+
+	/**
+	 * Receive what has arrived, waiting for something.
+	 * \return Bytes received, 0 when closed by the peer, NETSOCKET_TIMEOUT, or -1 on an error.
+	 */
+	int Recv(void *pData, size_t uSize);
+
+	/** Longest a Recv() waits, 0 for ever. */
+	void SetTimeout(int iMs);
+
+	/** Close the connection. */
+	void Close();
+
+	/** Check if a socket is open. */
+	bool IsOpen() const { return this->m_iSocket != -1; }
+
+	/** Port listened on, after Listen(). */
+	unsigned short GetPort() const;
+
+private:
+	NetSocket(const NetSocket &);
+	NetSocket &operator=(const NetSocket &);
+
+	/** Disable Nagle, replies are one write each. */
+	void SetNoDelay();
+
+	intptr_t m_iSocket; /** Native socket, -1 when closed. */
+
+};//end NetSocket
+
+#endif //NETSOCKET_H
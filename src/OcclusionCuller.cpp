@@ -0,0 +1,454 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#include <cmath>
+#include <algorithm>
+#include <SDL.h>
+#include "OcclusionCuller.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#include <emmintrin.h>
+	#define OCCLUSION_SSE2
+#endif
+
+// Points of the polygons occluder fans are put back into, longer fans are
+// split.
+#define OCCLUDER_MAX_POINTS 32
+
+// Boxes are tested on the coarsest level where they cover at most this many
+// texels per axis, which bounds the cost of a test.
+#define TEST_TEXELS 8
+
+
+/**
+ * Constructor.
+ * \param iWidth  Depth buffer width.
+ * \param iHeight Depth buffer height, a power of two.
+ */
+OcclusionCuller::OcclusionCuller(int iWidth, int iHeight)
+{
+	this->m_iWidth  = std::max(iWidth, 4);
+	this->m_iHeight = std::max(iHeight, 1);
+
+	for (int w = this->m_iWidth, h = this->m_iHeight; ; w = std::max(w / 2, 1), h = std::max(h / 2, 1)) {
+		this->m_vLevels.push_back(std::vector<float>(w * h, 1.0f));
+
+		if (w == 1 && h == 1) {
+			break;
+		}
+	}
+
+	for (int i = 0; i < 16; i++) {
+		this->m_fClip[i] = (i % 5 == 0) ? 1.0f : 0.0f;
+	}
+
+	this->m_iTested = this->m_iOccluded = this->m_iOccluderTris = 0;
+	this->m_uStart    = 0;
+	this->m_fCullTime = 0.0f;
+
+}//end OcclusionCuller::OcclusionCuller()
+
+
+/**
+ * Clear the depth buffer and start a frame.
+ * \param fClip Projection * modelview matrix, column major.
+ */
+void OcclusionCuller::Begin(const float fClip[16])
+{
+	this->m_uStart = SDL_GetPerformanceCounter();
+
+	for (int i = 0; i < 16; i++) {
+		this->m_fClip[i] = fClip[i];
+	}
+
+	std::fill(this->m_vLevels[0].begin(), this->m_vLevels[0].end(), 1.0f);
+	this->m_iTested = this->m_iOccluded = this->m_iOccluderTris = 0;
+
+}//end OcclusionCuller::Begin()
+
+
+/**
+ * Transform a point by the clip matrix.
+ */
+void OcclusionCuller::Transform(float x, float y, float z, float fOut[4]) const
+{
+	const float *m = this->m_fClip;
+
+	for (int row = 0; row < 4; row++) {
+		fOut[row] = m[row] * x + m[4 + row] * y + m[8 + row] * z + m[12 + row];
+	}
+
+}//end OcclusionCuller::Transform()
+
+
+/**
+ * Rasterize occluder triangles. The fans the faces were split into are put
+ * back together, so the texels along their inner edges are written too.
+ * \param vTris   Nine floats (three vertices) per triangle.
+ * \param fOffset Translation applied to every vertex.
+ */
+void OcclusionCuller::AddOccluders(const std::vector<float> &vTris, const float fOffset[3])
+{
+	size_t i = 0;
+
+	while (i + 9 <= vTris.size()) {
+		// The next triangle continues the fan when it shares the first
+		// vertex and the last edge.
+		size_t uEnd = i + 9;
+
+		while (uEnd + 9 <= vTris.size() && (uEnd - i) / 9 + 2 < OCCLUDER_MAX_POINTS &&
+		       std::equal(&vTris[uEnd], &vTris[uEnd] + 3, &vTris[i]) &&
+		       std::equal(&vTris[uEnd + 3], &vTris[uEnd + 3] + 3, &vTris[uEnd - 3])) {
+			uEnd += 9;
+		}
+
+		// The first two vertices, then the last one of each triangle.
+		float fClip[OCCLUDER_MAX_POINTS][4];
+		int   iCount = 0;
+
+		for (size_t v = i; v < uEnd; v += 9) {
+			if (v == i) {
+				this->Transform(vTris[v]     + fOffset[0], vTris[v + 1] + fOffset[1], vTris[v + 2] + fOffset[2], fClip[iCount++]);
+				this->Transform(vTris[v + 3] + fOffset[0], vTris[v + 4] + fOffset[1], vTris[v + 5] + fOffset[2], fClip[iCount++]);
+			}
+
+			this->Transform(vTris[v + 6] + fOffset[0], vTris[v + 7] + fOffset[1], vTris[v + 8] + fOffset[2], fClip[iCount++]);
+		}
+
+		this->ClipPolygon(fClip, iCount);
+		this->m_iOccluderTris += (int)((uEnd - i) / 9);
+		i = uEnd;
+	}
+
+}//end OcclusionCuller::AddOccluders()
+
+
+/**
+ * Clip a convex polygon against the near plane and rasterize what is left.
+ * Occluders under the camera always cross it, so they can't just be dropped.
+ */
+void OcclusionCuller::ClipPolygon(const float fClip[][4], int iPoints)
+{
+	float fPoly[OCCLUDER_MAX_POINTS + 1][4];
+	int   iCount = 0;
+
+	for (int i = 0; i < iPoints; i++) {
+		const float *a = fClip[i];
+		const float *b = fClip[(i + 1) % iPoints];
+		float da = a[2] + a[3];
+		float db = b[2] + b[3];
+
+		if (da >= 0.0f) {
+			for (int k = 0; k < 4; k++) fPoly[iCount][k] = a[k];
+			iCount++;
+		}
+
+		if ((da >= 0.0f) != (db >= 0.0f)) {
+			float t = da / (da - db);
+			for (int k = 0; k < 4; k++) fPoly[iCount][k] = a[k] + (b[k] - a[k]) * t;
+			iCount++;
+		}
+	}
+
+	if (iCount < 3) {
+		return;
+	}
+
+	float fScreen[OCCLUDER_MAX_POINTS + 1][3];
+
+	for (int i = 0; i < iCount; i++) {
+		float w = fPoly[i][3];
+
+		if (w <= 1e-6f) {
+			return;
+		}
+
+		fScreen[i][0] = (fPoly[i][0] / w * 0.5f + 0.5f) * this->m_iWidth;
+		fScreen[i][1] = (fPoly[i][1] / w * 0.5f + 0.5f) * this->m_iHeight;
+		fScreen[i][2] =  fPoly[i][2] / w * 0.5f + 0.5f;
+	}
+
+	this->RasterizePolygon(fScreen, iCount);
+
+}//end OcclusionCuller::ClipPolygon()
+
+
+/**
+ * Rasterize a convex polygon already in screen space (x, y in pixels, z in
+ * 0..1). Conservative: only texels the polygon covers entirely are written,
+ * with the farthest depth of the polygon over them, so nothing visible
+ * along its silhouette or behind a slanted part of it is hidden. Each texel
+ * keeps the nearest of those depths over the occluders.
+ */
+void OcclusionCuller::RasterizePolygon(const float fScreen[][3], int iCount)
+{
+	// Twice the signed area, and the fan triangle the depth plane is taken
+	// from, the largest for precision.
+	float fArea = 0.0f, fPlaneArea = 0.0f;
+	int   iPlane = 1;
+
+	for (int i = 1; i + 1 < iCount; i++) {
+		const float *p0 = fScreen[0], *p1 = fScreen[i], *p2 = fScreen[i + 1];
+		float fTri = (p1[0] - p0[0]) * (p2[1] - p0[1]) - (p2[0] - p0[0]) * (p1[1] - p0[1]);
+
+		fArea += fTri;
+		if (std::fabs(fTri) > std::fabs(fPlaneArea)) {
+			fPlaneArea = fTri;
+			iPlane     = i;
+		}
+	}
+
+	if (std::fabs(fArea) < 1e-6f || std::fabs(fPlaneArea) < 1e-6f) {
+		return;
+	}
+
+	// Occluders are solid from both sides, make the inside positive.
+	float fSign = fArea < 0.0f ? -1.0f : 1.0f;
+
+	float fMinX = fScreen[0][0], fMaxX = fScreen[0][0], fMinY = fScreen[0][1], fMaxY = fScreen[0][1];
+
+	for (int i = 1; i < iCount; i++) {
+		fMinX = std::min(fMinX, fScreen[i][0]);
+		fMaxX = std::max(fMaxX, fScreen[i][0]);
+		fMinY = std::min(fMinY, fScreen[i][1]);
+		fMaxY = std::max(fMaxY, fScreen[i][1]);
+	}
+
+	int iMinX = std::max((int)std::floor(fMinX), 0);
+	int iMaxX = std::min((int)std::ceil (fMaxX), this->m_iWidth - 1);
+	int iMinY = std::max((int)std::floor(fMinY), 0);
+	int iMaxY = std::min((int)std::ceil (fMaxY), this->m_iHeight - 1);
+
+	if (iMinX > iMaxX || iMinY > iMaxY) {
+		return;
+	}
+
+	// Depth plane, from the barycentrics of the chosen triangle. Edge i of
+	// it is opposite vertex i.
+	const float *t[3] = {fScreen[0], fScreen[iPlane], fScreen[iPlane + 1]};
+	float fInv = 1.0f / fPlaneArea, Zx = 0.0f, Zy = 0.0f, Zc = 0.0f;
+
+	for (int i = 0; i < 3; i++) {
+		const float *a = t[(i + 1) % 3], *b = t[(i + 2) % 3];
+		float EA = a[1] - b[1], EB = b[0] - a[0], EC = -(EA * a[0] + EB * a[1]);
+
+		Zx += EA * t[i][2] * fInv;
+		Zy += EB * t[i][2] * fInv;
+		Zc += EC * t[i][2] * fInv;
+	}
+
+	// Edge functions A*x + B*y + C, positive inside, sampled at texel
+	// centres: the edges move half a texel inwards, so a centre passes only
+	// when the whole texel is inside, and the depth moves to the texel
+	// corner the plane is farthest at.
+	float A[OCCLUDER_MAX_POINTS + 1], B[OCCLUDER_MAX_POINTS + 1], C[OCCLUDER_MAX_POINTS + 1];
+
+	for (int i = 0; i < iCount; i++) {
+		const float *a = fScreen[i], *b = fScreen[(i + 1) % iCount];
+		A[i] = (a[1] - b[1]) * fSign;
+		B[i] = (b[0] - a[0]) * fSign;
+		C[i] = -(A[i] * a[0] + B[i] * a[1]) - 0.5f * (std::fabs(A[i]) + std::fabs(B[i]));
+	}
+	Zc += 0.5f * (std::fabs(Zx) + std::fabs(Zy));
+
+	std::vector<float> &vDepth = this->m_vLevels[0];
+
+#ifdef OCCLUSION_SSE2
+	const __m128 fOffsets = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+	const __m128 fZero    = _mm_setzero_ps();
+
+	for (int y = iMinY; y <= iMaxY; y++) {
+		float  py  = y + 0.5f;
+		float *row = &vDepth[y * this->m_iWidth];
+
+		int x = iMinX & ~3;
+
+		// Four texels at a time while they are inside the row, the tail of
+		// a row whose width isn't a multiple of 4 is done one by one.
+		for (; x <= iMaxX && x + 4 <= this->m_iWidth; x += 4) {
+			__m128 px     = _mm_add_ps(_mm_set1_ps((float)x), fOffsets);
+			__m128 inside = _mm_cmpeq_ps(fZero, fZero);
+
+			for (int i = 0; i < iCount; i++) {
+				__m128 e = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(A[i]), px), _mm_set1_ps(B[i] * py + C[i]));
+				inside = _mm_and_ps(inside, _mm_cmpge_ps(e, fZero));
+			}
+
+			if (_mm_movemask_ps(inside) == 0) {
+				continue;
+			}
+
+			__m128 z   = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(Zx), px), _mm_set1_ps(Zy * py + Zc));
+			__m128 old = _mm_loadu_ps(row + x);
+			__m128 nz  = _mm_min_ps(old, z);
+			_mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nz), _mm_andnot_ps(inside, old)));
+		}
+
+		for (; x <= iMaxX; x++) {
+			float px = x + 0.5f;
+			int   i  = 0;
+
+			while (i < iCount && A[i] * px + B[i] * py + C[i] >= 0.0f) {
+				i++;
+			}
+
+			if (i == iCount) {
+				row[x] = std::min(row[x], Zx * px + Zy * py + Zc);
+			}
+		}
+	}
+#else
+	for (int y = iMinY; y <= iMaxY; y++) {
+		float  py  = y + 0.5f;
+		float *row = &vDepth[y * this->m_iWidth];
+
+		for (int x = iMinX; x <= iMaxX; x++) {
+			float px = x + 0.5f;
+			int   i  = 0;
+
+			while (i < iCount && A[i] * px + B[i] * py + C[i] >= 0.0f) {
+				i++;
+			}
+
+			if (i == iCount) {
+				row[x] = std::min(row[x], Zx * px + Zy * py + Zc);
+			}
+		}
+	}
+#endif
+
+}//end OcclusionCuller::RasterizePolygon()
+
+
+/**
+ * Build the pyramid from the depth buffer, after every occluder is in.
+ * Each texel keeps the farthest depth of the four below it.
+ */
+void OcclusionCuller::BuildPyramid()
+{
+	int sw = this->m_iWidth, sh = this->m_iHeight;
+
+	for (size_t l = 1; l < this->m_vLevels.size(); l++) {
+		const std::vector<float> &vSrc = this->m_vLevels[l - 1];
+		std::vector<float>       &vDst = this->m_vLevels[l];
+		int dw = std::max(sw / 2, 1), dh = std::max(sh / 2, 1);
+
+		for (int y = 0; y < dh; y++) {
+			const float *r0 = &vSrc[std::min(y * 2,     sh - 1) * sw];
+			const float *r1 = &vSrc[std::min(y * 2 + 1, sh - 1) * sw];
+			float       *d  = &vDst[y * dw];
+			int x = 0;
+
+#ifdef OCCLUSION_SSE2
+			if (sw >= 8) {
+				for (; x + 4 <= dw; x += 4) {
+					__m128 lo = _mm_max_ps(_mm_loadu_ps(r0 + x * 2),     _mm_loadu_ps(r1 + x * 2));
+					__m128 hi = _mm_max_ps(_mm_loadu_ps(r0 + x * 2 + 4), _mm_loadu_ps(r1 + x * 2 + 4));
+					__m128 even = _mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0));
+					__m128 odd  = _mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1));
+					_mm_storeu_ps(d + x, _mm_max_ps(even, odd));
+				}
+			}
+#endif
+
+			for (; x < dw; x++) {
+				int x0 = std::min(x * 2, sw - 1), x1 = std::min(x * 2 + 1, sw - 1);
+				d[x] = std::max(std::max(r0[x0], r0[x1]), std::max(r1[x0], r1[x1]));
+			}
+		}
+
+		sw = dw;
+		sh = dh;
+	}
+
+}//end OcclusionCuller::BuildPyramid()
+
+
+/**
+ * Check if an axis aligned box may be visible behind the occluders.
+ * \param fMins Minimum corner (x, y, z).
+ * \param fMaxs Maximum corner (x, y, z).
+ * \return false only when the box is fully hidden.
+ */
+bool OcclusionCuller::TestAABB(const float fMins[3], const float fMaxs[3])
+{
+	this->m_iTested++;
+
+	float fMinX = 1e30f, fMaxX = -1e30f, fMinY = 1e30f, fMaxY = -1e30f, fMinZ = 1e30f;
+
+	for (int i = 0; i < 8; i++) {
+		float c[4];
+		this->Transform((i & 1) ? fMaxs[0] : fMins[0], (i & 2) ? fMaxs[1] : fMins[1], (i & 4) ? fMaxs[2] : fMins[2], c);
+
+		// Boxes crossing the near plane contain the camera, or nearly so.
+		if (c[3] <= 1e-6f || c[2] < -c[3]) {
+			return true;
+		}
+
+		float x = (c[0] / c[3] * 0.5f + 0.5f) * this->m_iWidth;
+		float y = (c[1] / c[3] * 0.5f + 0.5f) * this->m_iHeight;
+		fMinX = std::min(fMinX, x); fMaxX = std::max(fMaxX, x);
+		fMinY = std::min(fMinY, y); fMaxY = std::max(fMaxY, y);
+		fMinZ = std::min(fMinZ, c[2] / c[3] * 0.5f + 0.5f);
+	}
+
+	// Boxes past the far plane are left to the frustum test too.
+	fMinZ = std::min(fMinZ, 1.0f);
+
+	// Off screen boxes are left to the frustum test.
+	if (fMaxX < 0.0f || fMaxY < 0.0f || fMinX >= this->m_iWidth || fMinY >= this->m_iHeight) {
+		return true;
+	}
+
+	int iMinX = std::max((int)fMinX, 0), iMaxX = std::min((int)fMaxX, this->m_iWidth  - 1);
+	int iMinY = std::max((int)fMinY, 0), iMaxY = std::min((int)fMaxY, this->m_iHeight - 1);
+
+	// Coarsest level where the box still covers only a few texels.
+	int iLevel = 0;
+	while (iLevel + 1 < (int)this->m_vLevels.size() && std::max((iMaxX >> iLevel) - (iMinX >> iLevel), (iMaxY >> iLevel) - (iMinY >> iLevel)) >= TEST_TEXELS) {
+		iLevel++;
+	}
+
+	const std::vector<float> &vLevel = this->m_vLevels[iLevel];
+	int lw = std::max(this->m_iWidth >> iLevel, 1);
+
+	for (int y = iMinY >> iLevel; y <= (iMaxY >> iLevel); y++) {
+		for (int x = iMinX >> iLevel; x <= (iMaxX >> iLevel); x++) {
+			if (fMinZ <= vLevel[y * lw + x]) {
+				return true;
+			}
+		}
+	}
+
+	this->m_iOccluded++;
+	return false;
+
+}//end OcclusionCuller::TestAABB()
+
+
+/**
+ * Finish the frame, stopping the cull timer.
+ */
+void OcclusionCuller::End()
+{
+	this->m_fCullTime = (float)((SDL_GetPerformanceCounter() - this->m_uStart) * 1000.0 / SDL_GetPerformanceFrequency());
+
+}//end OcclusionCuller::End()
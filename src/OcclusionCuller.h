@@ -0,0 +1,112 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#ifndef OCCLUSIONCULLER_H
+#define OCCLUSIONCULLER_H
+
+#include <vector>
+#include <atomic>
+
+
+/**
+ * Software occlusion culler.
+ *
+ * Occluder triangles are rasterized conservatively into a small depth
+ * buffer on the CPU, only where they cover whole texels and at their
+ * farthest depth over each. The buffer is reduced into a hierarchical-Z
+ * pyramid holding the farthest depth of each texel. Boxes are then tested against the pyramid level where
+ * their screen rectangle covers only a few texels. SSE2 is used when the
+ * compiler targets it, with a scalar fallback otherwise.
+ */
+class OcclusionCuller
+{
+public:
+	/**
+	 * Constructor.
+	 * \param iWidth  Depth buffer width.
+	 * \param iHeight Depth buffer height, a power of two.
+	 */
+	OcclusionCuller(int iWidth = 256, int iHeight = 128);
+
+	/**
+	 * Clear the depth buffer and start a frame.
+	 * \param fClip Projection * modelview matrix, column major.
+	 */
+	void Begin(const float fClip[16]);
+
+	/**
+	 * Rasterize occluder triangles.
+	 * \param vTris   Nine floats (three vertices) per triangle.
+	 * \param fOffset Translation applied to every vertex.
+	 */
+	void AddOccluders(const std::vector<float> &vTris, const float fOffset[3]);
+
+	/** Build the pyramid from the depth buffer, after every occluder is in. */
+	void BuildPyramid();
+
+	/**
+	 * Check if an axis aligned box may be visible behind the occluders.
+	 * Several threads may test at once, between BuildPyramid() and End().
+	 * \param fMins Minimum corner (x, y, z).
+	 * \param fMaxs Maximum corner (x, y, z).
+	 * \return false only when the box is fully hidden.
+	 */
+	bool TestAABB(const float fMins[3], const float fMaxs[3]);
+
+	/** Finish the frame, stopping the cull timer. */
+	void End();
+
+	/** Boxes tested in the last frame. */
+	int GetTested() const { return this->m_iTested; }
+
+	/** Boxes found hidden in the last frame. */
+	int GetOccluded() const { return this->m_iOccluded; }
+
+	/** Occluder triangles rasterized in the last frame. */
+	int GetOccluderTris() const { return this->m_iOccluderTris; }
+
+	/** Time spent between Begin() and End() in the last frame, in ms. */
+	float GetCullTime() const { return this->m_fCullTime; }
+
+private:
+	/** Clip a convex polygon against the near plane and rasterize what is left. */
+	void ClipPolygon(const float fClip[][4], int iPoints);
+
+	/** Rasterize a convex polygon already in screen space (x, y in pixels, z in 0..1). */
+	void RasterizePolygon(const float fScreen[][3], int iCount);
+
+	/** Transform a point by the clip matrix. */
+	void Transform(float x, float y, float z, float fOut[4]) const;
+
+	int   m_iWidth;             /** Depth buffer width. */
+	int   m_iHeight;            /** Depth buffer height. */
+	float m_fClip[16];          /** Matrix of the current frame. */
+	std::vector<std::vector<float> > m_vLevels; /** Level 0 is the depth buffer, each next level half the size. */
+
+	std::atomic<int> m_iTested;   /** Boxes tested this frame. */
+	std::atomic<int> m_iOccluded; /** Boxes hidden this frame. */
+	int   m_iOccluderTris;      /** Occluders rasterized this frame. */
+	unsigned long long m_uStart; /** Performance counter at Begin(). */
+	float m_fCullTime;          /** Duration of the last frame. */
+
+};//end OcclusionCuller
+
+#endif //OCCLUSIONCULLER_H
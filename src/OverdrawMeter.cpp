@@ -0,0 +1,152 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#include <algorithm>
+#include "OverdrawMeter.h"
+
+// Colour added per fragment. Red saturates after 4 layers, green after 16
+// and blue after 32.
+#define HEAT_RED   0.25f
+#define HEAT_GREEN 0.0625f
+#define HEAT_BLUE  0.03125f
+
+
+/**
+ * Make the queries, when the driver has them.
+ */
+OverdrawMeter::OverdrawMeter()
+{
+	this->m_uFrame   = 0;
+	this->m_fAverage = 0.0f;
+
+	for (int i = 0; i < OVERDRAW_QUERIES; i++) {
+		this->m_uQueries[i] = 0;
+		this->m_bPending[i] = false;
+		this->m_dSamples[i] = 0.0;
+	}
+
+	if (GLEW_VERSION_1_5) {
+		glGenQueries(OVERDRAW_QUERIES, this->m_uQueries);
+	}
+
+}//end OverdrawMeter::OverdrawMeter()
+
+
+/**
+ * Free the queries.
+ */
+OverdrawMeter::~OverdrawMeter()
+{
+	if (this->m_uQueries[0] != 0) {
+		glDeleteQueries(OVERDRAW_QUERIES, this->m_uQueries);
+	}
+
+}//end OverdrawMeter::~OverdrawMeter()
+
+
+/**
+ * Clear the colour, keeping the depth of nothing drawn yet, and switch to
+ * additive blending of the heat colour. Callers draw untextured.
+ */
+void OverdrawMeter::Begin()
+{
+	glPushAttrib(GL_COLOR_BUFFER_BIT | GL_CURRENT_BIT);
+	glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+	glClear(GL_COLOR_BUFFER_BIT);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_ONE, GL_ONE);
+	glColor4f(HEAT_RED, HEAT_GREEN, HEAT_BLUE, 1.0f);
+
+	if (this->m_uQueries[0] == 0) {
+		return;
+	}
+
+	unsigned int uSlot = this->m_uFrame % OVERDRAW_QUERIES;
+
+	if (this->m_bPending[uSlot]) {
+		this->Collect(true);
+	}
+
+	// With multisampling every covered sample counts, not every pixel.
+	GLint aViewport[4] = {0, 0, 0, 0}, iSamples = 0;
+	glGetIntegerv(GL_VIEWPORT, aViewport);
+	glGetIntegerv(GL_SAMPLES, &iSamples);
+	this->m_dSamples[uSlot] = (double)aViewport[2] * aViewport[3] * std::max(iSamples, 1);
+
+	glBeginQuery(GL_SAMPLES_PASSED, this->m_uQueries[uSlot]);
+
+}//end OverdrawMeter::Begin()
+
+
+/**
+ * End the frame's query and put the state back.
+ */
+void OverdrawMeter::End()
+{
+	glPopAttrib();
+
+	if (this->m_uQueries[0] == 0) {
+		return;
+	}
+
+	glEndQuery(GL_SAMPLES_PASSED);
+	this->m_bPending[this->m_uFrame % OVERDRAW_QUERIES] = true;
+	this->m_uFrame++;
+	this->Collect(false);
+
+}//end OverdrawMeter::End()
+
+
+/**
+ * Average in the counts of finished queries. Once a query isn't done the
+ * later ones aren't either.
+ */
+void OverdrawMeter::Collect(bool bWait)
+{
+	for (unsigned int i = 0; i < OVERDRAW_QUERIES; i++) {
+		// Oldest first, the next slot to be reused is the oldest.
+		unsigned int uSlot = (this->m_uFrame + i) % OVERDRAW_QUERIES;
+
+		if (!this->m_bPending[uSlot]) {
+			continue;
+		}
+
+		GLint iAvailable = 0;
+		glGetQueryObjectiv(this->m_uQueries[uSlot], GL_QUERY_RESULT_AVAILABLE, &iAvailable);
+
+		if (!iAvailable && !bWait) {
+			break;
+		}
+
+		GLuint uPassed = 0;
+		glGetQueryObjectuiv(this->m_uQueries[uSlot], GL_QUERY_RESULT, &uPassed);
+		this->m_bPending[uSlot] = false;
+		bWait = false;
+
+		if (this->m_dSamples[uSlot] <= 0.0) {
+			continue;
+		}
+
+		float fOverdraw = (float)(uPassed / this->m_dSamples[uSlot]);
+		this->m_fAverage = this->m_fAverage > 0.0f ? this->m_fAverage * 0.9f + fOverdraw * 0.1f : fOverdraw;
+	}
+
+}//end OverdrawMeter::Collect()
@@ -0,0 +1,74 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#ifndef OVERDRAWMETER_H
+#define OVERDRAWMETER_H
+
+#include <GL/glew.h>
+
+// Sample count queries in flight, read a few frames late like the timers.
+#define OVERDRAW_QUERIES 4
+
+
+/**
+ * Overdraw heatmap and its average.
+ *
+ * Between Begin() and End() every fragment that passes the depth test adds
+ * a fixed colour on a black frame, so pixels shaded once are dark red and
+ * the ones shaded many times go through red and yellow to white. A samples
+ * passed query counts the same fragments; over the pixels of the viewport
+ * it gives how many times each one was shaded on average, which drops when
+ * maps and faces are drawn front to back.
+ */
+class OverdrawMeter
+{
+public:
+	/** Constructor, needs a GL context. */
+	OverdrawMeter();
+
+	/** Destructor */
+	~OverdrawMeter();
+
+	/** Clear to black and start the additive heat colour and counting. */
+	void Begin();
+
+	/** Stop counting, restore blending and colour, read finished counts. */
+	void End();
+
+	/** Smoothed average of times each pixel was shaded, 0 before any result. */
+	float GetAverage() const { return this->m_fAverage; }
+
+private:
+	/**
+	 * Read the results of finished queries, oldest first.
+	 * \param bWait Wait for the oldest one instead of skipping it.
+	 */
+	void Collect(bool bWait);
+
+	GLuint       m_uQueries[OVERDRAW_QUERIES];  /** Samples passed queries. */
+	bool         m_bPending[OVERDRAW_QUERIES];  /** Query ended but not read yet. */
+	double       m_dSamples[OVERDRAW_QUERIES];  /** Samples covering the viewport when each query ran. */
+	unsigned int m_uFrame;                      /** Frames measured, picks the query. */
+	float        m_fAverage;                    /** Smoothed overdraw. */
+
+};//end OverdrawMeter
+
+#endif //OVERDRAWMETER_H
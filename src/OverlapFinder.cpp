@@ -0,0 +1,581 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#include "common.h"
+#include "bsp.h"
+#include "JobSystem.h"
+#include "TriangleBvh.h"
+#include "OverlapFinder.h"
+#include <functional>
+#include <cfloat>
+
+// Distance from a plane below which a vertex is on it, in units.
+#define OVERLAP_EPSILON 0.05f
+// Smallest coplanar area reported, in square units.
+#define OVERLAP_MIN_AREA 1.0f
+// Cells a single contact spans at most per axis, before it is grouped.
+#define OVERLAP_MAX_CELLS 16
+
+
+static void Sub(const float a[3], const float b[3], float r[3])
+{
+	r[0] = a[0] - b[0];
+	r[1] = a[1] - b[1];
+	r[2] = a[2] - b[2];
+}
+
+static void Cross(const float a[3], const float b[3], float r[3])
+{
+	r[0] = a[1] * b[2] - a[2] * b[1];
+	r[1] = a[2] * b[0] - a[0] * b[2];
+	r[2] = a[0] * b[1] - a[1] * b[0];
+}
+
+static float Dot(const float a[3], const float b[3])
+{
+	return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+/** Unit normal of a triangle. \return False when degenerate. */
+static bool Normal(const float fTri[3][3], float fNormal[3])
+{
+	float e1[3], e2[3];
+	Sub(fTri[1], fTri[0], e1);
+	Sub(fTri[2], fTri[0], e2);
+	Cross(e1, e2, fNormal);
+
+	float fLength = sqrtf(Dot(fNormal, fNormal));
+
+	if (fLength < 1e-6f) {
+		return false;
+	}
+
+	for (int k = 0; k < 3; k++) {
+		fNormal[k] /= fLength;
+	}
+
+	return true;
+}
+
+/**
+ * Where a triangle crosses the plane its vertices are fDist away from,
+ * as the two ends of that line along fDir.
+ */
+static void PlaneInterval(const float fTri[3][3], const float fDist[3], const float fDir[3], float &t0, float &t1, float p0[3], float p1[3])
+{
+	t0 = FLT_MAX;
+	t1 = -FLT_MAX;
+
+	for (int i = 0; i < 3; i++) {
+		float p[3];
+		int   j = (i + 1) % 3;
+
+		if (fDist[i] == 0.0f) {
+			memcpy(p, fTri[i], sizeof(p));
+		} else if ((fDist[i] < 0.0f && fDist[j] > 0.0f) || (fDist[i] > 0.0f && fDist[j] < 0.0f)) {
+			float s = fDist[i] / (fDist[i] - fDist[j]);
+
+			for (int k = 0; k < 3; k++) {
+				p[k] = fTri[i][k] + (fTri[j][k] - fTri[i][k]) * s;
+			}
+		} else {
+			continue;
+		}
+
+		float t = Dot(p, fDir);
+
+		if (t < t0) {
+			t0 = t;
+			memcpy(p0, p, sizeof(p));
+		}
+
+		if (t > t1) {
+			t1 = t;
+			memcpy(p1, p, sizeof(p));
+		}
+	}
+}
+
+/** Root of a contact in the joined sets, halving the path on the way. */
+static size_t FindRoot(std::vector<size_t> &vParent, size_t i)
+{
+	while (vParent[i] != i) {
+		vParent[i] = vParent[vParent[i]];
+		i = vParent[i];
+	}
+
+	return i;
+}
+
+/** Pairs by their first and then second map. */
+static bool CompareMaps(const MapOverlap &a, const MapOverlap &b)
+{
+	return a.uMapA != b.uMapA ? a.uMapA < b.uMapA : a.uMapB < b.uMapB;
+}
+
+/** Regions with the most crossings first, then the largest coplanar area. */
+static bool CompareRegions(const OverlapRegion &a, const OverlapRegion &b)
+{
+	return a.iCrossings != b.iCrossings ? a.iCrossings > b.iCrossings : a.fCoplanarArea > b.fCoplanarArea;
+}
+
+
+/**
+ * Constructor
+ * \param fCellSize Contacts closer than this end up in the same region.
+ */
+OverlapFinder::OverlapFinder(float fCellSize)
+{
+	this->m_fCellSize = fCellSize;
+	this->m_fTime     = 0.0f;
+
+}//end OverlapFinder::OverlapFinder()
+
+
+/**
+ * Find the overlapping pairs of maps.
+ * \param vMaps Maps with their picking BVHs built, at their render offsets.
+ * \param pJobs Job system to test the pairs on, NULL to test them here.
+ * \return Number of overlapping pairs.
+ */
+size_t OverlapFinder::Run(const std::vector<BSP*> &vMaps, JobSystem *pJobs)
+{
+	Uint64 uStart = SDL_GetPerformanceCounter();
+
+	this->m_vMaps = vMaps;
+	this->m_vOffsets.resize(vMaps.size() * 3);
+	this->m_vPairs.clear();
+	this->m_vOverlaps.clear();
+
+	// World bounds of every map with triangles, swept along x. Offsets are
+	// resolved here, the jobs only read them.
+	std::vector<std::pair<float, size_t> > vOrder;
+	std::vector<float> vBounds(vMaps.size() * 6);
+
+	for (size_t i = 0; i < vMaps.size(); i++) {
+		const TriangleBvh &bvh = vMaps[i]->GetBvh();
+		VERTEX o = vMaps[i]->GetRenderOffset();
+		float *fOffset = &this->m_vOffsets[i * 3];
+		fOffset[0] = o.x;
+		fOffset[1] = o.y;
+		fOffset[2] = o.z;
+
+		if (bvh.IsEmpty()) {
+			continue;
+		}
+
+		float *fMins = &vBounds[i * 6], *fMaxs = &vBounds[i * 6 + 3];
+		bvh.GetBounds(fMins, fMaxs);
+
+		for (int k = 0; k < 3; k++) {
+			fMins[k] += fOffset[k];
+			fMaxs[k] += fOffset[k];
+		}
+
+		vOrder.push_back(std::make_pair(fMins[0], i));
+	}
+
+	std::sort(vOrder.begin(), vOrder.end());
+
+	for (size_t n = 0; n < vOrder.size(); n++) {
+		size_t i = vOrder[n].second;
+
+		for (size_t m = n + 1; m < vOrder.size() && vOrder[m].first <= vBounds[i * 6 + 3]; m++) {
+			size_t j = vOrder[m].second;
+			MapOverlap o;
+			o.uMapA         = std::min(i, j);
+			o.uMapB         = std::max(i, j);
+			o.fBoundsVolume = 1.0f;
+			o.uCandidates   = 0;
+
+			for (int k = 0; k < 3; k++) {
+				o.fMins[k] = std::max(vBounds[i * 6 + k], vBounds[j * 6 + k]);
+				o.fMaxs[k] = std::min(vBounds[i * 6 + 3 + k], vBounds[j * 6 + 3 + k]);
+				o.fBoundsVolume *= std::max(o.fMaxs[k] - o.fMins[k], 0.0f);
+			}
+
+			if (o.fMins[1] <= o.fMaxs[1] && o.fMins[2] <= o.fMaxs[2]) {
+				this->m_vPairs.push_back(o);
+			}
+		}
+	}
+
+	// Narrow phase, one pair per job, the largest maps take the longest.
+	if (pJobs != NULL) {
+		pJobs->ParallelFor(this->m_vPairs.size(), 1, std::bind(&OverlapFinder::TestPairs, this, std::placeholders::_1, std::placeholders::_2));
+	} else {
+		this->TestPairs(0, this->m_vPairs.size());
+	}
+
+	for (size_t i = 0; i < this->m_vPairs.size(); i++) {
+		if (!this->m_vPairs[i].vRegions.empty()) {
+			this->m_vOverlaps.push_back(this->m_vPairs[i]);
+		}
+	}
+
+	std::sort(this->m_vOverlaps.begin(), this->m_vOverlaps.end(), CompareMaps);
+	this->m_fTime = (float)((SDL_GetPerformanceCounter() - uStart) * 1000.0 / SDL_GetPerformanceFrequency());
+
+	return this->m_vOverlaps.size();
+
+}//end OverlapFinder::Run()
+
+
+/**
+ * Test pairs [uFirst, uEnd), on a job thread.
+ */
+void OverlapFinder::TestPairs(size_t uFirst, size_t uEnd)
+{
+	for (size_t i = uFirst; i < uEnd; i++) {
+		this->TestPair(this->m_vPairs[i]);
+	}
+
+}//end OverlapFinder::TestPairs()
+
+
+/**
+ * Test the triangles of one pair of maps and group their contacts. The
+ * second map's triangles are moved into the first one's space.
+ */
+void OverlapFinder::TestPair(MapOverlap &overlap) const
+{
+	const BSP *pA = this->m_vMaps[overlap.uMapA];
+	const BSP *pB = this->m_vMaps[overlap.uMapB];
+	const float *fOffsetA = &this->m_vOffsets[overlap.uMapA * 3];
+	const float *fOffsetB = &this->m_vOffsets[overlap.uMapB * 3];
+	float fOffset[3] = {fOffsetB[0] - fOffsetA[0], fOffsetB[1] - fOffsetA[1], fOffsetB[2] - fOffsetA[2]};
+
+	std::vector<BvhPair> vPairs;
+	pA->GetBvh().FindOverlaps(pB->GetBvh(), fOffset, vPairs);
+	overlap.uCandidates = vPairs.size();
+
+	std::vector<Contact> vContacts;
+
+	for (size_t i = 0; i < vPairs.size(); i++) {
+		const BvhTriangle &a = *vPairs[i].pA;
+		const BvhTriangle &b = *vPairs[i].pB;
+
+		// Doors, platforms and triggers move or aren't drawn.
+		if (a.iModel != 0 || b.iModel != 0) {
+			continue;
+		}
+
+		float fB[3][3];
+
+		for (int v = 0; v < 3; v++) {
+			for (int k = 0; k < 3; k++) {
+				fB[v][k] = b.fVerts[v][k] + fOffset[k];
+			}
+		}
+
+		Contact c;
+
+		if (Intersect(a.fVerts, fB, c)) {
+			vContacts.push_back(c);
+		}
+	}
+
+	this->GroupContacts(vContacts, fOffsetA, overlap.vRegions);
+
+	overlap.iCrossings      = 0;
+	overlap.fCrossingLength = 0.0f;
+	overlap.fCoplanarArea   = 0.0f;
+
+	for (size_t r = 0; r < overlap.vRegions.size(); r++) {
+		overlap.iCrossings      += overlap.vRegions[r].iCrossings;
+		overlap.fCrossingLength += overlap.vRegions[r].fCrossingLength;
+		overlap.fCoplanarArea   += overlap.vRegions[r].fCoplanarArea;
+	}
+
+}//end OverlapFinder::TestPair()
+
+
+/**
+ * Group contacts into regions: each contact marks the cells its bounds
+ * cover, and contacts sharing or neighbouring a cell are joined.
+ */
+void OverlapFinder::GroupContacts(const std::vector<Contact> &vContacts, const float fOffset[3], std::vector<OverlapRegion> &vRegions) const
+{
+	std::vector<size_t> vParent(vContacts.size());
+	std::map<long long, size_t> mCells;
+
+	for (size_t i = 0; i < vParent.size(); i++) {
+		vParent[i] = i;
+	}
+
+	for (size_t i = 0; i < vContacts.size(); i++) {
+		int iMin[3], iMax[3];
+
+		for (int k = 0; k < 3; k++) {
+			iMin[k] = (int)floorf(vContacts[i].fMins[k] / this->m_fCellSize);
+			iMax[k] = std::min((int)floorf(vContacts[i].fMaxs[k] / this->m_fCellSize), iMin[k] + OVERLAP_MAX_CELLS - 1);
+		}
+
+		for (int x = iMin[0]; x <= iMax[0]; x++) {
+			for (int y = iMin[1]; y <= iMax[1]; y++) {
+				for (int z = iMin[2]; z <= iMax[2]; z++) {
+					long long key = ((long long)(x & 0x1fffff) << 42) | ((long long)(y & 0x1fffff) << 21) | (z & 0x1fffff);
+					std::map<long long, size_t>::iterator it = mCells.find(key);
+
+					if (it == mCells.end()) {
+						mCells[key] = i;
+					} else {
+						vParent[FindRoot(vParent, i)] = FindRoot(vParent, it->second);
+					}
+				}
+			}
+		}
+	}
+
+	// Neighbouring cells join their contacts too.
+	for (std::map<long long, size_t>::iterator it = mCells.begin(); it != mCells.end(); it++) {
+		int x = (int)(it->first >> 42) & 0x1fffff, y = (int)(it->first >> 21) & 0x1fffff, z = (int)it->first & 0x1fffff;
+
+		for (int dx = -1; dx <= 1; dx++) {
+			for (int dy = -1; dy <= 1; dy++) {
+				for (int dz = -1; dz <= 1; dz++) {
+					long long key = ((long long)((x + dx) & 0x1fffff) << 42) | ((long long)((y + dy) & 0x1fffff) << 21) | ((z + dz) & 0x1fffff);
+					std::map<long long, size_t>::iterator itNext = mCells.find(key);
+
+					if (itNext != mCells.end()) {
+						vParent[FindRoot(vParent, it->second)] = FindRoot(vParent, itNext->second);
+					}
+				}
+			}
+		}
+	}
+
+	// One region per root, in world space.
+	std::map<size_t, size_t> mRegionOfRoot;
+
+	for (size_t i = 0; i < vContacts.size(); i++) {
+		const Contact &c = vContacts[i];
+		size_t uRoot = FindRoot(vParent, i);
+
+		if (mRegionOfRoot.count(uRoot) == 0) {
+			OverlapRegion r;
+
+			for (int k = 0; k < 3; k++) {
+				r.fMins[k] = FLT_MAX;
+				r.fMaxs[k] = -FLT_MAX;
+			}
+
+			mRegionOfRoot[uRoot] = vRegions.size();
+			vRegions.push_back(r);
+		}
+
+		OverlapRegion &r = vRegions[mRegionOfRoot[uRoot]];
+
+		for (int k = 0; k < 3; k++) {
+			r.fMins[k] = std::min(r.fMins[k], c.fMins[k] + fOffset[k]);
+			r.fMaxs[k] = std::max(r.fMaxs[k], c.fMaxs[k] + fOffset[k]);
+		}
+
+		if (c.bCoplanar) {
+			r.fCoplanarArea += c.fAmount;
+		} else {
+			r.iCrossings++;
+			r.fCrossingLength += c.fAmount;
+		}
+	}
+
+	for (size_t i = 0; i < vRegions.size(); i++) {
+		OverlapRegion &r = vRegions[i];
+		r.fVolume = (r.fMaxs[0] - r.fMins[0]) * (r.fMaxs[1] - r.fMins[1]) * (r.fMaxs[2] - r.fMins[2]);
+	}
+
+	std::sort(vRegions.begin(), vRegions.end(), CompareRegions);
+
+}//end OverlapFinder::GroupContacts()
+
+
+/**
+ * Find how two triangles meet. When neither lies in the other's plane,
+ * each must have vertices on both sides of the other's plane, and the two
+ * lines where they cross that plane must share a stretch: that stretch is
+ * the contact. Triangles that only touch at an edge or a vertex are left
+ * out, so walls standing on floors of the other map aren't reported.
+ * \return False when they only touch or don't meet.
+ */
+bool OverlapFinder::Intersect(const float fA[3][3], const float fB[3][3], Contact &contact)
+{
+	float nA[3], nB[3];
+
+	if (!Normal(fA, nA) || !Normal(fB, nB)) {
+		return false;
+	}
+
+	float dA[3], dB[3], e[3];
+	bool  bCoplanar = true;
+
+	for (int i = 0; i < 3; i++) {
+		Sub(fB[i], fA[0], e);
+		dB[i] = Dot(nA, e);
+		Sub(fA[i], fB[0], e);
+		dA[i] = Dot(nB, e);
+
+		if (fabsf(dA[i]) < OVERLAP_EPSILON) dA[i] = 0.0f;
+		if (fabsf(dB[i]) < OVERLAP_EPSILON) dB[i] = 0.0f;
+
+		bCoplanar = bCoplanar && dB[i] == 0.0f;
+	}
+
+	if (bCoplanar) {
+		return CoplanarOverlap(fA, fB, nA, contact);
+	}
+
+	// Both split by the other's plane.
+	for (int t = 0; t < 2; t++) {
+		const float *d = t == 0 ? dA : dB;
+		float fMin = std::min(std::min(d[0], d[1]), d[2]);
+		float fMax = std::max(std::max(d[0], d[1]), d[2]);
+
+		if (fMin >= 0.0f || fMax <= 0.0f) {
+			return false;
+		}
+	}
+
+	float fDir[3], ta0, ta1, tb0, tb1, pa0[3], pa1[3], pb0[3], pb1[3];
+	Cross(nA, nB, fDir);
+	PlaneInterval(fA, dA, fDir, ta0, ta1, pa0, pa1);
+	PlaneInterval(fB, dB, fDir, tb0, tb1, pb0, pb1);
+
+	const float *p0 = ta0 >= tb0 ? pa0 : pb0;
+	const float *p1 = ta1 <= tb1 ? pa1 : pb1;
+	float d[3];
+	Sub(p1, p0, d);
+
+	float fLength = sqrtf(Dot(d, d));
+
+	if (std::min(ta1, tb1) <= std::max(ta0, tb0) || fLength < OVERLAP_EPSILON) {
+		return false;
+	}
+
+	for (int k = 0; k < 3; k++) {
+		contact.fMins[k] = std::min(p0[k], p1[k]);
+		contact.fMaxs[k] = std::max(p0[k], p1[k]);
+	}
+
+	contact.bCoplanar = false;
+	contact.fAmount   = fLength;
+
+	return true;
+
+}//end OverlapFinder::Intersect()
+
+
+/**
+ * Area where two coplanar triangles overlap: the first one is clipped by
+ * each edge of the second, in the plane of the axes the normal is least
+ * along.
+ * \return False when below OVERLAP_MIN_AREA.
+ */
+bool OverlapFinder::CoplanarOverlap(const float fA[3][3], const float fB[3][3], const float fNormal[3], Contact &contact)
+{
+	// Drop the axis the normal is most along.
+	int w = 0;
+
+	for (int k = 1; k < 3; k++) {
+		if (fabsf(fNormal[k]) > fabsf(fNormal[w])) {
+			w = k;
+		}
+	}
+
+	int u = (w + 1) % 3, v = (w + 2) % 3;
+
+	std::vector<float> vPoly, vClipped;
+
+	for (int i = 0; i < 3; i++) {
+		vPoly.push_back(fA[i][u]);
+		vPoly.push_back(fA[i][v]);
+	}
+
+	// Winding of the second triangle, so inside is on the same side of every edge.
+	float fWinding = (fB[1][u] - fB[0][u]) * (fB[2][v] - fB[0][v]) - (fB[1][v] - fB[0][v]) * (fB[2][u] - fB[0][u]);
+	float fSign    = fWinding < 0.0f ? -1.0f : 1.0f;
+
+	for (int i = 0; i < 3 && !vPoly.empty(); i++) {
+		const float *e0 = fB[i], *e1 = fB[(i + 1) % 3];
+		float eu = e1[u] - e0[u], ev = e1[v] - e0[v];
+		size_t n = vPoly.size() / 2;
+		vClipped.clear();
+
+		for (size_t j = 0; j < n; j++) {
+			size_t k  = (j + 1) % n;
+			float  s0 = fSign * (eu * (vPoly[j * 2 + 1] - e0[v]) - ev * (vPoly[j * 2] - e0[u]));
+			float  s1 = fSign * (eu * (vPoly[k * 2 + 1] - e0[v]) - ev * (vPoly[k * 2] - e0[u]));
+
+			if (s0 >= 0.0f) {
+				vClipped.push_back(vPoly[j * 2]);
+				vClipped.push_back(vPoly[j * 2 + 1]);
+			}
+
+			if ((s0 >= 0.0f) != (s1 >= 0.0f)) {
+				float s = s0 / (s0 - s1);
+				vClipped.push_back(vPoly[j * 2] + (vPoly[k * 2] - vPoly[j * 2]) * s);
+				vClipped.push_back(vPoly[j * 2 + 1] + (vPoly[k * 2 + 1] - vPoly[j * 2 + 1]) * s);
+			}
+		}
+
+		vPoly.swap(vClipped);
+	}
+
+	size_t n = vPoly.size() / 2;
+	float  fArea = 0.0f;
+
+	for (size_t j = 0; j < n; j++) {
+		size_t k = (j + 1) % n;
+		fArea += vPoly[j * 2] * vPoly[k * 2 + 1] - vPoly[k * 2] * vPoly[j * 2 + 1];
+	}
+
+	// Projected area, back to the plane's.
+	fArea = fabsf(fArea) * 0.5f / fabsf(fNormal[w]);
+
+	if (n < 3 || fArea < OVERLAP_MIN_AREA) {
+		return false;
+	}
+
+	// Bounds of the clipped polygon, with the dropped axis from the plane.
+	float fPlane = Dot(fNormal, fA[0]);
+
+	for (int k = 0; k < 3; k++) {
+		contact.fMins[k] = FLT_MAX;
+		contact.fMaxs[k] = -FLT_MAX;
+	}
+
+	for (size_t j = 0; j < n; j++) {
+		float p[3];
+		p[u] = vPoly[j * 2];
+		p[v] = vPoly[j * 2 + 1];
+		p[w] = (fPlane - fNormal[u] * p[u] - fNormal[v] * p[v]) / fNormal[w];
+
+		for (int k = 0; k < 3; k++) {
+			contact.fMins[k] = std::min(contact.fMins[k], p[k]);
+			contact.fMaxs[k] = std::max(contact.fMaxs[k], p[k]);
+		}
+	}
+
+	contact.bCoplanar = true;
+	contact.fAmount   = fArea;
+
+	return true;
+
+}//end OverlapFinder::CoplanarOverlap()
@@ -0,0 +1,156 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#ifndef OVERLAPFINDER_H
+#define OVERLAPFINDER_H
+
+#include <vector>
+#include <cstddef>
+
+class BSP;
+class JobSystem;
+struct BvhTriangle;
+
+// Contacts closer than this many units end up in the same region.
+#define OVERLAP_CELL_SIZE 128.0f
+
+
+/** Touching contacts between the faces of two maps. */
+struct OverlapRegion
+{
+	OverlapRegion()
+	{
+		for (int i = 0; i < 3; i++)
+			this->fMins[i] = this->fMaxs[i] = 0.0f;
+
+		this->fVolume = this->fCrossingLength = this->fCoplanarArea = 0.0f;
+		this->iCrossings = 0;
+	}
+
+	float fMins[3];        /** World bounds of its contacts. */
+	float fMaxs[3];
+	float fVolume;         /** Volume of the bounds, 0 for a flat region. */
+	int   iCrossings;      /** Triangle pairs passing through each other. */
+	float fCrossingLength; /** Total length of their intersection segments. */
+	float fCoplanarArea;   /** Area where faces of both maps lie in the same plane. */
+};
+
+
+/** Two maps whose world geometry overlaps. */
+struct MapOverlap
+{
+	MapOverlap()
+	{
+		for (int i = 0; i < 3; i++)
+			this->fMins[i] = this->fMaxs[i] = 0.0f;
+
+		this->uMapA = this->uMapB = this->uCandidates = 0;
+		this->fBoundsVolume = this->fCrossingLength = this->fCoplanarArea = 0.0f;
+		this->iCrossings = 0;
+	}
+
+	size_t uMapA;           /** Index into the maps, uMapA < uMapB. */
+	size_t uMapB;
+	float  fMins[3];        /** Where their world bounds intersect. */
+	float  fMaxs[3];
+	float  fBoundsVolume;   /** Volume of that intersection. */
+	size_t uCandidates;     /** Triangle pairs whose bounds overlap. */
+	int    iCrossings;      /** Totals of the regions. */
+	float  fCrossingLength;
+	float  fCoplanarArea;
+	std::vector<OverlapRegion> vRegions; /** Largest first. */
+};
+
+
+/**
+ * Finds every pair of landmark aligned maps whose world geometry overlaps.
+ *
+ * The broad phase sweeps the world bounds of the maps along x. Each pair of
+ * maps whose bounds intersect is then tested on a job: both picking BVHs are
+ * walked at once for triangles whose bounds overlap, and those are tested
+ * exactly. Triangles passing through each other are crossings, the extra
+ * walls of a misplaced map, and overlapping faces in one plane are coplanar
+ * contacts, which z-fight unless they are the same face copied into both
+ * maps around a changelevel. Triangles that only touch are left out.
+ * Contacts of a pair are grouped into regions of touching cells.
+ */
+class OverlapFinder
+{
+public:
+	/**
+	 * Constructor
+	 * \param fCellSize Contacts closer than this end up in the same region.
+	 */
+	OverlapFinder(float fCellSize = OVERLAP_CELL_SIZE);
+
+	/**
+	 * Find the overlapping pairs of maps.
+	 * \param vMaps Maps with their picking BVHs built, at their render offsets.
+	 *              Only the world model of each map is tested.
+	 * \param pJobs Job system to test the pairs on, NULL to test them here.
+	 * \return Number of overlapping pairs.
+	 */
+	size_t Run(const std::vector<BSP*> &vMaps, JobSystem *pJobs);
+
+	/** Overlapping pairs of the last Run(), by their first and then second map. */
+	const std::vector<MapOverlap> &GetOverlaps() const { return this->m_vOverlaps; }
+
+	/** Pairs of maps whose bounds intersect, tested by the last Run(). */
+	size_t GetCandidates() const { return this->m_vPairs.size(); }
+
+	/** Milliseconds the last Run() took. */
+	float GetTime() const { return this->m_fTime; }
+
+private:
+	/** A contact between a triangle of each map. */
+	struct Contact
+	{
+		float fMins[3];  /** Bounds, in the first map's space. */
+		float fMaxs[3];
+		bool  bCoplanar; /** In the same plane, otherwise a crossing. */
+		float fAmount;   /** Area when coplanar, length of the intersection otherwise. */
+	};
+
+	/** Test pairs [uFirst, uEnd), on a job thread. */
+	void TestPairs(size_t uFirst, size_t uEnd);
+
+	/** Test the triangles of one pair of maps and group their contacts. */
+	void TestPair(MapOverlap &overlap) const;
+
+	/** Group contacts of touching cells into regions, moved by fOffset into the world. */
+	void GroupContacts(const std::vector<Contact> &vContacts, const float fOffset[3], std::vector<OverlapRegion> &vRegions) const;
+
+	/** Find how two triangles meet. \return False when they only touch or don't meet. */
+	static bool Intersect(const float fA[3][3], const float fB[3][3], Contact &contact);
+
+	/** Area where two coplanar triangles overlap. \return False when below a unit. */
+	static bool CoplanarOverlap(const float fA[3][3], const float fB[3][3], const float fNormal[3], Contact &contact);
+
+	float                   m_fCellSize; /** Size of the grouping cells. */
+	std::vector<BSP*>       m_vMaps;     /** Maps of the running Run(). */
+	std::vector<float>      m_vOffsets;  /** Render offset of each, three floats per map. */
+	std::vector<MapOverlap> m_vPairs;    /** Every pair whose bounds intersect. */
+	std::vector<MapOverlap> m_vOverlaps; /** Pairs with contacts. */
+	float                   m_fTime;     /** Of the last Run(), in ms. */
+
+};//end OverlapFinder
+
+#endif //OVERLAPFINDER_H
@@ -0,0 +1,379 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#include "PngWriter.h"
+
+#include <fstream>
+#include <cstdlib>
+#include <algorithm>
+
+// LZ77 window of deflate, and how far a match search follows the hash chain.
+#define DEFLATE_WINDOW    32768
+#define DEFLATE_HASH_BITS 15
+#define DEFLATE_MAX_CHAIN 64
+#define DEFLATE_MIN_MATCH 3
+#define DEFLATE_MAX_MATCH 258
+
+// Lengths and distances of deflate: first value of each code, and its extra bits.
+static const int iLengthBase[29]  = {3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258};
+static const int iLengthExtra[29] = {0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0};
+static const int iDistBase[30]    = {1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577};
+static const int iDistExtra[30]   = {0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+
+// CRC-32 table, built before main so encoders on any thread can share it.
+static struct CrcTable
+{
+	uint32_t v[256];
+	CrcTable()
+	{
+		for (uint32_t n = 0; n < 256; n++) {
+			uint32_t c = n;
+			for (int k = 0; k < 8; k++) {
+				c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+			}
+			v[n] = c;
+		}
+	}
+} crcTable;
+
+// Packs codes into bytes, least significant bit first, as deflate wants.
+struct BitWriter
+{
+	std::vector<unsigned char> &vOut;
+	uint32_t uBits;
+	int      iCount;
+
+	BitWriter(std::vector<unsigned char> &out) : vOut(out), uBits(0), iCount(0) {}
+
+	void Put(uint32_t uValue, int iBits)
+	{
+		this->uBits |= uValue << this->iCount;
+		this->iCount += iBits;
+		while (this->iCount >= 8) {
+			this->vOut.push_back((unsigned char)(this->uBits & 0xFF));
+			this->uBits >>= 8;
+			this->iCount -= 8;
+		}
+	}
+
+	// Huffman codes are stored from their most significant bit.
+	void PutCode(uint32_t uCode, int iBits)
+	{
+		uint32_t uReversed = 0;
+		for (int i = 0; i < iBits; i++) {
+			uReversed = (uReversed << 1) | ((uCode >> i) & 1);
+		}
+		this->Put(uReversed, iBits);
+	}
+
+	void Flush()
+	{
+		if (this->iCount > 0) {
+			this->vOut.push_back((unsigned char)(this->uBits & 0xFF));
+		}
+		this->uBits = 0;
+		this->iCount = 0;
+	}
+};
+
+
+/**
+ * Write a literal or length symbol with the fixed Huffman code.
+ */
+static void putSymbol(BitWriter &bits, int iSymbol)
+{
+	if (iSymbol < 144) {
+		bits.PutCode(0x30 + iSymbol, 8);
+	} else if (iSymbol < 256) {
+		bits.PutCode(0x190 + iSymbol - 144, 9);
+	} else if (iSymbol < 280) {
+		bits.PutCode(iSymbol - 256, 7);
+	} else {
+		bits.PutCode(0xC0 + iSymbol - 280, 8);
+	}
+
+}//end putSymbol()
+
+
+/**
+ * Write a match, as a length and a distance code with their extra bits.
+ */
+static void putMatch(BitWriter &bits, int iLength, int iDistance)
+{
+	int i = 28;
+	while (iLengthBase[i] > iLength) {
+		i--;
+	}
+	putSymbol(bits, 257 + i);
+	bits.Put(iLength - iLengthBase[i], iLengthExtra[i]);
+
+	int d = 29;
+	while (iDistBase[d] > iDistance) {
+		d--;
+	}
+	bits.PutCode(d, 5);
+	bits.Put(iDistance - iDistBase[d], iDistExtra[d]);
+
+}//end putMatch()
+
+
+/**
+ * Paeth predictor of the PNG specification.
+ */
+static int paeth(int a, int b, int c)
+{
+	int p = a + b - c;
+	int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+
+	if (pa <= pb && pa <= pc) {
+		return a;
+	}
+
+	return pb <= pc ? b : c;
+
+}//end paeth()
+
+
+/**
+ * Encode 8 bit pixels.
+ * \param pPixels   Rows from the top, without padding.
+ * \param iWidth    Width in pixels.
+ * \param iHeight   Height in pixels.
+ * \param iChannels 3 for RGB, 4 for RGBA.
+ * \param vOut      Gets the PNG file.
+ */
+void PngWriter::Encode(const unsigned char *pPixels, int iWidth, int iHeight, int iChannels, std::vector<unsigned char> &vOut)
+{
+	static const unsigned char signature[8] = {137, 'P', 'N', 'G', 13, 10, 26, 10};
+
+	vOut.assign(signature, signature + 8);
+
+	unsigned char header[13] = {
+		(unsigned char)(iWidth >> 24), (unsigned char)(iWidth >> 16), (unsigned char)(iWidth >> 8), (unsigned char)iWidth,
+		(unsigned char)(iHeight >> 24), (unsigned char)(iHeight >> 16), (unsigned char)(iHeight >> 8), (unsigned char)iHeight,
+		8,                              // Bit depth
+		(unsigned char)(iChannels == 4 ? 6 : 2), // Truecolour, with alpha or not
+		0, 0, 0                         // Deflate, adaptive filtering, no interlace
+	};
+	WriteChunk(vOut, "IHDR", header, sizeof(header));
+
+	std::vector<unsigned char> vFiltered, vCompressed;
+	FilterRows(pPixels, iWidth, iHeight, iChannels, vFiltered);
+	Deflate(vFiltered, vCompressed);
+	WriteChunk(vOut, "IDAT", vCompressed.empty() ? NULL : &vCompressed[0], vCompressed.size());
+
+	WriteChunk(vOut, "IEND", NULL, 0);
+
+}//end PngWriter::Encode()
+
+
+/**
+ * Encode pixels and write them to a file.
+ * \return False when the file can't be written.
+ */
+bool PngWriter::Save(const std::string &szPath, const unsigned char *pPixels, int iWidth, int iHeight, int iChannels)
+{
+	std::vector<unsigned char> vFile;
+	Encode(pPixels, iWidth, iHeight, iChannels, vFile);
+
+	std::ofstream out(szPath.c_str(), std::ios::binary);
+	if (!out) {
+		return false;
+	}
+
+	out.write((const char*)&vFile[0], vFile.size());
+
+	return out.good();
+
+}//end PngWriter::Save()
+
+
+/**
+ * Filter the rows, each prefixed with its filter type.
+ */
+void PngWriter::FilterRows(const unsigned char *pPixels, int iWidth, int iHeight, int iChannels, std::vector<unsigned char> &vOut)
+{
+	size_t uStride = (size_t)iWidth * iChannels;
+	std::vector<unsigned char> vZero(uStride, 0), vTrial[5];
+
+	vOut.clear();
+	vOut.reserve((uStride + 1) * iHeight);
+
+	for (int i = 0; i < 5; i++) {
+		vTrial[i].resize(uStride);
+	}
+
+	for (int y = 0; y < iHeight; y++) {
+		const unsigned char *pRow = pPixels + y * uStride;
+		const unsigned char *pUp = y > 0 ? pRow - uStride : &vZero[0];
+		int iBest = 0;
+		unsigned long uBestSum = 0;
+
+		for (int f = 0; f < 5; f++) {
+			unsigned long uSum = 0;
+			for (size_t x = 0; x < uStride; x++) {
+				int a = x >= (size_t)iChannels ? pRow[x - iChannels] : 0;
+				int b = pUp[x];
+				int c = x >= (size_t)iChannels ? pUp[x - iChannels] : 0;
+				int p = 0;
+				switch (f) {
+					case 1: p = a; break;
+					case 2: p = b; break;
+					case 3: p = (a + b) / 2; break;
+					case 4: p = paeth(a, b, c); break;
+				}
+				unsigned char v = (unsigned char)(pRow[x] - p);
+				vTrial[f][x] = v;
+				uSum += v < 128 ? v : 256 - v;
+			}
+			if (f == 0 || uSum < uBestSum) {
+				iBest = f;
+				uBestSum = uSum;
+			}
+		}
+
+		vOut.push_back((unsigned char)iBest);
+		vOut.insert(vOut.end(), vTrial[iBest].begin(), vTrial[iBest].end());
+	}
+
+}//end PngWriter::FilterRows()
+
+
+/**
+ * Compress into a zlib stream.
+ */
+void PngWriter::Deflate(const std::vector<unsigned char> &vIn, std::vector<unsigned char> &vOut)
+{
+	size_t n = vIn.size();
+	const unsigned char *pIn = n ? &vIn[0] : NULL;
+
+	vOut.clear();
+	vOut.reserve(n / 2 + 64);
+	vOut.push_back(0x78); // Deflate, 32 KB window
+	vOut.push_back(0x01); // No dictionary, fastest
+
+	BitWriter bits(vOut);
+	bits.Put(1, 1); // Last block
+	bits.Put(1, 2); // Fixed Huffman codes
+
+	std::vector<int> vHead(1 << DEFLATE_HASH_BITS, -1), vPrev(DEFLATE_WINDOW, -1);
+	size_t i = 0;
+
+	while (i < n) {
+		int iBestLength = 0, iBestDistance = 0;
+
+		if (i + DEFLATE_MIN_MATCH <= n) {
+			uint32_t h = ((pIn[i] << 10) ^ (pIn[i + 1] << 5) ^ pIn[i + 2]) & ((1 << DEFLATE_HASH_BITS) - 1);
+			int iMaxLength = (int)std::min<size_t>(DEFLATE_MAX_MATCH, n - i);
+			int iCandidate = vHead[h];
+
+			for (int iChain = 0; iCandidate >= 0 && i - iCandidate <= DEFLATE_WINDOW && iChain < DEFLATE_MAX_CHAIN; iChain++) {
+				int iLength = 0;
+				while (iLength < iMaxLength && pIn[iCandidate + iLength] == pIn[i + iLength]) {
+					iLength++;
+				}
+				if (iLength > iBestLength) {
+					iBestLength = iLength;
+					iBestDistance = (int)(i - iCandidate);
+					if (iLength == iMaxLength) {
+						break;
+					}
+				}
+				iCandidate = vPrev[iCandidate & (DEFLATE_WINDOW - 1)];
+			}
+		}
+
+		size_t uAdvance = 1;
+		if (iBestLength >= DEFLATE_MIN_MATCH) {
+			putMatch(bits, iBestLength, iBestDistance);
+			uAdvance = iBestLength;
+		} else {
+			putSymbol(bits, pIn[i]);
+		}
+
+		// Every position passed over goes in the hash chains
+		for (size_t uEnd = i + uAdvance; i < uEnd; i++) {
+			if (i + DEFLATE_MIN_MATCH <= n) {
+				uint32_t h = ((pIn[i] << 10) ^ (pIn[i + 1] << 5) ^ pIn[i + 2]) & ((1 << DEFLATE_HASH_BITS) - 1);
+				vPrev[i & (DEFLATE_WINDOW - 1)] = vHead[h];
+				vHead[h] = (int)i;
+			}
+		}
+	}
+
+	putSymbol(bits, 256); // End of block
+	bits.Flush();
+
+	// Adler-32 of the uncompressed data
+	uint32_t s1 = 1, s2 = 0;
+	for (size_t j = 0; j < n; j++) {
+		s1 = (s1 + pIn[j]) % 65521;
+		s2 = (s2 + s1) % 65521;
+	}
+	uint32_t uAdler = (s2 << 16) | s1;
+	vOut.push_back((unsigned char)(uAdler >> 24));
+	vOut.push_back((unsigned char)(uAdler >> 16));
+	vOut.push_back((unsigned char)(uAdler >> 8));
+	vOut.push_back((unsigned char)uAdler);
+
+}//end PngWriter::Deflate()
+
+
+/**
+ * Append a chunk, with its length and CRC.
+ */
+void PngWriter::WriteChunk(std::vector<unsigned char> &vOut, const char *szType, const unsigned char *pData, size_t uSize)
+{
+	uint32_t uLength = (uint32_t)uSize;
+	vOut.push_back((unsigned char)(uLength >> 24));
+	vOut.push_back((unsigned char)(uLength >> 16));
+	vOut.push_back((unsigned char)(uLength >> 8));
+	vOut.push_back((unsigned char)uLength);
+
+	size_t uStart = vOut.size();
+	vOut.insert(vOut.end(), szType, szType + 4);
+	if (uSize) {
+		vOut.insert(vOut.end(), pData, pData + uSize);
+	}
+
+	uint32_t uCrc = Crc32(0, &vOut[uStart], vOut.size() - uStart);
+	vOut.push_back((unsigned char)(uCrc >> 24));
+	vOut.push_back((unsigned char)(uCrc >> 16));
+	vOut.push_back((unsigned char)(uCrc >> 8));
+	vOut.push_back((unsigned char)uCrc);
+
+}//end PngWriter::WriteChunk()
+
+
+/**
+ * CRC-32 of the PNG specification, continued from uCrc.
+ */
+uint32_t PngWriter::Crc32(uint32_t uCrc, const unsigned char *pData, size_t uSize)
+{
+	uint32_t c = uCrc ^ 0xFFFFFFFFu;
+
+	for (size_t i = 0; i < uSize; i++) {
+		c = crcTable.v[(c ^ pData[i]) & 0xFF] ^ (c >> 8);
+	}
+
+	return c ^ 0xFFFFFFFFu;
+
+}//end PngWriter::Crc32()
@@ -0,0 +1,74 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#ifndef PNGWRITER_H
+#define PNGWRITER_H
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <stdint.h>
+
+
+/**
+ * Minimal PNG encoder, for exported textures and lightmaps.
+ *
+ * Each row gets the filter with the smallest sum of absolute differences,
+ * then everything is compressed as one fixed Huffman deflate block, with
+ * greedy LZ77 matching over a 32 KB window. Files are larger than zlib's,
+ * but it needs no dependency and is fast enough to run one per job.
+ * Thread safe, there is no shared state.
+ */
+class PngWriter
+{
+public:
+	/**
+	 * Encode 8 bit pixels.
+	 * \param pPixels   Rows from the top, without padding.
+	 * \param iWidth    Width in pixels.
+	 * \param iHeight   Height in pixels.
+	 * \param iChannels 3 for RGB, 4 for RGBA.
+	 * \param vOut      Gets the PNG file.
+	 */
+	static void Encode(const unsigned char *pPixels, int iWidth, int iHeight, int iChannels, std::vector<unsigned char> &vOut);
+
+	/**
+	 * Encode pixels and write them to a file.
+	 * \return False when the file can't be written.
+	 */
+	static bool Save(const std::string &szPath, const unsigned char *pPixels, int iWidth, int iHeight, int iChannels);
+
+private:
+	/** Filter the rows, each prefixed with its filter type. */
+	static void FilterRows(const unsigned char *pPixels, int iWidth, int iHeight, int iChannels, std::vector<unsigned char> &vOut);
+
+	/** Compress into a zlib stream. */
+	static void Deflate(const std::vector<unsigned char> &vIn, std::vector<unsigned char> &vOut);
+
+	/** Append a chunk, with its length and CRC. */
+	static void WriteChunk(std::vector<unsigned char> &vOut, const char *szType, const unsigned char *pData, size_t uSize);
+
+	/** CRC-32 of the PNG specification, continued from uCrc. */
+	static uint32_t Crc32(uint32_t uCrc, const unsigned char *pData, size_t uSize);
+
+};//end PngWriter
+
+#endif //PNGWRITER_H
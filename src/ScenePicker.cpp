@@ -0,0 +1,509 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#include "common.h"
+#include "bsp.h"
+#include "TextureRegistry.h"
+#include "TriangleBvh.h"
+#include "ScenePicker.h"
+#include <cfloat>
+#include <iomanip>
+
+// Random rays and point queries timed by Benchmark().
+#define BENCHMARK_RAYS   100000
+#define BENCHMARK_POINTS 10000
+// Top level traversal stack, the tree is balanced so this covers any map count.
+#define STACK_SIZE 64
+
+
+/**
+ * Render offset and world bounds of a map's triangles.
+ */
+static void PlaceMap(BSP *pMap, float fOffset[3], float fMins[3], float fMaxs[3])
+{
+	VERTEX o = pMap->GetRenderOffset();
+	pMap->GetBvh().GetBounds(fMins, fMaxs);
+
+	fOffset[0] = o.x;
+	fOffset[1] = o.y;
+	fOffset[2] = o.z;
+
+	for (int k = 0; k < 3; k++) {
+		fMins[k] += fOffset[k];
+		fMaxs[k] += fOffset[k];
+	}
+
+}//end PlaceMap()
+
+
+/**
+ * Small xorshift generator, so benchmarks cast the same rays every run.
+ */
+static float NextRandom(unsigned int &uState)
+{
+	uState ^= uState << 13;
+	uState ^= uState >> 17;
+	uState ^= uState << 5;
+
+	return (uState & 0xFFFFFF) / (float)0x1000000;
+
+}//end NextRandom()
+
+
+/** Orders entries by the centre of their bounds along one axis. */
+struct EntryCentreLess
+{
+	int iAxis;
+
+	template <class T>
+	bool operator()(const T &a, const T &b) const
+	{
+		return a.fMins[this->iAxis] + a.fMaxs[this->iAxis] < b.fMins[this->iAxis] + b.fMaxs[this->iAxis];
+	}
+};
+
+
+/**
+ * Constructor.
+ * \param vMaps The maps, indices into it are reported.
+ */
+ScenePicker::ScenePicker(const std::vector<BSP*> &vMaps) : m_vMaps(vMaps)
+{
+	this->m_iRebuilds = 0;
+	this->m_iRefits   = 0;
+
+}//end ScenePicker::ScenePicker()
+
+
+/**
+ * Follow maps loaded, unloaded, reloaded or moved since the last call.
+ * Must be called from the main thread, before any query.
+ */
+void ScenePicker::Update()
+{
+	bool bRebuild = this->m_vBuildIds.size() != this->m_vMaps.size();
+	this->m_vBuildIds.resize(this->m_vMaps.size(), 0);
+
+	for (size_t i = 0; i < this->m_vMaps.size(); i++) {
+		const BSP *pMap = this->m_vMaps[i];
+		unsigned int uBuildId = pMap->IsResident() && !pMap->GetBvh().IsEmpty() ? pMap->GetBvh().GetBuildId() : 0;
+
+		if (uBuildId != this->m_vBuildIds[i]) {
+			this->m_vBuildIds[i] = uBuildId;
+			bRebuild = true;
+		}
+	}
+
+	if (bRebuild) {
+		this->m_vEntries.clear();
+		this->m_vNodes.clear();
+
+		for (size_t i = 0; i < this->m_vMaps.size(); i++) {
+			if (this->m_vBuildIds[i] != 0) {
+				Entry e;
+				e.iMap = (int)i;
+				PlaceMap(this->m_vMaps[i], e.fOffset, e.fMins, e.fMaxs);
+				this->m_vEntries.push_back(e);
+			}
+		}
+
+		if (!this->m_vEntries.empty()) {
+			this->BuildNode(0, (int)this->m_vEntries.size());
+		}
+
+		this->m_iRebuilds++;
+		return;
+	}
+
+	// Same maps, only offsets may have moved.
+	bool bMoved = false;
+
+	for (size_t i = 0; i < this->m_vEntries.size(); i++) {
+		Entry &e = this->m_vEntries[i];
+		VERTEX o = this->m_vMaps[e.iMap]->GetRenderOffset();
+
+		if (o.x != e.fOffset[0] || o.y != e.fOffset[1] || o.z != e.fOffset[2]) {
+			PlaceMap(this->m_vMaps[e.iMap], e.fOffset, e.fMins, e.fMaxs);
+			bMoved = true;
+		}
+	}
+
+	if (bMoved) {
+		this->Refit();
+		this->m_iRefits++;
+	}
+
+}//end ScenePicker::Update()
+
+
+/**
+ * Append the subtree over m_vEntries[iFirst, iFirst + iCount), its root
+ * first. Entries are halved at the median along the longest axis.
+ */
+void ScenePicker::BuildNode(int iFirst, int iCount)
+{
+	Node node;
+
+	for (int k = 0; k < 3; k++) {
+		node.fMins[k] = FLT_MAX;
+		node.fMaxs[k] = -FLT_MAX;
+	}
+
+	for (int i = iFirst; i < iFirst + iCount; i++) {
+		for (int k = 0; k < 3; k++) {
+			node.fMins[k] = std::min(node.fMins[k], this->m_vEntries[i].fMins[k]);
+			node.fMaxs[k] = std::max(node.fMaxs[k], this->m_vEntries[i].fMaxs[k]);
+		}
+	}
+
+	node.iRightOrFirst = iFirst;
+	node.iCount        = iCount == 1 ? 1 : 0;
+
+	size_t uIndex = this->m_vNodes.size();
+	this->m_vNodes.push_back(node);
+
+	if (iCount == 1) {
+		return;
+	}
+
+	EntryCentreLess less = {0};
+
+	for (int k = 1; k < 3; k++) {
+		if (node.fMaxs[k] - node.fMins[k] > node.fMaxs[less.iAxis] - node.fMins[less.iAxis]) {
+			less.iAxis = k;
+		}
+	}
+
+	int iLeft = iCount / 2;
+	std::nth_element(this->m_vEntries.begin() + iFirst, this->m_vEntries.begin() + iFirst + iLeft, this->m_vEntries.begin() + iFirst + iCount, less);
+
+	this->BuildNode(iFirst, iLeft);
+	this->m_vNodes[uIndex].iRightOrFirst = (int)this->m_vNodes.size();
+	this->BuildNode(iFirst + iLeft, iCount - iLeft);
+
+}//end ScenePicker::BuildNode()
+
+
+/**
+ * Bounds of every node from the entries, without changing the tree.
+ * Children always come after their parent, so one backwards pass does it.
+ */
+void ScenePicker::Refit()
+{
+	for (size_t i = this->m_vNodes.size(); i-- > 0;) {
+		Node &n = this->m_vNodes[i];
+		const float *pMins[2], *pMaxs[2];
+
+		if (n.iCount != 0) {
+			pMins[0] = pMins[1] = this->m_vEntries[n.iRightOrFirst].fMins;
+			pMaxs[0] = pMaxs[1] = this->m_vEntries[n.iRightOrFirst].fMaxs;
+		} else {
+			pMins[0] = this->m_vNodes[i + 1].fMins;
+			pMaxs[0] = this->m_vNodes[i + 1].fMaxs;
+			pMins[1] = this->m_vNodes[n.iRightOrFirst].fMins;
+			pMaxs[1] = this->m_vNodes[n.iRightOrFirst].fMaxs;
+		}
+
+		for (int k = 0; k < 3; k++) {
+			n.fMins[k] = std::min(pMins[0][k], pMins[1][k]);
+			n.fMaxs[k] = std::max(pMaxs[0][k], pMaxs[1][k]);
+		}
+	}
+
+}//end ScenePicker::Refit()
+
+
+/**
+ * Find the closest triangle along a ray.
+ * \param fOrigin World position the ray starts at.
+ * \param fDir    Direction, normalized.
+ * \param result  Filled on a hit.
+ * \return True on a hit.
+ */
+bool ScenePicker::Raycast(const float fOrigin[3], const float fDir[3], PickResult &result) const
+{
+	float fInvDir[3];
+
+	for (int k = 0; k < 3; k++) {
+		fInvDir[k] = fDir[k] != 0.0f ? 1.0f / fDir[k] : (fDir[k] < 0.0f ? -1e30f : 1e30f);
+	}
+
+	result.iMap      = -1;
+	result.fDistance = FLT_MAX;
+	result.pTriangle = NULL;
+
+	int iStack[STACK_SIZE];
+	int iTop = 0;
+
+	if (!this->m_vNodes.empty()) {
+		iStack[iTop++] = 0;
+	}
+
+	while (iTop > 0) {
+		int iNode = iStack[--iTop];
+		const Node &n = this->m_vNodes[iNode];
+
+		if (TriangleBvh::BoxEntry(n.fMins, n.fMaxs, fOrigin, fInvDir, result.fDistance) == FLT_MAX) {
+			continue;
+		}
+
+		if (n.iCount == 0) {
+			iStack[iTop++] = n.iRightOrFirst;
+			iStack[iTop++] = iNode + 1;
+			continue;
+		}
+
+		// Into the map's own space, its BVH has no offsets.
+		const Entry &e = this->m_vEntries[n.iRightOrFirst];
+		float fLocal[3] = {fOrigin[0] - e.fOffset[0], fOrigin[1] - e.fOffset[1], fOrigin[2] - e.fOffset[2]};
+		BvhHit hit;
+
+		if (this->m_vMaps[e.iMap]->GetBvh().Raycast(fLocal, fDir, result.fDistance, hit)) {
+			result.iMap      = e.iMap;
+			result.fDistance = hit.fDistance;
+			result.pTriangle = hit.pTriangle;
+		}
+	}
+
+	for (int k = 0; k < 3; k++) {
+		result.fPoint[k] = fOrigin[k] + fDir[k] * result.fDistance;
+	}
+
+	return result.iMap >= 0;
+
+}//end ScenePicker::Raycast()
+
+
+/**
+ * Entries whose bounds hold a point.
+ */
+void ScenePicker::Query(const float fPoint[3], std::vector<int> &vEntries) const
+{
+	int iStack[STACK_SIZE];
+	int iTop = 0;
+
+	if (!this->m_vNodes.empty()) {
+		iStack[iTop++] = 0;
+	}
+
+	while (iTop > 0) {
+		int iNode = iStack[--iTop];
+		const Node &n = this->m_vNodes[iNode];
+
+		bool bInside = true;
+
+		for (int k = 0; k < 3; k++) {
+			bInside = bInside && fPoint[k] >= n.fMins[k] && fPoint[k] <= n.fMaxs[k];
+		}
+
+		if (!bInside) {
+			continue;
+		}
+
+		if (n.iCount != 0) {
+			vEntries.push_back(n.iRightOrFirst);
+		} else {
+			iStack[iTop++] = n.iRightOrFirst;
+			iStack[iTop++] = iNode + 1;
+		}
+	}
+
+}//end ScenePicker::Query()
+
+
+/**
+ * Find the map a point is in: among the maps whose bounds hold it, the
+ * one whose faces enclose it from the most of the six axis directions,
+ * then the smallest.
+ * \return Index into the maps, -1 when outside every map.
+ */
+int ScenePicker::Locate(const float fPoint[3]) const
+{
+	static const float fAxes[6][3] = {{1, 0, 0}, {-1, 0, 0}, {0, 1, 0}, {0, -1, 0}, {0, 0, 1}, {0, 0, -1}};
+
+	std::vector<int> vCandidates;
+	this->Query(fPoint, vCandidates);
+
+	int   iBest = -1, iBestSides = -1;
+	float fBestVolume = FLT_MAX;
+
+	for (size_t i = 0; i < vCandidates.size(); i++) {
+		const Entry &e = this->m_vEntries[vCandidates[i]];
+		const TriangleBvh &bvh = this->m_vMaps[e.iMap]->GetBvh();
+		float fLocal[3] = {fPoint[0] - e.fOffset[0], fPoint[1] - e.fOffset[1], fPoint[2] - e.fOffset[2]};
+		int   iSides = 0;
+
+		for (int a = 0; a < 6; a++) {
+			BvhHit hit;
+
+			if (bvh.Raycast(fLocal, fAxes[a], FLT_MAX, hit)) {
+				iSides++;
+			}
+		}
+
+		float fVolume = (e.fMaxs[0] - e.fMins[0]) * (e.fMaxs[1] - e.fMins[1]) * (e.fMaxs[2] - e.fMins[2]);
+
+		if (iSides > iBestSides || (iSides == iBestSides && fVolume < fBestVolume)) {
+			iBest       = e.iMap;
+			iBestSides  = iSides;
+			fBestVolume = fVolume;
+		}
+	}
+
+	return iBest;
+
+}//end ScenePicker::Locate()
+
+
+/**
+ * Print what is under the crosshair and which map the camera is in.
+ */
+void ScenePicker::PrintPick(const float fOrigin[3], const float fDir[3], std::ostream &out)
+{
+	this->Update();
+
+	Uint64 uStart = SDL_GetPerformanceCounter();
+	PickResult result;
+	bool bHit = this->Raycast(fOrigin, fDir, result);
+	double fPickUs = (SDL_GetPerformanceCounter() - uStart) * 1000000.0 / SDL_GetPerformanceFrequency();
+
+	uStart = SDL_GetPerformanceCounter();
+	int iMapIn = this->Locate(fOrigin);
+	double fLocateUs = (SDL_GetPerformanceCounter() - uStart) * 1000000.0 / SDL_GetPerformanceFrequency();
+
+	std::streamsize iPrecision = out.precision();
+	out << std::fixed << std::setprecision(1);
+
+	if (bHit) {
+		BSP *pMap = this->m_vMaps[result.iMap];
+		std::string szTexture;
+		{
+			std::lock_guard<std::mutex> lock(texturesMutex);
+			szTexture = g_textures.GetName(result.pTriangle->iTexture);
+		}
+
+		out << "Pick: " << pMap->GetMapId() << " face " << result.pTriangle->iFace << ", texture " << szTexture << ", " << pMap->GetModelEntity(result.pTriangle->iModel);
+		out << ", " << result.fDistance << " units away at (" << result.fPoint[0] << " " << result.fPoint[1] << " " << result.fPoint[2] << "), " << fPickUs << " us." << std::endl;
+	} else {
+		out << "Pick: nothing under the crosshair, " << fPickUs << " us." << std::endl;
+	}
+
+	if (iMapIn >= 0) {
+		out << "Camera in: " << this->m_vMaps[iMapIn]->GetMapId() << ", " << fLocateUs << " us." << std::endl;
+	} else {
+		out << "Camera in: no loaded map, " << fLocateUs << " us." << std::endl;
+	}
+
+	out.unsetf(std::ios_base::floatfield);
+	out.precision(iPrecision);
+
+}//end ScenePicker::PrintPick()
+
+
+/**
+ * Time building every map's BVH again, rebuilding and refitting the top
+ * level, and random ray casts and point queries inside the scene bounds.
+ */
+void ScenePicker::Benchmark(std::ostream &out)
+{
+	this->Update();
+
+	if (this->m_vEntries.empty()) {
+		out << "Picking benchmark: no maps with a BVH are loaded." << std::endl;
+		return;
+	}
+
+	double fFreq = (double)SDL_GetPerformanceFrequency();
+
+	// Map BVHs, as the loader threads build them.
+	Uint64 uStart    = SDL_GetPerformanceCounter();
+	size_t uTriangles = 0;
+
+	for (size_t i = 0; i < this->m_vEntries.size(); i++) {
+		TriangleBvh &bvh = this->m_vMaps[this->m_vEntries[i].iMap]->GetBvh();
+		bvh.Rebuild();
+		uTriangles += bvh.GetTriangleCount();
+	}
+
+	double fBuildMs = (SDL_GetPerformanceCounter() - uStart) * 1000.0 / fFreq;
+
+	// Every build id changed, so this rebuilds the top level.
+	uStart = SDL_GetPerformanceCounter();
+	this->Update();
+	double fTopUs = (SDL_GetPerformanceCounter() - uStart) * 1000000.0 / fFreq;
+
+	uStart = SDL_GetPerformanceCounter();
+	this->Refit();
+	double fRefitUs = (SDL_GetPerformanceCounter() - uStart) * 1000000.0 / fFreq;
+
+	const Node &root = this->m_vNodes[0];
+	unsigned int uState = 2463534242u;
+	int iHits = 0;
+
+	uStart = SDL_GetPerformanceCounter();
+
+	for (int i = 0; i < BENCHMARK_RAYS; i++) {
+		float fOrigin[3], fDir[3], fLength = 0.0f;
+
+		for (int k = 0; k < 3; k++) {
+			fOrigin[k] = root.fMins[k] + NextRandom(uState) * (root.fMaxs[k] - root.fMins[k]);
+			fDir[k]    = NextRandom(uState) * 2.0f - 1.0f;
+			fLength   += fDir[k] * fDir[k];
+		}
+
+		fLength = sqrt(fLength);
+
+		for (int k = 0; k < 3; k++) {
+			fDir[k] = fLength > 0.0f ? fDir[k] / fLength : (k == 0 ? 1.0f : 0.0f);
+		}
+
+		PickResult result;
+		iHits += this->Raycast(fOrigin, fDir, result) ? 1 : 0;
+	}
+
+	double fRayMs = (SDL_GetPerformanceCounter() - uStart) * 1000.0 / fFreq;
+
+	uStart = SDL_GetPerformanceCounter();
+
+	for (int i = 0; i < BENCHMARK_POINTS; i++) {
+		float fPoint[3];
+
+		for (int k = 0; k < 3; k++) {
+			fPoint[k] = root.fMins[k] + NextRandom(uState) * (root.fMaxs[k] - root.fMins[k]);
+		}
+
+		this->Locate(fPoint);
+	}
+
+	double fPointMs = (SDL_GetPerformanceCounter() - uStart) * 1000.0 / fFreq;
+
+	std::streamsize iPrecision = out.precision();
+	out << std::fixed << std::setprecision(2);
+	out << "Picking benchmark: " << uTriangles << " triangles in " << this->m_vEntries.size() << " maps built in " << fBuildMs << " ms";
+	out << " (" << (fBuildMs > 0.0 ? uTriangles / fBuildMs / 1000.0 : 0.0) << " M/s), top level built in " << fTopUs << " us, refit in " << fRefitUs << " us." << std::endl;
+	out << "  " << BENCHMARK_RAYS << " rays in " << fRayMs << " ms (" << (fRayMs > 0.0 ? BENCHMARK_RAYS / fRayMs / 1000.0 : 0.0) << " M/s, ";
+	out << fRayMs * 1000.0 / BENCHMARK_RAYS << " us each, " << iHits * 100 / BENCHMARK_RAYS << "% hit)." << std::endl;
+	out << "  " << BENCHMARK_POINTS << " point queries in " << fPointMs << " ms (" << fPointMs * 1000.0 / BENCHMARK_POINTS << " us each)." << std::endl;
+	out << "  Top level rebuilt " << this->m_iRebuilds << " times, refit " << this->m_iRefits << " times." << std::endl;
+	out.unsetf(std::ios_base::floatfield);
+	out.precision(iPrecision);
+
+}//end ScenePicker::Benchmark()
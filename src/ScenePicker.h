@@ -0,0 +1,120 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#ifndef SCENEPICKER_H
+#define SCENEPICKER_H
+
+#include <vector>
+#include <ostream>
+#include <cstddef>
+
+class BSP;
+struct BvhTriangle;
+
+
+/** Closest triangle along a ray, over every map. */
+struct PickResult
+{
+	int                iMap;      /** Index into the maps. */
+	float              fDistance; /** Along the ray, with a normalized direction. */
+	float              fPoint[3]; /** World position hit. */
+	const BvhTriangle *pTriangle; /** Triangle hit, without its map's offset. */
+};
+
+
+/**
+ * Ray casts and point queries over every resident map.
+ *
+ * Two levels: each map keeps a TriangleBvh of its own triangles without
+ * offsets, built on the loader thread, and this keeps a small BVH over
+ * the maps' world bounds. Moving a map only refits the top level. Maps
+ * coming or going rebuild it, which is cheap for a few hundred maps.
+ */
+class ScenePicker
+{
+public:
+	/**
+	 * Constructor
+	 * \param vMaps The maps, indices into it are reported.
+	 */
+	ScenePicker(const std::vector<BSP*> &vMaps);
+
+	/** Follow maps loaded, unloaded, reloaded or moved since the last call. */
+	void Update();
+
+	/**
+	 * Find the closest triangle along a ray.
+	 * \param fOrigin World position the ray starts at.
+	 * \param fDir    Direction, normalized.
+	 * \param result  Filled on a hit.
+	 * \return True on a hit.
+	 */
+	bool Raycast(const float fOrigin[3], const float fDir[3], PickResult &result) const;
+
+	/**
+	 * Find the map a point is in: among the maps whose bounds hold it, the
+	 * one whose faces enclose it from the most sides, then the smallest.
+	 * \return Index into the maps, -1 when outside every map.
+	 */
+	int Locate(const float fPoint[3]) const;
+
+	/** Print what is under the crosshair and which map the camera is in. */
+	void PrintPick(const float fOrigin[3], const float fDir[3], std::ostream &out);
+
+	/** Time building every map's BVH again, and random ray casts and point queries. */
+	void Benchmark(std::ostream &out);
+
+private:
+	struct Entry
+	{
+		int   iMap;       /** Index into the maps. */
+		float fOffset[3]; /** Render offset of the map. */
+		float fMins[3];   /** World bounds of its triangles. */
+		float fMaxs[3];
+	};
+
+	struct Node
+	{
+		float fMins[3];
+		int   iRightOrFirst; /** Right child of an inner node, entry of a leaf. */
+		float fMaxs[3];
+		int   iCount;        /** 1 for leaves, 0 for inner nodes. */
+	};
+
+	/** Append the subtree over m_vEntries[iFirst, iFirst + iCount), its root first. */
+	void BuildNode(int iFirst, int iCount);
+
+	/** Bounds of every node from the entries, without changing the tree. */
+	void Refit();
+
+	/** Entries whose bounds hold a point. */
+	void Query(const float fPoint[3], std::vector<int> &vEntries) const;
+
+	const std::vector<BSP*>  &m_vMaps;     /** The maps. */
+	std::vector<unsigned int> m_vBuildIds; /** BVH build of each map in the tree, 0 when not in it. */
+	std::vector<Entry>        m_vEntries;  /** Maps in the tree, in leaf order. */
+	std::vector<Node>         m_vNodes;    /** Depth first, the root first. */
+	int                       m_iRebuilds; /** Top level rebuilds. */
+	int                       m_iRefits;   /** Top level refits. */
+
+};//end ScenePicker
+
+#endif //SCENEPICKER_H
@@ -0,0 +1,179 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#include "ScratchArena.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+
+// Smallest block, and the alignment of every allocation.
+#define SCRATCH_BLOCK_SIZE (1024*1024)
+#define SCRATCH_ALIGNMENT  16
+
+// Peak kept by a reset, arenas that needed more give the rest back.
+#define SCRATCH_KEEP_MAX   (64*1024*1024)
+
+std::mutex                               ScratchArena::s_mutex;
+std::map<std::thread::id, ScratchArena*> ScratchArena::s_mArenas;
+
+
+/**
+ * Constructor, nothing is allocated until first used.
+ */
+ScratchArena::ScratchArena()
+{
+	this->m_uOffset      = 0;
+	this->m_uUsed        = 0;
+	this->m_uLoads       = 0;
+	this->m_uAllocations = 0;
+	this->m_uHeapBlocks  = 0;
+	this->m_uPeak        = 0;
+	this->m_uHeld        = 0;
+
+}//end ScratchArena::ScratchArena()
+
+
+/**
+ * Destructor
+ */
+ScratchArena::~ScratchArena()
+{
+	for (size_t i = 0; i < this->m_vBlocks.size(); i++) {
+		free(this->m_vBlocks[i].pData);
+	}
+
+}//end ScratchArena::~ScratchArena()
+
+
+/**
+ * Arena of the calling thread, created on first use. Arenas live until
+ * exit, there are only as many as threads that load.
+ */
+ScratchArena &ScratchArena::ForThread()
+{
+	std::lock_guard<std::mutex> lock(s_mutex);
+
+	ScratchArena *&pArena = s_mArenas[std::this_thread::get_id()];
+	if (pArena == NULL) {
+		pArena = new ScratchArena();
+	}
+
+	return *pArena;
+
+}//end ScratchArena::ForThread()
+
+
+/**
+ * Uninitialised memory, aligned for any plain type.
+ * \param uBytes Size, may be 0.
+ */
+void *ScratchArena::Allocate(size_t uBytes)
+{
+	uBytes = (uBytes + SCRATCH_ALIGNMENT - 1) & ~(size_t)(SCRATCH_ALIGNMENT - 1);
+
+	if (this->m_vBlocks.empty() || this->m_uOffset + uBytes > this->m_vBlocks.back().uSize) {
+		this->Grow(uBytes);
+	}
+
+	void *p = this->m_vBlocks.back().pData + this->m_uOffset;
+	this->m_uOffset += uBytes;
+	this->m_uUsed   += uBytes;
+	this->m_uAllocations++;
+	if (this->m_uUsed > this->m_uPeak) {
+		this->m_uPeak = this->m_uUsed;
+	}
+
+	return p;
+
+}//end ScratchArena::Allocate()
+
+
+/**
+ * Forget every allocation, at the start of a load.
+ */
+void ScratchArena::Reset()
+{
+	// Several blocks become one of the whole peak, so the next load fits in it
+	if (this->m_vBlocks.size() > 1) {
+		for (size_t i = 0; i < this->m_vBlocks.size(); i++) {
+			free(this->m_vBlocks[i].pData);
+		}
+		this->m_vBlocks.clear();
+		this->m_uHeld = 0;
+		this->Grow(std::min<size_t>(this->m_uPeak, SCRATCH_KEEP_MAX));
+	} else if (!this->m_vBlocks.empty() && this->m_vBlocks[0].uSize > SCRATCH_KEEP_MAX) {
+		free(this->m_vBlocks[0].pData);
+		this->m_vBlocks.clear();
+		this->m_uHeld = 0;
+	}
+
+	this->m_uOffset = 0;
+	this->m_uUsed   = 0;
+	this->m_uLoads++;
+
+}//end ScratchArena::Reset()
+
+
+/**
+ * Add a block of at least uBytes.
+ */
+void ScratchArena::Grow(size_t uBytes)
+{
+	Block b;
+	b.uSize = std::max<size_t>(uBytes, SCRATCH_BLOCK_SIZE);
+	b.pData = (unsigned char*)malloc(b.uSize);
+	if (b.pData == NULL) {
+		throw std::bad_alloc();
+	}
+
+	this->m_vBlocks.push_back(b);
+	this->m_uOffset = 0;
+	this->m_uHeapBlocks++;
+	this->m_uHeld += b.uSize;
+
+}//end ScratchArena::Grow()
+
+
+/**
+ * Print loads, allocations and peak sizes over the arenas of every thread.
+ */
+void ScratchArena::PrintStats(std::ostream &out)
+{
+	size_t uLoads = 0, uAllocations = 0, uHeapBlocks = 0, uPeak = 0, uHeld = 0, uThreads = 0;
+	{
+		std::lock_guard<std::mutex> lock(s_mutex);
+		uThreads = s_mArenas.size();
+
+		for (std::map<std::thread::id, ScratchArena*>::const_iterator it = s_mArenas.begin(); it != s_mArenas.end(); it++) {
+			const ScratchArena *pArena = it->second;
+			uLoads       += pArena->m_uLoads;
+			uAllocations += pArena->m_uAllocations;
+			uHeapBlocks  += pArena->m_uHeapBlocks;
+			uPeak         = std::max<size_t>(uPeak, pArena->m_uPeak);
+			uHeld        += pArena->m_uHeld;
+		}
+	}
+
+	out << "Scratch memory: " << uLoads << " loads, " << uAllocations << " allocations from " << uHeapBlocks << " heap blocks, ";
+	out << "peak " << uPeak / 1024 << " KB per load, " << uHeld / 1024 << " KB held by " << uThreads << " threads." << std::endl;
+
+}//end ScratchArena::PrintStats()
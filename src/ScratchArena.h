@@ -0,0 +1,112 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#ifndef SCRATCHARENA_H
+#define SCRATCHARENA_H
+
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <map>
+#include <ostream>
+#include <cstddef>
+#include <cstring>
+
+
+/**
+ * Linear allocator for the transient buffers of one load.
+ *
+ * Each thread that loads maps or WADs gets its own arena, and resets it at
+ * the start of every load. Allocations bump an offset into the current
+ * block, nothing is freed on its own. When a load needs more than one
+ * block, the reset replaces them with a single block of the whole peak, so
+ * later loads of a similar size run without touching the heap at all.
+ *
+ * Only for plain data: constructors and destructors are not run. Memory
+ * handed out is valid until the next Reset() of the same arena.
+ */
+class ScratchArena
+{
+public:
+	/** Constructor, nothing is allocated until first used. */
+	ScratchArena();
+
+	/** Destructor */
+	~ScratchArena();
+
+	/** Arena of the calling thread, created on first use. */
+	static ScratchArena &ForThread();
+
+	/**
+	 * Uninitialised memory, aligned for any plain type.
+	 * \param uBytes Size, may be 0.
+	 */
+	void *Allocate(size_t uBytes);
+
+	/** Uninitialised array of a plain type. */
+	template <typename T>
+	T *Allocate(size_t uCount) { return static_cast<T*>(this->Allocate(uCount * sizeof(T))); }
+
+	/** Zeroed array of a plain type. */
+	template <typename T>
+	T *AllocateZeroed(size_t uCount)
+	{
+		T *p = this->Allocate<T>(uCount);
+		memset(p, 0, uCount * sizeof(T));
+		return p;
+	}
+
+	/** Forget every allocation, at the start of a load. */
+	void Reset();
+
+	/** Print loads, allocations and peak sizes over the arenas of every thread. */
+	static void PrintStats(std::ostream &out);
+
+private:
+	ScratchArena(const ScratchArena &);
+	ScratchArena &operator=(const ScratchArena &);
+
+	struct Block
+	{
+		unsigned char *pData; /** Start of the memory. */
+		size_t         uSize; /** Size of the memory. */
+	};
+
+	/** Add a block of at least uBytes. */
+	void Grow(size_t uBytes);
+
+	std::vector<Block>  m_vBlocks;      /** Blocks of the current load, the last one is being filled. */
+	size_t              m_uOffset;      /** Used part of the last block. */
+	size_t              m_uUsed;        /** Bytes handed out since the last reset. */
+	// Statistics, written by the owning thread and read by PrintStats() from any.
+	std::atomic<size_t> m_uLoads;       /** Resets. */
+	std::atomic<size_t> m_uAllocations; /** Allocate() calls. */
+	std::atomic<size_t> m_uHeapBlocks;  /** Blocks taken from the heap. */
+	std::atomic<size_t> m_uPeak;        /** Most bytes handed out between two resets. */
+	std::atomic<size_t> m_uHeld;        /** Bytes of m_vBlocks. */
+
+	static std::mutex                                 s_mutex;  /** Guards s_mArenas. */
+	static std::map<std::thread::id, ScratchArena*>   s_mArenas; /** Arena of each thread. */
+
+};//end ScratchArena
+
+#endif //SCRATCHARENA_H
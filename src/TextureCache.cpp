@@ -0,0 +1,397 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <stdint.h>
+#include "TextureCache.h"
+
+#if defined(_MSC_VER) || defined(__MINGW32__)
+	#include <direct.h>
+#else
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+	#define TEXTURECACHE_MMAP
+#endif
+
+TextureCache g_textureCache;
+
+// Layout of the start of every cache file, followed by each level's RGBA pixels.
+struct TextureCacheHeader
+{
+	char          szMagic[4]; // HMTC
+	uint32_t      uVersion;   // TEXTURECACHE_VERSION
+	uint32_t      uWidth;     // Width of level 0
+	uint32_t      uHeight;    // Height of level 0
+	uint32_t      uLevels;    // Number of levels
+	unsigned char avg[4];     // Average opaque colour, and padding
+};
+
+#define TEXTURECACHE_VERSION 1
+
+
+/**
+ * Constructor.
+ */
+CachedTexture::CachedTexture()
+{
+	this->m_pData    = NULL;
+	this->m_pMapping = NULL;
+	this->m_uSize    = 0;
+
+}//end CachedTexture::CachedTexture()
+
+
+/**
+ * Destructor, unmaps the file.
+ */
+CachedTexture::~CachedTexture()
+{
+	this->Release();
+
+}//end CachedTexture::~CachedTexture()
+
+
+/**
+ * Unmap or free the current file.
+ */
+void CachedTexture::Release()
+{
+#ifdef TEXTURECACHE_MMAP
+	if (this->m_pMapping != NULL) {
+		munmap(this->m_pMapping, this->m_uSize);
+	}
+#endif
+
+	this->m_vData.clear();
+	this->m_pData    = NULL;
+	this->m_pMapping = NULL;
+	this->m_uSize    = 0;
+
+}//end CachedTexture::Release()
+
+
+/**
+ * Width of level 0.
+ */
+int CachedTexture::GetWidth() const
+{
+	return (int)((const TextureCacheHeader*)this->m_pData)->uWidth;
+
+}//end CachedTexture::GetWidth()
+
+
+/**
+ * Height of level 0.
+ */
+int CachedTexture::GetHeight() const
+{
+	return (int)((const TextureCacheHeader*)this->m_pData)->uHeight;
+
+}//end CachedTexture::GetHeight()
+
+
+/**
+ * Number of levels stored.
+ */
+int CachedTexture::GetLevels() const
+{
+	return (int)((const TextureCacheHeader*)this->m_pData)->uLevels;
+
+}//end CachedTexture::GetLevels()
+
+
+/**
+ * Average opaque colour (RGB).
+ */
+const unsigned char *CachedTexture::GetAverage() const
+{
+	return ((const TextureCacheHeader*)this->m_pData)->avg;
+
+}//end CachedTexture::GetAverage()
+
+
+/**
+ * RGBA pixels of a level.
+ */
+const unsigned char *CachedTexture::GetMip(int iLevel) const
+{
+	const unsigned char *p = this->m_pData + sizeof(TextureCacheHeader);
+
+	for (int i = 0; i < iLevel; i++) {
+		p += (size_t)(this->GetWidth() >> i) * (this->GetHeight() >> i) * 4;
+	}
+
+	return p;
+
+}//end CachedTexture::GetMip()
+
+
+/**
+ * Constructor.
+ */
+TextureCache::TextureCache()
+{
+	this->m_iHits     = 0;
+	this->m_iMisses   = 0;
+	this->m_iStored   = 0;
+	this->m_uHitBytes = 0;
+
+}//end TextureCache::TextureCache()
+
+
+/**
+ * Set the cache directory, creating it if needed.
+ * \param szDir Directory, empty to disable the cache.
+ */
+void TextureCache::SetDirectory(const std::string &szDir)
+{
+	{
+		std::lock_guard<std::mutex> lock(this->m_mutex);
+		this->m_szDir = szDir;
+	}
+
+	if (szDir.empty()) {
+		return;
+	}
+
+#if defined(_MSC_VER) || defined(__MINGW32__)
+	_mkdir(szDir.c_str());
+#else
+	mkdir(szDir.c_str(), 0755);
+#endif
+
+}//end TextureCache::SetDirectory()
+
+
+/**
+ * Check if the cache is in use.
+ */
+bool TextureCache::IsEnabled() const
+{
+	std::lock_guard<std::mutex> lock(this->m_mutex);
+	return !this->m_szDir.empty();
+
+}//end TextureCache::IsEnabled()
+
+
+/**
+ * 64 bit FNV-1a hash of a block of bytes.
+ */
+unsigned long long TextureCache::Hash(const unsigned char *pData, size_t uSize)
+{
+	unsigned long long uHash = 14695981039346656037ULL;
+
+	for (size_t i = 0; i < uSize; i++) {
+		uHash ^= pData[i];
+		uHash *= 1099511628211ULL;
+	}
+
+	return uHash;
+
+}//end TextureCache::Hash()
+
+
+/**
+ * Path of the file for a hash, empty when the cache is disabled.
+ */
+std::string TextureCache::GetPath(unsigned long long uHash) const
+{
+	std::string szDir;
+	{
+		std::lock_guard<std::mutex> lock(this->m_mutex);
+		szDir = this->m_szDir;
+	}
+
+	if (szDir.empty()) {
+		return "";
+	}
+
+	std::ostringstream path;
+	path << szDir << "/" << std::hex << std::setw(16) << std::setfill('0') << uHash << ".tex";
+	return path.str();
+
+}//end TextureCache::GetPath()
+
+
+/**
+ * Look a texture up.
+ * \param uHash Hash of the source bytes.
+ * \param tex   Filled on a hit.
+ * \return True on a hit.
+ */
+bool TextureCache::Load(unsigned long long uHash, CachedTexture &tex)
+{
+	tex.Release();
+	std::string szPath = this->GetPath(uHash);
+
+	if (szPath.empty()) {
+		return false;
+	}
+
+#ifdef TEXTURECACHE_MMAP
+	int fd = open(szPath.c_str(), O_RDONLY);
+
+	if (fd != -1) {
+		struct stat st;
+
+		if (fstat(fd, &st) == 0 && st.st_size > 0) {
+			void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+			if (p != MAP_FAILED) {
+				tex.m_pMapping = p;
+				tex.m_pData    = (const unsigned char*)p;
+				tex.m_uSize    = st.st_size;
+			}
+		}
+
+		close(fd);
+	}
+#else
+	std::ifstream in(szPath.c_str(), std::ios::binary);
+
+	if (in.is_open()) {
+		in.seekg(0, std::ios::end);
+		tex.m_vData.resize((size_t)in.tellg());
+		in.seekg(0, std::ios::beg);
+
+		if (!tex.m_vData.empty() && in.read((char*)&tex.m_vData[0], tex.m_vData.size())) {
+			tex.m_pData = &tex.m_vData[0];
+			tex.m_uSize = tex.m_vData.size();
+		}
+	}
+#endif
+
+	// Check the file is complete before trusting it.
+	bool bValid = tex.m_pData != NULL && tex.m_uSize >= sizeof(TextureCacheHeader);
+
+	if (bValid) {
+		const TextureCacheHeader *h = (const TextureCacheHeader*)tex.m_pData;
+		size_t uExpected = sizeof(TextureCacheHeader);
+
+		for (uint32_t i = 0; i < h->uLevels && i < 16; i++) {
+			uExpected += (size_t)(h->uWidth >> i) * (h->uHeight >> i) * 4;
+		}
+
+		bValid = memcmp(h->szMagic, "HMTC", 4) == 0 && h->uVersion == TEXTURECACHE_VERSION && h->uLevels < 16 && tex.m_uSize >= uExpected;
+	}
+
+	std::lock_guard<std::mutex> lock(this->m_mutex);
+
+	if (!bValid) {
+		tex.Release();
+		this->m_iMisses++;
+		return false;
+	}
+
+	this->m_iHits++;
+	this->m_uHitBytes += tex.m_uSize - sizeof(TextureCacheHeader);
+	return true;
+
+}//end TextureCache::Load()
+
+
+/**
+ * Store a decoded texture.
+ * \param uHash   Hash of the source bytes.
+ * \param iWidth  Width of level 0.
+ * \param iHeight Height of level 0.
+ * \param pMips   RGBA pixels of each level, one after the other.
+ * \param iLevels Number of levels.
+ * \param avg     Average opaque colour (RGB).
+ */
+void TextureCache::Store(unsigned long long uHash, int iWidth, int iHeight, const unsigned char *pMips, int iLevels, const unsigned char avg[3])
+{
+	std::string szPath = this->GetPath(uHash);
+
+	if (szPath.empty()) {
+		return;
+	}
+
+	TextureCacheHeader h;
+	memcpy(h.szMagic, "HMTC", 4);
+	h.uVersion = TEXTURECACHE_VERSION;
+	h.uWidth   = iWidth;
+	h.uHeight  = iHeight;
+	h.uLevels  = iLevels;
+	h.avg[0]   = avg[0];
+	h.avg[1]   = avg[1];
+	h.avg[2]   = avg[2];
+	h.avg[3]   = 0;
+
+	// Written under the lock to a temporary name, so no thread ever maps a
+	// half written file.
+	std::lock_guard<std::mutex> lock(this->m_mutex);
+	std::string szTemp = szPath + ".tmp";
+	std::ofstream out(szTemp.c_str(), std::ios::binary);
+
+	if (!out.is_open()) {
+		return;
+	}
+
+	out.write((const char*)&h, sizeof(h));
+
+	// The file holds the levels laid out the same way.
+	size_t uBytes = 0;
+
+	for (int i = 0; i < iLevels; i++) {
+		uBytes += (size_t)(iWidth >> i) * (iHeight >> i) * 4;
+	}
+
+	out.write((const char*)pMips, uBytes);
+
+	out.close();
+
+#if defined(_WIN32)
+	// rename() doesn't replace an existing file there. Readers finding
+	// neither file in between just miss.
+	std::remove(szPath.c_str());
+#endif
+
+	if (!out || std::rename(szTemp.c_str(), szPath.c_str()) != 0) {
+		std::remove(szTemp.c_str());
+		return;
+	}
+
+	this->m_iStored++;
+
+}//end TextureCache::Store()
+
+
+/**
+ * Print hit and miss counts.
+ */
+void TextureCache::PrintStats(std::ostream &out) const
+{
+	if (!this->IsEnabled()) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(this->m_mutex);
+	out << "Texture cache: " << this->m_iHits << " hits (" << this->m_uHitBytes / 1024 << " KB), "
+	    << this->m_iMisses << " misses, " << this->m_iStored << " stored." << std::endl;
+
+}//end TextureCache::PrintStats()
@@ -0,0 +1,141 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#ifndef TEXTURECACHE_H
+#define TEXTURECACHE_H
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <ostream>
+#include <cstddef>
+
+
+/**
+ * A decoded texture read back from the cache. The file is memory mapped
+ * where possible, so levels can be uploaded straight from it.
+ */
+class CachedTexture
+{
+public:
+	/** Constructor */
+	CachedTexture();
+
+	/** Destructor, unmaps the file. */
+	~CachedTexture();
+
+	/** Width of level 0. */
+	int GetWidth() const;
+
+	/** Height of level 0. */
+	int GetHeight() const;
+
+	/** Number of levels stored. */
+	int GetLevels() const;
+
+	/** Average opaque colour (RGB). */
+	const unsigned char *GetAverage() const;
+
+	/** RGBA pixels of a level. */
+	const unsigned char *GetMip(int iLevel) const;
+
+private:
+	friend class TextureCache;
+
+	/** Unmap or free the current file. */
+	void Release();
+
+	CachedTexture(const CachedTexture &);
+	CachedTexture &operator=(const CachedTexture &);
+
+	const unsigned char       *m_pData;    /** Start of the file. */
+	void                      *m_pMapping; /** Mapping to release, NULL when read into m_vData. */
+	size_t                     m_uSize;    /** Size of the file. */
+	std::vector<unsigned char> m_vData;    /** File contents where mapping isn't available. */
+
+};//end CachedTexture
+
+
+/**
+ * Content addressed cache of decoded textures.
+ *
+ * Every WAD entry or embedded BSPMIPTEX is hashed as raw bytes, and the
+ * RGBA mip chain decoded from it is stored in <dir>/<hash>.tex. The file is
+ * a small header followed by each level, so it can be mapped and uploaded
+ * without any further work. Safe to use from loader threads.
+ */
+class TextureCache
+{
+public:
+	/** Constructor */
+	TextureCache();
+
+	/**
+	 * Set the cache directory, creating it if needed.
+	 * \param szDir Directory, empty to disable the cache.
+	 */
+	void SetDirectory(const std::string &szDir);
+
+	/** Check if the cache is in use. */
+	bool IsEnabled() const;
+
+	/** 64 bit FNV-1a hash of a block of bytes. */
+	static unsigned long long Hash(const unsigned char *pData, size_t uSize);
+
+	/**
+	 * Look a texture up.
+	 * \param uHash Hash of the source bytes.
+	 * \param tex   Filled on a hit.
+	 * \return True on a hit.
+	 */
+	bool Load(unsigned long long uHash, CachedTexture &tex);
+
+	/**
+	 * Store a decoded texture.
+	 * \param uHash   Hash of the source bytes.
+	 * \param iWidth  Width of level 0.
+	 * \param iHeight Height of level 0.
+	 * \param pMips   RGBA pixels of each level, one after the other.
+	 * \param iLevels Number of levels.
+	 * \param avg     Average opaque colour (RGB).
+	 */
+	void Store(unsigned long long uHash, int iWidth, int iHeight, const unsigned char *pMips, int iLevels, const unsigned char avg[3]);
+
+	/** Print hit and miss counts. */
+	void PrintStats(std::ostream &out) const;
+
+private:
+	/** Path of the file for a hash, empty when the cache is disabled. */
+	std::string GetPath(unsigned long long uHash) const;
+
+	std::string        m_szDir;     /** Cache directory, empty when disabled. */
+	mutable std::mutex m_mutex;     /** Guards the counters and the directory. */
+	int                m_iHits;     /** Textures found. */
+	int                m_iMisses;   /** Textures decoded. */
+	int                m_iStored;   /** Files written. */
+	size_t             m_uHitBytes; /** Decoded bytes read from the cache. */
+
+};//end TextureCache
+
+/** Shared decoded texture cache. */
+extern TextureCache g_textureCache;
+
+#endif //TEXTURECACHE_H
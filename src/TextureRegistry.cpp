@@ -0,0 +1,441 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#include <iomanip>
+#include "TextureRegistry.h"
+#include "wad.h"
+
+TextureRegistry g_textures;
+
+// Slots in a new table. The table grows past 70% full.
+#define INITIAL_SLOTS 256
+
+// Name conflicts listed by PrintStats(), the rest are only counted.
+#define MAX_LISTED_CONFLICTS 8
+
+
+/**
+ * Constructor.
+ */
+TextureRegistry::TextureRegistry()
+{
+	this->m_vSlots.assign(INITIAL_SLOTS, -1);
+	this->m_uLookups = 0;
+	this->m_uProbes  = 0;
+	this->m_iLoads   = 0;
+	this->m_uShared  = 0;
+	this->m_uSaved   = 0;
+
+}//end TextureRegistry::TextureRegistry()
+
+
+/**
+ * 32 bit FNV-1a hash of a name.
+ */
+uint32_t TextureRegistry::Hash(const std::string &szName)
+{
+	uint32_t uHash = 2166136261u;
+
+	for (size_t i = 0; i < szName.size(); i++) {
+		uHash ^= (unsigned char)szName[i];
+		uHash *= 16777619u;
+	}
+
+	return uHash;
+
+}//end TextureRegistry::Hash()
+
+
+/**
+ * Slot holding a name, or the empty slot it would go in. Linear probing,
+ * comparing the stored hash before the name.
+ * \return Index into m_vSlots.
+ */
+size_t TextureRegistry::Probe(const std::string &szName, uint32_t uHash) const
+{
+	size_t uMask = this->m_vSlots.size() - 1;
+	size_t uSlot = uHash & uMask;
+
+	this->m_uLookups++;
+
+	for (;;) {
+		this->m_uProbes++;
+
+		int iId = this->m_vSlots[uSlot];
+
+		if (iId < 0 || (this->m_vHashes[iId] == uHash && this->m_dNames[iId] == szName)) {
+			return uSlot;
+		}
+
+		uSlot = (uSlot + 1) & uMask;
+	}
+
+}//end TextureRegistry::Probe()
+
+
+/**
+ * Double the table and reinsert every name.
+ */
+void TextureRegistry::Grow()
+{
+	std::vector<int> vSlots(this->m_vSlots.size() * 2, -1);
+	size_t uMask = vSlots.size() - 1;
+
+	for (size_t iName = 0; iName < this->m_vHashes.size(); iName++) {
+		size_t uSlot = this->m_vHashes[iName] & uMask;
+
+		while (vSlots[uSlot] >= 0) {
+			uSlot = (uSlot + 1) & uMask;
+		}
+
+		vSlots[uSlot] = (int)iName;
+	}
+
+	this->m_vSlots.swap(vSlots);
+
+}//end TextureRegistry::Grow()
+
+
+/**
+ * Add a name in an empty slot.
+ * \return Index of the name.
+ */
+int TextureRegistry::AddName(const std::string &szName, uint32_t uHash, size_t uSlot, int iId)
+{
+	int iName = (int)this->m_dNames.size();
+	this->m_dNames.push_back(szName);
+	this->m_dIdOfName.push_back(iId);
+	this->m_vHashes.push_back(uHash);
+	this->m_vSlots[uSlot] = iName;
+	this->m_dNameCount[iId]++;
+
+	if (this->m_dNames.size() * 10 > this->m_vSlots.size() * 7) {
+		this->Grow();
+	}
+
+	return iName;
+
+}//end TextureRegistry::AddName()
+
+
+/**
+ * Add a blank 1x1 texture.
+ * \return Id of the texture.
+ */
+int TextureRegistry::AddTexture(int iName)
+{
+	TEXTURE t;
+	t.texId     = 0;
+	t.w         = 1;
+	t.h         = 1;
+	t.avg[0]    = t.avg[1] = t.avg[2] = 128;
+	t.mipDrop   = 0;
+	t.baseLevel = 0;
+
+	int iId = (int)this->m_dTextures.size();
+	this->m_dTextures.push_back(t);
+	this->m_dNameOfId.push_back(iName);
+	this->m_dNameCount.push_back(0);
+	this->m_dContent.push_back(0);
+	this->m_dCancelled.push_back(false);
+
+	return iId;
+
+}//end TextureRegistry::AddTexture()
+
+
+/**
+ * Point a name at another id.
+ */
+void TextureRegistry::MoveName(int iName, int iId)
+{
+	this->m_dNameCount[this->m_dIdOfName[iName]]--;
+	this->m_dNameCount[iId]++;
+	this->m_dIdOfName[iName] = iId;
+
+}//end TextureRegistry::MoveName()
+
+
+/**
+ * Count a name given to an existing texture instead of a new upload.
+ */
+void TextureRegistry::CountShared(int iId)
+{
+	const TEXTURE &t = this->m_dTextures[iId];
+
+	this->m_uShared++;
+	this->m_uSaved += mipChainOffset(t.w, t.h, MIPLEVELS);
+
+}//end TextureRegistry::CountShared()
+
+
+/**
+ * Whether a lookup finding an id has to decode it, because the map that
+ * was decoding it was unloaded first. Clears the flag, so only one does.
+ */
+bool TextureRegistry::TakeCancelled(int iId)
+{
+	if (!this->m_dCancelled[iId]) {
+		return false;
+	}
+
+	this->m_dCancelled[iId] = false;
+	return true;
+
+}//end TextureRegistry::TakeCancelled()
+
+
+/**
+ * Find a name, adding a blank 1x1 entry when it isn't there yet.
+ * \param szName Texture name.
+ * \param bAdded Set when the entry was added by this call.
+ * \return Id of the texture.
+ */
+int TextureRegistry::Intern(const std::string &szName, bool &bAdded)
+{
+	uint32_t uHash = Hash(szName);
+	size_t   uSlot = this->Probe(szName, uHash);
+
+	bAdded = this->m_vSlots[uSlot] < 0;
+
+	if (!bAdded) {
+		int iId = this->m_dIdOfName[this->m_vSlots[uSlot]];
+		bAdded = this->TakeCancelled(iId);
+		return iId;
+	}
+
+	int iId = this->AddTexture((int)this->m_dNames.size());
+	this->AddName(szName, uHash, uSlot, iId);
+
+	return iId;
+
+}//end TextureRegistry::Intern()
+
+
+/**
+ * Find a texture by name and content, for WAD entries and embedded miptex.
+ * \param szName   Texture name.
+ * \param uContent Hash of the pixels and palette, 0 when unknown to only go by name.
+ * \param iWidth   Width, set in an added entry.
+ * \param iHeight  Height, set in an added entry.
+ * \param bAdded   Set when the caller has to decode and upload the texture.
+ * \return Id of the texture.
+ */
+int TextureRegistry::InternContent(const std::string &szName, unsigned long long uContent, int iWidth, int iHeight, bool &bAdded)
+{
+	if (uContent == 0) {
+		int iId = this->Intern(szName, bAdded);
+		if (bAdded) {
+			this->m_dTextures[iId].w = iWidth;
+			this->m_dTextures[iId].h = iHeight;
+		}
+		return iId;
+	}
+
+	uint32_t uHash = Hash(szName);
+	size_t   uSlot = this->Probe(szName, uHash);
+	int      iName = this->m_vSlots[uSlot];
+	int      iId   = iName >= 0 ? this->m_dIdOfName[iName] : -1;
+
+	// Same name and pixels as before, the usual case of maps embedding a texture
+	if (iId >= 0 && this->m_dContent[iId] == uContent) {
+		bAdded = this->TakeCancelled(iId);
+		return iId;
+	}
+
+	// These pixels were seen before, under another name or as a conflict of this one
+	std::unordered_map<unsigned long long, int>::const_iterator it = this->m_mContent.find(uContent);
+	if (it != this->m_mContent.end()) {
+		if (iName < 0) {
+			this->AddName(szName, uHash, uSlot, it->second);
+			this->CountShared(it->second);
+		}
+		bAdded = this->TakeCancelled(it->second);
+		return it->second;
+	}
+
+	// New pixels: a name only referenced so far takes them, a name holding
+	// others keeps those and this copy gets a texture of its own
+	if (iName < 0) {
+		iId = this->AddTexture((int)this->m_dNames.size());
+		this->AddName(szName, uHash, uSlot, iId);
+	} else if (this->m_dContent[iId] != 0) {
+		this->m_vConflicts.push_back(szName);
+		iId = this->AddTexture(iName);
+	}
+
+	this->m_dTextures[iId].w = iWidth;
+	this->m_dTextures[iId].h = iHeight;
+	this->m_dContent[iId]    = uContent;
+	this->m_mContent[uContent] = iId;
+	bAdded = true;
+
+	return iId;
+
+}//end TextureRegistry::InternContent()
+
+
+/**
+ * Find a texture by name and content after its file changed. The name
+ * follows its new pixels: to the id already holding them, into its own id
+ * when bInPlace and no other name finds it, or else to a new id.
+ * \param szName   Texture name.
+ * \param uContent Hash of the new pixels and palette, 0 when unknown.
+ * \param iWidth   Width, set in an added entry.
+ * \param iHeight  Height, set in an added entry.
+ * \param bInPlace New pixels may replace the old ones in the same id.
+ * \param bAdded   Set when the caller has to decode and upload the texture.
+ * \return Id of the texture.
+ */
+int TextureRegistry::Rebind(const std::string &szName, unsigned long long uContent, int iWidth, int iHeight, bool bInPlace, bool &bAdded)
+{
+	int iName = this->m_vSlots[this->Probe(szName, Hash(szName))];
+
+	if (iName < 0 || uContent == 0) {
+		return this->InternContent(szName, uContent, iWidth, iHeight, bAdded);
+	}
+
+	int iOld = this->m_dIdOfName[iName];
+
+	if (this->m_dContent[iOld] == uContent) {
+		bAdded = this->TakeCancelled(iOld);
+		return iOld;
+	}
+
+	// Back to pixels another name or an older copy has
+	std::unordered_map<unsigned long long, int>::const_iterator it = this->m_mContent.find(uContent);
+	if (it != this->m_mContent.end()) {
+		this->MoveName(iName, it->second);
+		this->CountShared(it->second);
+		bAdded = this->TakeCancelled(it->second);
+		return it->second;
+	}
+
+	// Names sharing the old pixels keep them
+	int iId = iOld;
+	if (bInPlace && this->m_dNameCount[iOld] == 1) {
+		this->SetContent(iOld, uContent);
+	} else {
+		iId = this->AddTexture(iName);
+		this->MoveName(iName, iId);
+		this->m_dTextures[iId].w = iWidth;
+		this->m_dTextures[iId].h = iHeight;
+		this->m_dContent[iId]    = uContent;
+		this->m_mContent[uContent] = iId;
+	}
+	bAdded = true;
+
+	return iId;
+
+}//end TextureRegistry::Rebind()
+
+
+/**
+ * Find a name.
+ * \param szName Texture name.
+ * \return Id of the texture, -1 when unknown.
+ */
+int TextureRegistry::Find(const std::string &szName) const
+{
+	int iName = this->m_vSlots[this->Probe(szName, Hash(szName))];
+
+	return iName >= 0 ? this->m_dIdOfName[iName] : -1;
+
+}//end TextureRegistry::Find()
+
+
+/**
+ * Change the content of an id, when its texture is uploaded again. Names
+ * sharing the id follow it.
+ */
+void TextureRegistry::SetContent(int iId, unsigned long long uContent)
+{
+	unsigned long long uOld = this->m_dContent[iId];
+	std::unordered_map<unsigned long long, int>::iterator it = this->m_mContent.find(uOld);
+
+	if (it != this->m_mContent.end() && it->second == iId) {
+		this->m_mContent.erase(it);
+	}
+
+	this->m_dContent[iId] = uContent;
+
+	if (uContent != 0 && this->m_mContent.count(uContent) == 0) {
+		this->m_mContent[uContent] = iId;
+	}
+
+}//end TextureRegistry::SetContent()
+
+
+/**
+ * Blank an id no name or map uses any more, after its texture object was
+ * freed. Its pixels are forgotten, so they are decoded again if they come back.
+ */
+void TextureRegistry::Release(int iId)
+{
+	this->SetContent(iId, 0);
+
+	TEXTURE &t  = this->m_dTextures[iId];
+	t.texId     = 0;
+	t.w         = 1;
+	t.h         = 1;
+	t.mipDrop   = 0;
+	t.baseLevel = 0;
+	this->m_dCancelled[iId] = false;
+
+}//end TextureRegistry::Release()
+
+
+/**
+ * Print entry and lookup counts.
+ */
+void TextureRegistry::PrintStats(std::ostream &out) const
+{
+	std::streamsize iPrecision = out.precision();
+
+	out << std::fixed << std::setprecision(2);
+	out << "Texture registry: " << this->m_dTextures.size() << " textures for " << this->m_dNames.size() << " names in " << this->m_vSlots.size() << " slots, " << this->m_uLookups << " lookups";
+
+	if (this->m_iLoads != 0) {
+		out << " (" << (double)this->m_uLookups / this->m_iLoads << " per map load)";
+	}
+
+	if (this->m_uLookups != 0) {
+		out << ", " << (double)this->m_uProbes / this->m_uLookups << " probes each";
+	}
+
+	out << "." << std::endl;
+
+	out << "  " << this->m_uShared << " names shared the pixels of another texture (" << this->m_uSaved / 1024 << " KB not uploaded), ";
+	out << this->m_vConflicts.size() << " name conflicts kept apart";
+
+	for (size_t i = 0; i < this->m_vConflicts.size() && i < MAX_LISTED_CONFLICTS; i++) {
+		out << (i == 0 ? ": " : ", ") << this->m_vConflicts[i];
+	}
+
+	if (this->m_vConflicts.size() > MAX_LISTED_CONFLICTS) {
+		out << ", ...";
+	}
+
+	out << "." << std::endl;
+	out.unsetf(std::ios_base::floatfield);
+	out.precision(iPrecision);
+
+}//end TextureRegistry::PrintStats()
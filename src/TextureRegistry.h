@@ -0,0 +1,190 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#ifndef TEXTUREREGISTRY_H
+#define TEXTUREREGISTRY_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <ostream>
+#include <cstddef>
+#include <stdint.h>
+#include "bsp.h"
+
+
+/**
+ * Every world texture, handing out dense integer ids.
+ *
+ * Names are interned once, when a WAD or map is loaded, into a flat open
+ * addressing table. Loaders and renderers keep the id, or a pointer to the
+ * TEXTURE, so nothing past loading compares or hashes names. Entries are
+ * never removed, and ids and TEXTURE pointers stay valid for the whole run.
+ * An id left behind by a reload goes back to a blank texture once nothing
+ * uses it, see Release().
+ *
+ * Textures that come with their pixels are also keyed by a hash of them.
+ * The same pixels under another name share the id, and so the GPU texture,
+ * of the first copy. Different pixels under a name already taken get an id
+ * of their own, while lookups by name keep finding the first one.
+ *
+ * Not thread safe by itself: callers hold texturesMutex, like for the map it
+ * replaces.
+ */
+class TextureRegistry
+{
+public:
+	/** Constructor */
+	TextureRegistry();
+
+	/**
+	 * Find a name, adding a blank 1x1 entry when it isn't there yet.
+	 * \param szName Texture name.
+	 * \param bAdded Set when the entry was added by this call.
+	 * \return Id of the texture.
+	 */
+	int Intern(const std::string &szName, bool &bAdded);
+
+	/**
+	 * Find a texture by name and content, for WAD entries and embedded miptex.
+	 * \param szName   Texture name.
+	 * \param uContent Hash of the pixels and palette, 0 when unknown to only go by name.
+	 * \param iWidth   Width, set in an added entry.
+	 * \param iHeight  Height, set in an added entry.
+	 * \param bAdded   Set when the caller has to decode and upload the texture.
+	 * \return Id of the texture.
+	 */
+	int InternContent(const std::string &szName, unsigned long long uContent, int iWidth, int iHeight, bool &bAdded);
+
+	/**
+	 * Find a texture by name and content after its file changed. Unlike
+	 * InternContent(), a name holding other pixels moves to the new ones,
+	 * instead of keeping them as a conflict.
+	 * \param szName   Texture name.
+	 * \param uContent Hash of the new pixels and palette, 0 when unknown.
+	 * \param iWidth   Width, set in an added entry.
+	 * \param iHeight  Height, set in an added entry.
+	 * \param bInPlace New pixels may replace the old ones in the same id,
+	 *                 when no other name finds it.
+	 * \param bAdded   Set when the caller has to decode and upload the texture.
+	 * \return Id of the texture, another one than Find() gave before when the name moved.
+	 */
+	int Rebind(const std::string &szName, unsigned long long uContent, int iWidth, int iHeight, bool bInPlace, bool &bAdded);
+
+	/**
+	 * Find a name.
+	 * \param szName Texture name.
+	 * \return Id of the texture, -1 when unknown.
+	 */
+	int Find(const std::string &szName) const;
+
+	/**
+	 * Give up decoding an id that a lookup set bAdded for, when its map is
+	 * unloaded before the upload. The next lookup finding it sets bAdded.
+	 */
+	void CancelDecode(int iId) { this->m_dCancelled[iId] = true; }
+
+	/** Change the content of an id, when its texture is uploaded again. */
+	void SetContent(int iId, unsigned long long uContent);
+
+	/** Check if a name still finds an id. */
+	bool IsNamed(int iId) const { return this->m_dNameCount[iId] != 0; }
+
+	/**
+	 * Blank an id no name or map uses any more, after its texture object
+	 * was freed. Its pixels are forgotten, so they are decoded again if
+	 * they come back.
+	 */
+	void Release(int iId);
+
+	/** Texture of an id. The reference stays valid as entries are added. */
+	TEXTURE &Get(int iId) { return this->m_dTextures[iId]; }
+
+	/** Name of an id, the first one when it is shared. */
+	const std::string &GetName(int iId) const { return this->m_dNames[this->m_dNameOfId[iId]]; }
+
+	/** Number of ids handed out. */
+	int GetCount() const { return (int)this->m_dTextures.size(); }
+
+	/** Count a map load, to report lookups per load. */
+	void CountLoad() { this->m_iLoads++; }
+
+	/** Print entry and lookup counts, shared textures and name conflicts. */
+	void PrintStats(std::ostream &out) const;
+
+private:
+	/** 32 bit FNV-1a hash of a name. */
+	static uint32_t Hash(const std::string &szName);
+
+	/**
+	 * Slot holding a name, or the empty slot it would go in.
+	 * \return Index into m_vSlots.
+	 */
+	size_t Probe(const std::string &szName, uint32_t uHash) const;
+
+	/** Double the table and reinsert every name. */
+	void Grow();
+
+	/**
+	 * Add a name in an empty slot.
+	 * \return Index of the name.
+	 */
+	int AddName(const std::string &szName, uint32_t uHash, size_t uSlot, int iId);
+
+	/**
+	 * Add a blank 1x1 texture.
+	 * \return Id of the texture.
+	 */
+	int AddTexture(int iName);
+
+	/** Point a name at another id. */
+	void MoveName(int iName, int iId);
+
+	/** Count a name given to an existing texture instead of a new upload. */
+	void CountShared(int iId);
+
+	/** Whether a lookup finding an id has to decode it, clearing CancelDecode(). */
+	bool TakeCancelled(int iId);
+
+	std::vector<int>                               m_vSlots;    /** Name in each slot, -1 when empty. Size is a power of two. */
+	std::vector<uint32_t>                          m_vHashes;   /** Hash of each name, so growing doesn't rehash names. */
+	std::deque<std::string>                        m_dNames;    /** Each name. */
+	std::deque<int>                                m_dIdOfName; /** Id each name finds. */
+	std::deque<TEXTURE>                            m_dTextures; /** Texture of each id, a deque so references stay valid. */
+	std::deque<int>                                m_dNameOfId; /** First name of each id. */
+	std::deque<int>                                m_dNameCount; /** Names finding each id. */
+	std::deque<unsigned long long>                 m_dContent;  /** Content hash of each id, 0 when not known. */
+	std::deque<bool>                               m_dCancelled; /** Ids whose decode was given up, see CancelDecode(). */
+	std::unordered_map<unsigned long long, int>    m_mContent;  /** Id of each content hash. */
+	std::vector<std::string>                       m_vConflicts; /** Names that came with different pixels. */
+	mutable size_t                                 m_uLookups;  /** Intern() and Find() calls. */
+	mutable size_t                                 m_uProbes;   /** Slots looked at by those calls. */
+	int                                            m_iLoads;    /** Map loads counted. */
+	size_t                                         m_uShared;   /** Names that found their pixels under another name. */
+	size_t                                         m_uSaved;    /** Bytes of RGBA mips not uploaded thanks to those. */
+
+};//end TextureRegistry
+
+/** Every world texture, guarded by texturesMutex. */
+extern TextureRegistry g_textures;
+
+#endif //TEXTUREREGISTRY_H
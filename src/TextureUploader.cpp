@@ -0,0 +1,347 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#include <iostream>
+#include <iomanip>
+#include <SDL.h>
+#include "MemoryRegistry.h"
+#include "TextureUploader.h"
+
+TextureUploader g_textureUploader;
+
+// Blocks start on this boundary, enough for any pixel transfer.
+#define BLOCK_ALIGNMENT 256
+
+
+/**
+ * Constructor
+ */
+StagingBuffer::StagingBuffer()
+{
+	this->pData   = NULL;
+	this->uSize   = 0;
+	this->uOffset = 0;
+	this->uBlock  = 0;
+	this->bUsed   = false;
+
+}//end StagingBuffer::StagingBuffer()
+
+
+/**
+ * Constructor
+ */
+TextureUploader::TextureUploader()
+{
+	this->m_uBuffer      = 0;
+	this->m_pMapping     = NULL;
+	this->m_uSize        = 0;
+	this->m_uNextId      = 1;
+	this->m_uUploads     = 0;
+	this->m_uUploadBytes = 0;
+	this->m_fUploadMs    = 0.0;
+	this->m_fStallMs     = 0.0;
+	this->m_uRingBlocks  = 0;
+	this->m_uHeapBlocks  = 0;
+
+}//end TextureUploader::TextureUploader()
+
+
+/**
+ * Create and map the ring. Must be called from the GL thread.
+ * \param uBytes Size of the ring, 0 to stage on the heap.
+ * \return True when the ring is in use.
+ */
+bool TextureUploader::Init(size_t uBytes)
+{
+	if (uBytes == 0) {
+		return false;
+	}
+
+	if (!GLEW_ARB_buffer_storage || !GLEW_ARB_sync) {
+		std::cout << "GL_ARB_buffer_storage not available, textures are uploaded synchronously." << std::endl;
+		return false;
+	}
+
+	// Client storage with read access keeps the mapping in cached memory,
+	// the texture cache reads decoded mips back from it.
+	GLbitfield eFlags = GL_MAP_WRITE_BIT | GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+	glGenBuffers(1, &this->m_uBuffer);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, this->m_uBuffer);
+	glBufferStorage(GL_PIXEL_UNPACK_BUFFER, uBytes, NULL, eFlags | GL_CLIENT_STORAGE_BIT);
+	this->m_pMapping = (unsigned char*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, uBytes, eFlags);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	if (this->m_pMapping == NULL) {
+		std::cout << "Can't map the texture upload ring, textures are uploaded synchronously." << std::endl;
+		glDeleteBuffers(1, &this->m_uBuffer);
+		this->m_uBuffer = 0;
+		return false;
+	}
+
+	this->m_uSize = uBytes;
+	g_gpuMemory.TrackBuffer(this->m_uBuffer, MemoryRegistry::CATEGORY_TEXTURE, "upload ring", uBytes);
+	return true;
+
+}//end TextureUploader::Init()
+
+
+/**
+ * Delete the ring, waiting for pending uploads. Must be called from the GL thread.
+ */
+void TextureUploader::Shutdown()
+{
+	std::lock_guard<std::mutex> lock(this->m_mutex);
+
+	if (this->m_uBuffer == 0) {
+		return;
+	}
+
+	for (size_t i = 0; i < this->m_qBlocks.size(); i++) {
+		if (this->m_qBlocks[i].eState == BLOCK_FENCED) {
+			glClientWaitSync(this->m_qBlocks[i].fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+			glDeleteSync(this->m_qBlocks[i].fence);
+		}
+	}
+
+	this->m_qBlocks.clear();
+
+	g_gpuMemory.ReleaseBuffer(this->m_uBuffer);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, this->m_uBuffer);
+	glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	glDeleteBuffers(1, &this->m_uBuffer);
+
+	this->m_uBuffer  = 0;
+	this->m_pMapping = NULL;
+	this->m_uSize    = 0;
+
+}//end TextureUploader::Shutdown()
+
+
+/**
+ * Reserve staging memory. Safe to call from loader threads.
+ * \param uBytes Size needed.
+ * \param buffer Receives the memory.
+ * \param bWait  Wait for the GPU to free ring space instead of falling
+ *               back to the heap. Only on the GL thread.
+ */
+void TextureUploader::Reserve(size_t uBytes, StagingBuffer &buffer, bool bWait)
+{
+	buffer = StagingBuffer();
+	buffer.uSize = uBytes;
+
+	{
+		std::lock_guard<std::mutex> lock(this->m_mutex);
+		size_t uSize = (uBytes + BLOCK_ALIGNMENT - 1) & ~(size_t)(BLOCK_ALIGNMENT - 1);
+		size_t uOffset;
+
+		if (this->m_uBuffer != 0 && uSize <= this->m_uSize) {
+			bool bFound = this->Allocate(uSize, uOffset);
+
+			while (!bFound && bWait && !this->m_qBlocks.empty() && this->m_qBlocks.front().eState != BLOCK_RESERVED) {
+				this->Retire(true);
+				bFound = this->Allocate(uSize, uOffset);
+			}
+
+			if (bFound) {
+				Block b;
+				b.uId     = this->m_uNextId++;
+				b.uOffset = uOffset;
+				b.uSize   = uSize;
+				b.eState  = BLOCK_RESERVED;
+				b.fence   = 0;
+				this->m_qBlocks.push_back(b);
+
+				buffer.pData   = this->m_pMapping + uOffset;
+				buffer.uOffset = uOffset;
+				buffer.uBlock  = b.uId;
+				this->m_uRingBlocks++;
+				return;
+			}
+		}
+
+		this->m_uHeapBlocks++;
+	}
+
+	buffer.vHeap.resize(uBytes);
+	buffer.pData = buffer.vHeap.empty() ? NULL : &buffer.vHeap[0];
+
+}//end TextureUploader::Reserve()
+
+
+/**
+ * Upload one level of the bound GL_TEXTURE_2D from staging memory.
+ * Must be called from the GL thread.
+ * \param buffer  Staging memory.
+ * \param uOffset Offset of the level in it.
+ * \param iLevel  Texture level.
+ * \param eFormat GL_RGB or GL_RGBA, used as the internal format too.
+ * \param iWidth  Width of the level.
+ * \param iHeight Height of the level.
+ */
+void TextureUploader::UploadLevel(StagingBuffer &buffer, size_t uOffset, int iLevel, GLenum eFormat, int iWidth, int iHeight)
+{
+	Uint64 uStart = SDL_GetPerformanceCounter();
+
+	if (buffer.uBlock != 0) {
+		// From the ring, the pointer is an offset into the bound buffer.
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, this->m_uBuffer);
+		glTexImage2D(GL_TEXTURE_2D, iLevel, eFormat, iWidth, iHeight, 0, eFormat, GL_UNSIGNED_BYTE, (const GLvoid*)(buffer.uOffset + uOffset));
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	} else {
+		glTexImage2D(GL_TEXTURE_2D, iLevel, eFormat, iWidth, iHeight, 0, eFormat, GL_UNSIGNED_BYTE, buffer.pData + uOffset);
+	}
+
+	buffer.bUsed = true;
+
+	std::lock_guard<std::mutex> lock(this->m_mutex);
+	this->m_uUploads++;
+	this->m_uUploadBytes += (size_t)iWidth * iHeight * (eFormat == GL_RGBA ? 4 : 3);
+	this->m_fUploadMs    += (SDL_GetPerformanceCounter() - uStart) * 1000.0 / SDL_GetPerformanceFrequency();
+
+}//end TextureUploader::UploadLevel()
+
+
+/**
+ * Give staging memory back, once its uploads are issued or it isn't
+ * needed anymore. Blocks that were uploaded from are fenced, so this
+ * must then be called from the GL thread.
+ * \param buffer Staging memory, emptied.
+ */
+void TextureUploader::Release(StagingBuffer &buffer)
+{
+	if (buffer.uBlock != 0) {
+		std::lock_guard<std::mutex> lock(this->m_mutex);
+
+		for (size_t i = 0; i < this->m_qBlocks.size(); i++) {
+			Block &b = this->m_qBlocks[i];
+
+			if (b.uId != buffer.uBlock) {
+				continue;
+			}
+
+			if (buffer.bUsed) {
+				b.fence  = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+				b.eState = BLOCK_FENCED;
+			} else {
+				b.eState = BLOCK_FREE;
+			}
+			break;
+		}
+	}
+
+	buffer = StagingBuffer();
+
+}//end TextureUploader::Release()
+
+
+/**
+ * Recycle blocks the GPU has finished reading. Must be called from the GL thread.
+ */
+void TextureUploader::Update()
+{
+	std::lock_guard<std::mutex> lock(this->m_mutex);
+	this->Retire(false);
+
+}//end TextureUploader::Update()
+
+
+/**
+ * Print upload bandwidth and stalls.
+ */
+void TextureUploader::PrintStats(std::ostream &out) const
+{
+	std::lock_guard<std::mutex> lock(this->m_mutex);
+	double fMB = this->m_uUploadBytes / (1024.0 * 1024.0);
+
+	out << std::fixed << std::setprecision(1)
+	    << "Texture uploads: " << this->m_uUploads << " levels, " << fMB << " MB in " << this->m_fUploadMs << " ms ("
+	    << (this->m_fUploadMs > 0.0 ? fMB * 1000.0 / this->m_fUploadMs : 0.0) << " MB/s), "
+	    << this->m_fStallMs << " ms stalled, " << this->m_uRingBlocks << " staged in the ring, " << this->m_uHeapBlocks << " on the heap."
+	    << std::endl;
+	out.unsetf(std::ios::floatfield);
+
+}//end TextureUploader::PrintStats()
+
+
+/**
+ * Find space for a block, false when the ring is full. Called locked.
+ * Blocks are handed out in ring order, so the free space is the gap
+ * after the newest block, plus the start of the ring once wrapped.
+ */
+bool TextureUploader::Allocate(size_t uSize, size_t &uOffset) const
+{
+	if (this->m_qBlocks.empty()) {
+		uOffset = 0;
+		return uSize <= this->m_uSize;
+	}
+
+	size_t uTail = this->m_qBlocks.front().uOffset;
+	size_t uHead = this->m_qBlocks.back().uOffset + this->m_qBlocks.back().uSize;
+
+	// Head and tail only meet when the ring is full.
+	if (uHead > uTail) {
+		if (uHead + uSize <= this->m_uSize) {
+			uOffset = uHead;
+			return true;
+		}
+
+		uOffset = 0;
+		return uSize < uTail;
+	}
+
+	uOffset = uHead;
+	return uHead + uSize < uTail;
+
+}//end TextureUploader::Allocate()
+
+
+/**
+ * Recycle finished blocks from the oldest on, optionally waiting for the
+ * oldest. Called locked.
+ */
+void TextureUploader::Retire(bool bWait)
+{
+	while (!this->m_qBlocks.empty()) {
+		Block &b = this->m_qBlocks.front();
+
+		if (b.eState == BLOCK_RESERVED) {
+			break;
+		}
+
+		if (b.eState == BLOCK_FENCED) {
+			if (bWait) {
+				Uint64 uStart = SDL_GetPerformanceCounter();
+				glClientWaitSync(b.fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+				this->m_fStallMs += (SDL_GetPerformanceCounter() - uStart) * 1000.0 / SDL_GetPerformanceFrequency();
+				bWait = false;
+			} else if (glClientWaitSync(b.fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+				break;
+			}
+
+			glDeleteSync(b.fence);
+		}
+
+		this->m_qBlocks.pop_front();
+	}
+
+}//end TextureUploader::Retire()
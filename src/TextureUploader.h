@@ -0,0 +1,173 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#ifndef TEXTUREUPLOADER_H
+#define TEXTUREUPLOADER_H
+
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <ostream>
+#include <cstddef>
+#include <GL/glew.h>
+
+
+/**
+ * Memory a texture is written to before it is uploaded. Either a block of
+ * the persistently mapped upload ring, or a plain heap buffer when the
+ * ring is full or not supported. Heap memory is owned by the buffer and
+ * pData points into it, so a copy would point at the original's memory:
+ * hand buffers over with std::swap, and release them exactly once.
+ */
+struct StagingBuffer
+{
+	StagingBuffer();
+
+	/** Start of the memory, NULL when not reserved. */
+	unsigned char *GetData() const { return this->pData; }
+
+	/** Size of the memory, in bytes. */
+	size_t GetSize() const { return this->uSize; }
+
+	/** Bytes held on the heap, 0 for ring memory. */
+	size_t GetHeapBytes() const { return this->vHeap.capacity(); }
+
+	unsigned char             *pData;   /** Start of the memory. */
+	size_t                     uSize;   /** Size of the memory. */
+	size_t                     uOffset; /** Offset inside the ring. */
+	unsigned int               uBlock;  /** Ring block, 0 for heap memory. */
+	bool                       bUsed;   /** An upload was issued from it. */
+	std::vector<unsigned char> vHeap;   /** Heap memory, when not in the ring. */
+};
+
+
+/**
+ * Uploads textures through a ring of persistently mapped pixel buffer
+ * objects.
+ *
+ * Loader threads reserve a block and decode straight into it, the GL
+ * thread then issues glTexImage2D from the buffer, which returns without
+ * waiting for the driver to copy the pixels. Each block gets a fence,
+ * and is reused once the GPU has read it. Without GL 4.4 buffer storage
+ * everything is staged on the heap and uploaded as before.
+ *
+ * Blocks are recycled oldest first, so a block still reserved at the tail
+ * holds back the ones behind it until it is released. Reservations that
+ * don't fit meanwhile fall back to the heap, waiting ones included.
+ */
+class TextureUploader
+{
+public:
+	/** Constructor */
+	TextureUploader();
+
+	/**
+	 * Create and map the ring. Must be called from the GL thread.
+	 * \param uBytes Size of the ring, 0 to stage on the heap.
+	 * \return True when the ring is in use.
+	 */
+	bool Init(size_t uBytes);
+
+	/** Delete the ring, waiting for pending uploads. Must be called from the GL thread. */
+	void Shutdown();
+
+	/** Check if the ring is in use. */
+	bool IsEnabled() const { return this->m_uBuffer != 0; }
+
+	/**
+	 * Reserve staging memory. Safe to call from loader threads.
+	 * \param uBytes Size needed.
+	 * \param buffer Receives the memory.
+	 * \param bWait  Wait for the GPU to free ring space instead of falling
+	 *               back to the heap. Only on the GL thread.
+	 */
+	void Reserve(size_t uBytes, StagingBuffer &buffer, bool bWait = false);
+
+	/**
+	 * Upload one level of the bound GL_TEXTURE_2D from staging memory.
+	 * Must be called from the GL thread.
+	 * \param buffer  Staging memory.
+	 * \param uOffset Offset of the level in it.
+	 * \param iLevel  Texture level.
+	 * \param eFormat GL_RGB or GL_RGBA, used as the internal format too.
+	 * \param iWidth  Width of the level.
+	 * \param iHeight Height of the level.
+	 */
+	void UploadLevel(StagingBuffer &buffer, size_t uOffset, int iLevel, GLenum eFormat, int iWidth, int iHeight);
+
+	/**
+	 * Give staging memory back, once its uploads are issued or it isn't
+	 * needed anymore. Blocks that were uploaded from are fenced, so this
+	 * must then be called from the GL thread.
+	 * \param buffer Staging memory, emptied.
+	 */
+	void Release(StagingBuffer &buffer);
+
+	/** Recycle blocks the GPU has finished reading. Must be called from the GL thread. */
+	void Update();
+
+	/** Print upload bandwidth and stalls. */
+	void PrintStats(std::ostream &out) const;
+
+private:
+	enum BlockState
+	{
+		BLOCK_RESERVED, /** Being written, or waiting for its uploads. */
+		BLOCK_FENCED,   /** Uploads issued, waiting for the GPU. */
+		BLOCK_FREE      /** Can be recycled. */
+	};
+
+	struct Block
+	{
+		unsigned int uId;     /** Handle given to the StagingBuffer. */
+		size_t       uOffset; /** Start inside the ring. */
+		size_t       uSize;   /** Size, aligned. */
+		BlockState   eState;  /** Where the block is in its life. */
+		GLsync       fence;   /** Signalled when the GPU read the block. */
+	};
+
+	/** Find space for a block, false when the ring is full. Called locked. */
+	bool Allocate(size_t uSize, size_t &uOffset) const;
+
+	/** Recycle finished blocks from the oldest on, optionally waiting for the oldest. Called locked. */
+	void Retire(bool bWait);
+
+	GLuint            m_uBuffer;   /** The ring, 0 when staging on the heap. */
+	unsigned char    *m_pMapping;  /** Persistent mapping of the ring. */
+	size_t            m_uSize;     /** Size of the ring. */
+	unsigned int      m_uNextId;   /** Next block handle. */
+	std::deque<Block> m_qBlocks;   /** Live blocks, oldest first. */
+	mutable std::mutex m_mutex;    /** Guards the blocks and the counters. */
+
+	// Statistics.
+	unsigned int m_uUploads;       /** Levels uploaded. */
+	size_t       m_uUploadBytes;   /** Bytes uploaded. */
+	double       m_fUploadMs;      /** GL thread time spent issuing uploads. */
+	double       m_fStallMs;       /** GL thread time spent waiting for ring space. */
+	unsigned int m_uRingBlocks;    /** Reservations served by the ring. */
+	unsigned int m_uHeapBlocks;    /** Reservations that fell back to the heap. */
+
+};//end TextureUploader
+
+/** Shared texture uploader. */
+extern TextureUploader g_textureUploader;
+
+#endif //TEXTUREUPLOADER_H
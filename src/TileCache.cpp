@@ -0,0 +1,242 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#include <fstream>
+#include <iterator>
+#include <cstdio>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "TileCache.h"
+#include "MemoryRegistry.h"
+
+#if defined(_MSC_VER) || defined(__MINGW32__)
+	#include <direct.h>
+#endif
+
+// Disk order, oldest first, one "size name" line per file.
+#define TILE_INDEX "index.txt"
+
+
+/**
+ * Create the directory and read the order of its files.
+ */
+TileCache::TileCache(size_t uMemoryBytes, const std::string &szDir, size_t uDiskBytes)
+{
+	this->m_szDir         = szDir;
+	this->m_uMemoryBudget = uMemoryBytes;
+	this->m_uDiskBudget   = uDiskBytes;
+	this->m_uMemoryBytes  = 0;
+	this->m_uDiskBytes    = 0;
+	this->m_uMemoryHits   = 0;
+	this->m_uDiskHits     = 0;
+	this->m_uMisses       = 0;
+	this->m_uEvicted      = 0;
+
+	if (szDir.empty()) {
+		return;
+	}
+
+#if defined(_MSC_VER) || defined(__MINGW32__)
+	_mkdir(szDir.c_str());
+#else
+	mkdir(szDir.c_str(), 0755);
+#endif
+
+	std::ifstream index((szDir + "/" + TILE_INDEX).c_str());
+	size_t uSize;
+	std::string szKey;
+	std::vector<std::string> vEvicted;
+
+	while (index >> uSize >> szKey) {
+		this->KeepOnDisk(szKey, uSize, vEvicted);
+	}
+
+	for (size_t i = 0; i < vEvicted.size(); i++) {
+		remove(this->GetPath(vEvicted[i]).c_str());
+	}
+
+}//end TileCache::TileCache()
+
+
+/**
+ * Save the disk order for the next run.
+ */
+TileCache::~TileCache()
+{
+	g_hostMemory.SetUsage(this, MemoryRegistry::CATEGORY_TEXTURE, "Tile cache", 0);
+
+	if (this->m_szDir.empty()) {
+		return;
+	}
+
+	std::ofstream index((this->m_szDir + "/" + TILE_INDEX).c_str());
+
+	for (std::list<DiskEntry>::reverse_iterator it = this->m_lDisk.rbegin(); it != this->m_lDisk.rend(); ++it) {
+		index << it->second << " " << it->first << "\n";
+	}
+
+}//end TileCache::~TileCache()
+
+
+bool TileCache::Find(const std::string &szKey, std::vector<unsigned char> &vPng)
+{
+	{
+		std::lock_guard<std::mutex> lock(this->m_mutex);
+		std::unordered_map<std::string, std::list<MemoryEntry>::iterator>::iterator it = this->m_mMemory.find(szKey);
+
+		if (it != this->m_mMemory.end()) {
+			this->m_lMemory.splice(this->m_lMemory.begin(), this->m_lMemory, it->second);
+			vPng = it->second->second;
+			this->m_uMemoryHits++;
+			return true;
+		}
+
+		if (this->m_szDir.empty()) {
+			this->m_uMisses++;
+			return false;
+		}
+	}
+
+	std::ifstream file(this->GetPath(szKey).c_str(), std::ios::binary);
+	vPng.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+
+	std::vector<std::string> vEvicted;
+	{
+		std::lock_guard<std::mutex> lock(this->m_mutex);
+
+		if (vPng.empty()) {
+			this->m_uMisses++;
+			return false;
+		}
+
+		this->m_uDiskHits++;
+		this->KeepInMemory(szKey, vPng);
+		this->KeepOnDisk(szKey, vPng.size(), vEvicted);
+	}
+
+	for (size_t i = 0; i < vEvicted.size(); i++) {
+		remove(this->GetPath(vEvicted[i]).c_str());
+	}
+
+	return true;
+
+}//end TileCache::Find()
+
+
+void TileCache::Store(const std::string &szKey, const std::vector<unsigned char> &vPng)
+{
+	std::vector<std::string> vEvicted;
+	{
+		std::lock_guard<std::mutex> lock(this->m_mutex);
+		this->KeepInMemory(szKey, vPng);
+
+		if (this->m_szDir.empty()) {
+			return;
+		}
+
+		this->KeepOnDisk(szKey, vPng.size(), vEvicted);
+	}
+
+	std::ofstream file(this->GetPath(szKey).c_str(), std::ios::binary);
+	file.write((const char*)&vPng[0], vPng.size());
+
+	for (size_t i = 0; i < vEvicted.size(); i++) {
+		remove(this->GetPath(vEvicted[i]).c_str());
+	}
+
+}//end TileCache::Store()
+
+
+void TileCache::ClearMemory()
+{
+	std::lock_guard<std::mutex> lock(this->m_mutex);
+	this->m_lMemory.clear();
+	this->m_mMemory.clear();
+	this->m_uMemoryBytes = 0;
+
+	g_hostMemory.SetUsage(this, MemoryRegistry::CATEGORY_TEXTURE, "Tile cache", 0);
+
+}//end TileCache::ClearMemory()
+
+
+void TileCache::KeepInMemory(const std::string &szKey, const std::vector<unsigned char> &vPng)
+{
+	std::unordered_map<std::string, std::list<MemoryEntry>::iterator>::iterator it = this->m_mMemory.find(szKey);
+
+	if (it != this->m_mMemory.end()) {
+		this->m_uMemoryBytes -= it->second->second.size();
+		this->m_lMemory.erase(it->second);
+	}
+
+	this->m_lMemory.push_front(MemoryEntry(szKey, vPng));
+	this->m_mMemory[szKey] = this->m_lMemory.begin();
+	this->m_uMemoryBytes += vPng.size();
+
+	// The newest tile stays, even when it is larger than the budget.
+	while (this->m_uMemoryBytes > this->m_uMemoryBudget && this->m_lMemory.size() > 1) {
+		MemoryEntry &oldest = this->m_lMemory.back();
+		this->m_uMemoryBytes -= oldest.second.size();
+		this->m_mMemory.erase(oldest.first);
+		this->m_lMemory.pop_back();
+	}
+
+	g_hostMemory.SetUsage(this, MemoryRegistry::CATEGORY_TEXTURE, "Tile cache", this->m_uMemoryBytes);
+
+}//end TileCache::KeepInMemory()
+
+
+void TileCache::KeepOnDisk(const std::string &szKey, size_t uSize, std::vector<std::string> &vEvicted)
+{
+	std::unordered_map<std::string, std::list<DiskEntry>::iterator>::iterator it = this->m_mDisk.find(szKey);
+
+	if (it != this->m_mDisk.end()) {
+		this->m_uDiskBytes -= it->second->second;
+		this->m_lDisk.erase(it->second);
+	}
+
+	this->m_lDisk.push_front(DiskEntry(szKey, uSize));
+	this->m_mDisk[szKey] = this->m_lDisk.begin();
+	this->m_uDiskBytes += uSize;
+
+	while (this->m_uDiskBytes > this->m_uDiskBudget && this->m_lDisk.size() > 1) {
+		DiskEntry &oldest = this->m_lDisk.back();
+		this->m_uDiskBytes -= oldest.second;
+		this->m_mDisk.erase(oldest.first);
+		vEvicted.push_back(oldest.first);
+		this->m_lDisk.pop_back();
+		this->m_uEvicted++;
+	}
+
+}//end TileCache::KeepOnDisk()
+
+
+void TileCache::PrintStats(std::ostream &out)
+{
+	std::lock_guard<std::mutex> lock(this->m_mutex);
+
+	char szLine[200];
+	sprintf(szLine, "Tile cache: %u memory hits, %u disk hits, %u misses, %u tiles in %u KB of memory, %u files in %u KB on disk, %u evicted.",
+		(unsigned int)this->m_uMemoryHits, (unsigned int)this->m_uDiskHits, (unsigned int)this->m_uMisses,
+		(unsigned int)this->m_lMemory.size(), (unsigned int)(this->m_uMemoryBytes / 1024),
+		(unsigned int)this->m_lDisk.size(), (unsigned int)(this->m_uDiskBytes / 1024), (unsigned int)this->m_uEvicted);
+	out << szLine << std::endl;
+
+}//end TileCache::PrintStats()
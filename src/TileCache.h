@@ -0,0 +1,108 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#ifndef TILECACHE_H
+#define TILECACHE_H
+
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <mutex>
+#include <ostream>
+#include <cstddef>
+
+
+/**
+ * Encoded map tiles, least recently used first out, in memory and on disk.
+ *
+ * Lookups go to memory, then to the directory, and tiles found on disk are
+ * kept in memory again. Each level has its own byte budget. The order of
+ * the files on disk is saved to an index when the cache is destroyed, so
+ * a later run evicts them in the same order. Files the index doesn't know
+ * are still found, and join the order then.
+ *
+ * Thread safe. Files are read and written outside the lock.
+ */
+class TileCache
+{
+public:
+	/**
+	 * Constructor
+	 * \param uMemoryBytes Budget in memory.
+	 * \param szDir        Directory, empty to keep tiles in memory only.
+	 * \param uDiskBytes   Budget on disk.
+	 */
+	TileCache(size_t uMemoryBytes, const std::string &szDir, size_t uDiskBytes);
+
+	/** Destructor, saves the index. */
+	~TileCache();
+
+	/**
+	 * Find a tile.
+	 * \param szKey Name of the tile, a file name on disk.
+	 * \param vPng  Gets the PNG file.
+	 */
+	bool Find(const std::string &szKey, std::vector<unsigned char> &vPng);
+
+	/** Add a tile in memory and on disk. */
+	void Store(const std::string &szKey, const std::vector<unsigned char> &vPng);
+
+	/** Drop every tile kept in memory, the files stay. */
+	void ClearMemory();
+
+	/** Print hits, misses and sizes. */
+	void PrintStats(std::ostream &out);
+
+private:
+	typedef std::pair<std::string, std::vector<unsigned char> > MemoryEntry;
+	typedef std::pair<std::string, size_t>                      DiskEntry;
+
+	/** Move a tile to the front in memory, adding it and evicting past the budget. Needs the lock. */
+	void KeepInMemory(const std::string &szKey, const std::vector<unsigned char> &vPng);
+
+	/**
+	 * Move a file to the front of the disk order, adding it. Needs the lock.
+	 * \param vEvicted Gets the files past the budget, to delete.
+	 */
+	void KeepOnDisk(const std::string &szKey, size_t uSize, std::vector<std::string> &vEvicted);
+
+	/** File of a tile. */
+	std::string GetPath(const std::string &szKey) const { return this->m_szDir + "/" + szKey + ".png"; }
+
+	std::string                                                          m_szDir;          /** Directory, empty for none. */
+	size_t                                                               m_uMemoryBudget;  /** Bytes kept in memory. */
+	size_t                                                               m_uDiskBudget;    /** Bytes kept on disk. */
+	size_t                                                               m_uMemoryBytes;   /** Bytes in memory. */
+	size_t                                                               m_uDiskBytes;     /** Bytes on disk, of the files known. */
+	std::list<MemoryEntry>                                               m_lMemory;        /** Tiles in memory, most recent first. */
+	std::unordered_map<std::string, std::list<MemoryEntry>::iterator>    m_mMemory;        /** Position of each tile in m_lMemory. */
+	std::list<DiskEntry>                                                 m_lDisk;          /** Files, most recent first. */
+	std::unordered_map<std::string, std::list<DiskEntry>::iterator>      m_mDisk;          /** Position of each file in m_lDisk. */
+	size_t                                                               m_uMemoryHits;    /** Found in memory. */
+	size_t                                                               m_uDiskHits;      /** Found on disk. */
+	size_t                                                               m_uMisses;        /** Found nowhere. */
+	size_t                                                               m_uEvicted;       /** Files deleted for the budget. */
+	std::mutex                                                           m_mutex;
+
+};//end TileCache
+
+#endif //TILECACHE_H
@@ -0,0 +1,260 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#include <cstring>
+#include <algorithm>
+#include "TileRenderer.h"
+#include "MemoryRegistry.h"
+#include "bsp.h"
+
+// Isometric view angles, in degrees.
+#define TILE_ISO_PITCH 30.0f
+#define TILE_ISO_YAW   45.0f
+
+// Room left around a chapter at zoom 0, and in depth, in units.
+#define TILE_MARGIN 16.0f
+
+
+TileRenderer::TileRenderer(int iSize, bool bIsometric)
+{
+	this->m_iSize        = std::max(iSize, 16);
+	this->m_bIsometric   = bIsometric;
+	this->m_uFramebuffer = 0;
+	this->m_uColorBuffer = 0;
+	this->m_uDepthBuffer = 0;
+
+}//end TileRenderer::TileRenderer()
+
+
+TileRenderer::~TileRenderer()
+{
+	if (this->m_uFramebuffer != 0) {
+		glDeleteFramebuffers(1, &this->m_uFramebuffer);
+		glDeleteRenderbuffers(1, &this->m_uColorBuffer);
+		glDeleteRenderbuffers(1, &this->m_uDepthBuffer);
+		g_gpuMemory.SetUsage(this, MemoryRegistry::CATEGORY_FRAMEBUFFER, "Tile server", 0);
+	}
+
+}//end TileRenderer::~TileRenderer()
+
+
+bool TileRenderer::IsSupported()
+{
+	return GLEW_ARB_framebuffer_object ? true : false;
+
+}//end TileRenderer::IsSupported()
+
+
+/**
+ * Single sampled colour with alpha, and depth.
+ */
+bool TileRenderer::Init()
+{
+	glGenRenderbuffers(1, &this->m_uColorBuffer);
+	glBindRenderbuffer(GL_RENDERBUFFER, this->m_uColorBuffer);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, this->m_iSize, this->m_iSize);
+
+	glGenRenderbuffers(1, &this->m_uDepthBuffer);
+	glBindRenderbuffer(GL_RENDERBUFFER, this->m_uDepthBuffer);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, this->m_iSize, this->m_iSize);
+
+	glGenFramebuffers(1, &this->m_uFramebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, this->m_uFramebuffer);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, this->m_uColorBuffer);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,  GL_RENDERBUFFER, this->m_uDepthBuffer);
+	bool bComplete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	g_gpuMemory.SetUsage(this, MemoryRegistry::CATEGORY_FRAMEBUFFER, "Tile server", (size_t)this->m_iSize * this->m_iSize * 8);
+	this->m_vRows.resize((size_t)this->m_iSize * this->m_iSize * 4);
+
+	return bComplete;
+
+}//end TileRenderer::Init()
+
+
+void TileRenderer::AddChapter(const std::string &szName, const std::vector<BSP*> &vMaps)
+{
+	Chapter &chapter = this->m_mChapters[szName];
+	chapter.vMaps.insert(chapter.vMaps.end(), vMaps.begin(), vMaps.end());
+	chapter.bMeasured = false;
+
+}//end TileRenderer::AddChapter()
+
+
+void TileRenderer::GetChapters(std::vector<std::string> &vNames) const
+{
+	for (std::map<std::string, Chapter>::const_iterator it = this->m_mChapters.begin(); it != this->m_mChapters.end(); ++it) {
+		vNames.push_back(it->first);
+	}
+
+}//end TileRenderer::GetChapters()
+
+
+/**
+ * Looking down, or down at an angle from one corner, like the viewer's
+ * camera rotations.
+ */
+void TileRenderer::LoadView() const
+{
+	glLoadIdentity();
+
+	if (this->m_bIsometric) {
+		glRotatef(TILE_ISO_PITCH, 1.0f, 0.0f, 0.0f);
+		glRotatef(TILE_ISO_YAW,   0.0f, 1.0f, 0.0f);
+	} else {
+		glRotatef(90.0f, 1.0f, 0.0f, 0.0f);
+	}
+
+}//end TileRenderer::LoadView()
+
+
+/**
+ * Every corner of every map's bounds through the view rotation. The
+ * chapter is measured once its maps are loaded, later loads don't move it.
+ */
+void TileRenderer::Measure(Chapter &chapter)
+{
+	glMatrixMode(GL_MODELVIEW);
+	glPushMatrix();
+	this->LoadView();
+	float m[16];
+	glGetFloatv(GL_MODELVIEW_MATRIX, m);
+	glPopMatrix();
+
+	float fMin[3] = { 1e30f,  1e30f,  1e30f};
+	float fMax[3] = {-1e30f, -1e30f, -1e30f};
+
+	for (size_t i = 0; i < chapter.vMaps.size(); i++) {
+		BSP *pMap = chapter.vMaps[i];
+
+		if (!pMap->IsResident()) {
+			continue;
+		}
+
+		VERTEX mins, maxs;
+		pMap->GetBounds(mins, maxs);
+
+		for (int c = 0; c < 8; c++) {
+			float p[3] = {c & 1 ? maxs.x : mins.x, c & 2 ? maxs.y : mins.y, c & 4 ? maxs.z : mins.z};
+
+			for (int k = 0; k < 3; k++) {
+				float v = m[k] * p[0] + m[4 + k] * p[1] + m[8 + k] * p[2] + m[12 + k];
+				fMin[k] = std::min(fMin[k], v);
+				fMax[k] = std::max(fMax[k], v);
+			}
+		}
+	}
+
+	if (fMin[0] > fMax[0]) {
+		return;
+	}
+
+	chapter.fSize     = std::max(fMax[0] - fMin[0], fMax[1] - fMin[1]) + 2.0f * TILE_MARGIN;
+	chapter.fLeft     = (fMin[0] + fMax[0] - chapter.fSize) * 0.5f;
+	chapter.fTop      = (fMin[1] + fMax[1] + chapter.fSize) * 0.5f;
+	chapter.fNear     = -fMax[2] - TILE_MARGIN;
+	chapter.fFar      = -fMin[2] + TILE_MARGIN;
+	chapter.bMeasured = true;
+
+}//end TileRenderer::Measure()
+
+
+/**
+ * Maps outside the tile are skipped with the frustum test, the rest are
+ * drawn whole, at full detail. The readback waits for the GPU, tiles are
+ * few next to frames.
+ */
+bool TileRenderer::Render(const std::string &szChapter, int iZoom, int iX, int iY, std::vector<unsigned char> &vPixels)
+{
+	std::map<std::string, Chapter>::iterator it = this->m_mChapters.find(szChapter);
+
+	if (it == this->m_mChapters.end()) {
+		return false;
+	}
+
+	Chapter &chapter = it->second;
+
+	if (!chapter.bMeasured) {
+		this->Measure(chapter);
+
+		if (!chapter.bMeasured) {
+			return false;
+		}
+	}
+
+	float fTile  = chapter.fSize / (float)(1 << iZoom);
+	float fLeft  = chapter.fLeft + iX * fTile;
+	float fTop   = chapter.fTop  - iY * fTile;
+
+	glBindFramebuffer(GL_FRAMEBUFFER, this->m_uFramebuffer);
+	glPushAttrib(GL_COLOR_BUFFER_BIT | GL_VIEWPORT_BIT);
+	glViewport(0, 0, this->m_iSize, this->m_iSize);
+	glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+	glMatrixMode(GL_PROJECTION);
+	glPushMatrix();
+	glLoadIdentity();
+	glOrtho(fLeft, fLeft + fTile, fTop - fTile, fTop, chapter.fNear, chapter.fFar);
+
+	glMatrixMode(GL_MODELVIEW);
+	glPushMatrix();
+	this->LoadView();
+	this->m_frustum.Extract();
+
+	for (size_t i = 0; i < chapter.vMaps.size(); i++) {
+		BSP *pMap = chapter.vMaps[i];
+
+		if (!pMap->IsResident()) {
+			continue;
+		}
+
+		VERTEX mins, maxs;
+		pMap->GetBounds(mins, maxs);
+		float fMins[3] = {mins.x, mins.y, mins.z}, fMaxs[3] = {maxs.x, maxs.y, maxs.z};
+
+		if (this->m_frustum.TestAABB(fMins, fMaxs)) {
+			pMap->render();
+		}
+	}
+
+	glReadPixels(0, 0, this->m_iSize, this->m_iSize, GL_RGBA, GL_UNSIGNED_BYTE, &this->m_vRows[0]);
+
+	glPopMatrix();
+	glMatrixMode(GL_PROJECTION);
+	glPopMatrix();
+	glMatrixMode(GL_MODELVIEW);
+	glPopAttrib();
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	size_t uRow = (size_t)this->m_iSize * 4;
+	vPixels.resize(uRow * this->m_iSize);
+
+	for (int y = 0; y < this->m_iSize; y++) {
+		memcpy(&vPixels[y * uRow], &this->m_vRows[(this->m_iSize - 1 - y) * uRow], uRow);
+	}
+
+	return true;
+
+}//end TileRenderer::Render()
@@ -0,0 +1,116 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#ifndef TILERENDERER_H
+#define TILERENDERER_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <GL/glew.h>
+#include "Frustum.h"
+
+class BSP;
+
+
+/**
+ * Renders square map tiles of a chapter offscreen, for the tile server.
+ *
+ * A chapter is seen from straight above, or from a fixed isometric angle,
+ * with an orthographic projection. At zoom 0 one tile covers the bounds
+ * of every map of the chapter, and each zoom level splits every tile in
+ * four, numbered from the top left like slippy map tiles. Nothing else is
+ * drawn, so the space around the maps is transparent.
+ *
+ * Everything runs on the GL thread.
+ */
+class TileRenderer
+{
+public:
+	/**
+	 * Constructor
+	 * \param iSize      Width and height of a tile in pixels.
+	 * \param bIsometric Seen at an angle instead of from above.
+	 */
+	TileRenderer(int iSize, bool bIsometric);
+
+	/** Destructor */
+	~TileRenderer();
+
+	/** Check for framebuffer objects. */
+	static bool IsSupported();
+
+	/** Create the framebuffer, false when it can't be used. */
+	bool Init();
+
+	/** Make a chapter available, before the server starts. */
+	void AddChapter(const std::string &szName, const std::vector<BSP*> &vMaps);
+
+	/** Check if a chapter was added. Thread safe once the server runs. */
+	bool HasChapter(const std::string &szName) const { return this->m_mChapters.count(szName) != 0; }
+
+	/** Names of the chapters. */
+	void GetChapters(std::vector<std::string> &vNames) const;
+
+	/** Width and height of a tile. */
+	int GetSize() const { return this->m_iSize; }
+
+	/** Check if tiles are seen at an angle. */
+	bool IsIsometric() const { return this->m_bIsometric; }
+
+	/**
+	 * Render a tile.
+	 * \param vPixels Gets RGBA rows, top first.
+	 * \return False when the chapter has no loaded map.
+	 */
+	bool Render(const std::string &szChapter, int iZoom, int iX, int iY, std::vector<unsigned char> &vPixels);
+
+private:
+	/** Square a chapter fills at zoom 0, in view space. */
+	struct Chapter
+	{
+		std::vector<BSP*> vMaps;    /** Maps of the chapter. */
+		bool              bMeasured; /** The square is known. */
+		float             fLeft;    /** Left edge. */
+		float             fTop;     /** Top edge. */
+		float             fSize;    /** Width and height. */
+		float             fNear;    /** Depth range of the maps. */
+		float             fFar;
+	};
+
+	/** Load the view rotation into the modelview matrix. */
+	void LoadView() const;
+
+	/** Find the square and depth range of the loaded maps of a chapter. */
+	void Measure(Chapter &chapter);
+
+	int                            m_iSize;        /** Tile size in pixels. */
+	bool                           m_bIsometric;   /** Isometric instead of top down. */
+	GLuint                         m_uFramebuffer; /** Rendered into. */
+	GLuint                         m_uColorBuffer;
+	GLuint                         m_uDepthBuffer;
+	std::map<std::string, Chapter> m_mChapters;    /** Chapters by name. */
+	std::vector<unsigned char>     m_vRows;        /** Pixels as read, bottom first. */
+	Frustum                        m_frustum;      /** Of the tile being rendered. */
+
+};//end TileRenderer
+
+#endif //TILERENDERER_H
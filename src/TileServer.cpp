@@ -0,0 +1,567 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <algorithm>
+#include <SDL.h>
+#include "TileServer.h"
+#include "TileRenderer.h"
+#include "PngWriter.h"
+
+// Longest request header accepted, in bytes.
+#define TILE_MAX_HEADER 8192
+
+// Idle keep-alive connections are closed after this, in ms.
+#define TILE_IDLE_MS 5000
+
+// Socket waits are this long at most, so threads notice Stop().
+#define TILE_POLL_MS 250
+
+
+/**
+ * Nothing listens until Start().
+ */
+TileServer::TileServer(TileRenderer *pRenderer, size_t uMemory, const std::string &szCacheDir, size_t uDisk, int iQueueSize, int iMaxZoom)
+	: m_cache(uMemory, szCacheDir, uDisk)
+{
+	this->m_pRenderer  = pRenderer;
+	this->m_iQueueSize = std::max(iQueueSize, 1);
+	this->m_iMaxZoom   = std::min(std::max(iMaxZoom, 0), 20);
+	this->m_bQuit      = false;
+	this->m_uRequests  = 0;
+	this->m_uServed    = 0;
+	this->m_uRendered  = 0;
+	this->m_uCoalesced = 0;
+	this->m_uRejected  = 0;
+	this->m_fRenderMs  = 0.0f;
+
+}//end TileServer::TileServer()
+
+
+TileServer::~TileServer()
+{
+	this->Stop();
+
+}//end TileServer::~TileServer()
+
+
+bool TileServer::Start(unsigned short uPort, int iThreads)
+{
+	if (!NetSocket::Startup() || !this->m_listener.Listen(uPort)) {
+		std::cout << "Can't listen on port " << uPort << ", tiles aren't served." << std::endl;
+		return false;
+	}
+
+	this->m_bQuit    = false;
+	this->m_acceptor = std::thread(&TileServer::AcceptMain, this);
+
+	for (int i = 0; i < std::max(iThreads, 1); i++) {
+		this->m_vThreads.push_back(std::thread(&TileServer::ConnectionMain, this));
+	}
+
+	std::cout << "Serving " << this->m_pRenderer->GetSize() << "px tiles on http://127.0.0.1:" << this->m_listener.GetPort()
+		<< "/{chapter}/{z}/{x}/{y}.png, zoom 0 to " << this->m_iMaxZoom << "." << std::endl;
+	return true;
+
+}//end TileServer::Start()
+
+
+void TileServer::Stop()
+{
+	if (!this->m_listener.IsOpen()) {
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(this->m_mutex);
+		this->m_bQuit = true;
+
+		for (size_t i = 0; i < this->m_dQueue.size(); i++) {
+			this->m_dQueue[i]->eState = Pending::STATE_FAILED;
+		}
+
+		this->m_dQueue.clear();
+	}
+
+	this->m_accepted.notify_all();
+	this->m_progress.notify_all();
+	this->m_acceptor.join();
+
+	for (size_t i = 0; i < this->m_vThreads.size(); i++) {
+		this->m_vThreads[i].join();
+	}
+
+	this->m_vThreads.clear();
+	this->m_listener.Close();
+
+	for (size_t i = 0; i < this->m_dAccepted.size(); i++) {
+		delete this->m_dAccepted[i];
+	}
+
+	this->m_dAccepted.clear();
+
+}//end TileServer::Stop()
+
+
+/**
+ * Rendering goes from the front of the queue, each tile wakes the threads
+ * waiting for it.
+ */
+int TileServer::RenderQueued(int iMax)
+{
+	int iRendered = 0;
+	std::vector<unsigned char> vPixels;
+
+	while (iRendered < iMax) {
+		std::shared_ptr<Pending> pTile;
+		{
+			std::lock_guard<std::mutex> lock(this->m_mutex);
+
+			if (this->m_dQueue.empty()) {
+				break;
+			}
+
+			pTile = this->m_dQueue.front();
+			this->m_dQueue.pop_front();
+		}
+
+		Uint64 uStart = SDL_GetPerformanceCounter();
+		bool bRendered = this->m_pRenderer->Render(pTile->szChapter, pTile->iZoom, pTile->iX, pTile->iY, vPixels);
+		float fMs = (float)((SDL_GetPerformanceCounter() - uStart) * 1000.0 / SDL_GetPerformanceFrequency());
+
+		{
+			std::lock_guard<std::mutex> lock(this->m_mutex);
+			pTile->vPixels.swap(vPixels);
+			pTile->eState = bRendered ? Pending::STATE_RENDERED : Pending::STATE_FAILED;
+			this->m_uRendered++;
+			this->m_fRenderMs += fMs;
+		}
+
+		this->m_progress.notify_all();
+		iRendered++;
+	}
+
+	return iRendered;
+
+}//end TileServer::RenderQueued()
+
+
+/**
+ * Set the hash of what the tiles are drawn from. Tiles in memory are
+ * dropped when it changes, those on disk stay for when it comes back.
+ */
+void TileServer::SetContentHash(unsigned long long uHash)
+{
+	char szVersion[64];
+	sprintf(szVersion, "-%d%s-%016llx", this->m_pRenderer->GetSize(), this->m_pRenderer->IsIsometric() ? "iso" : "top", uHash);
+
+	{
+		std::lock_guard<std::mutex> lock(this->m_mutex);
+
+		if (this->m_szVersion == szVersion) {
+			return;
+		}
+
+		this->m_szVersion = szVersion;
+	}
+
+	this->m_cache.ClearMemory();
+
+}//end TileServer::SetContentHash()
+
+
+unsigned int TileServer::GetServed()
+{
+	std::lock_guard<std::mutex> lock(this->m_mutex);
+	return this->m_uServed;
+
+}//end TileServer::GetServed()
+
+
+void TileServer::AcceptMain()
+{
+	NetSocket *pClient = new NetSocket();
+
+	while (true) {
+		{
+			std::lock_guard<std::mutex> lock(this->m_mutex);
+
+			if (this->m_bQuit) {
+				break;
+			}
+		}
+
+		if (!this->m_listener.Accept(*pClient, TILE_POLL_MS)) {
+			continue;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(this->m_mutex);
+			this->m_dAccepted.push_back(pClient);
+		}
+
+		this->m_accepted.notify_one();
+		pClient = new NetSocket();
+	}
+
+	delete pClient;
+
+}//end TileServer::AcceptMain()
+
+
+void TileServer::ConnectionMain()
+{
+	while (true) {
+		NetSocket *pSocket = NULL;
+		{
+			std::unique_lock<std::mutex> lock(this->m_mutex);
+
+			while (this->m_dAccepted.empty() && !this->m_bQuit) {
+				this->m_accepted.wait(lock);
+			}
+
+			if (this->m_bQuit) {
+				break;
+			}
+
+			pSocket = this->m_dAccepted.front();
+			this->m_dAccepted.pop_front();
+		}
+
+		pSocket->SetTimeout(TILE_POLL_MS);
+		this->Serve(*pSocket);
+		delete pSocket;
+	}
+
+}//end TileServer::ConnectionMain()
+
+
+/**
+ * Several requests can come on one connection, and the ones after the
+ * first may already be in the buffer.
+ */
+void TileServer::Serve(NetSocket &socket)
+{
+	std::string szBuffer;
+	Request request;
+
+	while (this->ReadRequest(socket, szBuffer, request)) {
+		bool bHead = request.szMethod == "HEAD";
+		std::vector<unsigned char> vBody;
+		int iStatus = 200;
+		bool bTile = false;
+		const char *szType = "text/plain";
+
+		if (request.szMethod != "GET" && !bHead) {
+			iStatus = 405;
+		} else if (request.szPath == "/") {
+			// Index, for people pointing a browser at the server.
+			std::vector<std::string> vChapters;
+			this->m_pRenderer->GetChapters(vChapters);
+			std::string szText = "Tiles: /{chapter}/{z}/{x}/{y}.png\n\nChapters:\n";
+
+			for (size_t i = 0; i < vChapters.size(); i++) {
+				szText += vChapters[i] + "\n";
+			}
+
+			vBody.assign(szText.begin(), szText.end());
+		} else {
+			// /{chapter}/{z}/{x}/{y}.png
+			std::vector<std::string> vParts;
+			size_t uStart = 1;
+
+			while (uStart <= request.szPath.size()) {
+				size_t uEnd = request.szPath.find('/', uStart);
+
+				if (uEnd == std::string::npos) {
+					uEnd = request.szPath.size();
+				}
+
+				vParts.push_back(request.szPath.substr(uStart, uEnd - uStart));
+				uStart = uEnd + 1;
+			}
+
+			int aCoords[3] = {-1, -1, -1};
+			bool bValid = vParts.size() == 4 && vParts[3].size() > 4 && vParts[3].compare(vParts[3].size() - 4, 4, ".png") == 0;
+
+			if (bValid) {
+				vParts[3].resize(vParts[3].size() - 4);
+
+				for (int i = 0; i < 3; i++) {
+					const std::string &szNumber = vParts[i + 1];
+					bValid = bValid && !szNumber.empty() && szNumber.size() < 8 && szNumber.find_first_not_of("0123456789") == std::string::npos;
+					aCoords[i] = bValid ? atoi(szNumber.c_str()) : -1;
+				}
+			}
+
+			int iZoom = aCoords[0], iX = aCoords[1], iY = aCoords[2];
+
+			if (!bValid || !this->m_pRenderer->HasChapter(vParts[0]) || iZoom > this->m_iMaxZoom || iX >= (1 << iZoom) || iY >= (1 << iZoom)) {
+				iStatus = 404;
+			} else {
+				this->GetTile(vParts[0], iZoom, iX, iY, vBody, iStatus);
+				bTile  = iStatus == 200;
+				szType = bTile ? "image/png" : szType;
+			}
+		}
+
+		if (iStatus != 200) {
+			char szText[16];
+			sprintf(szText, "%d\n", iStatus);
+			vBody.assign(szText, szText + strlen(szText));
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(this->m_mutex);
+			this->m_uRequests++;
+			this->m_uServed += bTile ? 1 : 0;
+		}
+
+		if (!this->Respond(socket, iStatus, szType, vBody, request.bKeepAlive, bHead) || !request.bKeepAlive) {
+			break;
+		}
+	}
+
+}//end TileServer::Serve()
+
+
+bool TileServer::ReadRequest(NetSocket &socket, std::string &szBuffer, Request &request)
+{
+	size_t uEnd;
+	int iIdleMs = 0;
+
+	while ((uEnd = szBuffer.find("\r\n\r\n")) == std::string::npos) {
+		if (szBuffer.size() > TILE_MAX_HEADER) {
+			return false;
+		}
+
+		char aData[2048];
+		int iReceived = socket.Recv(aData, sizeof(aData));
+
+		if (iReceived == NETSOCKET_TIMEOUT) {
+			std::lock_guard<std::mutex> lock(this->m_mutex);
+			iIdleMs += TILE_POLL_MS;
+
+			if (this->m_bQuit || iIdleMs >= TILE_IDLE_MS) {
+				return false;
+			}
+
+			continue;
+		}
+
+		if (iReceived <= 0) {
+			return false;
+		}
+
+		szBuffer.append(aData, iReceived);
+		iIdleMs = 0;
+	}
+
+	std::string szHeader = szBuffer.substr(0, uEnd);
+	szBuffer.erase(0, uEnd + 4);
+
+	// Request line: method, target, version.
+	size_t uLine   = szHeader.find("\r\n");
+	std::string szLine = szHeader.substr(0, uLine);
+	size_t uSpace1 = szLine.find(' ');
+	size_t uSpace2 = szLine.find(' ', uSpace1 + 1);
+
+	if (uSpace1 == std::string::npos || uSpace2 == std::string::npos) {
+		return false;
+	}
+
+	request.szMethod = szLine.substr(0, uSpace1);
+	std::string szTarget  = szLine.substr(uSpace1 + 1, uSpace2 - uSpace1 - 1);
+	std::string szVersion = szLine.substr(uSpace2 + 1);
+	request.bKeepAlive = szVersion == "HTTP/1.1";
+
+	szTarget = szTarget.substr(0, szTarget.find('?'));
+	request.szPath.clear();
+
+	for (size_t i = 0; i < szTarget.size(); i++) {
+		if (szTarget[i] == '%' && i + 2 < szTarget.size() && isxdigit((unsigned char)szTarget[i + 1]) && isxdigit((unsigned char)szTarget[i + 2])) {
+			request.szPath += (char)strtol(szTarget.substr(i + 1, 2).c_str(), NULL, 16);
+			i += 2;
+		} else {
+			request.szPath += szTarget[i];
+		}
+	}
+
+	// Only the Connection header matters.
+	while (uLine != std::string::npos) {
+		size_t uNext = szHeader.find("\r\n", uLine + 2);
+		std::string szField = szHeader.substr(uLine + 2, uNext == std::string::npos ? std::string::npos : uNext - uLine - 2);
+		uLine = uNext;
+
+		for (size_t i = 0; i < szField.size(); i++) {
+			szField[i] = (char)tolower((unsigned char)szField[i]);
+		}
+
+		if (szField.compare(0, 11, "connection:") == 0) {
+			if (szField.find("close") != std::string::npos) {
+				request.bKeepAlive = false;
+			} else if (szField.find("keep-alive") != std::string::npos) {
+				request.bKeepAlive = true;
+			}
+		}
+	}
+
+	return true;
+
+}//end TileServer::ReadRequest()
+
+
+/**
+ * The first request for a tile queues it and, once rendered, encodes and
+ * caches it. Later requests for it wait for that.
+ */
+void TileServer::GetTile(const std::string &szChapter, int iZoom, int iX, int iY, std::vector<unsigned char> &vPng, int &iStatus)
+{
+	// Chapter names come from the config, keep them to characters fit for file names.
+	char szCoords[48];
+	sprintf(szCoords, "-%d-%d-%d", iZoom, iX, iY);
+	std::string szKey = szChapter;
+
+	for (size_t i = 0; i < szKey.size(); i++) {
+		if (!isalnum((unsigned char)szKey[i]) && szKey[i] != '_' && szKey[i] != '.') {
+			szKey[i] = '_';
+		}
+	}
+
+	szKey += szCoords;
+	{
+		std::lock_guard<std::mutex> lock(this->m_mutex);
+		szKey += this->m_szVersion;
+	}
+
+	if (this->m_cache.Find(szKey, vPng)) {
+		iStatus = 200;
+		return;
+	}
+
+	std::unique_lock<std::mutex> lock(this->m_mutex);
+	std::shared_ptr<Pending> pTile;
+	bool bOwner = false;
+	std::map<std::string, std::shared_ptr<Pending> >::iterator it = this->m_mPending.find(szKey);
+
+	if (it != this->m_mPending.end()) {
+		pTile = it->second;
+		this->m_uCoalesced++;
+	} else {
+		if ((int)this->m_dQueue.size() >= this->m_iQueueSize || this->m_bQuit) {
+			this->m_uRejected++;
+			iStatus = 503;
+			return;
+		}
+
+		pTile.reset(new Pending());
+		pTile->szKey     = szKey;
+		pTile->szChapter = szChapter;
+		pTile->iZoom     = iZoom;
+		pTile->iX        = iX;
+		pTile->iY        = iY;
+		pTile->eState    = Pending::STATE_QUEUED;
+		this->m_dQueue.push_back(pTile);
+		this->m_mPending[szKey] = pTile;
+		bOwner = true;
+	}
+
+	if (bOwner) {
+		while (pTile->eState == Pending::STATE_QUEUED) {
+			this->m_progress.wait(lock);
+		}
+
+		if (pTile->eState == Pending::STATE_RENDERED) {
+			lock.unlock();
+
+			int iSize = this->m_pRenderer->GetSize();
+			PngWriter::Encode(&pTile->vPixels[0], iSize, iSize, 4, vPng);
+			this->m_cache.Store(szKey, vPng);
+
+			lock.lock();
+			pTile->vPng    = vPng;
+			pTile->eState  = Pending::STATE_DONE;
+			std::vector<unsigned char>().swap(pTile->vPixels);
+		}
+
+		this->m_mPending.erase(szKey);
+		this->m_progress.notify_all();
+	} else {
+		while (pTile->eState != Pending::STATE_DONE && pTile->eState != Pending::STATE_FAILED) {
+			this->m_progress.wait(lock);
+		}
+
+		if (pTile->eState == Pending::STATE_DONE) {
+			vPng = pTile->vPng;
+		}
+	}
+
+	// Failed tiles are of chapters without a loaded map, unless the server is stopping.
+	iStatus = pTile->eState == Pending::STATE_DONE ? 200 : (this->m_bQuit ? 503 : 404);
+
+}//end TileServer::GetTile()
+
+
+bool TileServer::Respond(NetSocket &socket, int iStatus, const char *szType, const std::vector<unsigned char> &vBody, bool bKeepAlive, bool bHead)
+{
+	const char *szReason = "OK";
+
+	switch (iStatus) {
+		case 404: szReason = "Not Found";           break;
+		case 405: szReason = "Method Not Allowed";  break;
+		case 503: szReason = "Service Unavailable"; break;
+	}
+
+	char szHeader[256];
+	sprintf(szHeader, "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %u\r\nConnection: %s\r\n%s\r\n",
+		iStatus, szReason, szType, (unsigned int)vBody.size(), bKeepAlive ? "keep-alive" : "close",
+		iStatus == 503 ? "Retry-After: 1\r\n" : (iStatus == 200 ? "Cache-Control: max-age=60\r\n" : ""));
+
+	if (!socket.SendAll(szHeader, strlen(szHeader))) {
+		return false;
+	}
+
+	return bHead || vBody.empty() || socket.SendAll(&vBody[0], vBody.size());
+
+}//end TileServer::Respond()
+
+
+/**
+ * Requests, then the cache.
+ */
+void TileServer::PrintStats(std::ostream &out)
+{
+	{
+		std::lock_guard<std::mutex> lock(this->m_mutex);
+		char szLine[256];
+		sprintf(szLine, "Tile server: %u requests, %u tiles served, %u rendered (%.2f ms each), %u coalesced, %u rejected with a full queue, %u queued.",
+			this->m_uRequests, this->m_uServed, this->m_uRendered, this->m_uRendered ? this->m_fRenderMs / this->m_uRendered : 0.0f,
+			this->m_uCoalesced, this->m_uRejected, (unsigned int)this->m_dQueue.size());
+		out << szLine << std::endl;
+	}
+
+	this->m_cache.PrintStats(out);
+
+}//end TileServer::PrintStats()
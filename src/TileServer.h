@@ -0,0 +1,177 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#ifndef TILESERVER_H
+#define TILESERVER_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <ostream>
+#include "NetSocket.h"
+#include "TileCache.h"
+
+class TileRenderer;
+
+
+/**
+ * HTTP server of map tiles on localhost, for slippy map viewers.
+ *
+ * GET /{chapter}/{z}/{x}/{y}.png answers with a PNG tile of that chapter,
+ * and GET / lists the chapters. Connection threads parse the requests and
+ * look in the tile cache. Tiles it doesn't have are queued for the GL
+ * thread, which renders a few of them per frame with RenderQueued(), and
+ * the thread that queued a tile encodes and caches it. Requests for a tile
+ * already queued wait for that one instead of queueing it again. When the
+ * queue is full, requests get 503 right away, so a burst can't pile up
+ * work the GL thread would take seconds to get through.
+ */
+class TileServer
+{
+public:
+	/**
+	 * Constructor
+	 * \param pRenderer   Renders on the GL thread, outlives the server.
+	 * \param uMemory     Tile cache budget in memory, in bytes.
+	 * \param szCacheDir  Tile cache directory, empty for none.
+	 * \param uDisk       Tile cache budget on disk, in bytes.
+	 * \param iQueueSize  Tiles waiting to be rendered, at most.
+	 * \param iMaxZoom    Deepest zoom level served.
+	 */
+	TileServer(TileRenderer *pRenderer, size_t uMemory, const std::string &szCacheDir, size_t uDisk, int iQueueSize, int iMaxZoom);
+
+	/** Destructor, stops the server. */
+	~TileServer();
+
+	/**
+	 * Listen and start the connection threads.
+	 * \param uPort    Port on 127.0.0.1.
+	 * \param iThreads Connections served at once.
+	 */
+	bool Start(unsigned short uPort, int iThreads);
+
+	/** Close every connection and stop the threads. Queued tiles fail. */
+	void Stop();
+
+	/**
+	 * Render queued tiles, on the GL thread.
+	 * \param iMax Tiles rendered at most.
+	 * \return Tiles rendered.
+	 */
+	int RenderQueued(int iMax);
+
+	/**
+	 * Set the hash of what the tiles are drawn from. Tiles are cached under
+	 * it, with the tile size and projection, so a change renders them again.
+	 * \param uHash Hash of the map config, maps and WADs, see World::GetContentHash().
+	 */
+	void SetContentHash(unsigned long long uHash);
+
+	/** Tiles answered so far. */
+	unsigned int GetServed();
+
+	/** Print requests, cache use, coalesced and rejected requests. */
+	void PrintStats(std::ostream &out);
+
+private:
+	/** A tile being rendered, shared by the requests waiting for it. */
+	struct Pending
+	{
+		enum State
+		{
+			STATE_QUEUED,   /** Waiting for the GL thread. */
+			STATE_RENDERED, /** vPixels is set, the requesting thread encodes it. */
+			STATE_DONE,     /** vPng is set. */
+			STATE_FAILED    /** Nothing to render, or the server stopped. */
+		};
+
+		std::string                szKey;     /** Cache key. */
+		std::string                szChapter; /** Chapter name. */
+		int                        iZoom;     /** Tile coordinates. */
+		int                        iX;
+		int                        iY;
+		State                      eState;
+		std::vector<unsigned char> vPixels;   /** Rendered RGBA rows. */
+		std::vector<unsigned char> vPng;      /** Encoded tile. */
+	};
+
+	/** A parsed request. */
+	struct Request
+	{
+		std::string szMethod;     /** GET, HEAD... */
+		std::string szPath;       /** Decoded path. */
+		bool        bKeepAlive;   /** The connection stays open after the answer. */
+	};
+
+	/** Loop accepting connections. */
+	void AcceptMain();
+
+	/** Loop of a connection thread. */
+	void ConnectionMain();
+
+	/** Answer requests on a connection until it closes. */
+	void Serve(NetSocket &socket);
+
+	/**
+	 * Read one request, keeping what follows it in szBuffer.
+	 * \return False when the connection closed or sent garbage.
+	 */
+	bool ReadRequest(NetSocket &socket, std::string &szBuffer, Request &request);
+
+	/**
+	 * Find or render a tile.
+	 * \param iStatus Gets the HTTP status.
+	 */
+	void GetTile(const std::string &szChapter, int iZoom, int iX, int iY, std::vector<unsigned char> &vPng, int &iStatus);
+
+	/** Send a response. */
+	bool Respond(NetSocket &socket, int iStatus, const char *szType, const std::vector<unsigned char> &vBody, bool bKeepAlive, bool bHead);
+
+	TileRenderer                                     *m_pRenderer;   /** Renders tiles. */
+	TileCache                                         m_cache;       /** Encoded tiles. */
+	std::string                                       m_szVersion;   /** End of every cache key, from SetContentHash(). */
+	int                                               m_iQueueSize;  /** Most tiles queued. */
+	int                                               m_iMaxZoom;    /** Deepest zoom. */
+	NetSocket                                         m_listener;    /** Listening socket. */
+	std::thread                                       m_acceptor;    /** Runs AcceptMain(). */
+	std::vector<std::thread>                          m_vThreads;    /** Run ConnectionMain(). */
+	std::deque<NetSocket*>                            m_dAccepted;   /** Connections no thread took yet. */
+	std::deque<std::shared_ptr<Pending> >             m_dQueue;      /** Tiles for the GL thread. */
+	std::map<std::string, std::shared_ptr<Pending> >  m_mPending;    /** Tiles queued or being encoded, by key. */
+	std::mutex                                        m_mutex;       /** Guards everything below the threads. */
+	std::condition_variable                           m_accepted;    /** Signalled when a connection is queued. */
+	std::condition_variable                           m_progress;    /** Signalled when a tile changes state. */
+	bool                                              m_bQuit;       /** Set by Stop(). */
+	unsigned int                                      m_uRequests;   /** Requests answered. */
+	unsigned int                                      m_uServed;     /** Tiles answered. */
+	unsigned int                                      m_uRendered;   /** Tiles rendered. */
+	unsigned int                                      m_uCoalesced;  /** Requests that waited for a tile already queued. */
+	unsigned int                                      m_uRejected;   /** Requests answered 503 for a full queue. */
+	float                                             m_fRenderMs;   /** Time spent rendering tiles. */
+
+};//end TileServer
+
+#endif //TILESERVER_H
@@ -0,0 +1,592 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <functional>
+#include <cfloat>
+#include "TriangleBvh.h"
+
+// Ranges of this many triangles or fewer always become leaves.
+#define MAX_LEAF_SIZE 4
+// Ranges past this size are split even when the SAH prefers a leaf.
+#define MAX_LEAF_FORCED 32
+// Centroid bins tried per split.
+#define SAH_BINS 12
+// Below this depth splits are halved instead, so traversal stacks stay small.
+#define MAX_SAH_DEPTH 48
+// Traversal stack, enough for MAX_SAH_DEPTH plus halving 2^32 triangles.
+#define STACK_SIZE 96
+// Ranges this large build their left half on another thread, down to this depth.
+#define PARALLEL_MIN_TRIANGLES 16384
+#define PARALLEL_MAX_DEPTH 3
+
+static std::atomic<unsigned int> s_uNextBuildId(1);
+
+
+/**
+ * Half the surface area of a box, enough to compare SAH costs.
+ */
+static float HalfArea(const float fMins[3], const float fMaxs[3])
+{
+	float dx = fMaxs[0] - fMins[0], dy = fMaxs[1] - fMins[1], dz = fMaxs[2] - fMins[2];
+
+	return dx * dy + dy * dz + dz * dx;
+
+}//end HalfArea()
+
+
+/**
+ * Grow a box to hold another.
+ */
+static void GrowBox(float fMins[3], float fMaxs[3], const float *pMins, const float *pMaxs)
+{
+	for (int k = 0; k < 3; k++) {
+		fMins[k] = std::min(fMins[k], pMins[k]);
+		fMaxs[k] = std::max(fMaxs[k], pMaxs[k]);
+	}
+
+}//end GrowBox()
+
+
+/**
+ * Moller-Trumbore intersection, both sides of the triangle count.
+ * \return Distance along the ray, FLT_MAX on a miss.
+ */
+static float IntersectTriangle(const BvhTriangle &tri, const float fOrigin[3], const float fDir[3])
+{
+	const float *a = tri.fVerts[0], *b = tri.fVerts[1], *c = tri.fVerts[2];
+	float e1[3] = {b[0] - a[0], b[1] - a[1], b[2] - a[2]};
+	float e2[3] = {c[0] - a[0], c[1] - a[1], c[2] - a[2]};
+	float p[3]  = {fDir[1] * e2[2] - fDir[2] * e2[1], fDir[2] * e2[0] - fDir[0] * e2[2], fDir[0] * e2[1] - fDir[1] * e2[0]};
+	float det   = e1[0] * p[0] + e1[1] * p[1] + e1[2] * p[2];
+
+	if (det > -1e-8f && det < 1e-8f) {
+		return FLT_MAX;
+	}
+
+	float inv  = 1.0f / det;
+	float s[3] = {fOrigin[0] - a[0], fOrigin[1] - a[1], fOrigin[2] - a[2]};
+	float u    = (s[0] * p[0] + s[1] * p[1] + s[2] * p[2]) * inv;
+
+	if (u < 0.0f || u > 1.0f) {
+		return FLT_MAX;
+	}
+
+	float q[3] = {s[1] * e1[2] - s[2] * e1[1], s[2] * e1[0] - s[0] * e1[2], s[0] * e1[1] - s[1] * e1[0]};
+	float v    = (fDir[0] * q[0] + fDir[1] * q[1] + fDir[2] * q[2]) * inv;
+
+	if (v < 0.0f || u + v > 1.0f) {
+		return FLT_MAX;
+	}
+
+	float t = (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]) * inv;
+
+	return t > 0.0f ? t : FLT_MAX;
+
+}//end IntersectTriangle()
+
+
+/** Orders triangles by centroid along one axis. */
+struct CentroidLess
+{
+	const float *pCentroids;
+	int          iAxis;
+
+	bool operator()(int a, int b) const { return this->pCentroids[a * 3 + this->iAxis] < this->pCentroids[b * 3 + this->iAxis]; }
+};
+
+
+/** Tells triangles left of a bin boundary. */
+struct BinLeftOf
+{
+	const float *pCentroids;
+	int          iAxis;
+	float        fMin, fScale;
+	int          iSplit;
+
+	bool operator()(int i) const
+	{
+		int iBin = (int)((this->pCentroids[i * 3 + this->iAxis] - this->fMin) * this->fScale);
+		return std::min(iBin, SAH_BINS - 1) < this->iSplit;
+	}
+};
+
+
+/**
+ * Constructor.
+ */
+TriangleBvh::TriangleBvh()
+{
+	this->m_uBuildId = 0;
+
+}//end TriangleBvh::TriangleBvh()
+
+
+/**
+ * Distance along a ray to where it enters a box, FLT_MAX when it misses
+ * the box or enters past fMax.
+ */
+float TriangleBvh::BoxEntry(const float fMins[3], const float fMaxs[3], const float fOrigin[3], const float fInvDir[3], float fMax)
+{
+	float fNear = 0.0f, fFar = fMax;
+
+	for (int k = 0; k < 3; k++) {
+		float t0 = (fMins[k] - fOrigin[k]) * fInvDir[k];
+		float t1 = (fMaxs[k] - fOrigin[k]) * fInvDir[k];
+
+		if (t0 > t1) {
+			std::swap(t0, t1);
+		}
+
+		fNear = std::max(fNear, t0);
+		fFar  = std::min(fFar, t1);
+
+		if (fNear > fFar) {
+			return FLT_MAX;
+		}
+	}
+
+	return fNear;
+
+}//end TriangleBvh::BoxEntry()
+
+
+/**
+ * Build over a set of triangles, taking them over.
+ * \param vTriangles Emptied.
+ */
+void TriangleBvh::Build(std::vector<BvhTriangle> &vTriangles)
+{
+	this->m_vTriangles.swap(vTriangles);
+	std::vector<BvhTriangle>().swap(vTriangles);
+	this->Rebuild();
+
+}//end TriangleBvh::Build()
+
+
+/**
+ * Build again over the same triangles.
+ */
+void TriangleBvh::Rebuild()
+{
+	this->m_uBuildId = s_uNextBuildId++;
+	std::vector<Node>().swap(this->m_vNodes);
+
+	int iCount = (int)this->m_vTriangles.size();
+
+	if (iCount == 0) {
+		return;
+	}
+
+	BuildState state;
+	state.vOrder.resize(iCount);
+	state.vCentroids.resize(iCount * 3);
+	state.vMins.resize(iCount * 3);
+	state.vMaxs.resize(iCount * 3);
+
+	for (int i = 0; i < iCount; i++) {
+		const BvhTriangle &tri = this->m_vTriangles[i];
+		state.vOrder[i] = i;
+
+		for (int k = 0; k < 3; k++) {
+			state.vMins[i * 3 + k]      = std::min(std::min(tri.fVerts[0][k], tri.fVerts[1][k]), tri.fVerts[2][k]);
+			state.vMaxs[i * 3 + k]      = std::max(std::max(tri.fVerts[0][k], tri.fVerts[1][k]), tri.fVerts[2][k]);
+			state.vCentroids[i * 3 + k] = (state.vMins[i * 3 + k] + state.vMaxs[i * 3 + k]) * 0.5f;
+		}
+	}
+
+	std::vector<Node> vNodes;
+	vNodes.reserve(iCount / 2 + 1);
+	this->BuildNode(state, vNodes, 0, iCount, 0);
+
+	// Exact sizes, both are kept for as long as the map is loaded.
+	std::vector<BvhTriangle> vOrdered;
+	vOrdered.reserve(iCount);
+
+	for (int i = 0; i < iCount; i++) {
+		vOrdered.push_back(this->m_vTriangles[state.vOrder[i]]);
+	}
+
+	this->m_vTriangles.swap(vOrdered);
+	this->m_vNodes.assign(vNodes.begin(), vNodes.end());
+
+}//end TriangleBvh::Rebuild()
+
+
+/**
+ * Append the subtree over vOrder[iFirst, iFirst + iCount) to vOut, its root
+ * first. Splits at the cheapest of SAH_BINS centroid bins along the longest
+ * axis, and halves the range when binning can't separate it.
+ */
+void TriangleBvh::BuildNode(BuildState &state, std::vector<Node> &vOut, int iFirst, int iCount, int iDepth) const
+{
+	Node node;
+	float fCentMins[3] = {FLT_MAX, FLT_MAX, FLT_MAX}, fCentMaxs[3] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+
+	for (int k = 0; k < 3; k++) {
+		node.fMins[k] = FLT_MAX;
+		node.fMaxs[k] = -FLT_MAX;
+	}
+
+	for (int i = iFirst; i < iFirst + iCount; i++) {
+		int t = state.vOrder[i];
+		GrowBox(node.fMins, node.fMaxs, &state.vMins[t * 3], &state.vMaxs[t * 3]);
+		GrowBox(fCentMins, fCentMaxs, &state.vCentroids[t * 3], &state.vCentroids[t * 3]);
+	}
+
+	node.iRightOrFirst = iFirst;
+	node.iCount        = iCount;
+
+	size_t uIndex = vOut.size();
+	vOut.push_back(node);
+
+	if (iCount <= MAX_LEAF_SIZE) {
+		return;
+	}
+
+	int iAxis = 0;
+
+	for (int k = 1; k < 3; k++) {
+		if (fCentMaxs[k] - fCentMins[k] > fCentMaxs[iAxis] - fCentMins[iAxis]) {
+			iAxis = k;
+		}
+	}
+
+	float fExtent = fCentMaxs[iAxis] - fCentMins[iAxis];
+
+	// Every centroid in one spot, nothing tells them apart.
+	if (fExtent <= 0.0f) {
+		return;
+	}
+
+	int *pBegin = &state.vOrder[iFirst];
+	int  iLeft  = 0;
+
+	if (iDepth < MAX_SAH_DEPTH) {
+		float fBinMins[SAH_BINS][3], fBinMaxs[SAH_BINS][3];
+		int   iBinCount[SAH_BINS];
+		float fScale = SAH_BINS / fExtent;
+
+		for (int b = 0; b < SAH_BINS; b++) {
+			for (int k = 0; k < 3; k++) {
+				fBinMins[b][k] = FLT_MAX;
+				fBinMaxs[b][k] = -FLT_MAX;
+			}
+			iBinCount[b] = 0;
+		}
+
+		for (int i = iFirst; i < iFirst + iCount; i++) {
+			int t = state.vOrder[i];
+			int b = std::min((int)((state.vCentroids[t * 3 + iAxis] - fCentMins[iAxis]) * fScale), SAH_BINS - 1);
+			GrowBox(fBinMins[b], fBinMaxs[b], &state.vMins[t * 3], &state.vMaxs[t * 3]);
+			iBinCount[b]++;
+		}
+
+		// Sweep from the right, then from the left, pricing every boundary.
+		float fRightArea[SAH_BINS];
+		int   iRightCount[SAH_BINS];
+		float fMins[3] = {FLT_MAX, FLT_MAX, FLT_MAX}, fMaxs[3] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+		int   iSum = 0;
+
+		for (int b = SAH_BINS - 1; b > 0; b--) {
+			GrowBox(fMins, fMaxs, fBinMins[b], fBinMaxs[b]);
+			iSum          += iBinCount[b];
+			fRightArea[b]  = iSum != 0 ? HalfArea(fMins, fMaxs) : 0.0f;
+			iRightCount[b] = iSum;
+		}
+
+		float fBestCost = FLT_MAX;
+		int   iSplit    = -1;
+
+		for (int k = 0; k < 3; k++) {
+			fMins[k] = FLT_MAX;
+			fMaxs[k] = -FLT_MAX;
+		}
+		iSum = 0;
+
+		for (int b = 1; b < SAH_BINS; b++) {
+			GrowBox(fMins, fMaxs, fBinMins[b - 1], fBinMaxs[b - 1]);
+			iSum += iBinCount[b - 1];
+
+			if (iSum == 0 || iRightCount[b] == 0) {
+				continue;
+			}
+
+			float fCost = iSum * HalfArea(fMins, fMaxs) + iRightCount[b] * fRightArea[b];
+
+			if (fCost < fBestCost) {
+				fBestCost = fCost;
+				iSplit    = b;
+			}
+		}
+
+		// A leaf is cheaper than any split.
+		if (iSplit >= 0 && fBestCost >= iCount * HalfArea(node.fMins, node.fMaxs) && iCount <= MAX_LEAF_FORCED) {
+			return;
+		}
+
+		if (iSplit >= 0) {
+			BinLeftOf left = {&state.vCentroids[0], iAxis, fCentMins[iAxis], fScale, iSplit};
+			iLeft = (int)(std::partition(pBegin, pBegin + iCount, left) - pBegin);
+		}
+	}
+
+	// Deep or unbinnable ranges are halved along the axis.
+	if (iLeft == 0 || iLeft == iCount) {
+		CentroidLess less = {&state.vCentroids[0], iAxis};
+		iLeft = iCount / 2;
+		std::nth_element(pBegin, pBegin + iLeft, pBegin + iCount, less);
+	}
+
+	vOut[uIndex].iCount = 0;
+
+	if (iCount >= PARALLEL_MIN_TRIANGLES && iDepth < PARALLEL_MAX_DEPTH) {
+		// Both halves into their own arrays, then appended with their right
+		// child indices moved.
+		std::vector<Node> vLeft, vRight;
+		std::thread leftThread(&TriangleBvh::BuildNode, this, std::ref(state), std::ref(vLeft), iFirst, iLeft, iDepth + 1);
+		this->BuildNode(state, vRight, iFirst + iLeft, iCount - iLeft, iDepth + 1);
+		leftThread.join();
+
+		std::vector<Node> *pHalves[2] = {&vLeft, &vRight};
+
+		for (int h = 0; h < 2; h++) {
+			int iBase = (int)vOut.size();
+
+			if (h == 1) {
+				vOut[uIndex].iRightOrFirst = iBase;
+			}
+
+			for (size_t i = 0; i < pHalves[h]->size(); i++) {
+				Node n = (*pHalves[h])[i];
+
+				if (n.iCount == 0) {
+					n.iRightOrFirst += iBase;
+				}
+
+				vOut.push_back(n);
+			}
+		}
+	} else {
+		this->BuildNode(state, vOut, iFirst, iLeft, iDepth + 1);
+		vOut[uIndex].iRightOrFirst = (int)vOut.size();
+		this->BuildNode(state, vOut, iFirst + iLeft, iCount - iLeft, iDepth + 1);
+	}
+
+}//end TriangleBvh::BuildNode()
+
+
+/**
+ * Free everything.
+ */
+void TriangleBvh::Clear()
+{
+	std::vector<BvhTriangle>().swap(this->m_vTriangles);
+	std::vector<Node>().swap(this->m_vNodes);
+	this->m_uBuildId = 0;
+
+}//end TriangleBvh::Clear()
+
+
+/**
+ * Exchange with another BVH.
+ */
+void TriangleBvh::Swap(TriangleBvh &other)
+{
+	this->m_vTriangles.swap(other.m_vTriangles);
+	this->m_vNodes.swap(other.m_vNodes);
+	std::swap(this->m_uBuildId, other.m_uBuildId);
+
+}//end TriangleBvh::Swap()
+
+
+/**
+ * Bounds of every triangle. Only valid when not empty.
+ */
+void TriangleBvh::GetBounds(float fMins[3], float fMaxs[3]) const
+{
+	for (int k = 0; k < 3; k++) {
+		fMins[k] = this->m_vNodes[0].fMins[k];
+		fMaxs[k] = this->m_vNodes[0].fMaxs[k];
+	}
+
+}//end TriangleBvh::GetBounds()
+
+
+/**
+ * Host memory held, in bytes.
+ */
+size_t TriangleBvh::GetMemoryBytes() const
+{
+	return this->m_vTriangles.capacity() * sizeof(BvhTriangle) + this->m_vNodes.capacity() * sizeof(Node);
+
+}//end TriangleBvh::GetMemoryBytes()
+
+
+/**
+ * Find the closest triangle along a ray. Children are visited nearest
+ * first, so far subtrees are mostly skipped once something was hit.
+ * \param fOrigin Start of the ray.
+ * \param fDir    Direction of the ray, not necessarily normalized.
+ * \param fMax    Furthest distance to consider, in units of fDir.
+ * \param hit     Filled when something was hit.
+ * \return True on a hit.
+ */
+bool TriangleBvh::Raycast(const float fOrigin[3], const float fDir[3], float fMax, BvhHit &hit) const
+{
+	if (this->m_vNodes.empty()) {
+		return false;
+	}
+
+	float fInvDir[3];
+
+	for (int k = 0; k < 3; k++) {
+		fInvDir[k] = fDir[k] != 0.0f ? 1.0f / fDir[k] : (fDir[k] < 0.0f ? -1e30f : 1e30f);
+	}
+
+	hit.fDistance = fMax;
+	hit.pTriangle = NULL;
+
+	const Node &root = this->m_vNodes[0];
+
+	if (BoxEntry(root.fMins, root.fMaxs, fOrigin, fInvDir, fMax) == FLT_MAX) {
+		return false;
+	}
+
+	int iStack[STACK_SIZE];
+	int iTop  = 0;
+	int iNode = 0;
+
+	for (;;) {
+		const Node &n = this->m_vNodes[iNode];
+
+		if (n.iCount != 0) {
+			for (int i = n.iRightOrFirst; i < n.iRightOrFirst + n.iCount; i++) {
+				float t = IntersectTriangle(this->m_vTriangles[i], fOrigin, fDir);
+
+				if (t < hit.fDistance) {
+					hit.fDistance = t;
+					hit.pTriangle = &this->m_vTriangles[i];
+				}
+			}
+		} else {
+			int   iNear = iNode + 1, iFar = n.iRightOrFirst;
+			float fNear = BoxEntry(this->m_vNodes[iNear].fMins, this->m_vNodes[iNear].fMaxs, fOrigin, fInvDir, hit.fDistance);
+			float fFar  = BoxEntry(this->m_vNodes[iFar].fMins, this->m_vNodes[iFar].fMaxs, fOrigin, fInvDir, hit.fDistance);
+
+			if (fFar < fNear) {
+				std::swap(iNear, iFar);
+				std::swap(fNear, fFar);
+			}
+
+			if (fNear != FLT_MAX) {
+				if (fFar != FLT_MAX && iTop < STACK_SIZE) {
+					iStack[iTop++] = iFar;
+				}
+
+				iNode = iNear;
+				continue;
+			}
+		}
+
+		if (iTop == 0) {
+			break;
+		}
+
+		iNode = iStack[--iTop];
+	}
+
+	return hit.pTriangle != NULL;
+
+}//end TriangleBvh::Raycast()
+
+
+/**
+ * Find the triangles of another BVH whose bounds overlap triangles of this
+ * one. Both trees are walked at once, splitting the larger node of each
+ * pair of overlapping nodes, so far apart subtrees are never visited.
+ */
+void TriangleBvh::FindOverlaps(const TriangleBvh &other, const float fOffset[3], std::vector<BvhPair> &vPairs) const
+{
+	if (this->m_vNodes.empty() || other.m_vNodes.empty()) {
+		return;
+	}
+
+	std::vector<std::pair<int, int> > vStack;
+	vStack.push_back(std::make_pair(0, 0));
+
+	while (!vStack.empty()) {
+		int iA = vStack.back().first, iB = vStack.back().second;
+		vStack.pop_back();
+
+		const Node &a = this->m_vNodes[iA];
+		const Node &b = other.m_vNodes[iB];
+
+		bool bOverlap = true;
+
+		for (int k = 0; k < 3 && bOverlap; k++) {
+			bOverlap = a.fMins[k] <= b.fMaxs[k] + fOffset[k] && b.fMins[k] + fOffset[k] <= a.fMaxs[k];
+		}
+
+		if (!bOverlap) {
+			continue;
+		}
+
+		if (a.iCount != 0 && b.iCount != 0) {
+			for (int i = a.iRightOrFirst; i < a.iRightOrFirst + a.iCount; i++) {
+				const BvhTriangle &ta = this->m_vTriangles[i];
+
+				for (int j = b.iRightOrFirst; j < b.iRightOrFirst + b.iCount; j++) {
+					const BvhTriangle &tb = other.m_vTriangles[j];
+					bool bTouch = true;
+
+					for (int k = 0; k < 3 && bTouch; k++) {
+						float fMinA = std::min(std::min(ta.fVerts[0][k], ta.fVerts[1][k]), ta.fVerts[2][k]);
+						float fMaxA = std::max(std::max(ta.fVerts[0][k], ta.fVerts[1][k]), ta.fVerts[2][k]);
+						float fMinB = std::min(std::min(tb.fVerts[0][k], tb.fVerts[1][k]), tb.fVerts[2][k]) + fOffset[k];
+						float fMaxB = std::max(std::max(tb.fVerts[0][k], tb.fVerts[1][k]), tb.fVerts[2][k]) + fOffset[k];
+						bTouch = fMinA <= fMaxB && fMinB <= fMaxA;
+					}
+
+					if (bTouch) {
+						BvhPair p = {&ta, &tb};
+						vPairs.push_back(p);
+					}
+				}
+			}
+			continue;
+		}
+
+		// Split the inner node with the larger box, or the only inner one.
+		bool bSplitA = b.iCount != 0 || (a.iCount == 0 && HalfArea(a.fMins, a.fMaxs) >= HalfArea(b.fMins, b.fMaxs));
+
+		if (bSplitA) {
+			vStack.push_back(std::make_pair(iA + 1, iB));
+			vStack.push_back(std::make_pair(a.iRightOrFirst, iB));
+		} else {
+			vStack.push_back(std::make_pair(iA, iB + 1));
+			vStack.push_back(std::make_pair(iA, b.iRightOrFirst));
+		}
+	}
+
+}//end TriangleBvh::FindOverlaps()
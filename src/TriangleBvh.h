@@ -0,0 +1,154 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#ifndef TRIANGLEBVH_H
+#define TRIANGLEBVH_H
+
+#include <vector>
+#include <cstddef>
+
+
+/** A triangle of a map, as picked. Positions are without the map's offset. */
+struct BvhTriangle
+{
+	float fVerts[3][3]; /** Corners. */
+	int   iFace;        /** Face in the BSP faces lump. */
+	int   iTexture;     /** Id in g_textures. */
+	int   iModel;       /** Brush model the face belongs to, 0 for the world. */
+};
+
+
+/** Closest triangle along a ray. */
+struct BvhHit
+{
+	float              fDistance; /** Along the ray, in units of its direction. */
+	const BvhTriangle *pTriangle; /** Triangle hit. */
+};
+
+
+/** Triangles of two BVHs whose bounds overlap. */
+struct BvhPair
+{
+	const BvhTriangle *pA; /** Triangle of the BVH searched from. */
+	const BvhTriangle *pB; /** Triangle of the other BVH. */
+};
+
+
+/**
+ * Bounding volume hierarchy over the triangles of one map.
+ *
+ * Built with a binned SAH builder, the top levels of large maps in
+ * parallel. Nodes are stored depth first: the left child follows its
+ * parent, the parent keeps the index of the right child. Triangles are
+ * reordered so every leaf is a contiguous range.
+ */
+class TriangleBvh
+{
+public:
+	/** Constructor */
+	TriangleBvh();
+
+	/**
+	 * Build over a set of triangles, taking them over.
+	 * \param vTriangles Emptied.
+	 */
+	void Build(std::vector<BvhTriangle> &vTriangles);
+
+	/** Build again over the same triangles. */
+	void Rebuild();
+
+	/** Free everything. */
+	void Clear();
+
+	/** Exchange with another BVH. */
+	void Swap(TriangleBvh &other);
+
+	/** Check if there is anything to hit. */
+	bool IsEmpty() const { return this->m_vNodes.empty(); }
+
+	/** Bounds of every triangle. Only valid when not empty. */
+	void GetBounds(float fMins[3], float fMaxs[3]) const;
+
+	/**
+	 * Find the closest triangle along a ray.
+	 * \param fOrigin Start of the ray.
+	 * \param fDir    Direction of the ray, not necessarily normalized.
+	 * \param fMax    Furthest distance to consider, in units of fDir.
+	 * \param hit     Filled when something was hit.
+	 * \return True on a hit.
+	 */
+	bool Raycast(const float fOrigin[3], const float fDir[3], float fMax, BvhHit &hit) const;
+
+	/**
+	 * Find the triangles of another BVH whose bounds overlap triangles of this one.
+	 * \param other   The other BVH.
+	 * \param fOffset Added to the other's positions to place them in this one's space.
+	 * \param vPairs  Gets every pair of triangles whose bounds overlap.
+	 */
+	void FindOverlaps(const TriangleBvh &other, const float fOffset[3], std::vector<BvhPair> &vPairs) const;
+
+	/** Number of triangles. */
+	size_t GetTriangleCount() const { return this->m_vTriangles.size(); }
+
+	/** Number of nodes. */
+	size_t GetNodeCount() const { return this->m_vNodes.size(); }
+
+	/** Host memory held, in bytes. */
+	size_t GetMemoryBytes() const;
+
+	/** Changes on every build, so users can tell a rebuilt BVH from the one they saw. */
+	unsigned int GetBuildId() const { return this->m_uBuildId; }
+
+	/**
+	 * Distance along a ray to where it enters a box.
+	 * \param fInvDir One over each component of the ray direction.
+	 * \return FLT_MAX when the ray misses the box or enters past fMax.
+	 */
+	static float BoxEntry(const float fMins[3], const float fMaxs[3], const float fOrigin[3], const float fInvDir[3], float fMax);
+
+private:
+	struct Node
+	{
+		float fMins[3];
+		int   iRightOrFirst; /** Right child of an inner node, first triangle of a leaf. */
+		float fMaxs[3];
+		int   iCount;        /** Triangles of a leaf, 0 for inner nodes. */
+	};
+
+	/** Per build scratch, shared by the threads working on disjoint ranges. */
+	struct BuildState
+	{
+		std::vector<int>   vOrder;     /** Triangle of each position. */
+		std::vector<float> vCentroids; /** Three per triangle. */
+		std::vector<float> vMins;      /** Bounds of each triangle, three each. */
+		std::vector<float> vMaxs;
+	};
+
+	/** Append the subtree over vOrder[iFirst, iFirst + iCount) to vOut, its root first. */
+	void BuildNode(BuildState &state, std::vector<Node> &vOut, int iFirst, int iCount, int iDepth) const;
+
+	std::vector<BvhTriangle> m_vTriangles; /** In leaf order. */
+	std::vector<Node>        m_vNodes;     /** Depth first, the root first. */
+	unsigned int             m_uBuildId;   /** Set from a global counter by every build. */
+
+};//end TriangleBvh
+
+#endif //TRIANGLEBVH_H
@@ -23,6 +23,15 @@
 #include <SDL.h>
 #include <GL/glew.h>
 #include "VideoSystem.h"
+#include "MemoryRegistry.h"
+#include "FrameCapture.h"
+
+#include <cmath>
+#include <algorithm>
+
+
+// Samples of the offscreen framebuffer with multisampling, like the window's.
+#define FRAMEBUFFER_SAMPLES 4
 
 /**
  * Set the basic configuration of the window and renderer.
@@ -42,6 +51,28 @@ VideoSystem::VideoSystem(int iWidth, int iHeight, float fFov, bool bFullscreen,
 	m_bMultisampling = bMultisampling;
 	m_bVsync         = bVsync;
 
+	m_bDynamicResolution  = false;
+	m_fTargetMs           = 16.6f;
+	m_fMinScale           = 0.5f;
+	m_fMaxScale           = 1.0f;
+	m_fScale              = 1.0f;
+	m_fGpuMs              = 0.0f;
+	m_iRenderWidth        = iWidth;
+	m_iRenderHeight       = iHeight;
+	m_uFramebuffer        = 0;
+	m_uColorBuffer        = 0;
+	m_uDepthBuffer        = 0;
+	m_uResolveFramebuffer = 0;
+	m_uResolveBuffer      = 0;
+	m_uFrame              = 0;
+	m_bTiming             = false;
+	m_pCapture            = NULL;
+
+	for (unsigned int i = 0; i < QUERY_COUNT; i++) {
+		m_uQueries[i]      = 0;
+		m_bQueryPending[i] = false;
+	}
+
 }//end VideoSystem::VideoSystem()
 
 
@@ -50,6 +81,7 @@ VideoSystem::VideoSystem(int iWidth, int iHeight, float fFov, bool bFullscreen,
  */
 VideoSystem::~VideoSystem()
 {
+	this->DestroyFramebuffers();
 	SDL_GL_DeleteContext(this->sdlGLContext);
 	SDL_DestroyWindow(this->sdlWindow);
 
@@ -72,7 +104,11 @@ int VideoSystem::Init()
 		windowflags |= SDL_WINDOW_FULLSCREEN;
 	}
 
-	this->SetMultisampling(this->m_bMultisampling); // Setup multisampling before creating the window.
+	// Setup multisampling before creating the window. With dynamic resolution
+	// the samples are in the offscreen framebuffer instead.
+	bool bMultisampling = this->m_bMultisampling;
+	this->SetMultisampling(bMultisampling && !this->m_bDynamicResolution);
+	this->m_bMultisampling = bMultisampling;
 
 	this->sdlWindow = SDL_CreateWindow("HalfMapper (loading maps, please wait)", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, this->m_iWidth, this->m_iHeight, windowflags);
 
@@ -101,16 +137,226 @@ int VideoSystem::Init()
 
 	this->SetupViewport();
 
+	if (this->m_bDynamicResolution && !this->CreateFramebuffers()) {
+		std::cerr << "Framebuffer objects or timer queries not available, dynamic resolution disabled." << std::endl;
+		this->DestroyFramebuffers();
+		this->m_bDynamicResolution = false;
+	}
+
 	return 0;
 
 }//end VideoSystem::Init()
 
 
+/**
+ * Render into an offscreen framebuffer scaled each frame to hold a GPU
+ * frame time, then upscale it to the window. Call before Init().
+ * \param fTargetMs Frame time to hold, in milliseconds of GPU time.
+ * \param fMinScale Lowest resolution scale, per axis.
+ * \param fMaxScale Highest resolution scale, per axis.
+ */
+void VideoSystem::SetDynamicResolution(float fTargetMs, float fMinScale, float fMaxScale)
+{
+	this->m_bDynamicResolution = true;
+	this->m_fTargetMs          = std::max(fTargetMs, 1.0f);
+	this->m_fMaxScale          = std::min(std::max(fMaxScale, 0.1f), 2.0f);
+	this->m_fMinScale          = std::min(std::max(fMinScale, 0.1f), this->m_fMaxScale);
+	this->m_fScale             = this->m_fMaxScale;
+
+}//end VideoSystem::SetDynamicResolution()
+
+
+/**
+ * Create the offscreen framebuffers and timer queries. They are sized for
+ * the highest scale, lower scales render into a corner of them.
+ * \return False if unsupported.
+ */
+bool VideoSystem::CreateFramebuffers()
+{
+	if (!GLEW_ARB_framebuffer_object || !GLEW_ARB_timer_query) {
+		return false;
+	}
+
+	int iWidth  = std::max((int)(this->m_iWidth  * this->m_fMaxScale + 0.5f), 1);
+	int iHeight = std::max((int)(this->m_iHeight * this->m_fMaxScale + 0.5f), 1);
+	int iSamples = 0;
+
+	if (this->m_bMultisampling) {
+		GLint iMaxSamples = 0;
+		glGetIntegerv(GL_MAX_SAMPLES, &iMaxSamples);
+		iSamples = std::min(FRAMEBUFFER_SAMPLES, (int)iMaxSamples);
+	}
+
+	glGenRenderbuffers(1, &this->m_uColorBuffer);
+	glBindRenderbuffer(GL_RENDERBUFFER, this->m_uColorBuffer);
+	glRenderbufferStorageMultisample(GL_RENDERBUFFER, iSamples, GL_RGBA8, iWidth, iHeight);
+
+	glGenRenderbuffers(1, &this->m_uDepthBuffer);
+	glBindRenderbuffer(GL_RENDERBUFFER, this->m_uDepthBuffer);
+	glRenderbufferStorageMultisample(GL_RENDERBUFFER, iSamples, GL_DEPTH_COMPONENT24, iWidth, iHeight);
+
+	glGenFramebuffers(1, &this->m_uFramebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, this->m_uFramebuffer);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, this->m_uColorBuffer);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,  GL_RENDERBUFFER, this->m_uDepthBuffer);
+	bool bComplete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+
+	// Multisampled frames can only be blitted at the same size, so they are
+	// resolved first and upscaled from there.
+	if (iSamples > 0) {
+		glGenRenderbuffers(1, &this->m_uResolveBuffer);
+		glBindRenderbuffer(GL_RENDERBUFFER, this->m_uResolveBuffer);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, iWidth, iHeight);
+
+		glGenFramebuffers(1, &this->m_uResolveFramebuffer);
+		glBindFramebuffer(GL_FRAMEBUFFER, this->m_uResolveFramebuffer);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, this->m_uResolveBuffer);
+		bComplete = bComplete && glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+	}
+
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	if (!bComplete) {
+		return false;
+	}
+
+	glGenQueries(QUERY_COUNT, this->m_uQueries);
+
+	size_t uPixels = (size_t)iWidth * iHeight;
+	size_t uBytes  = uPixels * 8 * std::max(iSamples, 1) + (iSamples > 0 ? uPixels * 4 : 0);
+	g_gpuMemory.SetUsage(this, MemoryRegistry::CATEGORY_FRAMEBUFFER, "Dynamic resolution", uBytes);
+
+	std::cout << "Dynamic resolution: " << iWidth << "x" << iHeight << " framebuffer, " << iSamples << " samples, holding " << this->m_fTargetMs << " ms." << std::endl;
+
+	return true;
+
+}//end VideoSystem::CreateFramebuffers()
+
+
+/**
+ * Delete the offscreen framebuffers and timer queries.
+ */
+void VideoSystem::DestroyFramebuffers()
+{
+	if (this->m_uQueries[0] != 0) {
+		glDeleteQueries(QUERY_COUNT, this->m_uQueries);
+	}
+
+	if (this->m_uFramebuffer != 0) {
+		glDeleteFramebuffers(1, &this->m_uFramebuffer);
+		glDeleteRenderbuffers(1, &this->m_uColorBuffer);
+		glDeleteRenderbuffers(1, &this->m_uDepthBuffer);
+	}
+
+	if (this->m_uResolveFramebuffer != 0) {
+		glDeleteFramebuffers(1, &this->m_uResolveFramebuffer);
+		glDeleteRenderbuffers(1, &this->m_uResolveBuffer);
+	}
+
+	for (unsigned int i = 0; i < QUERY_COUNT; i++) {
+		this->m_uQueries[i]      = 0;
+		this->m_bQueryPending[i] = false;
+	}
+
+	this->m_uFramebuffer        = 0;
+	this->m_uColorBuffer        = 0;
+	this->m_uDepthBuffer        = 0;
+	this->m_uResolveFramebuffer = 0;
+	this->m_uResolveBuffer      = 0;
+
+	g_gpuMemory.SetUsage(this, MemoryRegistry::CATEGORY_FRAMEBUFFER, "Dynamic resolution", 0);
+
+}//end VideoSystem::DestroyFramebuffers()
+
+
+/**
+ * Read finished timer queries and pick the next scale. The cost of a frame
+ * grows with its pixels, the square of the scale, so the scale that would
+ * have met the target is the current one times the square root of the time
+ * ratio. The scale moves part of the way there each frame, and not at all
+ * for small changes, so it doesn't shimmer.
+ */
+void VideoSystem::UpdateScale()
+{
+	for (unsigned int i = 0; i < QUERY_COUNT; i++) {
+		// Oldest first, the current frame's query is the newest.
+		unsigned int uSlot = (this->m_uFrame + 1 + i) % QUERY_COUNT;
+
+		if (this->m_bQueryPending[uSlot] && !this->ReadQuery(uSlot)) {
+			break;
+		}
+	}
+
+	// Captured frames keep the full scale, however long they take.
+	if (this->m_pCapture != NULL) {
+		this->m_fScale = this->m_fMaxScale;
+		return;
+	}
+
+	if (this->m_fGpuMs <= 0.0f) {
+		return;
+	}
+
+	float fIdeal = this->m_fScale * std::sqrt(this->m_fTargetMs / this->m_fGpuMs);
+	fIdeal = std::min(std::max(fIdeal, this->m_fMinScale), this->m_fMaxScale);
+
+	if (std::fabs(fIdeal - this->m_fScale) > 0.02f || fIdeal == this->m_fMinScale || fIdeal == this->m_fMaxScale) {
+		this->m_fScale += (fIdeal - this->m_fScale) * 0.25f;
+	}
+
+}//end VideoSystem::UpdateScale()
+
+
+/**
+ * Read a finished timer query into the smoothed GPU time.
+ * \param uSlot Pending query.
+ * \return False when its result isn't available yet.
+ */
+bool VideoSystem::ReadQuery(unsigned int uSlot)
+{
+	GLint iAvailable = 0;
+	glGetQueryObjectiv(this->m_uQueries[uSlot], GL_QUERY_RESULT_AVAILABLE, &iAvailable);
+
+	if (!iAvailable) {
+		return false;
+	}
+
+	GLuint64 uNanoseconds = 0;
+	glGetQueryObjectui64v(this->m_uQueries[uSlot], GL_QUERY_RESULT, &uNanoseconds);
+	this->m_bQueryPending[uSlot] = false;
+
+	float fMs = (float)(uNanoseconds / 1000000.0);
+	this->m_fGpuMs = this->m_fGpuMs > 0.0f ? this->m_fGpuMs * 0.8f + fMs * 0.2f : fMs;
+
+	return true;
+
+}//end VideoSystem::ReadQuery()
+
+
 /**
  * Clear the buffer.
  */
 void VideoSystem::ClearBuffer()
 {
+	if (this->m_bDynamicResolution) {
+		unsigned int uSlot = this->m_uFrame % QUERY_COUNT;
+
+		// When the GPU is QUERY_COUNT frames behind, the slot's query is
+		// still running, and this frame goes untimed rather than waiting.
+		this->m_bTiming = !this->m_bQueryPending[uSlot] || this->ReadQuery(uSlot);
+
+		this->m_iRenderWidth  = std::max((int)(this->m_iWidth  * this->m_fScale + 0.5f), 1);
+		this->m_iRenderHeight = std::max((int)(this->m_iHeight * this->m_fScale + 0.5f), 1);
+
+		glBindFramebuffer(GL_FRAMEBUFFER, this->m_uFramebuffer);
+		glViewport(0, 0, this->m_iRenderWidth, this->m_iRenderHeight);
+
+		if (this->m_bTiming) {
+			glBeginQuery(GL_TIME_ELAPSED, this->m_uQueries[uSlot]);
+		}
+	}
+
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
 }//end VideoSystem::ClearBuffer()
@@ -121,8 +367,41 @@ void VideoSystem::ClearBuffer()
  */
 void VideoSystem::SwapBuffers()
 {
+	if (this->m_bDynamicResolution) {
+		if (this->m_bTiming) {
+			glEndQuery(GL_TIME_ELAPSED);
+			this->m_bQueryPending[this->m_uFrame % QUERY_COUNT] = true;
+		}
+
+		int iWidth  = this->m_iRenderWidth;
+		int iHeight = this->m_iRenderHeight;
+
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, this->m_uFramebuffer);
+
+		if (this->m_uResolveFramebuffer != 0) {
+			glBindFramebuffer(GL_DRAW_FRAMEBUFFER, this->m_uResolveFramebuffer);
+			glBlitFramebuffer(0, 0, iWidth, iHeight, 0, 0, iWidth, iHeight, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+			glBindFramebuffer(GL_READ_FRAMEBUFFER, this->m_uResolveFramebuffer);
+		}
+
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+		glBlitFramebuffer(0, 0, iWidth, iHeight, 0, 0, this->m_iWidth, this->m_iHeight, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glViewport(0, 0, this->m_iWidth, this->m_iHeight);
+	}
+
+	// The back buffer holds the upscaled frame now, and is undefined once swapped.
+	if (this->m_pCapture != NULL) {
+		this->m_pCapture->Read();
+	}
+
 	SDL_GL_SwapWindow(this->sdlWindow);
 
+	if (this->m_bDynamicResolution) {
+		this->UpdateScale();
+		this->m_uFrame++;
+	}
+
 }//end VideoSystem::SwapBuffers()
 
 
@@ -172,8 +451,8 @@ void VideoSystem::SetMultisampling(bool bEnable)
 {
 	if (bEnable) {
 		glEnable(GL_MULTISAMPLE);
-		SDL_GL_SetAttribute(SDL_GL_MULTISAMPLEBUFFERS, 1);
-		SDL_GL_SetAttribute(SDL_GL_MULTISAMPLESAMPLES, 4);
+		SDL_GL_SetAttribute(SDL_GL_MULTISAMPLEBUFFERS, 1);
+		SDL_GL_SetAttribute(SDL_GL_MULTISAMPLESAMPLES, 4);
 	}
 	else {
 		glDisable(GL_MULTISAMPLE);
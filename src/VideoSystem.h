@@ -26,6 +26,8 @@
 typedef struct SDL_Window SDL_Window;
 typedef void *SDL_GLContext;
 
+class FrameCapture;
+
 
 /**
  * Rendering and Window management.
@@ -47,6 +49,15 @@ public:
 	/** Destructor */
 	~VideoSystem();
 
+	/**
+	 * Render into an offscreen framebuffer scaled each frame to hold a GPU
+	 * frame time, then upscale it to the window. Call before Init().
+	 * \param fTargetMs Frame time to hold, in milliseconds of GPU time.
+	 * \param fMinScale Lowest resolution scale, per axis.
+	 * \param fMaxScale Highest resolution scale, per axis.
+	 */
+	void SetDynamicResolution(float fTargetMs, float fMinScale, float fMaxScale);
+
 	/** Create the window and GL context. */
 	int  Init();
 
@@ -62,7 +73,41 @@ public:
 	 */
 	void SetWindowTitle(const char *szTitle);
 
+	/** Check if the world is rendered at a dynamic resolution. */
+	bool IsDynamicResolution() const { return this->m_bDynamicResolution; }
+
+	/** Resolution scale per axis of the last frame, 1 without dynamic resolution. */
+	float GetResolutionScale() const { return this->m_fScale; }
+
+	/** Smoothed GPU time of a frame in milliseconds, 0 without dynamic resolution. */
+	float GetGpuTime() const { return this->m_fGpuMs; }
+
+	/**
+	 * Read every frame into a capture, at window size, before it is swapped.
+	 * The resolution scale stays at its maximum while capturing.
+	 * \param pCapture Started capture, NULL to stop reading.
+	 */
+	void SetFrameCapture(FrameCapture *pCapture) { this->m_pCapture = pCapture; }
+
 private:
+	/**
+	 * Timer queries in flight. Results are read a few frames late, once
+	 * available, so reading them never waits on the GPU.
+	 */
+	static const unsigned int QUERY_COUNT = 4;
+
+	/** Create the offscreen framebuffers and timer queries, false if unsupported. */
+	bool CreateFramebuffers();
+
+	/** Delete the offscreen framebuffers and timer queries. */
+	void DestroyFramebuffers();
+
+	/** Read finished timer queries and pick the next scale. */
+	void UpdateScale();
+
+	/** Read a finished timer query into the smoothed GPU time, false when not available yet. */
+	bool ReadQuery(unsigned int uSlot);
+
 	/** Set the perspective of the viewport, and set some GL hints. */
 	void SetupViewport();
 
@@ -87,6 +132,27 @@ private:
 	SDL_Window*   sdlWindow;        /** Pointer to the SDL Window. */
 	SDL_GLContext sdlGLContext;     /** Hold the SDL OpenGL Context. */
 
+	// Dynamic resolution.
+	bool          m_bDynamicResolution; /** Render offscreen at a scale picked from GPU time. */
+	float         m_fTargetMs;      /** GPU frame time to hold. */
+	float         m_fMinScale;      /** Lowest scale per axis. */
+	float         m_fMaxScale;      /** Highest scale per axis, the framebuffers are this size. */
+	float         m_fScale;         /** Scale of the current frame. */
+	float         m_fGpuMs;         /** Smoothed GPU frame time. */
+	int           m_iRenderWidth;   /** Size rendered this frame. */
+	int           m_iRenderHeight;
+	unsigned int  m_uFramebuffer;   /** Rendered into, multisampled with multisampling on. */
+	unsigned int  m_uColorBuffer;
+	unsigned int  m_uDepthBuffer;
+	unsigned int  m_uResolveFramebuffer; /** Multisampled frames are resolved here before upscaling. */
+	unsigned int  m_uResolveBuffer;
+	unsigned int  m_uQueries[QUERY_COUNT]; /** GL_TIME_ELAPSED queries, in a ring so results are read without waiting. */
+	bool          m_bQueryPending[QUERY_COUNT];
+	bool          m_bTiming;        /** The current frame has a query running. */
+	unsigned int  m_uFrame;         /** Frames rendered offscreen, selects the query. */
+
+	FrameCapture *m_pCapture;       /** Reads each frame before the swap, may be NULL. */
+
 };//end VideoSystem
 
 #endif //VIDEO_H
@@ -0,0 +1,539 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <stdint.h>
+#include <SDL.h>
+#include "VirtualFileSystem.h"
+
+#if defined(_MSC_VER)
+	#include <io.h>
+#else
+	#include <dirent.h>
+#endif
+
+#if !defined(_MSC_VER) && !defined(__MINGW32__)
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+	#define VFS_MMAP
+#endif
+
+// Layout of a PAK header, followed somewhere by nDirLength / sizeof(PakEntry) entries.
+struct PakHeader
+{
+	char    szMagic[4];  // PACK
+	int32_t nDirOffset;  // Offset of the directory
+	int32_t nDirLength;  // Size of the directory, in bytes
+};
+
+struct PakEntry
+{
+	char    szName[56];  // Relative path, null terminated
+	int32_t nFilePos;    // Offset of the file
+	int32_t nFileLength; // Size of the file
+};
+
+
+/**
+ * Bytes of a file, mapped or read into memory.
+ */
+struct VfsMapping
+{
+	VfsMapping() : pData(NULL), pMapping(NULL), uSize(0) {}
+
+	~VfsMapping()
+	{
+#ifdef VFS_MMAP
+		if (this->pMapping != NULL) {
+			munmap(this->pMapping, this->uSize);
+		}
+#endif
+	}
+
+	std::string                szPath;   /** File on disk. */
+	const unsigned char       *pData;    /** Start of the bytes, NULL when not loaded. */
+	void                      *pMapping; /** Mapping to release, NULL when read into vData. */
+	size_t                     uSize;    /** Size of the bytes. */
+	std::vector<unsigned char> vData;    /** Bytes, where mapping isn't available. */
+};
+
+
+/**
+ * Map a whole file, or read it where mapping isn't available.
+ */
+static std::shared_ptr<VfsMapping> MapFile(const std::string &szPath)
+{
+	std::shared_ptr<VfsMapping> pMapping(new VfsMapping());
+	pMapping->szPath = szPath;
+
+#ifdef VFS_MMAP
+	int fd = open(szPath.c_str(), O_RDONLY);
+
+	if (fd == -1) {
+		return std::shared_ptr<VfsMapping>();
+	}
+
+	struct stat st;
+	memset(&st, 0, sizeof(st));
+
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+		if (p != MAP_FAILED) {
+			pMapping->pMapping = p;
+			pMapping->pData    = (const unsigned char*)p;
+			pMapping->uSize    = (size_t)st.st_size;
+		}
+	}
+
+	close(fd);
+
+	if (pMapping->pData != NULL || st.st_size == 0) {
+		return pMapping;
+	}
+#endif
+
+	std::ifstream file(szPath.c_str(), std::ios::binary);
+
+	if (!file.is_open()) {
+		return std::shared_ptr<VfsMapping>();
+	}
+
+	file.seekg(0, std::ios::end);
+	pMapping->vData.resize((size_t)file.tellg());
+	file.seekg(0, std::ios::beg);
+
+	if (!pMapping->vData.empty()) {
+		file.read((char*)&pMapping->vData[0], pMapping->vData.size());
+	}
+
+	pMapping->pData = pMapping->vData.empty() ? NULL : &pMapping->vData[0];
+	pMapping->uSize = pMapping->vData.size();
+	return pMapping;
+
+}//end MapFile()
+
+
+/**
+ * Read part of a file into memory.
+ */
+static std::shared_ptr<VfsMapping> ReadRange(const std::string &szPath, size_t uOffset, size_t uSize)
+{
+	std::ifstream file(szPath.c_str(), std::ios::binary);
+
+	if (!file.is_open()) {
+		return std::shared_ptr<VfsMapping>();
+	}
+
+	std::shared_ptr<VfsMapping> pMapping(new VfsMapping());
+	pMapping->szPath = szPath;
+	pMapping->vData.resize(uSize);
+
+	file.seekg(uOffset, std::ios::beg);
+
+	if (uSize > 0) {
+		file.read((char*)&pMapping->vData[0], uSize);
+		pMapping->vData.resize((size_t)file.gcount());
+	}
+
+	pMapping->pData = pMapping->vData.empty() ? NULL : &pMapping->vData[0];
+	pMapping->uSize = pMapping->vData.size();
+	return pMapping;
+
+}//end ReadRange()
+
+
+/**
+ * Constructor
+ */
+VfsFile::VfsFile()
+{
+	this->m_pData = NULL;
+	this->m_uSize = 0;
+
+}//end VfsFile::VfsFile()
+
+
+/**
+ * Constructor
+ * \param file The file, must outlive the stream.
+ */
+VfsStream::VfsStream(const VfsFile &file)
+	: std::istream(NULL), m_buffer(file.GetData(), file.GetSize())
+{
+	this->rdbuf(&this->m_buffer);
+
+}//end VfsStream::VfsStream()
+
+
+/**
+ * Constructor, the get area covers the whole file.
+ */
+VfsStream::Buffer::Buffer(const unsigned char *pData, size_t uSize)
+{
+	char *p = (char*)pData;
+	this->setg(p, p, p + uSize);
+
+}//end VfsStream::Buffer::Buffer()
+
+
+/**
+ * Seek inside the get area.
+ */
+VfsStream::Buffer::pos_type VfsStream::Buffer::seekoff(off_type iOffset, std::ios_base::seekdir eDir, std::ios_base::openmode eMode)
+{
+	off_type iSize = this->egptr() - this->eback();
+	off_type iPos  = iOffset;
+
+	if (!(eMode & std::ios_base::in)) {
+		return pos_type(off_type(-1));
+	}
+
+	if (eDir == std::ios_base::cur) {
+		iPos += this->gptr() - this->eback();
+	} else if (eDir == std::ios_base::end) {
+		iPos += iSize;
+	}
+
+	if (iPos < 0 || iPos > iSize) {
+		return pos_type(off_type(-1));
+	}
+
+	this->setg(this->eback(), this->eback() + iPos, this->egptr());
+	return pos_type(iPos);
+
+}//end VfsStream::Buffer::seekoff()
+
+
+/**
+ * Seek inside the get area.
+ */
+VfsStream::Buffer::pos_type VfsStream::Buffer::seekpos(pos_type iPos, std::ios_base::openmode eMode)
+{
+	return this->seekoff(off_type(iPos), std::ios_base::beg, eMode);
+
+}//end VfsStream::Buffer::seekpos()
+
+
+/**
+ * Constructor
+ */
+VirtualFileSystem::VirtualFileSystem()
+{
+}//end VirtualFileSystem::VirtualFileSystem()
+
+
+/**
+ * Destructor
+ */
+VirtualFileSystem::~VirtualFileSystem()
+{
+}//end VirtualFileSystem::~VirtualFileSystem()
+
+
+/**
+ * Scan the game paths and their PAKs, replacing the previous index.
+ * Views opened before stay valid.
+ * \param szGamePaths Game paths, highest precedence first.
+ */
+void VirtualFileSystem::Mount(const std::vector<std::string> &szGamePaths)
+{
+	std::lock_guard<std::mutex> lock(this->m_mutex);
+	unsigned int uStart = SDL_GetTicks();
+
+	this->m_mIndex.clear();
+	this->m_vPaks.clear();
+
+	for (size_t i = 0; i < szGamePaths.size(); i++) {
+		std::string szRoot = szGamePaths[i];
+
+		if (!szRoot.empty() && szRoot[szRoot.size() - 1] != '/' && szRoot[szRoot.size() - 1] != '\\') {
+			szRoot += '/';
+		}
+
+		// Loose files come first, so they override the PAKs of the same path.
+		std::vector<std::string> vPaks;
+		this->ScanDirectory(szRoot, "", vPaks);
+
+		// pak10.pak sorts after pak9.pak.
+		std::sort(vPaks.begin(), vPaks.end(), [](const std::string &a, const std::string &b) {
+			return a.size() != b.size() ? a.size() > b.size() : a > b;
+		});
+
+		for (size_t j = 0; j < vPaks.size(); j++) {
+			this->ScanPak(szRoot + vPaks[j]);
+		}
+	}
+
+	std::cout << "Indexed " << this->m_mIndex.size() << " game files (" << this->m_vPaks.size() << " PAKs) in " << SDL_GetTicks() - uStart << " ms." << std::endl;
+
+}//end VirtualFileSystem::Mount()
+
+
+/**
+ * Open a file.
+ * \param szPath Relative path, any case or slashes.
+ * \param file   Receives the view.
+ * \return False when the file isn't in any game path.
+ */
+bool VirtualFileSystem::Open(const std::string &szPath, VfsFile &file) const
+{
+	Entry entry;
+	std::shared_ptr<VfsMapping> pPak;
+	{
+		std::lock_guard<std::mutex> lock(this->m_mutex);
+		std::unordered_map<std::string, Entry>::const_iterator it = this->m_mIndex.find(Normalize(szPath));
+
+		if (it == this->m_mIndex.end()) {
+			return false;
+		}
+
+		entry = it->second;
+
+		if (entry.iPak != -1) {
+			pPak = this->m_vPaks[entry.iPak];
+		}
+	}
+
+	std::shared_ptr<VfsMapping> pMapping;
+	size_t uOffset = 0;
+
+	if (pPak && pPak->pData != NULL) {
+		// A view into the mapped PAK, nothing is read.
+		pMapping = pPak;
+		uOffset  = entry.uOffset;
+	} else if (entry.iPak != -1) {
+		pMapping = ReadRange(entry.szSource, entry.uOffset, entry.uSize);
+	} else {
+		pMapping = MapFile(entry.szSource);
+	}
+
+	if (!pMapping) {
+		return false;
+	}
+
+	file.m_pMapping = pMapping;
+	file.m_pData    = pMapping->pData != NULL ? pMapping->pData + uOffset : NULL;
+	file.m_uSize    = pMapping == pPak ? entry.uSize : pMapping->uSize;
+	file.m_szSource = entry.szSource;
+	return true;
+
+}//end VirtualFileSystem::Open()
+
+
+/**
+ * File on disk a path resolves to, the PAK for PAK entries.
+ * \param szPath Relative path, any case or slashes.
+ * \return Empty when the file isn't in any game path.
+ */
+std::string VirtualFileSystem::Locate(const std::string &szPath) const
+{
+	std::lock_guard<std::mutex> lock(this->m_mutex);
+	std::unordered_map<std::string, Entry>::const_iterator it = this->m_mIndex.find(Normalize(szPath));
+
+	return it == this->m_mIndex.end() ? "" : it->second.szSource;
+
+}//end VirtualFileSystem::Locate()
+
+
+/**
+ * Number of indexed files.
+ */
+size_t VirtualFileSystem::GetFileCount() const
+{
+	std::lock_guard<std::mutex> lock(this->m_mutex);
+	return this->m_mIndex.size();
+
+}//end VirtualFileSystem::GetFileCount()
+
+
+/**
+ * Lower case, forward slashes, no leading slashes.
+ */
+std::string VirtualFileSystem::Normalize(const std::string &szPath)
+{
+	std::string szOut;
+	szOut.reserve(szPath.size());
+
+	for (size_t i = 0; i < szPath.size(); i++) {
+		char c = szPath[i] == '\\' ? '/' : (char)tolower((unsigned char)szPath[i]);
+
+		if (c == '/' && (szOut.empty() || szOut[szOut.size() - 1] == '/')) {
+			continue;
+		}
+
+		szOut += c;
+	}
+
+	return szOut;
+
+}//end VirtualFileSystem::Normalize()
+
+
+/**
+ * Index loose files under a directory, recursively.
+ * \param szRoot     Game path, ending in a slash.
+ * \param szRelative Directory relative to it, empty or ending in a slash.
+ * \param vPaks      Receives the PAKs found at the root.
+ */
+void VirtualFileSystem::ScanDirectory(const std::string &szRoot, const std::string &szRelative, std::vector<std::string> &vPaks)
+{
+	std::vector<std::pair<std::string, bool> > vNames;
+
+#if defined(_MSC_VER)
+	struct _finddata_t data;
+	intptr_t hFind = _findfirst((szRoot + szRelative + "*").c_str(), &data);
+
+	if (hFind == -1) {
+		return;
+	}
+
+	do {
+		vNames.push_back(std::make_pair(std::string(data.name), (data.attrib & _A_SUBDIR) != 0));
+	} while (_findnext(hFind, &data) == 0);
+
+	_findclose(hFind);
+#else
+	DIR *pDir = opendir((szRoot + szRelative).c_str());
+
+	if (pDir == NULL) {
+		return;
+	}
+
+	struct dirent *pEntry;
+
+	while ((pEntry = readdir(pDir)) != NULL) {
+		bool bDirectory = false;
+
+#ifdef _DIRENT_HAVE_D_TYPE
+		if (pEntry->d_type != DT_UNKNOWN && pEntry->d_type != DT_LNK) {
+			bDirectory = pEntry->d_type == DT_DIR;
+		} else
+#endif
+		{
+			DIR *pChild = opendir((szRoot + szRelative + pEntry->d_name).c_str());
+			bDirectory = pChild != NULL;
+
+			if (pChild != NULL) {
+				closedir(pChild);
+			}
+		}
+
+		vNames.push_back(std::make_pair(std::string(pEntry->d_name), bDirectory));
+	}
+
+	closedir(pDir);
+#endif
+
+	for (size_t i = 0; i < vNames.size(); i++) {
+		const std::string &szName = vNames[i].first;
+
+		if (szName == "." || szName == "..") {
+			continue;
+		}
+
+		if (vNames[i].second) {
+			this->ScanDirectory(szRoot, szRelative + szName + "/", vPaks);
+			continue;
+		}
+
+		std::string szKey = Normalize(szRelative + szName);
+
+		if (szRelative.empty() && szKey.size() > 4 && szKey.compare(szKey.size() - 4, 4, ".pak") == 0) {
+			vPaks.push_back(szName);
+		}
+
+		Entry entry;
+		entry.iPak     = -1;
+		entry.szSource = szRoot + szRelative + szName;
+		entry.uOffset  = 0;
+		entry.uSize    = 0;
+		this->m_mIndex.insert(std::make_pair(szKey, entry));
+	}
+
+}//end VirtualFileSystem::ScanDirectory()
+
+
+/**
+ * Index the entries of a PAK.
+ * \param szPath PAK on disk.
+ */
+void VirtualFileSystem::ScanPak(const std::string &szPath)
+{
+	std::ifstream file(szPath.c_str(), std::ios::binary);
+	PakHeader header;
+
+	file.read((char*)&header, sizeof(header));
+
+	if (!file || memcmp(header.szMagic, "PACK", 4) != 0 || header.nDirOffset < 0 || header.nDirLength < 0) {
+		std::cout << "Skipping " << szPath << ", not a PAK." << std::endl;
+		return;
+	}
+
+	std::vector<PakEntry> vEntries(header.nDirLength / sizeof(PakEntry));
+	file.seekg(header.nDirOffset, std::ios::beg);
+
+	if (!vEntries.empty()) {
+		file.read((char*)&vEntries[0], vEntries.size() * sizeof(PakEntry));
+	}
+
+	if (!file) {
+		std::cout << "Skipping " << szPath << ", truncated directory." << std::endl;
+		return;
+	}
+
+	// Mapped once, entries are views into it.
+#ifdef VFS_MMAP
+	std::shared_ptr<VfsMapping> pMapping = MapFile(szPath);
+#else
+	std::shared_ptr<VfsMapping> pMapping(new VfsMapping());
+	pMapping->szPath = szPath;
+#endif
+
+	if (!pMapping) {
+		return;
+	}
+
+	int iPak = (int)this->m_vPaks.size();
+	this->m_vPaks.push_back(pMapping);
+
+	for (size_t i = 0; i < vEntries.size(); i++) {
+		const PakEntry &e = vEntries[i];
+
+		if (e.nFilePos < 0 || e.nFileLength < 0 || (pMapping->pData != NULL && (size_t)e.nFilePos + e.nFileLength > pMapping->uSize)) {
+			continue;
+		}
+
+		Entry entry;
+		entry.iPak     = iPak;
+		entry.szSource = szPath;
+		entry.uOffset  = (size_t)e.nFilePos;
+		entry.uSize    = (size_t)e.nFileLength;
+		this->m_mIndex.insert(std::make_pair(Normalize(std::string(e.szName, strnlen(e.szName, sizeof(e.szName)))), entry));
+	}
+
+}//end VirtualFileSystem::ScanPak()
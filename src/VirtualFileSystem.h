@@ -0,0 +1,165 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#ifndef VIRTUALFILESYSTEM_H
+#define VIRTUALFILESYSTEM_H
+
+#include <string>
+#include <vector>
+#include <istream>
+#include <streambuf>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+struct VfsMapping;
+
+
+/**
+ * A read only view of a game file, loose or inside a PAK. The bytes are
+ * memory mapped where possible, and stay valid for as long as the view
+ * is kept, even if the file system is mounted again.
+ */
+class VfsFile
+{
+public:
+	/** Constructor */
+	VfsFile();
+
+	/** Start of the file. */
+	const unsigned char *GetData() const { return this->m_pData; }
+
+	/** Size of the file, in bytes. */
+	size_t GetSize() const { return this->m_uSize; }
+
+	/** File on disk the bytes come from, the PAK for PAK entries. */
+	const std::string &GetSourcePath() const { return this->m_szSource; }
+
+private:
+	friend class VirtualFileSystem;
+
+	std::shared_ptr<VfsMapping>  m_pMapping; /** Keeps the bytes alive. */
+	const unsigned char         *m_pData;    /** Start of the file. */
+	size_t                       m_uSize;    /** Size of the file. */
+	std::string                  m_szSource; /** File on disk. */
+
+};//end VfsFile
+
+
+/**
+ * An istream over a VfsFile, so existing parsers can seek and read
+ * straight from the mapping.
+ */
+class VfsStream : public std::istream
+{
+public:
+	/**
+	 * Constructor
+	 * \param file The file, must outlive the stream.
+	 */
+	explicit VfsStream(const VfsFile &file);
+
+private:
+	class Buffer : public std::streambuf
+	{
+	public:
+		Buffer(const unsigned char *pData, size_t uSize);
+
+	protected:
+		pos_type seekoff(off_type iOffset, std::ios_base::seekdir eDir, std::ios_base::openmode eMode);
+		pos_type seekpos(pos_type iPos, std::ios_base::openmode eMode);
+	};
+
+	Buffer m_buffer; /** Get area over the file. */
+
+};//end VfsStream
+
+
+/**
+ * Index of every file in the game paths, and in the PAK archives at
+ * their root, built with a single scan.
+ *
+ * Paths are relative to the game path, lower case and use forward
+ * slashes. When several sources have the same path the first one wins:
+ * game paths in config order, so a mod is listed before the game it
+ * overrides, then loose files over PAKs, then higher numbered PAKs
+ * (pak1.pak) over lower ones (pak0.pak), like the engine. Safe to use
+ * from loader threads.
+ */
+class VirtualFileSystem
+{
+public:
+	/** Constructor */
+	VirtualFileSystem();
+
+	/** Destructor */
+	~VirtualFileSystem();
+
+	/**
+	 * Scan the game paths and their PAKs, replacing the previous index.
+	 * Views opened before stay valid.
+	 * \param szGamePaths Game paths, highest precedence first.
+	 */
+	void Mount(const std::vector<std::string> &szGamePaths);
+
+	/**
+	 * Open a file.
+	 * \param szPath Relative path, any case or slashes.
+	 * \param file   Receives the view.
+	 * \return False when the file isn't in any game path.
+	 */
+	bool Open(const std::string &szPath, VfsFile &file) const;
+
+	/**
+	 * File on disk a path resolves to, the PAK for PAK entries.
+	 * \param szPath Relative path, any case or slashes.
+	 * \return Empty when the file isn't in any game path.
+	 */
+	std::string Locate(const std::string &szPath) const;
+
+	/** Number of indexed files. */
+	size_t GetFileCount() const;
+
+private:
+	struct Entry
+	{
+		int         iPak;     /** Index into m_vPaks, -1 for loose files. */
+		std::string szSource; /** File on disk. */
+		size_t      uOffset;  /** Start inside the PAK. */
+		size_t      uSize;    /** Size of the file. */
+	};
+
+	/** Lower case, forward slashes, no leading slashes. */
+	static std::string Normalize(const std::string &szPath);
+
+	/** Index loose files under a directory, recursively. */
+	void ScanDirectory(const std::string &szRoot, const std::string &szRelative, std::vector<std::string> &vPaks);
+
+	/** Index the entries of a PAK. */
+	void ScanPak(const std::string &szPath);
+
+	std::unordered_map<std::string, Entry>    m_mIndex; /** Relative path to its source. */
+	std::vector<std::shared_ptr<VfsMapping> > m_vPaks;  /** Mounted PAKs. */
+	mutable std::mutex                        m_mutex;  /** Guards the index against remounts. */
+
+};//end VirtualFileSystem
+
+#endif //VIRTUALFILESYSTEM_H
@@ -0,0 +1,256 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#include "common.h"
+#include "bsp.h"
+#include "Frustum.h"
+#include "OcclusionCuller.h"
+#include "JobSystem.h"
+#include "VisibilityPass.h"
+
+// Maps per job, and clusters per range. A range of clusters costs about as
+// much as a few maps, so jobs end up of similar size.
+#define MAPS_PER_JOB     8
+#define CLUSTERS_PER_JOB 32
+
+
+/**
+ * Constructor
+ * \param vMaps The maps, results are indexed like it.
+ */
+VisibilityPass::VisibilityPass(const std::vector<BSP*> &vMaps) :
+	m_vMaps(vMaps)
+{
+	this->m_pFrustum  = NULL;
+	this->m_pCuller   = NULL;
+	this->m_pLodView  = NULL;
+	this->m_bClusters = false;
+	this->m_pJobs     = NULL;
+	this->m_fTime     = 0.0f;
+
+	for (int i = 0; i < 3; i++) {
+		this->m_fCamera[i] = 0.0f;
+	}
+
+}//end VisibilityPass::VisibilityPass()
+
+
+/**
+ * One flag per GetClusterBounds() entry of a map, NULL to draw every cluster.
+ */
+const std::vector<char> *VisibilityPass::GetClusterVisible(size_t i) const
+{
+	return this->m_vClusterVisible[i].empty() ? NULL : &this->m_vClusterVisible[i];
+
+}//end VisibilityPass::GetClusterVisible()
+
+
+/**
+ * Run func over [0, uCount), with jobs when there is a job system.
+ */
+void VisibilityPass::Spread(size_t uCount, size_t uGrain, void (VisibilityPass::*func)(size_t, size_t))
+{
+	if (this->m_pJobs != NULL) {
+		this->m_pJobs->ParallelFor(uCount, uGrain, std::bind(func, this, std::placeholders::_1, std::placeholders::_2));
+	} else if (uCount != 0) {
+		(this->*func)(0, uCount);
+	}
+
+}//end VisibilityPass::Spread()
+
+
+/**
+ * Compute this frame's visibility.
+ * \param frustum       View frustum, already extracted.
+ * \param pCuller       Occlusion culler, NULL to only test the frustum.
+ * \param pLodView      How the camera sees the world, NULL to draw every map at full detail.
+ * \param fCamera       World position of the camera.
+ * \param uOccluderMaps Nearest maps in view rasterized as occluders.
+ * \param bClusters     Also test each map's clusters against the occluders.
+ * \param pJobs         Job system to spread the tests over, NULL to run them here.
+ */
+void VisibilityPass::Run(const Frustum &frustum, OcclusionCuller *pCuller, const LODVIEW *pLodView, const float fCamera[3],
+                         size_t uOccluderMaps, bool bClusters, JobSystem *pJobs)
+{
+	Uint64 uStart = SDL_GetPerformanceCounter();
+	size_t uMaps  = this->m_vMaps.size();
+
+	this->m_pFrustum  = &frustum;
+	this->m_pCuller   = pCuller;
+	this->m_pLodView  = pLodView;
+	this->m_bClusters = bClusters && pCuller != NULL;
+	this->m_pJobs     = pJobs;
+
+	for (int i = 0; i < 3; i++) {
+		this->m_fCamera[i] = fCamera[i];
+	}
+
+	this->m_vLod.resize(uMaps);
+	this->m_vVisible.resize(uMaps);
+	this->m_vBatchMask.resize(uMaps);
+	this->m_vInFrustum.resize(uMaps);
+	this->m_vDistance.resize(uMaps);
+	this->m_vBounds.resize(uMaps * 6);
+	this->m_vClusterVisible.resize(uMaps);
+	this->m_vClusterBounds.resize(uMaps);
+
+	// Offsets are resolved in map order first, as a map is placed from
+	// a neighbour resolved before it, the jobs then only look them up.
+	for (size_t i = 0; i < uMaps; i++) {
+		this->m_vMaps[i]->GetRenderOffset();
+	}
+
+	this->Spread(uMaps, MAPS_PER_JOB, &VisibilityPass::TestMaps);
+
+	// Rasterize the nearest maps in view as occluders
+	if (pCuller != NULL) {
+		pCuller->Begin(frustum.GetClipMatrix());
+
+		this->m_vNearest.clear();
+
+		for (size_t i = 0; i < uMaps; i++) {
+			if (this->m_vInFrustum[i]) {
+				this->m_vNearest.push_back(std::make_pair(this->m_vDistance[i], i));
+			}
+		}
+
+		std::sort(this->m_vNearest.begin(), this->m_vNearest.end());
+
+		for (size_t i = 0; i < this->m_vNearest.size() && i < uOccluderMaps; i++) {
+			BSP   *pMap = this->m_vMaps[this->m_vNearest[i].second];
+			VERTEX o    = pMap->GetRenderOffset();
+			pCuller->AddOccluders(pMap->GetOccluders(), &o.x);
+		}
+
+		pCuller->BuildPyramid();
+	}
+
+	this->Spread(uMaps, MAPS_PER_JOB, &VisibilityPass::TestOcclusion);
+
+	// Cut every map's clusters into ranges, so a large map is spread too
+	this->m_vClusterRanges.clear();
+
+	for (size_t i = 0; i < uMaps; i++) {
+		size_t uClusters = this->m_vClusterVisible[i].size();
+
+		for (size_t j = 0; j < uClusters; j += CLUSTERS_PER_JOB) {
+			ClusterRange r;
+			r.uMap   = i;
+			r.uFirst = j;
+			r.uEnd   = std::min(j + CLUSTERS_PER_JOB, uClusters);
+			this->m_vClusterRanges.push_back(r);
+		}
+	}
+
+	this->Spread(this->m_vClusterRanges.size(), 1, &VisibilityPass::TestClusters);
+
+	if (pCuller != NULL) {
+		pCuller->End();
+	}
+
+	this->m_fTime = (float)((SDL_GetPerformanceCounter() - uStart) * 1000.0 / SDL_GetPerformanceFrequency());
+
+}//end VisibilityPass::Run()
+
+
+/**
+ * Bounds, level, frustum test and distance of maps [uFirst, uEnd).
+ */
+void VisibilityPass::TestMaps(size_t uFirst, size_t uEnd)
+{
+	for (size_t i = uFirst; i < uEnd; i++) {
+		BSP   *pMap   = this->m_vMaps[i];
+		float *fMins  = &this->m_vBounds[i * 6];
+		float *fMaxs  = fMins + 3;
+		VERTEX mins, maxs;
+
+		pMap->GetBounds(mins, maxs);
+		fMins[0] = mins.x; fMins[1] = mins.y; fMins[2] = mins.z;
+		fMaxs[0] = maxs.x; fMaxs[1] = maxs.y; fMaxs[2] = maxs.z;
+
+		this->m_vLod[i]       = this->m_pLodView != NULL ? pMap->SelectLod(*this->m_pLodView) : 0;
+		this->m_vInFrustum[i] = pMap->IsResident() && this->m_pFrustum->TestAABB(fMins, fMaxs);
+
+		float fDistance = 0.0f;
+
+		for (int k = 0; k < 3; k++) {
+			float d = std::max(std::max(fMins[k] - this->m_fCamera[k], this->m_fCamera[k] - fMaxs[k]), 0.0f);
+			fDistance += d * d;
+		}
+
+		this->m_vDistance[i] = fDistance;
+	}
+
+}//end VisibilityPass::TestMaps()
+
+
+/**
+ * Occlusion test of maps [uFirst, uEnd), and bounds of their clusters to test.
+ */
+void VisibilityPass::TestOcclusion(size_t uFirst, size_t uEnd)
+{
+	std::vector<std::pair<VERTEX, VERTEX> > vBounds;
+
+	for (size_t i = uFirst; i < uEnd; i++) {
+		const float *fMins = &this->m_vBounds[i * 6];
+		bool bVisible      = this->m_vInFrustum[i] && (this->m_pCuller == NULL || this->m_pCuller->TestAABB(fMins, fMins + 3));
+
+		this->m_vVisible[i]   = bVisible;
+		this->m_vBatchMask[i] = bVisible && this->m_vLod[i] == 0;
+
+		this->m_vClusterVisible[i].clear();
+
+		if (bVisible && this->m_bClusters && this->m_vLod[i] == 0) {
+			this->m_vMaps[i]->GetClusterBounds(vBounds);
+
+			std::vector<float> &vFlat = this->m_vClusterBounds[i];
+			vFlat.resize(vBounds.size() * 6);
+
+			for (size_t j = 0; j < vBounds.size(); j++) {
+				const VERTEX &mins = vBounds[j].first, &maxs = vBounds[j].second;
+				float *f = &vFlat[j * 6];
+				f[0] = mins.x; f[1] = mins.y; f[2] = mins.z;
+				f[3] = maxs.x; f[4] = maxs.y; f[5] = maxs.z;
+			}
+
+			this->m_vClusterVisible[i].resize(vBounds.size());
+		}
+	}
+
+}//end VisibilityPass::TestOcclusion()
+
+
+/**
+ * Occlusion test of cluster ranges [uFirst, uEnd).
+ */
+void VisibilityPass::TestClusters(size_t uFirst, size_t uEnd)
+{
+	for (size_t r = uFirst; r < uEnd; r++) {
+		const ClusterRange &range   = this->m_vClusterRanges[r];
+		const float        *fBounds = &this->m_vClusterBounds[range.uMap][0];
+		std::vector<char>  &vFlags  = this->m_vClusterVisible[range.uMap];
+
+		for (size_t j = range.uFirst; j < range.uEnd; j++) {
+			vFlags[j] = this->m_pCuller->TestAABB(&fBounds[j * 6], &fBounds[j * 6 + 3]);
+		}
+	}
+
+}//end VisibilityPass::TestClusters()
@@ -0,0 +1,128 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#ifndef VISIBILITYPASS_H
+#define VISIBILITYPASS_H
+
+#include <vector>
+#include <utility>
+#include <cstddef>
+
+class BSP;
+class Frustum;
+class OcclusionCuller;
+class JobSystem;
+struct LODVIEW;
+
+
+/**
+ * Per frame visibility of every map and of its (map, texture) clusters.
+ *
+ * Level selection, frustum and occlusion tests run as jobs, one range of
+ * maps per job and then one range of clusters per job. Jobs only write
+ * their own entries, and the main thread reads the merged result to submit
+ * draws. Occluders are picked and rasterized on the main thread in between.
+ */
+class VisibilityPass
+{
+public:
+	/**
+	 * Constructor
+	 * \param vMaps The maps, results are indexed like it.
+	 */
+	VisibilityPass(const std::vector<BSP*> &vMaps);
+
+	/**
+	 * Compute this frame's visibility.
+	 * \param frustum       View frustum, already extracted.
+	 * \param pCuller       Occlusion culler, NULL to only test the frustum.
+	 * \param pLodView      How the camera sees the world, NULL to draw every map at full detail.
+	 * \param fCamera       World position of the camera.
+	 * \param uOccluderMaps Nearest maps in view rasterized as occluders.
+	 * \param bClusters     Also test each map's clusters against the occluders.
+	 * \param pJobs         Job system to spread the tests over, NULL to run them here.
+	 */
+	void Run(const Frustum &frustum, OcclusionCuller *pCuller, const LODVIEW *pLodView, const float fCamera[3],
+	         size_t uOccluderMaps, bool bClusters, JobSystem *pJobs);
+
+	/** Level to draw a map at. */
+	int GetLod(size_t i) const { return this->m_vLod[i]; }
+
+	/** Check if a map is drawn at all. */
+	bool IsVisible(size_t i) const { return this->m_vVisible[i] != 0; }
+
+	/** Maps visible at full detail, for the batch renderer. */
+	const std::vector<char> *GetBatchMask() const { return &this->m_vBatchMask; }
+
+	/** One flag per GetClusterBounds() entry of a map, NULL to draw every cluster. */
+	const std::vector<char> *GetClusterVisible(size_t i) const;
+
+	/** Milliseconds the last Run() took. */
+	float GetTime() const { return this->m_fTime; }
+
+private:
+	/** Bounds, level, frustum test and distance of maps [uFirst, uEnd). */
+	void TestMaps(size_t uFirst, size_t uEnd);
+
+	/** Occlusion test of maps [uFirst, uEnd), and bounds of their clusters to test. */
+	void TestOcclusion(size_t uFirst, size_t uEnd);
+
+	/** Occlusion test of cluster ranges [uFirst, uEnd). */
+	void TestClusters(size_t uFirst, size_t uEnd);
+
+	/** Run func over [0, uCount), with jobs when there is a job system. */
+	void Spread(size_t uCount, size_t uGrain, void (VisibilityPass::*func)(size_t, size_t));
+
+	/** A range of one map's clusters, tested by one job. */
+	struct ClusterRange
+	{
+		size_t uMap;
+		size_t uFirst;
+		size_t uEnd;
+	};
+
+	const std::vector<BSP*>          &m_vMaps;
+
+	// Per map results
+	std::vector<int>                  m_vLod;
+	std::vector<char>                 m_vVisible;
+	std::vector<char>                 m_vBatchMask;
+	std::vector<char>                 m_vInFrustum;
+	std::vector<float>                m_vDistance;      /** Squared distance from the camera to the bounds. */
+	std::vector<float>                m_vBounds;        /** Six floats per map, mins then maxs. */
+	std::vector<std::vector<char> >   m_vClusterVisible;
+	std::vector<std::vector<float> >  m_vClusterBounds; /** Six floats per cluster. */
+	std::vector<ClusterRange>         m_vClusterRanges;
+	std::vector<std::pair<float, size_t> > m_vNearest;
+
+	// Frame inputs, for the jobs
+	const Frustum                    *m_pFrustum;
+	OcclusionCuller                  *m_pCuller;
+	const LODVIEW                    *m_pLodView;
+	float                             m_fCamera[3];
+	bool                              m_bClusters;
+	JobSystem                        *m_pJobs;
+
+	float                             m_fTime;
+
+};//end VisibilityPass
+
+#endif //VISIBILITYPASS_H
@@ -0,0 +1,293 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#include "common.h"
+#include "World.h"
+#include "wad.h"
+#include "ConfigXML.h"
+#include "JobSystem.h"
+#include "TextureCache.h"
+#include "VirtualFileSystem.h"
+
+/**
+ * Load the textures of a WAD into g_textures and upload them.
+ * \param fs    Game files of the world.
+ * \param szWad WAD name, without the extension.
+ */
+bool GLWorldBackend::LoadWad(const VirtualFileSystem &fs, const std::string &szWad)
+{
+	return wadLoad(fs, szWad + ".wad") != -1;
+
+}//end GLWorldBackend::LoadWad()
+
+
+/**
+ * Upload a loaded map.
+ * \param pMap The map.
+ */
+void GLWorldBackend::AddMap(BSP *pMap)
+{
+	pMap->Upload();
+
+}//end GLWorldBackend::AddMap()
+
+
+/**
+ * Free the GL objects of a map.
+ * \param pMap The map.
+ */
+void GLWorldBackend::RemoveMap(BSP *pMap)
+{
+	pMap->Unload();
+
+}//end GLWorldBackend::RemoveMap()
+
+
+/**
+ * Constructor, loads the program config.
+ */
+World::World()
+{
+	this->m_pConfig     = new ConfigXML();
+	this->m_pFileSystem = new VirtualFileSystem();
+	this->m_pBackend    = NULL;
+	this->m_uConfigMaps = 0;
+
+	this->m_state.fileSystem = this->m_pFileSystem;
+
+	this->m_pConfig->LoadProgramConfig();
+
+}//end World::World()
+
+
+/**
+ * Destructor, removes the maps from the backend and deletes them.
+ */
+World::~World()
+{
+	for (size_t i = 0; i < this->m_vMaps.size(); i++) {
+		if (this->m_pBackend != NULL) {
+			this->m_pBackend->RemoveMap(this->m_vMaps[i]);
+		}
+
+		delete this->m_vMaps[i];
+	}
+
+	delete this->m_pConfig;
+	delete this->m_pFileSystem;
+
+}//end World::~World()
+
+
+/**
+ * Set where textures and maps go, before Load().
+ * \param pBackend Backend, outlives the world. NULL keeps everything on the host.
+ */
+void World::SetBackend(WorldBackend *pBackend)
+{
+	this->m_pBackend = pBackend;
+
+}//end World::SetBackend()
+
+
+/**
+ * Load a map config, its WADs and the entities of its maps.
+ * \param szMapConfig  Path of the map config.
+ * \param bRequireWads Stop before reading any entities when a WAD is missing.
+ * \return False when a WAD is missing.
+ */
+bool World::Load(const std::string &szMapConfig, bool bRequireWads)
+{
+	ConfigXML *pConfig = this->m_pConfig;
+
+	this->m_szMapConfig = szMapConfig;
+	pConfig->LoadMapConfig(szMapConfig.c_str());
+
+	// Decoded textures are shared between runs and configs, keyed by their
+	// content, so a later world doesn't move the cache of an earlier one.
+	if (pConfig->m_bTextureCache && !g_textureCache.IsEnabled()) {
+		g_textureCache.SetDirectory(pConfig->m_szTextureCache);
+	}
+
+	// One scan of the gamepaths and their PAKs, instead of trying each path for every file.
+	this->m_pFileSystem->Mount(pConfig->m_szGamePaths);
+	this->m_state.buildPickingBvh    = pConfig->m_bPicking;
+	this->m_state.keepHostGeometry   = pConfig->m_bKeepHostGeometry;
+	this->m_state.animateLightStyles = pConfig->m_bLightStyles;
+
+	// Without a backend only the names are read, nothing is decoded.
+	for (size_t i = 0; i < pConfig->m_vWads.size(); i++) {
+		bool bFound;
+
+		if (this->m_pBackend != NULL) {
+			bFound = this->m_pBackend->LoadWad(*this->m_pFileSystem, pConfig->m_vWads[i]);
+		} else {
+			std::vector<std::string> vNames;
+			bFound = wadList(*this->m_pFileSystem, pConfig->m_vWads[i] + ".wad", vNames) != -1;
+			this->m_sWadTextures.insert(vNames.begin(), vNames.end());
+		}
+
+		if (!bFound) {
+			this->m_vMissingWads.push_back(pConfig->m_vWads[i]);
+		}
+	}
+
+	if (bRequireWads && !this->m_vMissingWads.empty()) {
+		return false;
+	}
+
+	// Entities are read serially, landmarks are shared between maps.
+	for (size_t i = 0; i < pConfig->m_vChapterEntries.size(); i++) {
+		const ChapterEntry &sChapterEntry = pConfig->m_vChapterEntries[i];
+
+		for (size_t j = 0; j < sChapterEntry.m_vMapEntries.size(); j++) {
+			const MapEntry &sMapEntry = sChapterEntry.m_vMapEntries[j];
+			this->m_uConfigMaps++;
+
+			if (!sChapterEntry.m_bRender || !sMapEntry.m_bRender) {
+				continue;
+			}
+
+			Uint64 uStart = SDL_GetPerformanceCounter();
+			BSP *pMap = new BSP("maps/" + sMapEntry.m_szName + ".bsp", sMapEntry, &this->m_state);
+			pMap->SetChapterOffset(sChapterEntry.m_fOffsetX, sChapterEntry.m_fOffsetY, sChapterEntry.m_fOffsetZ);
+
+			this->m_vEntitiesMs.push_back((SDL_GetPerformanceCounter() - uStart) * 1000.0f / SDL_GetPerformanceFrequency());
+			this->m_vMaps.push_back(pMap);
+			this->m_vChapters.push_back(i);
+		}
+	}
+
+	this->m_vLoaded.assign(this->m_vMaps.size(), 0);
+
+	return this->m_vMissingWads.empty();
+
+}//end World::Load()
+
+
+/**
+ * Read and build every map on the job threads, then hand them to the backend.
+ * \param pJobs Job threads.
+ * \param bKeep Hand the maps to the backend. Otherwise each map is freed once built.
+ * \return Maps loaded.
+ */
+size_t World::LoadGeometry(JobSystem *pJobs, bool bKeep)
+{
+	pJobs->ParallelFor(this->m_vMaps.size(), 1, std::bind(&World::LoadRange, this, bKeep, std::placeholders::_1, std::placeholders::_2));
+
+	// Uploads need the thread that owns the backend's context.
+	size_t uLoaded = 0;
+
+	for (size_t i = 0; i < this->m_vMaps.size(); i++) {
+		if (!this->m_vLoaded[i]) {
+			continue;
+		}
+
+		if (bKeep && this->m_pBackend != NULL) {
+			this->m_pBackend->AddMap(this->m_vMaps[i]);
+		}
+
+		uLoaded++;
+	}
+
+	return uLoaded;
+
+}//end World::LoadGeometry()
+
+
+/**
+ * Build maps [uFirst, uEnd), on a job thread.
+ * \param bKeep  Keep the geometry, otherwise only the statistics stay.
+ * \param uFirst First map.
+ * \param uEnd   One past the last map.
+ */
+void World::LoadRange(bool bKeep, size_t uFirst, size_t uEnd)
+{
+	for (size_t i = uFirst; i < uEnd; i++) {
+		this->m_vLoaded[i] = this->m_vMaps[i]->LoadGeometry();
+
+		if (!bKeep) {
+			this->m_vMaps[i]->Unload();
+		}
+	}
+
+}//end World::LoadRange()
+
+
+/**
+ * Index of a map by name.
+ * \param szMapId Map name, as in the config.
+ * \return Its index, -1 when the config doesn't render it.
+ */
+int World::FindMap(const std::string &szMapId) const
+{
+	for (size_t i = 0; i < this->m_vMaps.size(); i++) {
+		if (this->m_vMaps[i]->GetMapId() == szMapId) {
+			return (int)i;
+		}
+	}
+
+	return -1;
+
+}//end World::FindMap()
+
+
+/**
+ * Brush models of a map its entities hide.
+ * \param szMapId Map name.
+ */
+std::vector<std::string> World::GetHiddenModels(const std::string &szMapId)
+{
+	std::lock_guard<std::mutex> lock(this->m_state.entitiesMutex);
+	std::map<std::string, std::vector<std::string> >::const_iterator it = this->m_state.dontRenderModel.find(szMapId);
+
+	return it != this->m_state.dontRenderModel.end() ? it->second : std::vector<std::string>();
+
+}//end World::GetHiddenModels()
+
+
+/**
+ * Hash of what the maps are drawn from: the map config and WADs as they
+ * are on disk, and each map as it was last loaded.
+ */
+unsigned long long World::GetContentHash() const
+{
+	std::vector<unsigned long long> vParts;
+
+	std::ifstream in(this->m_szMapConfig.c_str(), std::ios::binary);
+	std::string szConfig((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+	vParts.push_back(TextureCache::Hash((const unsigned char*)szConfig.data(), szConfig.size()));
+
+	for (size_t i = 0; i < this->m_pConfig->m_vWads.size(); i++) {
+		VfsFile file;
+
+		if (this->m_pFileSystem->Open(this->m_pConfig->m_vWads[i] + ".wad", file)) {
+			vParts.push_back(TextureCache::Hash(file.GetData(), file.GetSize()));
+		}
+	}
+
+	for (size_t i = 0; i < this->m_vMaps.size(); i++) {
+		vParts.push_back(this->m_vMaps[i]->GetFileHash());
+	}
+
+	return TextureCache::Hash((const unsigned char*)&vParts[0], vParts.size() * sizeof(vParts[0]));
+
+}//end World::GetContentHash()
@@ -0,0 +1,195 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#ifndef WORLD_H
+#define WORLD_H
+
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include "bsp.h"
+
+class ConfigXML;
+class JobSystem;
+class VirtualFileSystem;
+
+
+/**
+ * Where a world's textures and loaded maps go.
+ *
+ * The viewer uploads them to OpenGL with GLWorldBackend. Headless tools
+ * set no backend at all, and the maps keep their geometry on the host.
+ */
+class WorldBackend
+{
+public:
+	/** Destructor. */
+	virtual ~WorldBackend() {}
+
+	/**
+	 * Load the textures of a WAD of the config.
+	 * \param fs    Game files of the world.
+	 * \param szWad WAD name, without the extension.
+	 * \return False when it can't be read.
+	 */
+	virtual bool LoadWad(const VirtualFileSystem &fs, const std::string &szWad) = 0;
+
+	/** Take a map whose geometry was just loaded, on the thread that loaded the world. */
+	virtual void AddMap(BSP *pMap) = 0;
+
+	/** Let go of a map before it is deleted. */
+	virtual void RemoveMap(BSP *pMap) = 0;
+
+};//end WorldBackend
+
+
+/**
+ * Uploads textures and maps to the current OpenGL context.
+ * Every call must come from the GL thread.
+ */
+class GLWorldBackend : public WorldBackend
+{
+public:
+	bool LoadWad(const VirtualFileSystem &fs, const std::string &szWad);
+	void AddMap(BSP *pMap);
+	void RemoveMap(BSP *pMap);
+
+};//end GLWorldBackend
+
+
+/**
+ * The maps of a config and everything they share.
+ *
+ * Owns the program and map config, the maps in config order, their
+ * landmarks, hidden models and offsets, and the index of its game paths.
+ * The texture registry, texture cache and memory registries are still
+ * process wide: the texture cache keeps the directory of the first world
+ * that enables it. Load() reads the config
+ * and the entities of every map, LoadGeometry() reads and builds the maps
+ * on the job threads and hands them to the backend.
+ */
+class World
+{
+public:
+	/** Constructor, loads the program config so its defaults can be read before Load(). */
+	World();
+
+	/** Destructor, removes the maps from the backend and deletes them. */
+	~World();
+
+	/**
+	 * Set where textures and maps go, before Load().
+	 * \param pBackend Backend, outlives the world. NULL keeps everything on the host.
+	 */
+	void SetBackend(WorldBackend *pBackend);
+
+	/**
+	 * Load a map config: mount its game paths, load its WADs and read the
+	 * entities of every map it renders, which places them.
+	 * \param szMapConfig  Path of the map config.
+	 * \param bRequireWads Stop before reading any entities when a WAD is missing.
+	 * \return False when a WAD is missing.
+	 */
+	bool Load(const std::string &szMapConfig, bool bRequireWads = false);
+
+	/**
+	 * Read and build the geometry of every map, in parallel.
+	 * \param pJobs Job threads.
+	 * \param bKeep Hand the maps to the backend. Otherwise each map is freed once built, leaving its statistics.
+	 * \return Maps loaded.
+	 */
+	size_t LoadGeometry(JobSystem *pJobs, bool bKeep = true);
+
+	/** Program and map config. */
+	ConfigXML *GetConfig() const { return this->m_pConfig; }
+
+	/** Path of the loaded map config. */
+	const std::string &GetMapConfigPath() const { return this->m_szMapConfig; }
+
+	/** State the maps share. */
+	WORLDSTATE *GetState() { return &this->m_state; }
+
+	/** Maps the config renders, in config order. */
+	std::vector<BSP*> &GetMaps() { return this->m_vMaps; }
+
+	/** Number of maps the config renders. */
+	size_t GetMapCount() const { return this->m_vMaps.size(); }
+
+	/** A map, by index. */
+	BSP *GetMap(size_t i) const { return this->m_vMaps[i]; }
+
+	/** Index of a map by name, -1 when the config doesn't render it. */
+	int FindMap(const std::string &szMapId) const;
+
+	/** Index of the chapter of a map in the config. */
+	size_t GetMapChapter(size_t i) const { return this->m_vChapters[i]; }
+
+	/** Whether the last LoadGeometry() built a map. */
+	bool IsMapLoaded(size_t i) const { return this->m_vLoaded[i] != 0; }
+
+	/** Time spent reading the entities of a map, in ms. */
+	float GetEntitiesMs(size_t i) const { return this->m_vEntitiesMs[i]; }
+
+	/** Maps listed in the config, rendered or not. */
+	size_t GetConfigMapCount() const { return this->m_uConfigMaps; }
+
+	/** Offset of a map in the world, found from the landmarks in config order. */
+	VERTEX GetOffset(size_t i) { return this->m_vMaps[i]->GetRenderOffset(); }
+
+	/** Every landmark, with the position and map of each info_landmark of that name. */
+	const std::map<std::string, std::vector<std::pair<VERTEX, std::string> > > &GetLandmarks() const { return this->m_state.landmarks; }
+
+	/** Brush models of a map its entities hide, by model name. */
+	std::vector<std::string> GetHiddenModels(const std::string &szMapId);
+
+	/** Names of the textures the WADs of the config have, only listed without a backend. */
+	const std::set<std::string> &GetWadTextures() const { return this->m_sWadTextures; }
+
+	/** WADs of the config that couldn't be read. */
+	const std::vector<std::string> &GetMissingWads() const { return this->m_vMissingWads; }
+
+	/**
+	 * Hash of what the maps are drawn from: the map config and WADs as they
+	 * are on disk, and each map as it was last loaded. Reads the WADs.
+	 */
+	unsigned long long GetContentHash() const;
+
+private:
+	/** Build maps [uFirst, uEnd), on a job thread. */
+	void LoadRange(bool bKeep, size_t uFirst, size_t uEnd);
+
+	ConfigXML                  *m_pConfig;      /** Program and map config. */
+	VirtualFileSystem          *m_pFileSystem;  /** Game files of the config, mounted by Load(). */
+	std::string                 m_szMapConfig;  /** Path of the map config. */
+	WorldBackend               *m_pBackend;     /** Textures and maps go there, or NULL. */
+	WORLDSTATE                  m_state;        /** Landmarks, hidden models and offsets. */
+	std::vector<BSP*>           m_vMaps;        /** Rendered maps in config order. */
+	std::vector<size_t>         m_vChapters;    /** Chapter of each map. */
+	std::vector<char>           m_vLoaded;      /** Built by the last LoadGeometry(). */
+	std::vector<float>          m_vEntitiesMs;  /** Entity parsing time of each map. */
+	size_t                      m_uConfigMaps;  /** Maps in the config. */
+	std::set<std::string>       m_sWadTextures; /** Texture names of the WADs. */
+	std::vector<std::string>    m_vMissingWads; /** WADs that couldn't be read. */
+
+};//end World
+
+#endif //WORLD_H
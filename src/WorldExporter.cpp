@@ -0,0 +1,580 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#include "common.h"
+#include "bsp.h"
+#include "TextureRegistry.h"
+#include "PngWriter.h"
+#include "WorldExporter.h"
+#include <cstdio>
+#include <algorithm>
+#include <functional>
+
+// glTF constants used by the export.
+#define GLTF_FLOAT               5126
+#define GLTF_ARRAY_BUFFER        34962
+#define GLTF_LINEAR              9729
+#define GLTF_LINEAR_MIPMAP       9987
+#define GLTF_REPEAT              10497
+#define GLTF_CLAMP_TO_EDGE       33071
+
+// Samplers of the export, textures repeat and lightmaps don't.
+#define SAMPLER_TEXTURE  0
+#define SAMPLER_LIGHTMAP 1
+
+// Vertices reordered and written at a time, a whole number of triangles.
+#define EXPORT_BLOCK_VERTICES (3*4096)
+
+
+/**
+ * Constructor.
+ * \param szPath Output file, .gltf or .obj. The other files are written next to it.
+ * \param pJobs  Runs the image encoding, NULL to encode on the caller.
+ */
+WorldExporter::WorldExporter(const std::string &szPath, JobSystem *pJobs)
+{
+	this->m_szPath     = szPath;
+	this->m_eFormat    = FORMAT_UNKNOWN;
+	this->m_pJobs      = pJobs;
+	this->m_pCounter   = NULL;
+	this->m_bOpen      = false;
+	this->m_uDataBytes = 0;
+	this->m_uMaps      = 0;
+	this->m_uTriangles = 0;
+	this->m_iImages    = 0;
+	this->m_iFailed    = 0;
+
+	size_t uDot = szPath.find_last_of('.');
+	size_t uSlash = szPath.find_last_of("/\\");
+	std::string szExtension;
+
+	if (uDot != std::string::npos && (uSlash == std::string::npos || uDot > uSlash)) {
+		this->m_szBase = szPath.substr(0, uDot);
+		szExtension = szPath.substr(uDot + 1);
+		for (size_t i = 0; i < szExtension.size(); i++) {
+			szExtension[i] = (char)tolower(szExtension[i]);
+		}
+	} else {
+		this->m_szBase = szPath;
+	}
+
+	this->m_szBaseName = uSlash == std::string::npos ? this->m_szBase : this->m_szBase.substr(uSlash + 1);
+
+	if (szExtension == "gltf") {
+		this->m_eFormat = FORMAT_GLTF;
+	} else if (szExtension == "obj") {
+		this->m_eFormat = FORMAT_OBJ;
+	}
+
+}//end WorldExporter::WorldExporter()
+
+
+/**
+ * Destructor, finishes the output if End() wasn't called.
+ */
+WorldExporter::~WorldExporter()
+{
+	if (this->m_bOpen) {
+		this->End();
+	}
+
+}//end WorldExporter::~WorldExporter()
+
+
+/**
+ * Create the output files.
+ * \return False when the format is unknown or a file can't be created.
+ */
+bool WorldExporter::Begin()
+{
+	if (this->m_eFormat == FORMAT_UNKNOWN) {
+		std::cerr << "Can't export to " << this->m_szPath << ", use a .gltf or .obj file." << std::endl;
+		return false;
+	}
+
+	if (this->m_eFormat == FORMAT_GLTF) {
+		this->m_data.open((this->m_szBase + ".bin").c_str(), std::ios::binary);
+	} else {
+		this->m_data.open(this->m_szPath.c_str(), std::ios::binary);
+		this->m_mtl.open((this->m_szBase + ".mtl").c_str(), std::ios::binary);
+		this->m_data << "# Exported by halfmapper\nmtllib " << this->m_szBaseName << ".mtl\n";
+		this->m_mtl << "# Exported by halfmapper\n";
+	}
+
+	if (!this->m_data || (this->m_eFormat == FORMAT_OBJ && !this->m_mtl)) {
+		std::cerr << "Can't create " << this->m_szPath << "." << std::endl;
+		return false;
+	}
+
+	this->m_bOpen = true;
+
+	return true;
+
+}//end WorldExporter::Begin()
+
+
+/**
+ * Write one map. Must be called between its LoadGeometry() and Upload(),
+ * from the GL thread, which reads back textures that only live in GL.
+ * The map can be unloaded as soon as this returns.
+ */
+void WorldExporter::AddMap(BSP *pMap)
+{
+	if (!this->m_bOpen) {
+		return;
+	}
+
+	// The images of the map before last are done, so at most two maps of pixels are waiting
+	this->m_pCounter = &this->m_counters[this->m_uMaps % 2];
+	if (this->m_pJobs != NULL) {
+		this->m_pJobs->Wait(*this->m_pCounter);
+	}
+
+	if (this->m_eFormat == FORMAT_GLTF) {
+		this->AddMapGltf(pMap);
+	} else {
+		this->AddMapObj(pMap);
+	}
+
+	this->m_uMaps++;
+
+}//end WorldExporter::AddMap()
+
+
+/**
+ * Wait for the images and complete the output.
+ * \return False when something couldn't be written.
+ */
+bool WorldExporter::End()
+{
+	if (!this->m_bOpen) {
+		return false;
+	}
+
+	this->m_bOpen = false;
+
+	if (this->m_pJobs != NULL) {
+		this->m_pJobs->Wait(this->m_counters[0]);
+		this->m_pJobs->Wait(this->m_counters[1]);
+	}
+
+	bool bResult = this->m_data.good() && this->m_iFailed == 0;
+	this->m_data.close();
+
+	if (this->m_eFormat == FORMAT_GLTF) {
+		bResult = this->WriteGltf() && bResult;
+	} else {
+		bResult = this->m_mtl.good() && bResult;
+		this->m_mtl.close();
+	}
+
+	return bResult;
+
+}//end WorldExporter::End()
+
+
+/**
+ * Print maps, triangles and images written.
+ */
+void WorldExporter::PrintStats(std::ostream &out) const
+{
+	out << "Exported " << this->m_uMaps << " maps to " << this->m_szPath << ": " << this->m_uTriangles << " triangles, ";
+	out << this->m_uDataBytes / 1024 << " KB of " << (this->m_eFormat == FORMAT_GLTF ? "buffer" : "text") << ", ";
+	out << this->m_iImages << " images";
+	if (this->m_iFailed != 0) {
+		out << " (" << this->m_iFailed << " couldn't be written)";
+	}
+	out << "." << std::endl;
+
+}//end WorldExporter::PrintStats()
+
+
+/**
+ * Encode and write an image, on any thread.
+ */
+void WorldExporter::EncodeImage(std::shared_ptr<ImageJob> pJob, std::atomic<int> *pFailed)
+{
+	if (!PngWriter::Save(pJob->szPath, &pJob->vPixels[0], pJob->iWidth, pJob->iHeight, pJob->iChannels)) {
+		(*pFailed)++;
+	}
+
+}//end WorldExporter::EncodeImage()
+
+
+/**
+ * Copy pixels and queue their encoding.
+ * \param szFile File name, next to the output.
+ */
+void WorldExporter::QueueImage(const std::string &szFile, const unsigned char *pPixels, int iWidth, int iHeight, int iChannels)
+{
+	std::shared_ptr<ImageJob> pJob(new ImageJob);
+	size_t uDirectory = this->m_szBase.size() - this->m_szBaseName.size();
+
+	pJob->szPath    = this->m_szBase.substr(0, uDirectory) + szFile;
+	pJob->vPixels.assign(pPixels, pPixels + (size_t)iWidth * iHeight * iChannels);
+	pJob->iWidth    = iWidth;
+	pJob->iHeight   = iHeight;
+	pJob->iChannels = iChannels;
+	this->m_iImages++;
+
+	if (this->m_pJobs != NULL) {
+		this->m_pJobs->Submit(std::bind(&WorldExporter::EncodeImage, pJob, &this->m_iFailed), this->m_pCounter);
+	} else {
+		EncodeImage(pJob, &this->m_iFailed);
+	}
+
+}//end WorldExporter::QueueImage()
+
+
+/**
+ * Write the image of a texture the first time it is used.
+ * \return Its glTF texture, or -1 when it has no pixels.
+ */
+int WorldExporter::ExportTexture(int iTexture, const TEXTURE *pTexture, const BSP *pMap)
+{
+	std::map<int, int>::const_iterator it = this->m_mTextures.find(iTexture);
+	if (it != this->m_mTextures.end()) {
+		return it->second;
+	}
+
+	std::string szName;
+	{
+		lock_guard<mutex> lock(texturesMutex);
+		szName = g_textures.GetName(iTexture);
+	}
+
+	// Embedded textures are still in staging memory, WAD textures are read back from GL
+	const unsigned char *pPixels = pMap->GetPendingTexture(pTexture);
+	std::vector<unsigned char> vReadBack;
+	int iWidth = pTexture->w, iHeight = pTexture->h;
+
+	if (pPixels == NULL && pTexture->texId != 0) {
+		glBindTexture(GL_TEXTURE_2D, pTexture->texId);
+		glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &iWidth);
+		glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &iHeight);
+		vReadBack.resize((size_t)iWidth * iHeight * 4);
+		glPixelStorei(GL_PACK_ALIGNMENT, 1);
+		glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, &vReadBack[0]);
+		pPixels = &vReadBack[0];
+	}
+
+	int iResult = -1;
+	std::string szFile = this->UniqueFile(this->m_szBaseName + "_" + FileName(szName));
+
+	if (pPixels != NULL && iWidth > 0 && iHeight > 0) {
+		this->QueueImage(szFile, pPixels, iWidth, iHeight, 4);
+		if (this->m_eFormat == FORMAT_GLTF) {
+			iResult = (int)this->m_vImages.size();
+			this->m_vImages.push_back("{\"name\":" + Quote(szName) + ",\"uri\":" + Quote(szFile) + "}");
+			this->m_vSamplers.push_back(SAMPLER_TEXTURE);
+		} else {
+			iResult = 0;
+		}
+	}
+
+	if (this->m_eFormat == FORMAT_OBJ) {
+		// Textures of the same name with different pixels need materials of their own
+		std::string szMtl = szFile.substr(this->m_szBaseName.size() + 1, szFile.size() - this->m_szBaseName.size() - 5);
+		this->m_mMtlNames[iTexture] = szMtl;
+		this->m_mtl << "\nnewmtl " << szMtl << "\nKd 1 1 1\n";
+		if (iResult != -1) {
+			this->m_mtl << "map_Kd " << szFile << "\n";
+			// Transparent textures keep their colour key in the alpha channel
+			if (szName[0] == '{') {
+				this->m_mtl << "map_d " << szFile << "\n";
+			}
+		}
+	}
+
+	this->m_mTextures[iTexture] = iResult;
+
+	return iResult;
+
+}//end WorldExporter::ExportTexture()
+
+
+/**
+ * Append a map to the glTF buffer and scene.
+ */
+void WorldExporter::AddMapGltf(BSP *pMap)
+{
+	const std::vector<TEXSTUFF> &vTris = pMap->GetTexturedTris();
+	const std::string &szMapId = pMap->GetMapId();
+	char szNumbers[256];
+
+	// The lightmap atlas, one per map
+	int iLightmap = -1;
+	if (pMap->GetLightmapAtlas() != NULL) {
+		std::string szFile = this->UniqueFile(this->m_szBaseName + "_lightmap_" + FileName(szMapId));
+		this->QueueImage(szFile, pMap->GetLightmapAtlas(), 1024, 1024, 3);
+		iLightmap = (int)this->m_vImages.size();
+		this->m_vImages.push_back("{\"name\":" + Quote(szMapId + " lightmap") + ",\"uri\":" + Quote(szFile) + "}");
+		this->m_vSamplers.push_back(SAMPLER_LIGHTMAP);
+	}
+
+	std::string szPrimitives;
+	std::vector<VECFINAL> vBlock;
+
+	for (size_t i = 0; i < vTris.size(); i++) {
+		const TEXSTUFF &ts = vTris[i];
+		if (!ts.renderable || ts.triangles.empty()) {
+			continue;
+		}
+
+		// Vertices go to the buffer as they are, one view per (map, texture)
+		size_t uCount = ts.triangles.size();
+		size_t uBytes = uCount * sizeof(VECFINAL);
+		int iView = (int)this->m_vBufferViews.size();
+
+		sprintf(szNumbers, "{\"buffer\":0,\"byteOffset\":%llu,\"byteLength\":%llu,\"byteStride\":%d,\"target\":%d}",
+			(unsigned long long)this->m_uDataBytes, (unsigned long long)uBytes, (int)sizeof(VECFINAL), GLTF_ARRAY_BUFFER);
+		this->m_vBufferViews.push_back(szNumbers);
+
+		// The renderer culls GL_FRONT, so triangles wind clockwise. glTF wants them the other way.
+		for (size_t j = 0; j < uCount; j += EXPORT_BLOCK_VERTICES) {
+			vBlock.assign(ts.triangles.begin() + j, ts.triangles.begin() + std::min(uCount, j + EXPORT_BLOCK_VERTICES));
+			for (size_t k = 0; k + 2 < vBlock.size(); k += 3) {
+				std::swap(vBlock[k + 1], vBlock[k + 2]);
+			}
+			this->m_data.write((const char*)&vBlock[0], vBlock.size() * sizeof(VECFINAL));
+		}
+		this->m_uDataBytes += uBytes;
+		this->m_uTriangles += uCount / 3;
+
+		// Position, texture UV and lightmap UV
+		int iAccessor = (int)this->m_vAccessors.size();
+		sprintf(szNumbers, "{\"bufferView\":%d,\"byteOffset\":0,\"componentType\":%d,\"count\":%llu,\"type\":\"VEC3\",\"min\":[%.9g,%.9g,%.9g],\"max\":[%.9g,%.9g,%.9g]}",
+			iView, GLTF_FLOAT, (unsigned long long)uCount, ts.mins.x, ts.mins.y, ts.mins.z, ts.maxs.x, ts.maxs.y, ts.maxs.z);
+		this->m_vAccessors.push_back(szNumbers);
+		sprintf(szNumbers, "{\"bufferView\":%d,\"byteOffset\":12,\"componentType\":%d,\"count\":%llu,\"type\":\"VEC2\"}", iView, GLTF_FLOAT, (unsigned long long)uCount);
+		this->m_vAccessors.push_back(szNumbers);
+		sprintf(szNumbers, "{\"bufferView\":%d,\"byteOffset\":20,\"componentType\":%d,\"count\":%llu,\"type\":\"VEC2\"}", iView, GLTF_FLOAT, (unsigned long long)uCount);
+		this->m_vAccessors.push_back(szNumbers);
+
+		// One material per (map, texture), as each map has its own lightmap
+		int iTexture = this->ExportTexture(ts.texture, ts.tex, pMap);
+		std::string szName;
+		{
+			lock_guard<mutex> lock(texturesMutex);
+			szName = g_textures.GetName(ts.texture);
+		}
+
+		std::string szMaterial = "{\"name\":" + Quote(szMapId + "/" + szName) + ",\"pbrMetallicRoughness\":{";
+		if (iTexture != -1) {
+			sprintf(szNumbers, "\"baseColorTexture\":{\"index\":%d},", iTexture);
+			szMaterial += szNumbers;
+		}
+		szMaterial += "\"metallicFactor\":0,\"roughnessFactor\":1}";
+		if (iLightmap != -1) {
+			// Occlusion would only use the red channel, the lightmap is coloured
+			sprintf(szNumbers, ",\"extensions\":{\"MOZ_lightmap\":{\"index\":%d,\"texCoord\":1,\"intensity\":1}},\"extras\":{\"lightmap\":%d}", iLightmap, iLightmap);
+			szMaterial += szNumbers;
+		}
+		if (szName[0] == '{') {
+			szMaterial += ",\"alphaMode\":\"MASK\"";
+		}
+		szMaterial += "}";
+
+		sprintf(szNumbers, "{\"attributes\":{\"POSITION\":%d,\"TEXCOORD_0\":%d,\"TEXCOORD_1\":%d},\"material\":%d}",
+			iAccessor, iAccessor + 1, iAccessor + 2, (int)this->m_vMaterials.size());
+		this->m_vMaterials.push_back(szMaterial);
+		szPrimitives += (szPrimitives.empty() ? "" : ",") + std::string(szNumbers);
+	}
+
+	if (szPrimitives.empty()) {
+		return;
+	}
+
+	// The map's offset is the translation of its node
+	VERTEX offset = pMap->GetRenderOffset();
+	sprintf(szNumbers, ",\"mesh\":%d,\"translation\":[%.9g,%.9g,%.9g]}", (int)this->m_vMeshes.size(), offset.x, offset.y, offset.z);
+	this->m_vNodes.push_back("{\"name\":" + Quote(szMapId) + szNumbers);
+	this->m_vMeshes.push_back("{\"name\":" + Quote(szMapId) + ",\"primitives\":[" + szPrimitives + "]}");
+
+}//end WorldExporter::AddMapGltf()
+
+
+/**
+ * Append a map to the OBJ file.
+ */
+void WorldExporter::AddMapObj(BSP *pMap)
+{
+	const std::vector<TEXSTUFF> &vTris = pMap->GetTexturedTris();
+	VERTEX offset = pMap->GetRenderOffset();
+	char szLine[512];
+
+	this->m_data << "\no " << FileName(pMap->GetMapId()) << "\n";
+
+	for (size_t i = 0; i < vTris.size(); i++) {
+		const TEXSTUFF &ts = vTris[i];
+		if (!ts.renderable || ts.triangles.empty()) {
+			continue;
+		}
+
+		this->ExportTexture(ts.texture, ts.tex, pMap);
+		this->m_data << "usemtl " << this->m_mMtlNames[ts.texture] << "\n";
+
+		// Faces index their own vertices backwards, so nothing is counted across maps.
+		// They are turned counter clockwise, like the glTF ones.
+		for (size_t j = 0; j + 2 < ts.triangles.size(); j += 3) {
+			const VECFINAL *v = &ts.triangles[j];
+			int iLength = sprintf(szLine,
+				"v %.7g %.7g %.7g\nv %.7g %.7g %.7g\nv %.7g %.7g %.7g\nvt %.7g %.7g\nvt %.7g %.7g\nvt %.7g %.7g\nf -3/-3 -1/-1 -2/-2\n",
+				v[0].x + offset.x, v[0].y + offset.y, v[0].z + offset.z,
+				v[1].x + offset.x, v[1].y + offset.y, v[1].z + offset.z,
+				v[2].x + offset.x, v[2].y + offset.y, v[2].z + offset.z,
+				v[0].u, 1.0f - v[0].v, v[1].u, 1.0f - v[1].v, v[2].u, 1.0f - v[2].v);
+			this->m_data.write(szLine, iLength);
+			this->m_uDataBytes += iLength;
+		}
+		this->m_uTriangles += ts.triangles.size() / 3;
+	}
+
+}//end WorldExporter::AddMapObj()
+
+
+/**
+ * Write the .gltf file, once every map is in the buffer.
+ */
+bool WorldExporter::WriteGltf()
+{
+	std::ofstream out(this->m_szPath.c_str(), std::ios::binary);
+	if (!out) {
+		std::cerr << "Can't create " << this->m_szPath << "." << std::endl;
+		return false;
+	}
+
+	out << "{\"asset\":{\"version\":\"2.0\",\"generator\":\"halfmapper\"},\n\"scene\":0,\n\"scenes\":[{\"name\":\"world\"";
+	if (!this->m_vNodes.empty()) {
+		out << ",\"nodes\":[";
+		for (size_t i = 0; i < this->m_vNodes.size(); i++) {
+			out << (i ? "," : "") << i;
+		}
+		out << "]";
+	}
+	out << "}]";
+
+	// Lightmaps are optional, viewers without the extension show the textures alone
+	if (std::find(this->m_vSamplers.begin(), this->m_vSamplers.end(), SAMPLER_LIGHTMAP) != this->m_vSamplers.end()) {
+		out << ",\n\"extensionsUsed\":[\"MOZ_lightmap\"]";
+	}
+
+	// Arrays can't be empty in glTF, so they are left out instead
+	const std::vector<std::string> *pArrays[] = {&this->m_vNodes, &this->m_vMeshes, &this->m_vMaterials, &this->m_vImages, &this->m_vAccessors, &this->m_vBufferViews};
+	const char *szArrays[] = {"nodes", "meshes", "materials", "images", "accessors", "bufferViews"};
+
+	for (size_t a = 0; a < sizeof(szArrays) / sizeof(szArrays[0]); a++) {
+		if (pArrays[a]->empty()) {
+			continue;
+		}
+		out << ",\n\"" << szArrays[a] << "\":[\n";
+		for (size_t i = 0; i < pArrays[a]->size(); i++) {
+			out << (i ? ",\n" : "") << (*pArrays[a])[i];
+		}
+		out << "\n]";
+	}
+
+	if (!this->m_vImages.empty()) {
+		out << ",\n\"textures\":[\n";
+		for (size_t i = 0; i < this->m_vImages.size(); i++) {
+			out << (i ? ",\n" : "") << "{\"sampler\":" << this->m_vSamplers[i] << ",\"source\":" << i << "}";
+		}
+		out << "\n],\n\"samplers\":[\n";
+		out << "{\"magFilter\":" << GLTF_LINEAR << ",\"minFilter\":" << GLTF_LINEAR_MIPMAP << ",\"wrapS\":" << GLTF_REPEAT << ",\"wrapT\":" << GLTF_REPEAT << "},\n";
+		out << "{\"magFilter\":" << GLTF_LINEAR << ",\"minFilter\":" << GLTF_LINEAR << ",\"wrapS\":" << GLTF_CLAMP_TO_EDGE << ",\"wrapT\":" << GLTF_CLAMP_TO_EDGE << "}\n]";
+	}
+
+	if (this->m_uDataBytes != 0) {
+		out << ",\n\"buffers\":[{\"byteLength\":" << this->m_uDataBytes << ",\"uri\":" << Quote(this->m_szBaseName + ".bin") << "}]";
+	}
+
+	out << "\n}\n";
+
+	return out.good();
+
+}//end WorldExporter::WriteGltf()
+
+
+/**
+ * Name of a new image, numbered when the name was already written.
+ * \param szStem File name without extension.
+ */
+std::string WorldExporter::UniqueFile(const std::string &szStem)
+{
+	std::string szFile = szStem + ".png";
+
+	for (int i = 2; this->m_sFiles.count(szFile) != 0; i++) {
+		char szNumber[16];
+		sprintf(szNumber, "_%d", i);
+		szFile = szStem + szNumber + ".png";
+	}
+	this->m_sFiles.insert(szFile);
+
+	return szFile;
+
+}//end WorldExporter::UniqueFile()
+
+
+/**
+ * A name made safe for a file name.
+ */
+std::string WorldExporter::FileName(const std::string &szName)
+{
+	std::string szResult = szName;
+
+	for (size_t i = 0; i < szResult.size(); i++) {
+		unsigned char c = (unsigned char)szResult[i];
+		if (!isalnum(c) && c != '-' && c != '_' && c != '{' && c != '}' && c != '!' && c != '+' && c != '~') {
+			szResult[i] = '_';
+		}
+	}
+
+	return szResult.empty() ? "_" : szResult;
+
+}//end WorldExporter::FileName()
+
+
+/**
+ * A string quoted for JSON.
+ */
+std::string WorldExporter::Quote(const std::string &szText)
+{
+	std::string szResult = "\"";
+
+	for (size_t i = 0; i < szText.size(); i++) {
+		unsigned char c = (unsigned char)szText[i];
+		if (c == '"' || c == '\\') {
+			szResult += '\\';
+			szResult += (char)c;
+		} else if (c >= 0x80) {
+			szResult += '_'; // Names are read as Latin-1, JSON is UTF-8
+		} else if (c < 0x20) {
+			char szEscape[8];
+			sprintf(szEscape, "\\u%04x", c);
+			szResult += szEscape;
+		} else {
+			szResult += (char)c;
+		}
+	}
+
+	return szResult + "\"";
+
+}//end WorldExporter::Quote()
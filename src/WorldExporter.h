@@ -0,0 +1,167 @@
+/*
+ * halfmapper, a renderer for GoldSrc maps and chapters.
+ *
+ * Copyright(C) 2014  Gonzalo vila "gzalo" Alterach
+ * Copyright(C) 2015  Anthony "birkett" Birkett
+ *
+ * This file is part of halfmapper.
+ *
+ * This program is free software; you can redistribute it and / or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation, either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see http://www.gnu.org/licenses/
+ */
+#ifndef WORLDEXPORTER_H
+#define WORLDEXPORTER_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <fstream>
+#include <ostream>
+#include <atomic>
+#include <memory>
+#include <cstddef>
+#include <stdint.h>
+#include "JobSystem.h"
+
+class BSP;
+struct TEXTURE;
+
+/**
+ * Writes the assembled world to glTF 2.0 or OBJ, one map at a time.
+ *
+ * Maps are handed over between LoadGeometry and Upload, and their triangles
+ * are appended to the output right away, so only the map being written is
+ * in memory. Each map keeps its landmark and chapter offset: as the
+ * translation of its node in glTF, added to every vertex in OBJ.
+ *
+ * glTF gets a .gltf file with the scene, a .bin buffer with the vertices
+ * (position, texture UV, lightmap UV, interleaved as in the renderer) and
+ * PNG images. The lightmap atlas of each map is the MOZ_lightmap texture of
+ * its materials, on the second UV set, which multiplies the base colour in
+ * viewers supporting it, and is named in their extras for the others. OBJ
+ * has a single UV set, so it gets the textures only, through an MTL file.
+ *
+ * Images are encoded as jobs. The images of a map are waited for before
+ * the map after next is written, which bounds the pixels held in memory.
+ */
+class WorldExporter
+{
+public:
+	/** Output formats, chosen from the file extension. */
+	enum Format
+	{
+		FORMAT_UNKNOWN,
+		FORMAT_GLTF, /** .gltf, with .bin and .png files. */
+		FORMAT_OBJ   /** .obj, with .mtl and .png files. */
+	};
+
+	/**
+	 * Constructor.
+	 * \param szPath Output file, .gltf or .obj. The other files are written next to it.
+	 * \param pJobs  Runs the image encoding, NULL to encode on the caller.
+	 */
+	WorldExporter(const std::string &szPath, JobSystem *pJobs);
+
+	/** Destructor, finishes the output if End() wasn't called. */
+	~WorldExporter();
+
+	/** Create the output files. False when the format is unknown or a file can't be created. */
+	bool Begin();
+
+	/**
+	 * Write one map. Must be called between its LoadGeometry() and Upload(),
+	 * from the GL thread, which reads back textures that only live in GL.
+	 * The map can be unloaded as soon as this returns.
+	 */
+	void AddMap(BSP *pMap);
+
+	/** Wait for the images and complete the output. False when something couldn't be written. */
+	bool End();
+
+	/** Print maps, triangles and images written. */
+	void PrintStats(std::ostream &out) const;
+
+private:
+	/** Pixels of an image to encode, owned by its job. */
+	struct ImageJob
+	{
+		std::string                szPath;
+		std::vector<unsigned char> vPixels;
+		int                        iWidth;
+		int                        iHeight;
+		int                        iChannels;
+	};
+
+	/** Encode and write an image, on any thread. */
+	static void EncodeImage(std::shared_ptr<ImageJob> pJob, std::atomic<int> *pFailed);
+
+	/**
+	 * Copy pixels and queue their encoding.
+	 * \param szFile File name, next to the output.
+	 */
+	void QueueImage(const std::string &szFile, const unsigned char *pPixels, int iWidth, int iHeight, int iChannels);
+
+	/**
+	 * Write the image of a texture the first time it is used.
+	 * \return Its glTF texture, or -1 when it has no pixels.
+	 */
+	int ExportTexture(int iTexture, const TEXTURE *pTexture, const BSP *pMap);
+
+	/** Append a map to the glTF buffer and scene. */
+	void AddMapGltf(BSP *pMap);
+
+	/** Append a map to the OBJ file. */
+	void AddMapObj(BSP *pMap);
+
+	/** Write the .gltf file, once every map is in the buffer. */
+	bool WriteGltf();
+
+	/** Name of a new image, numbered when the name was already written. */
+	std::string UniqueFile(const std::string &szStem);
+
+	/** A name made safe for a file name. */
+	static std::string FileName(const std::string &szName);
+
+	/** A string quoted for JSON. */
+	static std::string Quote(const std::string &szText);
+
+	std::string               m_szPath;        /** Output file. */
+	std::string               m_szBase;        /** Output file without its extension, for the other files. */
+	std::string               m_szBaseName;    /** m_szBase without its directory, for references between files. */
+	Format                    m_eFormat;       /** Chosen from the extension. */
+	JobSystem                *m_pJobs;         /** Encodes images, may be NULL. */
+	JobCounter                m_counters[2];   /** Images of the last two maps. */
+	JobCounter               *m_pCounter;      /** Counter of the map being written. */
+	std::ofstream             m_data;          /** .bin buffer or .obj file. */
+	std::ofstream             m_mtl;           /** .mtl file. */
+	bool                      m_bOpen;         /** Between Begin() and End(). */
+	uint64_t                  m_uDataBytes;    /** Written to m_data. */
+	std::map<int, int>        m_mTextures;     /** glTF texture of each texture id written, -1 without pixels. */
+	std::map<int, std::string> m_mMtlNames;    /** OBJ material of each texture id, unique like the image names. */
+	std::set<std::string>     m_sFiles;        /** Images written, so none is written twice. */
+	std::vector<std::string>  m_vImages;       /** JSON of each image, also each texture. */
+	std::vector<int>          m_vSamplers;     /** Sampler of each texture. */
+	std::vector<std::string>  m_vMaterials;    /** JSON of each material. */
+	std::vector<std::string>  m_vMeshes;       /** JSON of each mesh. */
+	std::vector<std::string>  m_vNodes;        /** JSON of each node. */
+	std::vector<std::string>  m_vAccessors;    /** JSON of each accessor. */
+	std::vector<std::string>  m_vBufferViews;  /** JSON of each buffer view. */
+	size_t                    m_uMaps;         /** Maps written. */
+	size_t                    m_uTriangles;    /** Triangles written. */
+	int                       m_iImages;       /** Images queued. */
+	std::atomic<int>          m_iFailed;       /** Images that couldn't be written. */
+
+};//end WorldExporter
+
+#endif //WORLDEXPORTER_H
@@ -2,12 +2,166 @@
 #include "bsp.h"
 #include "entities.h"
 #include "ConfigXML.h"
+#include "MemoryRegistry.h"
+#include "TextureCache.h"
+#include "TextureRegistry.h"
+#include "VirtualFileSystem.h"
+#include "wad.h"
+#include "ScratchArena.h"
+#include "MipStreamer.h"
 #include <cstring>
 
-map <string, TEXTURE> textures;
-map <string, vector<pair<VERTEX,string> > > landmarks;
-map <string, vector<string> > dontRenderModel;
-map <string, VERTEX> offsets;
+mutex texturesMutex;
+
+//Don't render some dummy triangles (triggers and such)
+bool isRenderableTexture(const string &name){
+	return name != "aaatrigger" && name != "origin" && name != "clip" && name != "sky" && name[0]!='{';
+}
+
+//Average colour of a palettized image, ignoring the transparent blue
+static void paletteAverage(const uint8_t *indices, size_t size, const uint8_t *pal, unsigned char *avg){
+	unsigned int sum[3] = {0, 0, 0}, count = 0;
+	for(size_t j=0;j<size;j++){
+		const uint8_t *c = &pal[indices[j]*3];
+		if(c[0] == 0 && c[1] == 0 && c[2] == 255) continue;
+		sum[0] += c[0]; sum[1] += c[1]; sum[2] += c[2];
+		count++;
+	}
+	for(int c=0;c<3;c++) avg[c] = count ? sum[c]/count : 128;
+}
+
+//Faces picked as occluders for the occlusion culler, the largest first
+#define OCCLUDER_MIN_AREA (128.0f*128.0f)
+#define MAX_OCCLUDER_TRIS 512
+
+static float polygonArea(const VERTEX *p, int count){
+	float area = 0;
+	for(int k=1;k+1<count;k++){
+		VERTEX a(p[k].x-p[0].x, p[k].y-p[0].y, p[k].z-p[0].z), b(p[k+1].x-p[0].x, p[k+1].y-p[0].y, p[k+1].z-p[0].z);
+		float cx = a.y*b.z-a.z*b.y, cy = a.z*b.x-a.x*b.z, cz = a.x*b.y-a.y*b.x;
+		area += sqrt(cx*cx+cy*cy+cz*cz)/2;
+	}
+	return area;
+}
+
+static void buildOccluders(const vector<LODFACE> &faces, vector<float> &out){
+	vector <pair<float, size_t> > bySize;
+	for(size_t i=0;i<faces.size();i++){
+		float area = polygonArea(faces[i].points, faces[i].pointCount);
+		if(area >= OCCLUDER_MIN_AREA) bySize.push_back(make_pair(area, i));
+	}
+	sort(bySize.rbegin(), bySize.rend());
+	
+	out.clear();
+	for(size_t i=0;i<bySize.size();i++){
+		const VERTEX *p = faces[bySize[i].second].points;
+		int count = faces[bySize[i].second].pointCount;
+		if(out.size()/9 + count-2 > MAX_OCCLUDER_TRIS) break;
+		for(int k=1;k+1<count;k++){
+			const VERTEX *t[3] = {&p[0], &p[k], &p[k+1]};
+			for(int j=0;j<3;j++){
+				out.push_back(t[j]->x); out.push_back(t[j]->y); out.push_back(t[j]->z);
+			}
+		}
+	}
+}
+
+//Faces per region drawn front to back, larger subtrees are split at their BSP node
+#define REGION_MAX_FACES 256
+//Deeper trees are malformed, what is below is left to the last region
+#define ORDER_MAX_DEPTH 256
+
+//BSP nodes of a map being split into regions
+struct ORDERBUILD{
+	const BSPNODE *nodes; int nodeCount;
+	const BSPPLANE *planes; int planeCount;
+	int faceCount;
+	int *subtreeFaces; //Faces of each node and the nodes below it, -1 before counting, -2 once used
+	int *faceRegion; //Region of each face, -1 for none yet
+	int regions;
+	vector <ORDERNODE> *out;
+};
+
+//Faces of a node's subtree, stored into subtreeFaces
+static int countSubtreeFaces(ORDERBUILD &b, int node, int depth){
+	if(node < 0 || node >= b.nodeCount || depth > ORDER_MAX_DEPTH) return 0;
+	if(b.subtreeFaces[node] >= 0) return b.subtreeFaces[node];
+	if(b.subtreeFaces[node] == -2) return 0; //Already in a region, models may share nodes
+	b.subtreeFaces[node] = 0; //Broken files may loop
+	const BSPNODE &n = b.nodes[node];
+	int count = n.nFaces + countSubtreeFaces(b, n.iChildren[0], depth+1) + countSubtreeFaces(b, n.iChildren[1], depth+1);
+	b.subtreeFaces[node] = count;
+	return count;
+}
+
+static void assignRegion(ORDERBUILD &b, int node, int region, int depth){
+	if(node < 0 || node >= b.nodeCount || depth > ORDER_MAX_DEPTH || b.subtreeFaces[node] == -2) return;
+	b.subtreeFaces[node] = -2;
+	const BSPNODE &n = b.nodes[node];
+	for(int f=n.firstFace;f<n.firstFace+n.nFaces && f<b.faceCount;f++)
+		if(b.faceRegion[f] < 0) b.faceRegion[f] = region;
+	assignRegion(b, n.iChildren[0], region, depth+1);
+	assignRegion(b, n.iChildren[1], region, depth+1);
+}
+
+//Splits a subtree into regions of at most REGION_MAX_FACES faces, returns what ORDERNODE::children holds for it
+static int buildOrderTree(ORDERBUILD &b, int node, int depth){
+	if(node < 0 || node >= b.nodeCount || b.subtreeFaces[node] <= 0) return ORDER_EMPTY;
+	if(b.subtreeFaces[node] <= REGION_MAX_FACES || depth >= ORDER_MAX_DEPTH){
+		int region = b.regions++;
+		assignRegion(b, node, region, 0);
+		return -1-region;
+	}
+	
+	const BSPNODE &n = b.nodes[node];
+	b.subtreeFaces[node] = -2;
+	ORDERNODE o;
+	o.normal[0] = o.normal[1] = o.normal[2] = o.dist = 0;
+	if(n.iPlane < (uint32_t)b.planeCount){
+		const BSPPLANE &p = b.planes[n.iPlane];
+		o.normal[0] = p.vNormal.x; o.normal[1] = p.vNormal.y; o.normal[2] = p.vNormal.z;
+		o.dist = p.fDist;
+	}
+	o.region = -1;
+	if(n.nFaces > 0){
+		o.region = b.regions++;
+		for(int f=n.firstFace;f<n.firstFace+n.nFaces && f<b.faceCount;f++)
+			if(b.faceRegion[f] < 0) b.faceRegion[f] = o.region;
+	}
+	int index = b.out->size();
+	b.out->push_back(o);
+	int front = buildOrderTree(b, n.iChildren[0], depth+1);
+	int back = buildOrderTree(b, n.iChildren[1], depth+1);
+	(*b.out)[index].children[0] = front;
+	(*b.out)[index].children[1] = back;
+	return index;
+}
+
+//Lightmap gamma, applied as samples are written into the atlas
+static struct GAMMATABLE{
+	uint8_t v[256];
+	GAMMATABLE(){ for(int i=0;i<256;i++) v[i] = pow(i/255.0,1.0/3.0)*255; }
+} gammaTable;
+
+//Sums the styles of a face's lightmap, each weighted by its value, into gamma corrected samples
+static void combineStyles(const uint8_t *samples, int count, int styleCount, const int *values, uint8_t *out){
+	for(int j=0;j<count*3;j++){
+		int sum = 0;
+		for(int s=0;s<styleCount;s++) sum += samples[s*count*3+j]*values[s];
+		out[j] = gammaTable.v[min(sum/LIGHTSTYLE_NORMAL, 255)];
+	}
+}
+
+//Starts from the standard light styles, with the map's switchable lights on top
+static void applyLightPatterns(LightStyles &styles, const map <int,string> &patterns){
+	styles.Reset();
+	for(map <int,string>::const_iterator it=patterns.begin(); it!=patterns.end(); it++) styles.SetPattern((*it).first, (*it).second);
+}
+
+//Milliseconds since a performance counter value, for the stage timings of LoadGeometry
+static float msSince(Uint64 start){
+	return (SDL_GetPerformanceCounter()-start)*1000.0f/SDL_GetPerformanceFrequency();
+}
 
 //Correct UV coordinates
 static inline COORDS calcCoords(VERTEX v, VERTEX vs, VERTEX vt, float sShift, float tShift){
@@ -17,27 +171,26 @@ static inline COORDS calcCoords(VERTEX v, VERTEX vs, VERTEX vt, float sShift, fl
 	return ret;
 }
 
-BSP::BSP(const std::vector<std::string> &szGamePaths, const string &filename, const MapEntry &sMapEntry){
-	string id = sMapEntry.m_szName;
-
-	uint8_t gammaTable[256];
-	for(int i=0;i<256;i++)
-		gammaTable[i] = pow(i/255.0,1.0/3.0)*255;
-
-	//Light map atlas
-	lmapAtlas = new uint8_t[1024*1024*3];
-
-	ifstream inBSP;
+BSP::BSP(const string &filename, const MapEntry &sMapEntry, WORLDSTATE *worldState){
+	world = worldState;
+	mapId = sMapEntry.m_szName;
+	fileName = filename;
+	valid = loaded = resident = reloaded = false;
+	fileHash = 0;
+	lmapTexId = 0;
+	bufObjects = NULL;
+	residentBytes = 0;
+	totalTris = 0;
+	for(int l=0;l<LOD_LEVELS;l++){ lodBufObjects[l] = 0; lodCount[l] = 0; }
+	worldMins = worldMaxs = VERTEX(0,0,0);
+	offset = ConfigOffsetChapter = VERTEX(0,0,0);
+	animCursor = 0;
 
-	// Try to open the file from all known gamepaths.
-	for (size_t i = 0; i < szGamePaths.size(); i++) {
-		if (!inBSP.is_open()) {
-			inBSP.open(szGamePaths[i] + filename.c_str(), ios::binary);
-		}
-	}
-
-	// If the BSP wasn't found in any of the gamepaths...
-	if(!inBSP.is_open()){ cerr << "Can't open BSP " << filename << "." << endl; return;}
+	// Loose, or inside a PAK of any of the gamepaths
+	VfsFile file;
+	if(!world->fileSystem->Open(filename, file)){ cerr << "Can't open BSP " << filename << "." << endl; return;}
+	filePath = file.GetSourcePath();
+	VfsStream inBSP(file);
 	
 	//Check BSP version
 	BSPHEADER bHeader;
@@ -48,189 +201,249 @@ BSP::BSP(const std::vector<std::string> &szGamePaths, const string &filename, co
 	inBSP.seekg(bHeader.lump[LUMP_ENTITIES].nOffset, ios::beg);
 	char *bff = new char[bHeader.lump[LUMP_ENTITIES].nLength];
 	inBSP.read(bff, bHeader.lump[LUMP_ENTITIES].nLength);
-	parseEntities(bff,id,sMapEntry);
+	map <int,string> lightPatterns;
+	parseEntities(bff,world,mapId,sMapEntry,&modelEntities,&lightPatterns,&changeLevels);
+	applyLightPatterns(lightStyles, lightPatterns);
 	delete []bff;
+
+	//Worldspawn bounds, so the map can be placed before its geometry is loaded
+	BSPMODEL world;
+	inBSP.seekg(bHeader.lump[LUMP_MODELS].nOffset, ios::beg);
+	inBSP.read((char*)&world, sizeof(world));
+	VERTEX a(world.nMins[0], world.nMins[1], world.nMins[2]), b(world.nMaxs[0], world.nMaxs[1], world.nMaxs[2]);
+	a.fixHand();
+	b.fixHand();
+	worldMins = VERTEX(min(a.x,b.x), min(a.y,b.y), min(a.z,b.z));
+	worldMaxs = VERTEX(max(a.x,b.x), max(a.y,b.y), max(a.z,b.z));
+
+	valid = true;
+}
+
+BSP::~BSP(){
+	Unload();
+}
+
+bool BSP::LoadGeometry(){
+	if(!valid) return false;
+	if(loaded) return true;
+
+	const string &id = mapId;
+	const string &filename = fileName;
+
+	VfsFile file;
+	if(!world->fileSystem->Open(filename, file)){ cerr << "Can't open BSP " << filename << "." << endl; return false;}
+	VfsStream inBSP(file);
+	fileHash = TextureCache::Hash(file.GetData(), file.GetSize());
+
+	BSPHEADER bHeader;
+	inBSP.read((char*)&bHeader, sizeof(bHeader));
 	
-	//Read Models and hide some faces
-	BSPMODEL *models = new BSPMODEL[bHeader.lump[LUMP_MODELS].nLength/(int)sizeof(BSPMODEL)];
-	inBSP.seekg(bHeader.lump[LUMP_MODELS].nOffset, ios::beg);	
-	inBSP.read((char*)models, bHeader.lump[LUMP_MODELS].nLength);
+	stats = BSPSTATS();
+	Uint64 stage = SDL_GetPerformanceCounter();
+
+	//Buffers that only live during the load come from this thread's arena, sized from the lumps
+	ScratchArena &scratch = ScratchArena::ForThread();
+	scratch.Reset();
+	int modelCount = bHeader.lump[LUMP_MODELS].nLength/(int)sizeof(BSPMODEL);
+	int faceCount = bHeader.lump[LUMP_FACES].nLength/(int)sizeof(BSPFACE);
+
+	//Light map atlas, written straight into upload memory
+	g_textureUploader.Reserve(1024*1024*3, this->lmapAtlas);
+	uint8_t *lmapAtlas = this->lmapAtlas.GetData();
 	
-	map <int, bool> dontRenderFace;
-	for(unsigned int i=0;i<dontRenderModel[id].size();i++){
-		int modelId = atoi(dontRenderModel[id][i].substr(1).c_str());
+	//Read Models and hide some faces
+	BSPMODEL *models = scratch.Allocate<BSPMODEL>(modelCount);
+	inBSP.seekg(bHeader.lump[LUMP_MODELS].nOffset, ios::beg);
+	inBSP.read((char*)models, modelCount*sizeof(BSPMODEL));
+
+	//Brush model of each face, for picking
+	int *faceModel = scratch.AllocateZeroed<int>(faceCount);
+	for(int i=modelCount-1;i>0;i--){
+		for(int j=0;j<models[i].nFaces;j++)
+			if(models[i].iFirstFace+j < faceCount) faceModel[models[i].iFirstFace+j] = i;
+	}
+
+	char *dontRenderFace = scratch.AllocateZeroed<char>(faceCount);
+	vector <string> hidden;
+	{
+		lock_guard<mutex> lock(world->entitiesMutex);
+		map <string, vector<string> >::const_iterator it = world->dontRenderModel.find(id);
+		if(it != world->dontRenderModel.end()) hidden = (*it).second;
+	}
+	for(unsigned int i=0;i<hidden.size();i++){
+		int modelId = atoi(hidden[i].substr(1).c_str());
+		if(modelId < 0 || modelId >= modelCount) continue;
 		int startingFace = models[modelId].iFirstFace;
 		for(int j=0;j<models[modelId].nFaces;j++){
 			//if(modelId == 57) cout << j+startingFace << endl;
-			dontRenderFace[j+startingFace] = true;
+			if(j+startingFace < faceCount) dontRenderFace[j+startingFace] = 1;
 		}
-	}	
-	
-	
-	//Read Vertices
-	vector <VERTEX> vertices;
-	inBSP.seekg(bHeader.lump[LUMP_VERTICES].nOffset, ios::beg);		
-	for(int i=0;i<bHeader.lump[LUMP_VERTICES].nLength/12;i++){
-		VERTEX v;
-		inBSP.read((char*)&v, sizeof(v));
-		vertices.push_back(v);
 	}
-	
-	//Read Edges	
-	BSPEDGE *edges = new BSPEDGE[bHeader.lump[LUMP_EDGES].nLength/(int)sizeof(BSPEDGE)];
-	inBSP.seekg(bHeader.lump[LUMP_EDGES].nOffset, ios::beg);	
-	inBSP.read((char*)edges, bHeader.lump[LUMP_EDGES].nLength);
-	
+
+
+	//Read Vertices
+	int vertexCount = bHeader.lump[LUMP_VERTICES].nLength/(int)sizeof(VERTEX);
+	VERTEX *vertices = scratch.Allocate<VERTEX>(vertexCount);
+	inBSP.seekg(bHeader.lump[LUMP_VERTICES].nOffset, ios::beg);
+	inBSP.read((char*)vertices, vertexCount*sizeof(VERTEX));
+
+	//Read Edges
+	BSPEDGE *edges = scratch.Allocate<BSPEDGE>(bHeader.lump[LUMP_EDGES].nLength/(int)sizeof(BSPEDGE));
+	inBSP.seekg(bHeader.lump[LUMP_EDGES].nOffset, ios::beg);
+	inBSP.read((char*)edges, bHeader.lump[LUMP_EDGES].nLength/(int)sizeof(BSPEDGE)*sizeof(BSPEDGE));
+
 	//Read Surfedges
-	vector <VERTEX> verticesPrime;
+	int surfedgeCount = bHeader.lump[LUMP_SURFEDGES].nLength/(int)sizeof(int);
+	int *surfedges = scratch.Allocate<int>(surfedgeCount);
 	inBSP.seekg(bHeader.lump[LUMP_SURFEDGES].nOffset, ios::beg);
-	for(int i=0;i<bHeader.lump[LUMP_SURFEDGES].nLength/(int)sizeof(int);i++){
-		int e;
-		inBSP.read((char*)&e, sizeof(e));
-		verticesPrime.push_back(vertices[edges[e>0?e:-e].iVertex[e>0?0:1]]);
+	inBSP.read((char*)surfedges, surfedgeCount*sizeof(int));
+	VERTEX *verticesPrime = scratch.Allocate<VERTEX>(surfedgeCount);
+	for(int i=0;i<surfedgeCount;i++){
+		int e = surfedges[i];
+		verticesPrime[i] = vertices[edges[e>0?e:-e].iVertex[e>0?0:1]];
 	}
+
+	stats.vertices = vertexCount;
+	stats.readMs = msSince(stage);
+	stage = SDL_GetPerformanceCounter();
 	
-	//Read Lightmaps
-	inBSP.seekg(bHeader.lump[LUMP_LIGHTING].nOffset, ios::beg);
+	//Lightmaps are read in place, no copy of the lump is made
+	if((size_t)bHeader.lump[LUMP_LIGHTING].nOffset + bHeader.lump[LUMP_LIGHTING].nLength > file.GetSize()){ cerr << "Lighting lump is out of bounds (" << filename << ")." << endl; return false;}
+	const uint8_t *lmap = file.GetData() + bHeader.lump[LUMP_LIGHTING].nOffset;
 	int size = bHeader.lump[LUMP_LIGHTING].nLength;
-	uint8_t *lmap = new uint8_t[size];
-	inBSP.read((char*)lmap, size);
-	vector <LMAP> lmaps;
-	
+	LMAP *lmaps = scratch.Allocate<LMAP>(faceCount);
+
 	//Read Textures
 	inBSP.seekg(bHeader.lump[LUMP_TEXTURES].nOffset, ios::beg);
 	BSPTEXTUREHEADER theader;
 	inBSP.read((char*)&theader, sizeof(theader));
-	int *texOffSets = new int[theader.nMipTextures];
+	int *texOffSets = scratch.Allocate<int>(theader.nMipTextures);
 	inBSP.read((char*)texOffSets, theader.nMipTextures*sizeof(int));
-	
-	vector <string> texNames;
-	
+
+	//Names are only looked up here, once per miptex, faces use the ids
+	int *texIds = scratch.Allocate<int>(theader.nMipTextures);
+	TEXTURE **texEntries = scratch.Allocate<TEXTURE*>(theader.nMipTextures);
+	unsigned char *texAvg = scratch.Allocate<unsigned char>(theader.nMipTextures*3); //Used by the LOD meshes
+	int *texSize = scratch.Allocate<int>(theader.nMipTextures*2); //Copied locked, the GL thread may be reloading the entry
+	char *texRenderable = scratch.Allocate<char>(theader.nMipTextures);
+
 	for(unsigned int i=0;i<theader.nMipTextures;i++){
 		inBSP.seekg(bHeader.lump[LUMP_TEXTURES].nOffset+texOffSets[i], ios::beg);
 		
 		BSPMIPTEX bmt;
 		inBSP.read((char*)&bmt, sizeof(bmt));
-		if(textures.count(bmt.szName) == 0){ //First appearance of the texture
-			if(bmt.nOffsets[0] != 0 && bmt.nOffsets[1] != 0 && bmt.nOffsets[2] != 0 && bmt.nOffsets[3] != 0){
-				//Textures that are inside the BSP
-				
-				//Awful code. This and wad.cpp may be joined, they are pretty similar (except that these don't have color palettes)
-				
-				unsigned char *data0 = new unsigned char[bmt.nWidth*bmt.nHeight];
-				inBSP.seekg(bHeader.lump[LUMP_TEXTURES].nOffset+texOffSets[i]+bmt.nOffsets[0], ios::beg);
-				inBSP.read((char*)data0, bmt.nWidth*bmt.nHeight);
-				
-				unsigned char *data1 = new unsigned char[bmt.nWidth*bmt.nHeight/4];
-				inBSP.seekg(bHeader.lump[LUMP_TEXTURES].nOffset+texOffSets[i]+bmt.nOffsets[1], ios::beg);
-				inBSP.read((char*)data1, bmt.nWidth*bmt.nHeight/4);
-				
-				unsigned char *data2 = new unsigned char[bmt.nWidth*bmt.nHeight/16];
-				inBSP.seekg(bHeader.lump[LUMP_TEXTURES].nOffset+texOffSets[i]+bmt.nOffsets[2], ios::beg);
-				inBSP.read((char*)data2, bmt.nWidth*bmt.nHeight/16);
-				
-				unsigned char *data3 = new unsigned char[bmt.nWidth*bmt.nHeight/64];
-				inBSP.seekg(bHeader.lump[LUMP_TEXTURES].nOffset+texOffSets[i]+bmt.nOffsets[3], ios::beg);
-				inBSP.read((char*)data3, bmt.nWidth*bmt.nHeight/64);
-				
-				short dummy; inBSP.read((char*)&dummy, 2);
-				
-				unsigned char *data4 = new unsigned char[256*3];
-				inBSP.read((char*)data4, 256*3);
-				
-				unsigned char *dataFinal0 = new unsigned char[bmt.nWidth*bmt.nHeight*4];
-				unsigned char *dataFinal1 = new unsigned char[bmt.nWidth*bmt.nHeight];
-				unsigned char *dataFinal2 = new unsigned char[bmt.nWidth*bmt.nHeight/4];
-				unsigned char *dataFinal3 = new unsigned char[bmt.nWidth*bmt.nHeight/16];
-				
-				for(unsigned int y=0;y<bmt.nHeight;y++)
-				for(unsigned int x=0;x<bmt.nWidth;x++){
-					dataFinal0[(x+y*bmt.nWidth)*4] = data4[data0[y*bmt.nWidth+x]*3];
-					dataFinal0[(x+y*bmt.nWidth)*4+1] = data4[data0[y*bmt.nWidth+x]*3+1];
-					dataFinal0[(x+y*bmt.nWidth)*4+2] = data4[data0[y*bmt.nWidth+x]*3+2];
-					
-					if(dataFinal0[(x+y*bmt.nWidth)*4] == 0 && dataFinal0[(x+y*bmt.nWidth)*4+1] == 0 && dataFinal0[(x+y*bmt.nWidth)*4+2] == 255)
-						dataFinal0[(x+y*bmt.nWidth)*4+3] = dataFinal0[(x+y*bmt.nWidth)*4+2] = dataFinal0[(x+y*bmt.nWidth)*4+1] = dataFinal0[(x+y*bmt.nWidth)*4+0] = 0;
-					else
-						dataFinal0[(x+y*bmt.nWidth)*4+3] = 255;
-				}
-				for(unsigned int y=0;y<bmt.nHeight/2;y++)
-				for(unsigned int x=0;x<bmt.nWidth/2;x++){
-					dataFinal1[(x+y*bmt.nWidth/2)*4] = data4[data1[y*bmt.nWidth/2+x]*3];
-					dataFinal1[(x+y*bmt.nWidth/2)*4+1] = data4[data1[y*bmt.nWidth/2+x]*3+1];
-					dataFinal1[(x+y*bmt.nWidth/2)*4+2] = data4[data1[y*bmt.nWidth/2+x]*3+2];
-					
-					if(dataFinal1[(x+y*bmt.nWidth/2)*4] == 0 && dataFinal1[(x+y*bmt.nWidth/2)*4+1] == 0 && dataFinal1[(x+y*bmt.nWidth/2)*4+2] == 255)
-						dataFinal1[(x+y*bmt.nWidth/2)*4+3] = dataFinal1[(x+y*bmt.nWidth/2)*4+2] = dataFinal1[(x+y*bmt.nWidth/2)*4+1] = dataFinal1[(x+y*bmt.nWidth/2)*4+0] = 0;
-					else
-						dataFinal1[(x+y*bmt.nWidth/2)*4+3] = 255;
-				}
-				for(unsigned int y=0;y<bmt.nHeight/4;y++)
-				for(unsigned int x=0;x<bmt.nWidth/4;x++){
-					dataFinal2[(x+y*bmt.nWidth/4)*4] = data4[data2[y*bmt.nWidth/4+x]*3];
-					dataFinal2[(x+y*bmt.nWidth/4)*4+1] = data4[data2[y*bmt.nWidth/4+x]*3+1];
-					dataFinal2[(x+y*bmt.nWidth/4)*4+2] = data4[data2[y*bmt.nWidth/4+x]*3+2];
-					
-					if(dataFinal2[(x+y*bmt.nWidth/4)*4] == 0 && dataFinal2[(x+y*bmt.nWidth/4)*4+1] == 0 && dataFinal2[(x+y*bmt.nWidth/4)*4+2] == 255)
-						dataFinal2[(x+y*bmt.nWidth/4)*4+3] = dataFinal2[(x+y*bmt.nWidth/4)*4+2] = dataFinal2[(x+y*bmt.nWidth/4)*4+1] = dataFinal2[(x+y*bmt.nWidth/4)*4+0] = 0;
-					else
-						dataFinal2[(x+y*bmt.nWidth/4)*4+3] = 255;
-				}
-				for(unsigned int y=0;y<bmt.nHeight/8;y++)
-				for(unsigned int x=0;x<bmt.nWidth/8;x++){
-					dataFinal3[(x+y*bmt.nWidth/8)*4] = data4[data3[y*bmt.nWidth/8+x]*3];
-					dataFinal3[(x+y*bmt.nWidth/8)*4+1] = data4[data3[y*bmt.nWidth/8+x]*3+1];
-					dataFinal3[(x+y*bmt.nWidth/8)*4+2] = data4[data3[y*bmt.nWidth/8+x]*3+2];
-					
-					if(dataFinal3[(x+y*bmt.nWidth/8)*4] == 0 && dataFinal3[(x+y*bmt.nWidth/8)*4+1] == 0 && dataFinal3[(x+y*bmt.nWidth/8)*4+2] == 255)
-						dataFinal3[(x+y*bmt.nWidth/8)*4+3] = dataFinal3[(x+y*bmt.nWidth/8)*4+2] = dataFinal3[(x+y*bmt.nWidth/8)*4+1] = dataFinal3[(x+y*bmt.nWidth/8)*4+0] = 0;
-					else
-						dataFinal3[(x+y*bmt.nWidth/8)*4+3] = 255;
-				}
-				
-				TEXTURE n;
-				n.w = bmt.nWidth; n.h = bmt.nHeight;
-				glGenTextures(1, &n.texId);		
-				glBindTexture(GL_TEXTURE_2D, n.texId);
-				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 3);
-				glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, bmt.nWidth  , bmt.nHeight  , 0, GL_RGBA, GL_UNSIGNED_BYTE, dataFinal0);
-				glTexImage2D(GL_TEXTURE_2D, 1, GL_RGBA, bmt.nWidth/2, bmt.nHeight/2, 0, GL_RGBA, GL_UNSIGNED_BYTE, dataFinal1);
-				glTexImage2D(GL_TEXTURE_2D, 2, GL_RGBA, bmt.nWidth/4, bmt.nHeight/4, 0, GL_RGBA, GL_UNSIGNED_BYTE, dataFinal2);
-				glTexImage2D(GL_TEXTURE_2D, 3, GL_RGBA, bmt.nWidth/8, bmt.nHeight/8, 0, GL_RGBA, GL_UNSIGNED_BYTE, dataFinal3);
-				textures[bmt.szName]=n;
-				
-				delete[] data0; delete[] data1; delete[] data2; delete[] data3; delete[] data4;
-				delete[] dataFinal0; delete[] dataFinal1; delete[] dataFinal2; delete[] dataFinal3;
-				
+		bool embedded = bmt.nOffsets[0] != 0 && bmt.nOffsets[1] != 0 && bmt.nOffsets[2] != 0 && bmt.nOffsets[3] != 0;
+		bool decode = false;
+		
+		//Miptex data is used in place, clipped to the end of the file
+		size_t rawOffset = (size_t)bHeader.lump[LUMP_TEXTURES].nOffset + texOffSets[i];
+		size_t rawSize = (size_t)bmt.nOffsets[3] + (bmt.nWidth/8)*(bmt.nHeight/8) + 2 + 256*3;
+		if(rawOffset > file.GetSize()) rawOffset = file.GetSize();
+		rawSize = min(rawSize, file.GetSize() - rawOffset);
+		const uint8_t *raw = file.GetData() + rawOffset;
+		
+		//Embedded textures go by their pixels, so equal ones share and different ones with the same name don't
+		unsigned long long content = embedded ? miptexContentHash(raw, rawSize) : 0;
+		{
+			//Other loader threads may be reserving textures too
+			lock_guard<mutex> lock(texturesMutex);
+			bool added;
+			if(embedded && reloaded){
+				//An edited texture takes its name along, the old pixels are freed once no map uses them
+				int oldId = g_textures.Find(bmt.szName);
+				texIds[i] = g_textures.Rebind(bmt.szName, content, bmt.nWidth, bmt.nHeight, false, added);
+				if(oldId >= 0 && oldId != texIds[i]) replacedTextures.push_back(oldId);
+			}else if(embedded) texIds[i] = g_textures.InternContent(bmt.szName, content, bmt.nWidth, bmt.nHeight, added);
+			else texIds[i] = g_textures.Intern(bmt.szName, added);
+			texEntries[i] = &g_textures.Get(texIds[i]);
+			decode = added && embedded; //First appearance of the texture
+			for(int c=0;c<3;c++) texAvg[i*3+c] = texEntries[i]->avg[c];
+			texSize[i*2] = texEntries[i]->w;
+			texSize[i*2+1] = texEntries[i]->h;
+		}
+		texRenderable[i] = isRenderableTexture(bmt.szName);
+		if(embedded) stats.embeddedTextures++;
+		else stats.wadTextures.push_back(bmt.szName);
+
+		if(embedded){
+			//Average of the smallest mipmap, the shared entry may be filled by another thread
+			size_t indicesSize = bmt.nWidth*bmt.nHeight/64;
+			size_t palOffset = (size_t)bmt.nOffsets[3] + indicesSize + 2;
+			if(palOffset + 256*3 <= rawSize) paletteAverage(raw + bmt.nOffsets[3], indicesSize, raw + palOffset, &texAvg[i*3]);
+		}
+
+		if(embedded && !decode && reloaded){
+			//Shared with an older copy of this file, the streamer has to read it at its new offset
+			TEXSOURCE ts;
+			ts.id = texIds[i];
+			ts.rawOffset = rawOffset; ts.rawSize = rawSize;
+			ts.hash = TextureCache::Hash(raw, rawSize);
+			movedTextures.push_back(ts);
+		}
+
+		if(decode){
+			//Textures that are inside the BSP, up to the palette after the last mipmap
+			PENDINGTEX pt;
+			pt.tex = texEntries[i];
+			pt.firstMip = g_mipStreamer.GetFirstMip();
+
+			//Decoded mips come from the texture cache when this miptex was seen before
+			CachedTexture cached;
+			unsigned char avg[3];
+			unsigned long long hash = TextureCache::Hash(raw, rawSize);
+			size_t firstOffset = mipChainOffset(bmt.nWidth, bmt.nHeight, pt.firstMip);
+			g_textureUploader.Reserve(mipChainOffset(bmt.nWidth, bmt.nHeight, MIPLEVELS) - firstOffset, pt.mips);
+			if(g_textureCache.Load(hash, cached) && cached.GetWidth() == (int)bmt.nWidth && cached.GetHeight() == (int)bmt.nHeight && cached.GetLevels() == MIPLEVELS){
+				memcpy(pt.mips.GetData(), cached.GetMip(pt.firstMip), pt.mips.GetSize());
+			}else if(decodeMiptex(raw, rawSize, pt.mips.GetData(), avg, pt.firstMip)){
+				//Only whole chains are cached, the streamer stores the rest when it reads it
+				if(pt.firstMip == 0) g_textureCache.Store(hash, bmt.nWidth, bmt.nHeight, pt.mips.GetData(), MIPLEVELS, avg);
 			}else{
-				TEXTURE n;
-				n.texId = 0;
-				n.w = 1;
-				n.h = 1;
-				textures[bmt.szName]=n;
+				cerr << "Can't decode " << bmt.szName << " in " << fileName << "." << endl;
+				g_textureUploader.Release(pt.mips);
+				pt.tex = NULL;
+			}
+			if(pt.tex != NULL){
+				//Swapped in, a copy would leave heap staging pData on pt's freed buffer
+				pendingTextures.push_back(PENDINGTEX());
+				PENDINGTEX &back = pendingTextures.back();
+				back.tex = pt.tex;
+				back.id = texIds[i];
+				back.firstMip = pt.firstMip;
+				back.rawOffset = rawOffset; back.rawSize = rawSize;
+				back.hash = hash;
+				swap(back.mips, pt.mips);
 			}
 		}
-		texNames.push_back(bmt.szName);
 	}
+	{
+		lock_guard<mutex> lock(texturesMutex);
+		g_textures.CountLoad();
+	}
+	stats.textures = theader.nMipTextures;
+	stats.texturesMs = msSince(stage);
+	stage = SDL_GetPerformanceCounter();
 	
 	//Read Texture information
 	inBSP.seekg(bHeader.lump[LUMP_TEXINFO].nOffset, ios::beg);
-	BSPTEXTUREINFO *btfs = new BSPTEXTUREINFO[bHeader.lump[LUMP_TEXINFO].nLength/(int)sizeof(BSPTEXTUREINFO)];
-	inBSP.read((char*)btfs, bHeader.lump[LUMP_TEXINFO].nLength);	
-	
+	BSPTEXTUREINFO *btfs = scratch.Allocate<BSPTEXTUREINFO>(bHeader.lump[LUMP_TEXINFO].nLength/(int)sizeof(BSPTEXTUREINFO));
+	inBSP.read((char*)btfs, bHeader.lump[LUMP_TEXINFO].nLength/(int)sizeof(BSPTEXTUREINFO)*sizeof(BSPTEXTUREINFO));
+
 	//Read Faces and lightmaps
+	BSPFACE *faces = scratch.Allocate<BSPFACE>(faceCount);
 	inBSP.seekg(bHeader.lump[LUMP_FACES].nOffset, ios::beg);
-	
-	float *minUV = new float[bHeader.lump[LUMP_FACES].nLength/(int)sizeof(BSPFACE)*2];
-	float *maxUV = new float[bHeader.lump[LUMP_FACES].nLength/(int)sizeof(BSPFACE)*2];
-	
-	for(int i=0;i<bHeader.lump[LUMP_FACES].nLength/(int)sizeof(BSPFACE);i++){
-		BSPFACE f;
-		inBSP.read((char*)&f, sizeof(f));
+	inBSP.read((char*)faces, faceCount*sizeof(BSPFACE));
+
+	float *minUV = scratch.Allocate<float>(faceCount*2);
+	float *maxUV = scratch.Allocate<float>(faceCount*2);
+
+	//Output sizes are counted on the way, so the persistent vectors are allocated once
+	int *miptexVerts = scratch.AllocateZeroed<int>(theader.nMipTextures);
+	size_t lodFaceCount = 0, pickTriCount = 0;
+
+	for(int i=0;i<faceCount;i++){
+		const BSPFACE &f = faces[i];
 		BSPTEXTUREINFO b = btfs[f.iTextureInfo];
-		string faceTexName = texNames[b.iMiptex];
 		
 		minUV[i*2] = minUV[i*2+1] = 99999;
 		maxUV[i*2] = maxUV[i*2+1] = -99999;
@@ -252,16 +465,26 @@ BSP::BSP(const std::vector<std::string> &szGamePaths, const string &filename, co
 		
 		int lmw = ceil(maxUV[i*2]/16) - floor(minUV[i*2]/16) + 1;
 		int lmh = ceil(maxUV[i*2+1]/16) - floor(minUV[i*2+1]/16) + 1;
-		
+
+		if(!dontRenderFace[i] && lmw <= 17 && lmh <= 17 && f.nEdges > 2){
+			miptexVerts[b.iMiptex] += (f.nEdges-2)*3;
+			if(texRenderable[b.iMiptex]){ lodFaceCount++; pickTriCount += f.nEdges-2; }
+		}
+
 		if(lmw > 17 || lmh > 17) lmw = lmh = 1;
 		LMAP l; l.w = lmw; l.h = lmh; l.offset = lmap+f.nLightmapOffset;
-		lmaps.push_back(l);
+		for(l.styleCount=0;l.styleCount<4 && f.nStyles[l.styleCount] != LIGHTSTYLE_NONE;l.styleCount++) l.styles[l.styleCount] = f.nStyles[l.styleCount];
+		l.valid = l.styleCount > 0 && (int)f.nLightmapOffset >= 0 && (int)f.nLightmapOffset + l.styleCount*lmw*lmh*3 <= size;
+		l.drawn = texRenderable[b.iMiptex] && !dontRenderFace[i];
+		lmaps[i] = l;
+		if(l.valid) stats.lightmaps++;
 	}
-		
+	stats.faces = faceCount;
+
 	int lmapRover[1024]; memset(lmapRover, 0, 1024*4);
 
 	//Light map "rover" algorithm from Quake 2 (http://fabiensanglard.net/quake2/quake2_opengl_renderer.php)
-	for(unsigned int i=0;i<lmaps.size();i++){
+	for(int i=0;i<faceCount;i++){
 		int best=1024, best2;
 
 		for(int a=0;a<1024-lmaps[i].w;a++){
@@ -281,8 +504,11 @@ BSP::BSP(const std::vector<std::string> &szGamePaths, const string &filename, co
 
 		if(best + lmaps[i].h > 1024){
 			cout << "Lightmap atlas is too small (" << filename <<")." << endl;
+			stats.atlasOverflow = faceCount - i;
 			break;
 		}
+		stats.atlasTexels += lmaps[i].w*lmaps[i].h;
+		stats.atlasHeight = max(stats.atlasHeight, best + lmaps[i].h);
 
 		for(int a=0;a<lmaps[i].w;a++)
 			lmapRover[lmaps[i].finalX + a] = best + lmaps[i].h;
@@ -290,31 +516,92 @@ BSP::BSP(const std::vector<std::string> &szGamePaths, const string &filename, co
 		int finalX = lmaps[i].finalX;
 		int finalY = lmaps[i].finalY;
 		
+		//Styles are combined at their starting value, faces with animated ones keep their samples to combine them again
+		//Without light styles, every style is baked at normal brightness, as some start dark
+		uint8_t block[17*17*3];
+		int count = lmaps[i].w*lmaps[i].h, values[4];
+		bool animated = false;
+		for(int s=0;s<lmaps[i].styleCount;s++){
+			if(!world->animateLightStyles){ values[s] = LIGHTSTYLE_NORMAL; continue; }
+			values[s] = lightStyles.GetValue(lmaps[i].styles[s], 0);
+			animated = animated || lightStyles.IsAnimated(lmaps[i].styles[s]);
+		}
+		if(lmaps[i].valid) combineStyles(lmaps[i].offset, count, lmaps[i].styleCount, values, block);
+		else memset(block, 255, count*3); //No light data, fullbright
+		
 		#define ATXY(_x,_y) ((_x)+((_y)*1024))*3
-		#define LMXY(_x,_y) ((_x)+((_y)*lmaps[i].w))*3
 		for(int y=0;y<lmaps[i].h;y++)
-		for(int x=0;x<lmaps[i].w;x++){
-			lmapAtlas[ATXY(finalX+x, finalY+y)+0] = gammaTable[lmaps[i].offset[LMXY(x,y)+0]];
-			lmapAtlas[ATXY(finalX+x, finalY+y)+1] = gammaTable[lmaps[i].offset[LMXY(x,y)+1]];
-			lmapAtlas[ATXY(finalX+x, finalY+y)+2] = gammaTable[lmaps[i].offset[LMXY(x,y)+2]];
+			memcpy(&lmapAtlas[ATXY(finalX, finalY+y)], &block[y*lmaps[i].w*3], lmaps[i].w*3);
+		
+		if(animated && lmaps[i].valid && lmaps[i].drawn){
+			ANIMFACE af;
+			af.rect.x = finalX; af.rect.y = finalY; af.rect.w = lmaps[i].w; af.rect.h = lmaps[i].h;
+			af.styleCount = lmaps[i].styleCount;
+			for(int s=0;s<af.styleCount;s++){ af.styles[s] = lmaps[i].styles[s]; af.values[s] = values[s]; }
+			af.samples = animSamples.size();
+			animSamples.insert(animSamples.end(), lmaps[i].offset, lmaps[i].offset + af.styleCount*count*3);
+			animFaces.push_back(af);
 		}
 	}
 
-	//Load the actual triangles
+	stats.lightmapsMs = msSince(stage);
+	stage = SDL_GetPerformanceCounter();
 	
-	inBSP.seekg(bHeader.lump[LUMP_FACES].nOffset, ios::beg);
-	for(int i=0;i<bHeader.lump[LUMP_FACES].nLength/(int)sizeof(BSPFACE);i++){
-		
-		
-		BSPFACE f;
-		inBSP.read((char*)&f, sizeof(f));
-		
+	//Regions of nearby faces, from the node tree of each brush model, so they can be drawn front to back
+	ORDERBUILD ob;
+	ob.nodeCount = bHeader.lump[LUMP_NODES].nLength/(int)sizeof(BSPNODE);
+	ob.planeCount = bHeader.lump[LUMP_PLANES].nLength/(int)sizeof(BSPPLANE);
+	BSPNODE *nodes = scratch.Allocate<BSPNODE>(ob.nodeCount);
+	BSPPLANE *planes = scratch.Allocate<BSPPLANE>(ob.planeCount);
+	inBSP.seekg(bHeader.lump[LUMP_NODES].nOffset, ios::beg);
+	inBSP.read((char*)nodes, ob.nodeCount*sizeof(BSPNODE));
+	inBSP.seekg(bHeader.lump[LUMP_PLANES].nOffset, ios::beg);
+	inBSP.read((char*)planes, ob.planeCount*sizeof(BSPPLANE));
+	ob.nodes = nodes; ob.planes = planes;
+	ob.faceCount = faceCount;
+	ob.subtreeFaces = scratch.Allocate<int>(ob.nodeCount);
+	ob.faceRegion = scratch.Allocate<int>(faceCount);
+	ob.regions = 0;
+	ob.out = &orderNodes;
+	for(int i=0;i<ob.nodeCount;i++) ob.subtreeFaces[i] = -1;
+	for(int i=0;i<faceCount;i++) ob.faceRegion[i] = -1;
+	for(int m=0;m<modelCount;m++){
+		countSubtreeFaces(ob, models[m].iHeadnodes[0], 0);
+		int root = buildOrderTree(ob, models[m].iHeadnodes[0], 0);
+		if(root != ORDER_EMPTY) orderRoots.push_back(root);
+	}
+	
+	//Faces no tree reached are drawn last, all other faces are visited region by region
+	int regionCount = ob.regions + 1;
+	int *regionStart = scratch.AllocateZeroed<int>(regionCount + 1);
+	for(int i=0;i<faceCount;i++){
+		if(ob.faceRegion[i] < 0) ob.faceRegion[i] = ob.regions;
+		regionStart[ob.faceRegion[i] + 1]++;
+	}
+	orderRoots.push_back(-1-ob.regions);
+	for(int r=0;r<regionCount;r++) regionStart[r+1] += regionStart[r];
+	int *faceOrder = scratch.Allocate<int>(faceCount);
+	for(int i=0;i<faceCount;i++) faceOrder[regionStart[ob.faceRegion[i]]++] = i;
+	int *lastDrawOfCluster = scratch.Allocate<int>(theader.nMipTextures);
+	int *lastRegionOfCluster = scratch.Allocate<int>(theader.nMipTextures);
+	
+	//Load the actual triangles
+	vector <LODFACE> lodFaces, occluderFaces;
+	lodFaces.reserve(lodFaceCount);
+	int *slotOfMiptex = scratch.Allocate<int>(theader.nMipTextures); //Index into texturedTris
+	for(unsigned int i=0;i<theader.nMipTextures;i++) slotOfMiptex[i] = -1;
+	texturedTris.reserve(theader.nMipTextures);
+	vector <BvhTriangle> pickTris;
+	if(world->buildPickingBvh) pickTris.reserve(pickTriCount);
+
+	for(int n=0;n<faceCount;n++){
+		int i = faceOrder[n];
+		const BSPFACE &f = faces[i];
+
 		if(dontRenderFace[i]) continue;
 		
 		BSPTEXTUREINFO b = btfs[f.iTextureInfo];
 		
-		string faceTexName = texNames[b.iMiptex];
-		
 		//Calculate light map uvs
 		int lmw = ceil(maxUV[i*2]/16) - floor(minUV[i*2]/16) + 1;
 		int lmh = ceil(maxUV[i*2+1]/16) - floor(minUV[i*2+1]/16) + 1;
@@ -328,9 +615,60 @@ BSP::BSP(const std::vector<std::string> &szGamePaths, const string &filename, co
 		float mid_tex_t = (float)lmh / 2.0f;
 		float fX = lmaps[i].finalX;
 		float fY = lmaps[i].finalY;
-		TEXTURE t = textures[faceTexName];
+		float texW = texSize[b.iMiptex*2], texH = texSize[b.iMiptex*2+1];
 		
-		vector <VECFINAL>*vt = &texturedTris[faceTexName].triangles;
+		if(texRenderable[b.iMiptex]){
+			//Flat colour for the LOD meshes: texture average lit by the average lightmap sample
+			LODFACE lf;
+			float light[3] = {255, 255, 255};
+			if((int)f.nLightmapOffset >= 0 && (int)f.nLightmapOffset + lmw*lmh*3 <= size){
+				float sum[3] = {0, 0, 0};
+				for(int j=0;j<lmw*lmh;j++)
+					for(int c=0;c<3;c++) sum[c] += gammaTable.v[lmaps[i].offset[j*3+c]];
+				for(int c=0;c<3;c++) light[c] = sum[c]/(lmw*lmh);
+			}
+			for(int c=0;c<3;c++) lf.color[c] = texAvg[b.iMiptex*3+c]*light[c]/255;
+			VERTEX *points = scratch.Allocate<VERTEX>(f.nEdges);
+			for(int j=0;j<f.nEdges;j++){
+				points[j] = verticesPrime[f.iFirstEdge+j];
+				points[j].fixHand();
+			}
+			lf.points = points;
+			lf.pointCount = f.nEdges;
+			lodFaces.push_back(lf);
+			//Only world faces occlude: brush entities open (doors) or are drawn see-through (grates, fences),
+			//and transparent { textures aren't renderable at all
+			if(faceModel[i] == 0) occluderFaces.push_back(lf);
+		}
+		
+		if(slotOfMiptex[b.iMiptex] < 0){
+			TEXSTUFF ts;
+			ts.vertCount = 0;
+			ts.mins = ts.maxs = VERTEX(0,0,0); //Found once the triangles are in
+			ts.texture = texIds[b.iMiptex];
+			ts.renderable = texRenderable[b.iMiptex];
+			ts.tex = texEntries[b.iMiptex];
+			lastDrawOfCluster[texturedTris.size()] = -1;
+			slotOfMiptex[b.iMiptex] = texturedTris.size();
+			texturedTris.push_back(ts);
+			texturedTris.back().triangles.reserve(miptexVerts[b.iMiptex]);
+		}
+		int cluster = slotOfMiptex[b.iMiptex];
+		vector <VECFINAL>*vt = &texturedTris[cluster].triangles;
+		
+		//Faces come region by region, so a region's vertices of each texture are one range
+		int region = ob.faceRegion[i];
+		int &last = lastDrawOfCluster[cluster];
+		if(last < 0 || lastRegionOfCluster[cluster] != region){
+			while((int)regionFirstDraw.size() <= region) regionFirstDraw.push_back(regionDraws.size());
+			REGIONDRAW d;
+			d.cluster = cluster;
+			d.first = vt->size();
+			d.count = 0;
+			last = regionDraws.size();
+			lastRegionOfCluster[cluster] = region;
+			regionDraws.push_back(d);
+		}
 		
 		for(int j=2,k=1;j<f.nEdges;j++,k++){	
 			VERTEX v1 = verticesPrime[f.iFirstEdge], v2 = verticesPrime[f.iFirstEdge+k], v3 = verticesPrime[f.iFirstEdge+j];
@@ -353,8 +691,8 @@ BSP::BSP(const std::vector<std::string> &szGamePaths, const string &filename, co
 			c1l.u /= 1024.0; c2l.u /= 1024.0; c3l.u /= 1024.0;
 			c1l.v /= 1024.0; c2l.v /= 1024.0; c3l.v /= 1024.0;
 			
-			c1.u /= t.w; c2.u /= t.w; c3.u /= t.w;
-			c1.v /= t.h; c2.v /= t.h; c3.v /= t.h;
+			c1.u /= texW; c2.u /= texW; c3.u /= texW;
+			c1.v /= texH; c2.v /= texH; c3.v /= texH;
 			
 			v1.fixHand();
 			v2.fixHand();
@@ -363,42 +701,191 @@ BSP::BSP(const std::vector<std::string> &szGamePaths, const string &filename, co
 			vt->push_back(VECFINAL(v1,c1,c1l));
 			vt->push_back(VECFINAL(v2,c2,c2l));
 			vt->push_back(VECFINAL(v3,c3,c3l));
+			
+			if(world->buildPickingBvh && texRenderable[b.iMiptex]){
+				BvhTriangle bt = {{{v1.x,v1.y,v1.z}, {v2.x,v2.y,v2.z}, {v3.x,v3.y,v3.z}}, i, texIds[b.iMiptex], faceModel[i]};
+				pickTris.push_back(bt);
+			}
 		}
-		texturedTris[faceTexName].texId = textures[faceTexName].texId;
+		regionDraws[last].count = vt->size() - regionDraws[last].first;
 	}
+	while((int)regionFirstDraw.size() <= regionCount) regionFirstDraw.push_back(regionDraws.size());
+
 
+	totalTris=0;
+	for(size_t i=0;i<texturedTris.size();i++){
+		vector <VECFINAL> &t = texturedTris[i].triangles;
+		texturedTris[i].vertCount = t.size();
+		totalTris += t.size();
+		
+		//Cluster bounds for the occlusion culler
+		VERTEX &mins = texturedTris[i].mins, &maxs = texturedTris[i].maxs;
+		mins = maxs = t.empty() ? VERTEX(0,0,0) : VERTEX(t[0].x, t[0].y, t[0].z);
+		for(size_t j=1;j<t.size();j++){
+			mins.x = min(mins.x, t[j].x); mins.y = min(mins.y, t[j].y); mins.z = min(mins.z, t[j].z);
+			maxs.x = max(maxs.x, t[j].x); maxs.y = max(maxs.y, t[j].y); maxs.z = max(maxs.z, t[j].z);
+		}
+	}
 	
-	delete []btfs;
-	delete []texOffSets;
-	delete []edges;
+	stats.triangles = totalTris/3;
+	stats.trianglesMs = msSince(stage);
+	stage = SDL_GetPerformanceCounter();
 	
-	inBSP.close();
+	buildOccluders(occluderFaces, occluders);
+	if(world->buildPickingBvh) bvh.Build(pickTris);
+	
+	for(int l=0;l<LOD_LEVELS;l++){
+		buildLod(lodFaces, lodCellSize[l], lodVerts[l]);
+		lodCount[l] = lodVerts[l].size();
+	}
+	stats.buildMs = msSince(stage);
+	
+	loaded = true;
+	reportHostMemory();
+	return true;
+}
+
+void BSP::Upload(){
+	if(!loaded || resident) return;
+	
+	//Room for the next loads, from uploads the GPU has finished
+	g_textureUploader.Update();
+	
+	//Embedded textures decoded by LoadGeometry
+	for(size_t i=0;i<pendingTextures.size();i++){
+		TEXTURE *n = pendingTextures[i].tex;
+		GLuint texId;
+		glGenTextures(1, &texId);		
+		glBindTexture(GL_TEXTURE_2D, texId);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		
+		//Top levels are left out when over the memory budget, or until streamed in
+		int drop = g_gpuMemory.MipsToDrop(n->w, n->h, MIPLEVELS);
+		int first = pendingTextures[i].firstMip, top = max(drop, first);
+		size_t firstOffset = mipChainOffset(n->w, n->h, first), bytes = 0;
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, top-drop);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 3-drop);
+		for(int mip=top;mip<MIPLEVELS;mip++){
+			g_textureUploader.UploadLevel(pendingTextures[i].mips, mipChainOffset(n->w, n->h, mip) - firstOffset, mip-drop, GL_RGBA, n->w>>mip, n->h>>mip);
+			bytes += (n->w>>mip)*(n->h>>mip)*4;
+		}
+		g_textureUploader.Release(pendingTextures[i].mips);
+		g_gpuMemory.TrackTexture(texId, MemoryRegistry::CATEGORY_TEXTURE, mapId, bytes);
+		{
+			lock_guard<mutex> lock(texturesMutex);
+			n->mipDrop = drop;
+			n->baseLevel = top-drop;
+			n->texId = texId;
+		}
+		
+		MipSource source;
+		source.pFileSystem = world->fileSystem; source.szFile = fileName; source.uOffset = pendingTextures[i].rawOffset; source.uSize = pendingTextures[i].rawSize;
+		source.uHash = pendingTextures[i].hash; source.szOwner = mapId;
+		g_mipStreamer.Register(pendingTextures[i].id, n, source);
+	}
+	pendingTextures.clear();
+	moveTextureSources();
 	
 	glGenTextures(1, &lmapTexId);		
 	glBindTexture(GL_TEXTURE_2D, lmapTexId);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, 1024, 1024, 0, GL_RGB, GL_UNSIGNED_BYTE, lmapAtlas);
-	delete []lmapAtlas;
+	g_textureUploader.UploadLevel(lmapAtlas, 0, 0, GL_RGB, 1024, 1024);
+	g_textureUploader.Release(lmapAtlas);
+	g_gpuMemory.TrackTexture(lmapTexId, MemoryRegistry::CATEGORY_LIGHTMAP, mapId, 1024*1024*3);
+	residentBytes = 1024*1024*3;
 	
 	bufObjects = new GLuint[texturedTris.size()];
 	glGenBuffers(texturedTris.size(), bufObjects);
 	
-	int i=0;
-	totalTris=0;
-	for(map <string, TEXSTUFF >::iterator it = texturedTris.begin();it != texturedTris.end();it++, i++){	
+	for(size_t i=0;i<texturedTris.size();i++){
+		vector <VECFINAL> &t = texturedTris[i].triangles;
 		glBindBuffer(GL_ARRAY_BUFFER, bufObjects[i]);
-		glBufferData(GL_ARRAY_BUFFER, (*it).second.triangles.size()*sizeof(VECFINAL), (void*)&(*it).second.triangles[0], GL_STATIC_DRAW);
-		totalTris += (*it).second.triangles.size();
+		glBufferData(GL_ARRAY_BUFFER, t.size()*sizeof(VECFINAL), (void*)&t[0], GL_STATIC_DRAW);
+		residentBytes += t.size()*sizeof(VECFINAL);
+		g_gpuMemory.TrackBuffer(bufObjects[i], MemoryRegistry::CATEGORY_GEOMETRY, mapId, t.size()*sizeof(VECFINAL));
+		if(!world->keepHostGeometry) vector<VECFINAL>().swap(t);
 	}
 	
-	mapId = id;
-		
+	glGenBuffers(LOD_LEVELS, lodBufObjects);
+	for(int l=0;l<LOD_LEVELS;l++){
+		glBindBuffer(GL_ARRAY_BUFFER, lodBufObjects[l]);
+		glBufferData(GL_ARRAY_BUFFER, lodVerts[l].size()*sizeof(LODVERT), lodVerts[l].empty() ? NULL : (void*)&lodVerts[l][0], GL_STATIC_DRAW);
+		residentBytes += lodVerts[l].size()*sizeof(LODVERT);
+		g_gpuMemory.TrackBuffer(lodBufObjects[l], MemoryRegistry::CATEGORY_GEOMETRY, mapId, lodVerts[l].size()*sizeof(LODVERT));
+		vector<LODVERT>().swap(lodVerts[l]);
+	}
+	
+	resident = true;
+	reportHostMemory();
 }
 
-void BSP::calculateOffset(){
-	if(offsets.count(mapId) != 0){
-		offset = offsets[mapId];
+void BSP::Unload(){
+	if(resident){
+		for(size_t i=0;i<texturedTris.size();i++) g_gpuMemory.ReleaseBuffer(bufObjects[i]);
+		for(int l=0;l<LOD_LEVELS;l++) g_gpuMemory.ReleaseBuffer(lodBufObjects[l]);
+		g_gpuMemory.ReleaseTexture(lmapTexId);
+		glDeleteBuffers(texturedTris.size(), bufObjects);
+		glDeleteTextures(1, &lmapTexId);
+		glDeleteBuffers(LOD_LEVELS, lodBufObjects);
+		for(int l=0;l<LOD_LEVELS;l++) lodBufObjects[l] = 0;
+		delete []bufObjects;
+		bufObjects = NULL;
+		lmapTexId = 0;
+		resident = false;
+	}
+	g_textureUploader.Release(lmapAtlas);
+	texturedTris.clear();
+	moveTextureSources();
+	if(!pendingTextures.empty()){
+		//Never uploaded, the next map using them decodes them instead
+		lock_guard<mutex> lock(texturesMutex);
+		for(size_t i=0;i<pendingTextures.size();i++){
+			g_textureUploader.Release(pendingTextures[i].mips);
+			g_textures.CancelDecode(pendingTextures[i].id);
+		}
+	}
+	pendingTextures.clear();
+	for(int l=0;l<LOD_LEVELS;l++){ vector<LODVERT>().swap(lodVerts[l]); lodCount[l] = 0; }
+	vector<float>().swap(occluders);
+	vector<ORDERNODE>().swap(orderNodes);
+	vector<int>().swap(orderRoots);
+	vector<REGIONDRAW>().swap(regionDraws);
+	vector<int>().swap(regionFirstDraw);
+	vector<ANIMFACE>().swap(animFaces);
+	vector<uint8_t>().swap(animSamples);
+	animCursor = 0;
+	bvh.Clear();
+	residentBytes = 0;
+	totalTris = 0;
+	loaded = false;
+	reportHostMemory();
+}
+
+//Bytes still held by the map in host memory, as seen by g_hostMemory
+void BSP::reportHostMemory(){
+	size_t geometry = occluders.capacity()*sizeof(float) + bvh.GetMemoryBytes(), pending = 0;
+	geometry += orderNodes.capacity()*sizeof(ORDERNODE) + regionDraws.capacity()*sizeof(REGIONDRAW) + (orderRoots.capacity() + regionFirstDraw.capacity())*sizeof(int);
+	for(size_t i=0;i<texturedTris.size();i++) geometry += texturedTris[i].triangles.capacity()*sizeof(VECFINAL);
+	for(int l=0;l<LOD_LEVELS;l++) geometry += lodVerts[l].capacity()*sizeof(LODVERT);
+	for(size_t i=0;i<pendingTextures.size();i++) pending += pendingTextures[i].mips.GetHeapBytes();
+	
+	g_hostMemory.SetUsage(this, MemoryRegistry::CATEGORY_GEOMETRY, mapId, geometry);
+	g_hostMemory.SetUsage(this, MemoryRegistry::CATEGORY_TEXTURE, mapId, pending);
+	g_hostMemory.SetUsage(this, MemoryRegistry::CATEGORY_LIGHTMAP, mapId, lmapAtlas.GetHeapBytes() + animFaces.capacity()*sizeof(ANIMFACE) + animSamples.capacity());
+}
+
+VERTEX BSP::calculateOffset(){
+	map <string, vector<pair<VERTEX,string> > > &landmarks = world->landmarks;
+	map <string, VERTEX> &offsets = world->offsets;
+	map <string, string> &offsetParent = world->offsetParent;
+	
+	//Visibility jobs call this at once, and hot reload invalidates offsets between frames
+	lock_guard<mutex> lock(world->entitiesMutex);
+	map <string, VERTEX>::const_iterator known = offsets.find(mapId);
+	if(known != offsets.end()){
+		offset = known->second;
 	}else{
 		if(mapId == "c0a0"){
 			//Origin for other maps
@@ -420,6 +907,7 @@ void BSP::calculateOffset(){
 									oz = + c2.z + c3.z - c1.z;
 									
 									found=true;
+									offsetParent[mapId] = (*it).second[i+1].second;
 									cout << "Matched " << (*it).second[i].second << " " << (*it).second[i+1].second << endl;
 									break;
 								}
@@ -433,6 +921,7 @@ void BSP::calculateOffset(){
 									oz = + c2.z + c3.z - c1.z;
 									
 									found=true;
+									offsetParent[mapId] = (*it).second[i-1].second;
 									cout << "Matched " << (*it).second[i].second << " " << (*it).second[i-1].second << endl;
 									break;
 								}
@@ -444,57 +933,302 @@ void BSP::calculateOffset(){
 			}
 			if(!found){
 				cout << "Cant find matching landmarks for " << mapId << endl;  
+				offsetParent[mapId] = "";
 			}
 			offsets[mapId] = VERTEX(ox,oy,oz);
 		}
+		offset = offsets[mapId];
+	}
+	return offset;
+}
+
+void invalidateOffsets(WORLDSTATE *world, const string &mapId){
+	map <string, string> &offsetParent = world->offsetParent;
+	lock_guard<mutex> lock(world->entitiesMutex);
+	
+	//Maps that didn't match before may match now, so they go too
+	map <string, bool> stale;
+	stale[mapId] = true;
+	for(bool grew=true;grew;){
+		grew = false;
+		for(map <string, string>::iterator it = offsetParent.begin(); it != offsetParent.end();it++){
+			if(stale.count((*it).first) == 0 && ((*it).second.empty() || stale.count((*it).second) != 0)){
+				stale[(*it).first] = true;
+				grew = true;
+			}
+		}
+	}
+	for(map <string, bool>::iterator it = stale.begin(); it != stale.end();it++){
+		world->offsets.erase((*it).first);
+		offsetParent.erase((*it).first);
+	}
+}
+
+bool BSP::ReloadEntities(const MapEntry &sMapEntry){
+	VfsFile file;
+	if(!world->fileSystem->Open(fileName, file)){ cerr << "Can't open BSP " << fileName << "." << endl; return false;}
+	VfsStream inBSP(file);
+	
+	BSPHEADER bHeader;
+	inBSP.read((char*)&bHeader, sizeof(bHeader));
+	if(bHeader.nVersion != 30){ cerr << "BSP version is not 30 (" << fileName << ")." << endl; return false;}
+	
+	inBSP.seekg(bHeader.lump[LUMP_ENTITIES].nOffset, ios::beg);
+	string bff(bHeader.lump[LUMP_ENTITIES].nLength, '\0');
+	inBSP.read(&bff[0], bff.size());
+	modelEntities.clear();
+	changeLevels.clear();
+	map <int,string> lightPatterns;
+	parseEntities(bff.c_str(),world,mapId,sMapEntry,&modelEntities,&lightPatterns,&changeLevels);
+	applyLightPatterns(lightStyles, lightPatterns);
+	return true;
+}
+
+//Points the streamer at the new offsets of the embedded textures an older copy of the file registered
+void BSP::moveTextureSources(){
+	for(size_t i=0;i<movedTextures.size();i++){
+		MipSource source;
+		source.pFileSystem = world->fileSystem; source.szFile = fileName; source.uOffset = movedTextures[i].rawOffset; source.uSize = movedTextures[i].rawSize;
+		source.uHash = movedTextures[i].hash; source.szOwner = mapId;
+		g_mipStreamer.MoveSource(movedTextures[i].id, source);
+	}
+	vector<TEXSOURCE>().swap(movedTextures);
+}
+
+void BSP::TakeReplacedTextures(vector<int> &ids){
+	ids.insert(ids.end(), replacedTextures.begin(), replacedTextures.end());
+	replacedTextures.clear();
+}
+
+void BSP::Swap(BSP &other){
+	swap(filePath, other.filePath);
+	swap(fileName, other.fileName);
+	swap(valid, other.valid);
+	swap(loaded, other.loaded);
+	swap(resident, other.resident);
+	swap(reloaded, other.reloaded);
+	swap(fileHash, other.fileHash);
+	replacedTextures.swap(other.replacedTextures);
+	swap(worldMins, other.worldMins);
+	swap(worldMaxs, other.worldMaxs);
+	swap(lmapAtlas, other.lmapAtlas);
+	swap(lmapTexId, other.lmapTexId);
+	texturedTris.swap(other.texturedTris);
+	pendingTextures.swap(other.pendingTextures);
+	movedTextures.swap(other.movedTextures);
+	swap(bufObjects, other.bufObjects);
+	for(int l=0;l<LOD_LEVELS;l++){
+		lodVerts[l].swap(other.lodVerts[l]);
+		swap(lodBufObjects[l], other.lodBufObjects[l]);
+		swap(lodCount[l], other.lodCount[l]);
 	}
+	occluders.swap(other.occluders);
+	orderNodes.swap(other.orderNodes);
+	orderRoots.swap(other.orderRoots);
+	regionDraws.swap(other.regionDraws);
+	regionFirstDraw.swap(other.regionFirstDraw);
+	bvh.Swap(other.bvh);
+	modelEntities.swap(other.modelEntities);
+	changeLevels.swap(other.changeLevels);
+	swap(stats, other.stats);
+	swap(lightStyles, other.lightStyles);
+	animFaces.swap(other.animFaces);
+	animSamples.swap(other.animSamples);
+	swap(animCursor, other.animCursor);
+	swap(residentBytes, other.residentBytes);
+	swap(totalTris, other.totalTris);
+	swap(mapId, other.mapId);
+	swap(offset, other.offset);
+	swap(ConfigOffsetChapter, other.ConfigOffsetChapter);
+	reportHostMemory();
+	other.reportHostMemory();
 }
 
-void BSP::render(){
+int BSP::render(int lod, const vector<char> *visibleClusters, const VERTEX *eye, bool textured){
+	if(!resident) return 0;
+	
 	//Calculate map offset based on landmarks
-	calculateOffset();
+	VERTEX l = calculateOffset();
+	VERTEX o(l.x + ConfigOffsetChapter.x, l.y + ConfigOffsetChapter.y, l.z + ConfigOffsetChapter.z);
 	
 	glPushMatrix();
-	glTranslatef(offset.x + ConfigOffsetChapter.x, offset.y + ConfigOffsetChapter.y, offset.z + ConfigOffsetChapter.z);
+	glTranslatef(o.x, o.y, o.z);
+	
+	if(lod > 0){
+		//Untextured, the colours are baked into the vertices
+		glActiveTextureARB(GL_TEXTURE1_ARB);
+		glDisable(GL_TEXTURE_2D);
+		glClientActiveTextureARB(GL_TEXTURE1_ARB);
+		glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+		glActiveTextureARB(GL_TEXTURE0_ARB);
+		glDisable(GL_TEXTURE_2D);
+		glClientActiveTextureARB(GL_TEXTURE0_ARB);
+		glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+		
+		glBindBuffer(GL_ARRAY_BUFFER, lodBufObjects[lod-1]);
+		glEnableClientState(GL_VERTEX_ARRAY);
+		if(textured) glEnableClientState(GL_COLOR_ARRAY);
+		glVertexPointer(3, GL_FLOAT, sizeof(LODVERT), (void*)0);
+		glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(LODVERT), (char*)NULL+4*3);
+		glDrawArrays(GL_TRIANGLES, 0, lodCount[lod-1]);
+		if(textured){
+			glDisableClientState(GL_COLOR_ARRAY);
+			glColor4f(1, 1, 1, 1);
+		}
+		
+		glPopMatrix();
+		return 1;
+	}
 
 	glEnableClientState(GL_VERTEX_ARRAY);
-	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
 	
 	glActiveTextureARB(GL_TEXTURE0_ARB);
-	glEnable(GL_TEXTURE_2D);
+	if(textured) glEnable(GL_TEXTURE_2D);
+	else glDisable(GL_TEXTURE_2D);
 	glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
 	
 	glActiveTextureARB(GL_TEXTURE1_ARB); 
-	glEnable(GL_TEXTURE_2D);
+	if(textured) glEnable(GL_TEXTURE_2D);
+	else glDisable(GL_TEXTURE_2D);
 	glBindTexture(GL_TEXTURE_2D, lmapTexId);
 
 	glClientActiveTextureARB(GL_TEXTURE1_ARB); 
 	glEnableClientState(GL_TEXTURE_COORD_ARRAY);	
 	
-	int i=0;
-	for(map <string, TEXSTUFF >::iterator it = texturedTris.begin();it != texturedTris.end();it++, i++){
-		//Don't render some dummy triangles (triggers and such)
-		if((*it).first != "aaatrigger" && (*it).first != "origin" && (*it).first != "clip" && (*it).first != "sky" && (*it).first[0]!='{' && (*it).second.triangles.size() != 0){
-			//if(mapId == "c1a0e.bsp") cout << (*it).first << endl;
-			glBindBuffer(GL_ARRAY_BUFFER, bufObjects[i]);
-			
-			/////T0
-			glActiveTextureARB(GL_TEXTURE0_ARB);
-			glBindTexture(GL_TEXTURE_2D, (*it).second.texId);
-			
-			glClientActiveTextureARB(GL_TEXTURE0_ARB); 
-			glTexCoordPointer(2, GL_FLOAT, sizeof(VECFINAL), (char*)NULL+4*3);
-			glEnableClientState(GL_TEXTURE_COORD_ARRAY); 
-			
-			////T1
-			glClientActiveTextureARB(GL_TEXTURE1_ARB); 
-			glTexCoordPointer(2, GL_FLOAT, sizeof(VECFINAL), (char*)NULL+4*5);
-			
-			glVertexPointer(3, GL_FLOAT, sizeof(VECFINAL), (void*)0);
-			glDrawArrays(GL_TRIANGLES, 0, (*it).second.triangles.size());
+	int drawCalls=0;
+	if(eye != NULL && !orderRoots.empty()){
+		//Camera in the map's own BSP space, undoing the offset and fixHand
+		orderRegions(VERTEX(o.x - eye->x, eye->z - o.z, eye->y - o.y));
+		for(size_t r=0;r<regionOrder.size();r++){
+			for(int d=regionFirstDraw[regionOrder[r]];d<regionFirstDraw[regionOrder[r]+1];d++){
+				const REGIONDRAW &rd = regionDraws[d];
+				if(visibleClusters != NULL && !(*visibleClusters)[rd.cluster]) continue;
+				if(!texturedTris[rd.cluster].renderable || rd.count == 0) continue;
+				drawCluster(rd.cluster, rd.first, rd.count, textured);
+				drawCalls++;
+			}
+		}
+	}else{
+		for(size_t i=0;i<texturedTris.size();i++){
+			if(visibleClusters != NULL && !(*visibleClusters)[i]) continue;
+			const TEXSTUFF &ts = texturedTris[i];
+			if(ts.renderable && ts.vertCount != 0){
+				drawCluster(i, 0, ts.vertCount, textured);
+				drawCalls++;
+			}
 		}
 	}
 	glPopMatrix();
+	return drawCalls;
+}
+
+//Draws a range of one texture's vertices, render() sets up the rest
+void BSP::drawCluster(size_t i, int first, int count, bool textured){
+	glBindBuffer(GL_ARRAY_BUFFER, bufObjects[i]);
+	
+	/////T0
+	glActiveTextureARB(GL_TEXTURE0_ARB);
+	if(textured) glBindTexture(GL_TEXTURE_2D, texturedTris[i].tex->texId);
+	
+	glClientActiveTextureARB(GL_TEXTURE0_ARB); 
+	glTexCoordPointer(2, GL_FLOAT, sizeof(VECFINAL), (char*)NULL+4*3);
+	glEnableClientState(GL_TEXTURE_COORD_ARRAY); 
+	
+	////T1
+	glClientActiveTextureARB(GL_TEXTURE1_ARB); 
+	glTexCoordPointer(2, GL_FLOAT, sizeof(VECFINAL), (char*)NULL+4*5);
+	
+	glVertexPointer(3, GL_FLOAT, sizeof(VECFINAL), (void*)0);
+	glDrawArrays(GL_TRIANGLES, first, count);
+}
+
+//Regions from the nearest to the farthest, into regionOrder, by walking each model's tree
+void BSP::orderRegions(const VERTEX &eye){
+	regionOrder.clear();
+	for(size_t m=0;m<orderRoots.size();m++){
+		orderStack.clear();
+		orderStack.push_back(orderRoots[m]);
+		while(!orderStack.empty()){
+			int item = orderStack.back();
+			orderStack.pop_back();
+			if(item == ORDER_EMPTY) continue;
+			if(item < 0){
+				regionOrder.push_back(-1-item);
+				continue;
+			}
+			
+			//The side the eye is on comes first, then the faces on the plane, then the far side
+			const ORDERNODE &n = orderNodes[item];
+			int side = eye.x*n.normal[0] + eye.y*n.normal[1] + eye.z*n.normal[2] - n.dist >= 0 ? 0 : 1;
+			orderStack.push_back(n.children[1-side]);
+			if(n.region >= 0) orderStack.push_back(-1-n.region);
+			orderStack.push_back(n.children[side]);
+		}
+	}
+}
+
+//Level to draw this frame, from the projected size of the map
+int BSP::SelectLod(const LODVIEW &view){
+	if(!resident) return 0;
+	VERTEX mins, maxs;
+	GetBounds(mins, maxs);
+	int lod = selectLod(mins, maxs, view);
+	
+	//Fall back to a finer level when a coarse one collapsed to nothing
+	while(lod > 0 && lodCount[lod-1] == 0) lod--;
+	return lod;
+}
+
+//Landmark offset plus chapter offset, as applied by render()
+VERTEX BSP::GetRenderOffset(){
+	VERTEX l = calculateOffset();
+	return VERTEX(l.x + ConfigOffsetChapter.x, l.y + ConfigOffsetChapter.y, l.z + ConfigOffsetChapter.z);
+}
+
+const uint8_t *BSP::GetPendingTexture(const TEXTURE *tex) const{
+	for(size_t i=0;i<pendingTextures.size();i++)
+		if(pendingTextures[i].tex == tex && pendingTextures[i].firstMip == 0) return pendingTextures[i].mips.GetData();
+	return NULL;
+}
+
+//World space bounds of the worldspawn model
+void BSP::GetBounds(VERTEX &mins, VERTEX &maxs){
+	VERTEX o = GetRenderOffset();
+	mins = VERTEX(worldMins.x + o.x, worldMins.y + o.y, worldMins.z + o.z);
+	maxs = VERTEX(worldMaxs.x + o.x, worldMaxs.y + o.y, worldMaxs.z + o.z);
+}
+
+void BSP::GetClusterBounds(vector<pair<VERTEX,VERTEX> > &bounds){
+	VERTEX o = GetRenderOffset();
+	bounds.clear();
+	for(size_t i=0;i<texturedTris.size();i++){
+		const VERTEX &mins = texturedTris[i].mins, &maxs = texturedTris[i].maxs;
+		bounds.push_back(make_pair(VERTEX(mins.x + o.x, mins.y + o.y, mins.z + o.z), VERTEX(maxs.x + o.x, maxs.y + o.y, maxs.z + o.z)));
+	}
+}
+
+void BSP::GetDraws(vector<BSPDRAW> &vDraws){
+	if(!resident) return;
+	for(size_t i=0;i<texturedTris.size();i++){
+		const TEXSTUFF &ts = texturedTris[i];
+		if(ts.renderable && ts.vertCount != 0){
+			BSPDRAW d;
+			d.texture = ts.texture;
+			d.tex = ts.tex;
+			d.bufObject = bufObjects[i];
+			d.vertCount = ts.vertCount;
+			vDraws.push_back(d);
+		}
+	}
+}
+
+string BSP::GetModelEntity(int model) const{
+	if(model == 0) return "worldspawn";
+	stringstream ss;
+	map <int,string>::const_iterator it = modelEntities.find(model);
+	if(it == modelEntities.end()) ss << "model *" << model;
+	else ss << (*it).second << " (model *" << model << ")";
+	return ss.str();
 }
 
 void BSP::SetChapterOffset(const float x, const float y, const float z)
@@ -503,3 +1237,45 @@ void BSP::SetChapterOffset(const float x, const float y, const float z)
 	ConfigOffsetChapter.y = y;
 	ConfigOffsetChapter.z = z;
 }
+
+void BSP::UpdateLightStyles(vector<LMRECT> &rects){
+	if(!resident || animFaces.empty()) return;
+	
+	unsigned int ms = g_lightmapUpdates.GetTime();
+	uint8_t block[17*17*3];
+	bool bound = false;
+	size_t resume = animFaces.size();
+	
+	//Start where the budget ran out last frame, so every face gets its turn
+	for(size_t n=0;n<animFaces.size();n++){
+		size_t i = (animCursor + n) % animFaces.size();
+		ANIMFACE &af = animFaces[i];
+		
+		int values[4];
+		bool changed = false;
+		for(int s=0;s<af.styleCount;s++){
+			values[s] = lightStyles.GetValue(af.styles[s], ms);
+			if(values[s] != af.values[s]) changed = true;
+		}
+		if(!changed) continue;
+		
+		if(!g_lightmapUpdates.Consume(af.rect.w*af.rect.h*3)){
+			if(resume == animFaces.size()) resume = i;
+			continue;
+		}
+		
+		if(!bound){
+			glBindTexture(GL_TEXTURE_2D, lmapTexId);
+			glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+			bound = true;
+		}
+		combineStyles(&animSamples[af.samples], af.rect.w*af.rect.h, af.styleCount, values, block);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, af.rect.x, af.rect.y, af.rect.w, af.rect.h, GL_RGB, GL_UNSIGNED_BYTE, block);
+		
+		for(int s=0;s<af.styleCount;s++) af.values[s] = values[s];
+		rects.push_back(af.rect);
+	}
+	
+	if(bound) glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	animCursor = resume == animFaces.size() ? 0 : resume;
+}
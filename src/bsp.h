@@ -2,6 +2,11 @@
 #define BSP_H
 
 #include "common.h"
+#include "lod.h"
+#include "TextureUploader.h"
+#include "TriangleBvh.h"
+#include "LightStyles.h"
+#include <climits>
 
 //Extracted from http://hlbsp.sourceforge.net/index.php?content=bspdef
 
@@ -25,6 +30,7 @@
 #define MIPLEVELS 4
 
 struct MapEntry; // Dont include ConfigXML.h here.
+class VirtualFileSystem;
 
 struct BSPLUMP{
 	int32_t nOffset; // File offset to data
@@ -63,6 +69,18 @@ struct BSPMIPTEX{
 	uint32_t nOffsets[MIPLEVELS]; // Offsets to texture mipmaps BSPMIPTEX;
 };
 
+struct BSPPLANE{
+	VERTEX vNormal; // The planes normal vector
+	float fDist;    // Plane equation is: vNormal * X = fDist
+	int32_t nType;  // Plane type, see #defines
+};
+struct BSPNODE{
+	uint32_t iPlane;           // Index into Planes lump
+	int16_t iChildren[2];      // If > 0, then indices into Nodes, otherwise bitwise inverse indices into Leafs
+	int16_t nMins[3], nMaxs[3]; // Defines bounding box
+	uint16_t firstFace, nFaces; // Index and count into Faces
+};
+
 #define MAX_MAP_HULLS 4
 struct BSPMODEL{
     float nMins[3], nMaxs[3];          // Defines bounding box
@@ -94,37 +112,226 @@ struct VECFINAL{
 struct TEXTURE{
 	GLuint texId;
 	int w,h;
+	unsigned char avg[3]; //Average opaque colour, for LOD vertex colours
+	int mipDrop; //Top mip levels left out to fit the memory budget, w and h are still the full size
+	int baseLevel; //First GL level uploaded, the ones above it are still to be streamed in
 };
 struct LMAP{
-	unsigned char *offset; int w,h;
+	const unsigned char *offset; int w,h;
 	int finalX, finalY;
+	uint8_t styles[4]; int styleCount; //One block of w*h samples per style at offset
+	bool valid; //Samples are inside the lighting lump
+	bool drawn; //Renderable texture and not hidden, only those are animated
+};
+
+//Atlas rectangle of a face's lightmap
+struct LMRECT{
+	int x,y,w,h;
+};
+
+//Face whose lightmap follows animated light styles
+struct ANIMFACE{
+	LMRECT rect;
+	uint8_t styles[4]; int styleCount;
+	int values[4]; //Style values the atlas holds it at
+	size_t samples; //Offset of its styleCount blocks in animSamples
 };
 
 struct TEXSTUFF{
-	vector <VECFINAL> triangles;
-	int texId;
+	vector <VECFINAL> triangles; //Emptied once uploaded, unless keepHostGeometry is set
+	int vertCount;
+	int texture; //Id in g_textures
+	bool renderable; //isRenderableTexture of its name, so drawing never looks at names
+	TEXTURE *tex; //Entry in g_textures, its texId may be set later by another map's upload
+	VERTEX mins, maxs; //Bounds of the triangles, without offsets
+};
+
+//Embedded texture decoded by LoadGeometry, waiting for Upload
+struct PENDINGTEX{
+	TEXTURE *tex;
+	int id; //Of tex in g_textures
+	StagingBuffer mips; //RGBA, level after level (see mipChainOffset) from firstMip
+	int firstMip; //Levels above it are left to the mip streamer
+	size_t rawOffset, rawSize; //Miptex in the BSP, where the streamer reads the other levels
+	unsigned long long hash; //TextureCache::Hash of the miptex
+};
+
+//Embedded texture a reloaded map found already uploaded, whose pixels may have moved in the file
+struct TEXSOURCE{
+	int id; //In g_textures
+	size_t rawOffset, rawSize; //Miptex in the BSP now
+	unsigned long long hash; //TextureCache::Hash of the miptex
+};
+
+//Counts and stage timings of the last LoadGeometry, for inspecting maps
+struct BSPSTATS{
+	int faces, triangles, vertices;
+	int textures, embeddedTextures;
+	int lightmaps; //Faces with light samples
+	int atlasTexels; //Taken by the lightmaps placed in the 1024x1024 atlas
+	int atlasHeight; //Highest row reached
+	int atlasOverflow; //Faces left out once the atlas was full
+	vector<string> wadTextures; //Names used but not embedded, expected from the WADs
+	float readMs, texturesMs, lightmapsMs, trianglesMs, buildMs;
+	BSPSTATS(){
+		faces = triangles = vertices = textures = embeddedTextures = 0;
+		lightmaps = atlasTexels = atlasHeight = atlasOverflow = 0;
+		readMs = texturesMs = lightmapsMs = trianglesMs = buildMs = 0;
+	}
+};
+
+//Node of the tree walked to draw a map's regions front to back, made from the BSP nodes above them
+#define ORDER_EMPTY INT_MIN
+struct ORDERNODE{
+	float normal[3], dist; //Splitting plane, in BSP space
+	int children[2]; //Front and back: an order node, -1-region for a whole subtree, or ORDER_EMPTY
+	int region; //Faces on the plane itself, -1 when none
+};
+
+//Range of a texture's vertices that lie in one region
+struct REGIONDRAW{
+	int cluster; //Index into texturedTris
+	int first, count;
+};
+
+//One (map, texture) draw, as uploaded by Upload
+struct BSPDRAW{
+	int texture; //Id in g_textures
+	TEXTURE *tex;
+	GLuint bufObject;
+	int vertCount;
+};
+
+//What the maps of one world share, instead of globals, so more than one world can be loaded
+struct WORLDSTATE{
+	map <string, vector<pair<VERTEX,string> > > landmarks;
+	map <string, vector<string> > dontRenderModel;
+	mutex entitiesMutex; //Guards landmarks, dontRenderModel and offsets, read by loader and visibility threads
+	map <string, VERTEX> offsets;
+	map <string, string> offsetParent; //Map each offset was found from, empty when none matched
+	VirtualFileSystem *fileSystem; //Game files of the world's config, maps and WADs are read from it
+	bool keepHostGeometry; //Keeps the triangles in host memory after upload, from ConfigXML::m_bKeepHostGeometry
+	bool buildPickingBvh; //Builds a BVH of every map as it is loaded, for picking
+	bool animateLightStyles; //Keeps the samples of faces with animated styles, from ConfigXML::m_bLightStyles
+	WORLDSTATE() : fileSystem(NULL), keepHostGeometry(false), buildPickingBvh(false), animateLightStyles(false) {}
 };
 
 class BSP{
 	public:
-		BSP(const std::vector<std::string> &szGamePaths, const string &filename, const MapEntry &sMapEntry);
-		void render();
+		//Reads the entities and world bounds only, geometry is read by LoadGeometry
+		//The landmarks and hidden models go into worldState, which outlives the map
+		BSP(const string &filename, const MapEntry &sMapEntry, WORLDSTATE *worldState);
+		~BSP();
+		//CPU side loading, can run on a loader thread
+		bool LoadGeometry();
+		//GL side loading, main thread only
+		void Upload();
+		//Frees GL objects and geometry, the map can be loaded again later
+		void Unload();
+		bool IsResident() const { return resident; }
+		bool IsLoaded() const { return loaded; }
+		bool IsValid() const { return valid; }
+		//Re-reads the entities only, after the map's config entry changed
+		bool ReloadEntities(const MapEntry &sMapEntry);
+		//Exchanges everything with another BSP of the same map, to swap in a reloaded copy
+		void Swap(BSP &other);
+		//Marks a reloaded copy: embedded textures whose pixels changed move their name to the new pixels,
+		//instead of being kept apart as name conflicts
+		void SetReloaded() { reloaded = true; }
+		//Appends the ids embedded textures of a reloaded copy moved away from, and forgets them
+		void TakeReplacedTextures(vector<int> &ids);
+		//lod 0 is the full detail mesh, 1..LOD_LEVELS the simplified ones
+		//visibleClusters has one flag per GetClusterBounds entry, NULL draws them all
+		//With an eye position, full detail is drawn region by region, front to back from it
+		//Untextured draws only set depth and the current colour, for the overdraw view
+		int render(int lod = 0, const vector<char> *visibleClusters = NULL, const VERTEX *eye = NULL, bool textured = true);
+		int SelectLod(const LODVIEW &view);
+		int GetLodTris(int lod) const { return lodCount[lod-1]/3; }
 		int totalTris;
 		void SetChapterOffset(const float x, const float y, const float z);
+		VERTEX GetRenderOffset();
+		void GetBounds(VERTEX &mins, VERTEX &maxs);
+		size_t GetResidentBytes() const { return residentBytes; }
+		const string &GetMapId() const { return mapId; }
+		//File on disk the map was read from, the PAK for maps inside one
+		const string &GetFilePath() const { return filePath; }
+		//Hash of the file the last LoadGeometry read, 0 before, for caches of what the map looks like
+		unsigned long long GetFileHash() const { return fileHash; }
+		WORLDSTATE *GetWorldState() const { return world; }
+		void GetDraws(vector<BSPDRAW> &vDraws);
+		GLuint GetLightmapTexture() const { return lmapTexId; }
+		//Large faces of the map, nine floats per triangle, without offsets
+		const vector<float> &GetOccluders() const { return occluders; }
+		//World space bounds of each (map, texture) draw, in render order
+		void GetClusterBounds(vector<pair<VERTEX,VERTEX> > &bounds);
+		//Renderable triangles without offsets, empty unless the world's buildPickingBvh was set when loaded
+		const TriangleBvh &GetBvh() const { return bvh; }
+		TriangleBvh &GetBvh() { return bvh; }
+		//Classname and targetname of a brush model, "worldspawn" for model 0
+		string GetModelEntity(int model) const;
+		//Re-uploads the lightmaps whose light styles changed, within g_lightmapUpdates' budget. Main thread only.
+		//rects gets the atlas rectangles uploaded, for copies of the atlas
+		void UpdateLightStyles(vector<LMRECT> &rects);
+		int GetAnimatedFaces() const { return animFaces.size(); }
+		//Triangles of each texture, without offsets. Empty once uploaded, unless the world's keepHostGeometry is set
+		const vector<TEXSTUFF> &GetTexturedTris() const { return texturedTris; }
+		//RGB 1024x1024 lightmap atlas, from LoadGeometry until Upload, NULL otherwise
+		const uint8_t *GetLightmapAtlas() const { return lmapAtlas.GetData(); }
+		//Level 0 of an embedded texture decoded by LoadGeometry and not uploaded yet, RGBA, NULL otherwise
+		const uint8_t *GetPendingTexture(const TEXTURE *tex) const;
+		//Counts and timings of the last LoadGeometry, kept after Unload
+		const BSPSTATS &GetStats() const { return stats; }
+		//Map and landmark of each trigger_changelevel
+		const vector<pair<string,string> > &GetChangeLevels() const { return changeLevels; }
 	private:
-		void calculateOffset();
+		VERTEX calculateOffset();
+		void reportHostMemory();
+		void moveTextureSources();
+		void drawCluster(size_t i, int first, int count, bool textured);
+		void orderRegions(const VERTEX &eye);
 
-		unsigned char *lmapAtlas; GLuint lmapTexId;
-		map <string, TEXSTUFF > texturedTris;
+		WORLDSTATE *world;
+		string filePath, fileName;
+		bool valid, loaded, resident;
+		bool reloaded; //See SetReloaded
+		unsigned long long fileHash;
+		vector <int> replacedTextures; //See TakeReplacedTextures
+		VERTEX worldMins, worldMaxs; //Bounds of the worldspawn model, without offsets
+
+		StagingBuffer lmapAtlas; GLuint lmapTexId;
+		vector <TEXSTUFF> texturedTris; //One per texture used, in order of first use
+		vector <PENDINGTEX> pendingTextures;
+		vector <TEXSOURCE> movedTextures; //Streamed from the new offsets once uploaded
 		GLuint *bufObjects;
+		vector <LODVERT> lodVerts[LOD_LEVELS];
+		GLuint lodBufObjects[LOD_LEVELS];
+		int lodCount[LOD_LEVELS];
+		vector <float> occluders;
+		vector <ORDERNODE> orderNodes; //Front to back tree over the regions, see ORDERNODE
+		vector <int> orderRoots; //Tree of each brush model, the world first
+		vector <REGIONDRAW> regionDraws; //Grouped by region
+		vector <int> regionFirstDraw; //First draw of each region, plus the end
+		vector <int> regionOrder, orderStack; //Reused by render
+		TriangleBvh bvh;
+		map <int,string> modelEntities;
+		vector <pair<string,string> > changeLevels;
+		BSPSTATS stats;
+		LightStyles lightStyles;
+		vector <ANIMFACE> animFaces;
+		vector <uint8_t> animSamples;
+		size_t animCursor; //Face to start from next frame, after running out of budget
+		size_t residentBytes;
 		string mapId;
 		VERTEX offset;
 
 		VERTEX ConfigOffsetChapter;
 };
 
-extern map <string, TEXTURE> textures;
-extern map <string, vector<pair<VERTEX,string> > > landmarks;
-extern map <string, vector<string> > dontRenderModel;
+bool isRenderableTexture(const string &name);
+
+extern mutex texturesMutex; //Guards g_textures while loader threads run
+
+//Forgets the offset of a map and every offset found from it, they are found again when next needed
+void invalidateOffsets(WORLDSTATE *world, const string &mapId);
 
 #endif
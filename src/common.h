@@ -10,6 +10,7 @@
 #include <cmath>
 #include <map>
 #include <algorithm>
+#include <mutex>
 #include <assert.h>
 #include <SDL.h>
 #include <GL/glew.h>
@@ -1,13 +1,32 @@
 #include "common.h"
 #include "bsp.h"
 #include "ConfigXML.h"
+#include "MemoryRegistry.h"
 
-void parseEntities(const string &szStr, const string &id, const MapEntry &sMapEntry){
+//Bytes held for a map by landmarks and dontRenderModel, as seen by g_hostMemory
+static void reportEntities(WORLDSTATE *world, const string &id){
+	size_t bytes = 0;
+	lock_guard<mutex> lock(world->entitiesMutex);
+	for(map <string, vector<pair<VERTEX,string> > >::iterator it=world->landmarks.begin(); it!=world->landmarks.end(); it++){
+		for(unsigned int i=0;i<(*it).second.size();i++){
+			if((*it).second[i].second == id) bytes += sizeof(pair<VERTEX,string>) + (*it).first.capacity() + id.capacity();
+		}
+	}
+	map <string, vector<string> >::const_iterator it = world->dontRenderModel.find(id);
+	if(it != world->dontRenderModel.end()){
+		for(unsigned int i=0;i<(*it).second.size();i++) bytes += sizeof(string) + (*it).second[i].capacity();
+	}
+	g_hostMemory.SetUsage(&world->dontRenderModel, MemoryRegistry::CATEGORY_ENTITIES, id, bytes);
+}
+
+void parseEntities(const string &szStr, WORLDSTATE *world, const string &id, const MapEntry &sMapEntry, map <int,string> *modelEntities, map <int,string> *lightPatterns, vector<pair<string,string> > *changeLevels){
 	stringstream ss(szStr);
 	
 	int status = 0;
 	
 	string origin, targetname,landmark, modelname;
+	string classname, entityModel, entityTarget; //Reset per entity, unlike the ones above
+	string style, pattern, spawnflags, mapname, entityLandmark;
 	bool isLandMark=false,isChangeLevel=false,isTeleport=false;
 	
 	map <string,int> changelevels;
@@ -19,6 +38,8 @@ void parseEntities(const string &szStr, const string &id, const MapEntry &sMapEn
 		if(status == 0){
 			if(str == "{"){
 				status = 1, isLandMark=false,isChangeLevel=false,isTeleport=false;
+				classname.clear(); entityModel.clear(); entityTarget.clear();
+				style.clear(); pattern.clear(); spawnflags.clear(); mapname.clear(); entityLandmark.clear();
 			}else{
 				if(ss.good())
 					cerr << "Missing stuff in entity: " << str << endl;
@@ -44,9 +65,19 @@ void parseEntities(const string &szStr, const string &id, const MapEntry &sMapEn
 				}else if(isChangeLevel){
 					if(landmark.size()>0)
 						changelevels[landmark]=1;
+					if(changeLevels != NULL)
+						changeLevels->push_back(make_pair(mapname, entityLandmark));
 				}
 				if(isTeleport || isChangeLevel){
-					dontRenderModel[id].push_back(modelname);
+					lock_guard<mutex> lock(world->entitiesMutex);
+					world->dontRenderModel[id].push_back(modelname);
+				}
+				if(modelEntities != NULL && entityModel.size() > 1 && entityModel[0] == '*'){
+					(*modelEntities)[atoi(entityModel.c_str()+1)] = entityTarget.empty() ? classname : classname + " " + entityTarget;
+				}
+				//Switchable lights, as the game sets them up when the map starts
+				if(lightPatterns != NULL && classname.substr(0,5) == "light" && atoi(style.c_str()) >= 32){
+					(*lightPatterns)[atoi(style.c_str())] = (atoi(spawnflags.c_str()) & 1) ? "a" : (pattern.empty() ? "m" : pattern);
 				}
 			}else{
 				if(str == "\"classname\" \"info_landmark\""){
@@ -66,22 +97,83 @@ void parseEntities(const string &szStr, const string &id, const MapEntry &sMapEn
 				if(str.substr(0,7) == "\"model\""){
 					modelname = str.substr(9);
 					modelname.erase(modelname.size() - 1);
+					entityModel = modelname;
+				}
+				if(str.substr(0,11) == "\"classname\""){
+					classname = str.substr(13);
+					classname.erase(classname.size() - 1);
 				}
 				if(str.substr(0,12) == "\"targetname\""){
 					targetname = str.substr(14);
 					targetname.erase(targetname.size() - 1);
+					entityTarget = targetname;
+				}
+				if(str.substr(0,7) == "\"style\""){
+					style = str.substr(9);
+					style.erase(style.size() - 1);
+				}
+				if(str.substr(0,9) == "\"pattern\""){
+					pattern = str.substr(11);
+					pattern.erase(pattern.size() - 1);
+				}
+				if(str.substr(0,12) == "\"spawnflags\""){
+					spawnflags = str.substr(14);
+					spawnflags.erase(spawnflags.size() - 1);
+				}
+				if(str.substr(0,5) == "\"map\""){
+					mapname = str.substr(7);
+					mapname.erase(mapname.size() - 1);
 				}
 				if(str.substr(0,10) == "\"landmark\""){
 					landmark = str.substr(12);
 					landmark.erase(landmark.size() - 1);
+					entityLandmark = landmark;
 				}
 			}
 		}
 	}
-	for(map <string,VERTEX>::iterator it=ret.begin(); it!=ret.end(); it++){
-		if(changelevels.count((*it).first) != 0){
-			landmarks[(*it).first].push_back(make_pair((*it).second, id));
+	{
+		lock_guard<mutex> lock(world->entitiesMutex);
+		for(map <string,VERTEX>::iterator it=ret.begin(); it!=ret.end(); it++){
+			if(changelevels.count((*it).first) != 0){
+				world->landmarks[(*it).first].push_back(make_pair((*it).second, id));
+			}
 		}
 	}
+	reportEntities(world, id);
+}
 
+map <string,int> detachEntities(WORLDSTATE *world, const string &id){
+	map <string,int> slots;
+	{
+		lock_guard<mutex> lock(world->entitiesMutex);
+		for(map <string, vector<pair<VERTEX,string> > >::iterator it=world->landmarks.begin(); it!=world->landmarks.end(); it++){
+			vector<pair<VERTEX,string> > &v = (*it).second;
+			for(unsigned int i=0;i<v.size();i++){
+				if(v[i].second == id){
+					slots[(*it).first] = i;
+					v.erase(v.begin() + i);
+					break;
+				}
+			}
+		}
+		world->dontRenderModel.erase(id);
+	}
+	reportEntities(world, id);
+	return slots;
+}
+
+void reattachEntities(WORLDSTATE *world, const string &id, const map <string,int> &slots){
+	lock_guard<mutex> lock(world->entitiesMutex);
+	for(map <string,int>::const_iterator it=slots.begin(); it!=slots.end(); it++){
+		vector<pair<VERTEX,string> > &v = world->landmarks[(*it).first];
+		for(unsigned int i=0;i<v.size();i++){
+			if(v[i].second == id){
+				pair<VERTEX,string> p = v[i];
+				v.erase(v.begin() + i);
+				v.insert(v.begin() + min((int)v.size(), (*it).second), p);
+				break;
+			}
+		}
+	}
 }
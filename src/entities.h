@@ -2,7 +2,15 @@
 #define ENTITIES_H
 
 struct MapEntry;
+struct WORLDSTATE;
 
-void parseEntities(const string &str, const string &id, const MapEntry &sMapEntry);
+//modelEntities, when given, gets the classname and targetname of each brush entity by model number
+//lightPatterns, when given, gets the initial pattern of each switchable light style
+//changeLevels, when given, gets the map and landmark of each trigger_changelevel
+void parseEntities(const string &str, WORLDSTATE *world, const string &id, const MapEntry &sMapEntry, map <int,string> *modelEntities = NULL, map <int,string> *lightPatterns = NULL, vector<pair<string,string> > *changeLevels = NULL);
+//Takes a map's landmarks and hidden models out, returns where each landmark sat so a re-parse keeps the map order
+map <string,int> detachEntities(WORLDSTATE *world, const string &id);
+//Moves the re-parsed landmarks of a map back to the slots detachEntities returned
+void reattachEntities(WORLDSTATE *world, const string &id, const map <string,int> &slots);
 
 #endif
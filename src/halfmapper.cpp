@@ -1,18 +1,88 @@
 #include "common.h"
 #include "VideoSystem.h"
-#include "wad.h"
 #include "bsp.h"
 #include "ConfigXML.h"
+#include "BatchRenderer.h"
+#include "MapStreamer.h"
+#include "Frustum.h"
+#include "OcclusionCuller.h"
+#include "MemoryRegistry.h"
+#include "TextureCache.h"
+#include "HotReloader.h"
+#include "VirtualFileSystem.h"
+#include "TextureUploader.h"
+#include "TextureRegistry.h"
+#include "ScenePicker.h"
+#include "JobSystem.h"
+#include "VisibilityPass.h"
+#include "LightStyles.h"
+#include "WorldExporter.h"
+#include "ScratchArena.h"
+#include "OverdrawMeter.h"
+#include "FrameCapture.h"
+#include "TileRenderer.h"
+#include "TileServer.h"
+#include "World.h"
+#include "MipStreamer.h"
 
-int main(int argc, char **argv){
-	ConfigXML *xmlconfig = new ConfigXML();
+//Camera path values per frame: position, rotation and isometric zoom
+#define CAMERA_VALUES 6
 
-	xmlconfig->LoadProgramConfig();
+//Writes the world to a file one map at a time, so it is never all in memory
+static bool exportWorld(vector<BSP*> &maps, const string &path, JobSystem *jobs){
+	int t = SDL_GetTicks();
+	WorldExporter exporter(path, jobs);
+	if(!exporter.Begin()) return false;
+	for(size_t i=0;i<maps.size();i++){
+		if(!maps[i]->LoadGeometry()) continue;
+		exporter.AddMap(maps[i]);
+		maps[i]->Unload();
+	}
+	bool ok = exporter.End();
+	exporter.PrintStats(cout);
+	cout << "Export took " << SDL_GetTicks()-t << " ms." << endl;
+	return ok;
+}
 
-	if(argc >= 2){
-		xmlconfig->LoadMapConfig(argv[1]);
-	}else{
-		xmlconfig->LoadMapConfig("halflife.xml");
+//Camera path, one line of CAMERA_VALUES per frame
+static bool loadCameraPath(const string &path, vector<float> &values){
+	ifstream in(path.c_str());
+	if(!in) return false;
+	float v;
+	while(in >> v) values.push_back(v);
+	values.resize(values.size() - values.size()%CAMERA_VALUES);
+	return !values.empty();
+}
+
+//Visible maps nearest first, by the distance from the eye to their bounds
+static void sortByDistance(vector<BSP*> &maps, VisibilityPass &visibility, const VERTEX &eye, vector<pair<float,size_t> > &order){
+	order.clear();
+	for(size_t i=0;i<maps.size();i++){
+		if(!visibility.IsVisible(i)) continue;
+		VERTEX mins, maxs;
+		maps[i]->GetBounds(mins, maxs);
+		float dx = max(max(mins.x - eye.x, eye.x - maxs.x), 0.0f);
+		float dy = max(max(mins.y - eye.y, eye.y - maxs.y), 0.0f);
+		float dz = max(max(mins.z - eye.z, eye.z - maxs.z), 0.0f);
+		order.push_back(make_pair(dx*dx + dy*dy + dz*dz, i));
+	}
+	sort(order.begin(), order.end());
+}
+
+int main(int argc, char **argv){
+	//The loader owns the config and the maps, the viewer draws them
+	World *world = new World();
+	ConfigXML *xmlconfig = world->GetConfig();
+
+	//halfmapper [mapconfig.xml] [--export world.gltf|world.obj] [--capture video.y4m|prefix] [--camera path.txt] [--serve]
+	string mapConfig = "halflife.xml", exportPath, capturePath, cameraPathFile = "camera.txt";
+	bool serve = false;
+	for(int i=1;i<argc;i++){
+		if(string(argv[i]) == "--export" && i+1 < argc) exportPath = argv[++i];
+		else if(string(argv[i]) == "--serve") serve = true;
+		else if(string(argv[i]) == "--capture" && i+1 < argc) capturePath = argv[++i];
+		else if(string(argv[i]) == "--camera" && i+1 < argc) cameraPathFile = argv[++i];
+		else mapConfig = argv[i];
 	}
 
 	VideoSystem *videosystem = new VideoSystem(
@@ -24,40 +94,104 @@ int main(int argc, char **argv){
 		xmlconfig->m_bVsync
 	);
 
+	//Render offscreen at a resolution that holds the frame time, upscaled to the window
+	if(xmlconfig->m_bDynamicResolution)
+		videosystem->SetDynamicResolution(xmlconfig->m_fFrameTarget, xmlconfig->m_fMinScale, xmlconfig->m_fMaxScale);
+
 	if(videosystem->Init() == -1) return -1;
 
-	//Texture loading
-	for(size_t i=0;i<xmlconfig->m_vWads.size();i++){
-		if(wadLoad(xmlconfig->m_szGamePaths, xmlconfig->m_vWads[i] + ".wad") == -1) return -1;
+	//Textures past the budget drop their top mips as they are uploaded
+	g_gpuMemory.SetBudget((size_t)xmlconfig->m_iGpuBudget*1024*1024);
+	
+	//Textures are decoded into mapped pixel buffers and uploaded from there
+	g_textureUploader.Init((size_t)xmlconfig->m_iUploadRing*1024*1024);
+	
+	//Textures start with their smallest mips, the others come as the camera gets close.
+	//Exports and tiles want every level at once.
+	if(xmlconfig->m_bMipStreaming && exportPath.empty() && !serve)
+		g_mipStreamer.Init((size_t)xmlconfig->m_iMipBudget*1024, xmlconfig->m_fMipBias, (unsigned int)(xmlconfig->m_fMipKeep*1000.0f));
+	
+	//Textures and maps are uploaded as the world loads them
+	GLWorldBackend glBackend;
+	world->SetBackend(&glBackend);
+	
+	//Culling and loading jobs, spread over every core
+	JobSystem *jobs = new JobSystem(xmlconfig->m_iJobThreads);
+	
+	//WADs, then the entities of every map, which places them
+	int t = SDL_GetTicks();
+	int totalTris=0, lodTris[LOD_LEVELS] = {0}, animatedFaces=0;
+	if(!world->Load(mapConfig, true)) return -1;
+	vector <BSP*> &maps = world->GetMaps();
+	int mapCount = world->GetConfigMapCount(), mapRenderCount = maps.size();
+	
+	//Export mode writes every map out and quits, without rendering
+	if(!exportPath.empty()){
+		bool ok = exportWorld(maps, exportPath, jobs);
+		delete world;
+		delete jobs;
+		g_textureUploader.Shutdown();
+		SDL_Quit();
+		return ok ? 0 : -1;
 	}
-
-	//Map loading
-	vector <BSP*> maps;
 	
-	int t = SDL_GetTicks(), mapCount = 0, mapRenderCount = 0;
-	int totalTris=0;
+	//With streaming, geometry is loaded as the camera gets close. Otherwise everything is loaded now.
+	MapStreamer *streamer = NULL;
 	
-	for(unsigned int i = 0; i < xmlconfig->m_vChapterEntries.size(); i++) {
-		for (unsigned int j = 0; j < xmlconfig->m_vChapterEntries[i].m_vMapEntries.size(); j++) {
-			ChapterEntry sChapterEntry = xmlconfig->m_vChapterEntries[i];
-			MapEntry sMapEntry = xmlconfig->m_vChapterEntries[i].m_vMapEntries[j];
-
-			if (sChapterEntry.m_bRender && sMapEntry.m_bRender) {
-				BSP *b = new BSP(xmlconfig->m_szGamePaths, "maps/" + sMapEntry.m_szName + ".bsp", sMapEntry);
-				b->SetChapterOffset(sChapterEntry.m_fOffsetX, sChapterEntry.m_fOffsetY, sChapterEntry.m_fOffsetZ);
-				totalTris += b->totalTris;
-				maps.push_back(b);
-				mapRenderCount++;
-			}
-
-			mapCount++;
+	if(xmlconfig->m_bStreaming && !serve){
+		streamer = new MapStreamer(maps, xmlconfig->m_fStreamRadius, xmlconfig->m_fStreamHysteresis, (size_t)xmlconfig->m_iStreamBudget*1024*1024);
+	}else{
+		//Parsing and building geometry runs as jobs, uploading needs the GL thread
+		world->LoadGeometry(jobs);
+		for(size_t i=0;i<maps.size();i++){
+			totalTris += maps[i]->totalTris;
+			animatedFaces += maps[i]->GetAnimatedFaces();
+			for(int l=0;l<LOD_LEVELS;l++) if(maps[i]->IsResident()) lodTris[l] += maps[i]->GetLodTris(l+1);
 		}
 	}
 	
 	cout << mapCount << " maps found in config file." << endl;
-	cout << mapRenderCount << " maps to render - loaded in " << SDL_GetTicks()-t << " ms." << endl;
-	cout << "Total triangles: " << totalTris << endl;
+	if(streamer != NULL){
+		cout << mapRenderCount << " maps to stream - placed in " << SDL_GetTicks()-t << " ms." << endl;
+	}else{
+		cout << mapRenderCount << " maps to render - loaded in " << SDL_GetTicks()-t << " ms on " << jobs->GetThreadCount() << " threads." << endl;
+		cout << "Total triangles: " << totalTris << endl;
+		if(xmlconfig->m_bLod) cout << "LOD triangles: " << lodTris[0] << ", " << lodTris[1] << endl;
+		if(xmlconfig->m_bLightStyles) cout << "Faces with animated light styles: " << animatedFaces << endl;
+	}
+
+	//Batch every map into a few multi-draws when the driver allows it
+	BatchRenderer *batch = NULL;
+	bool useBatch = false;
+
+	if(xmlconfig->m_bBatching){
+		if(BatchRenderer::IsSupported()){
+			batch = new BatchRenderer();
+			useBatch = batch->Build(maps);
+			if(useBatch){
+				cout << "Draw calls per frame: " << batch->GetLegacyDrawCalls() << " per map, " << batch->GetDrawCalls() << " batched." << endl;
+			}
+		}else{
+			cout << "OpenGL 4.3 not available, batching disabled." << endl;
+		}
+	}
 
+	g_gpuMemory.Print(cout);
+	g_hostMemory.Print(cout);
+	g_textureCache.PrintStats(cout);
+	g_textureUploader.PrintStats(cout);
+	ScratchArena::PrintStats(cout);
+	{
+		lock_guard<mutex> lock(texturesMutex);
+		g_textures.PrintStats(cout);
+	}
+	
+	//What is under the crosshair, and which map the camera is in
+	ScenePicker *picker = xmlconfig->m_bPicking ? new ScenePicker(maps) : NULL;
+	
+	//Pick up recompiled maps, edited WADs and map config changes
+	HotReloader *reloader = xmlconfig->m_bHotReload ? new HotReloader(world, streamer) : NULL;
+	
 	//---
 	
 	bool quit=false;
@@ -66,6 +200,79 @@ int main(int argc, char **argv){
 	float rotation[2] = {0.0f, 0.0f};
 	float isoBounds=1000.0;
 	int oldMs = SDL_GetTicks(), frame=0;
+	Frustum frustum;
+	
+	//Level of detail selection, maps drawn with a simplified mesh are masked out of the batch
+	LODVIEW lodView;
+	lodView.isometric = xmlconfig->m_bIsometric;
+	for(int l=0;l<LOD_LEVELS;l++) lodView.minPixels[l] = xmlconfig->m_fLodPixels[l];
+	
+	//Occlusion culling against the large faces of the nearest maps
+	OcclusionCuller *culler = xmlconfig->m_bOcclusion ? new OcclusionCuller() : NULL;
+	bool useOcclusion = culler != NULL;
+	
+	//Per map and per cluster tests run as jobs, draws are submitted from here
+	VisibilityPass visibility(maps);
+	bool useJobs = true;
+	float visibilityMs = 0.0f;
+	
+	//Animated light styles re-upload the changed lightmaps, a budget of bytes at a time
+	g_lightmapUpdates.SetBudget((size_t)xmlconfig->m_iLightBudget*1024);
+	vector <LMRECT> lightRects;
+	
+	//Textures that got streamed levels, copied into the batch arrays
+	vector <int> mipChanges;
+	
+	//Front to back draw order, and the overdraw heatmap that shows what it saves
+	bool frontToBack = xmlconfig->m_bFrontToBack, showOverdraw = false;
+	OverdrawMeter *overdraw = NULL;
+	vector <pair<float,size_t> > mapOrder;
+	
+	//Captured frames are read back a few frames late and written on their own thread
+	FrameCapture *capture = NULL;
+	if(!capturePath.empty()){
+		if(FrameCapture::IsSupported()){
+			capture = new FrameCapture(capturePath, xmlconfig->m_iCaptureFps, xmlconfig->m_iCaptureRing);
+			if(capture->Start(xmlconfig->m_iWidth, xmlconfig->m_iHeight)) videosystem->SetFrameCapture(capture);
+			else{ delete capture; capture = NULL; }
+		}else{
+			cout << "Pixel buffer objects or fences not available, frames aren't captured." << endl;
+		}
+	}
+	
+	//Tiles of every chapter for slippy map viewers, rendered between frames
+	TileRenderer *tileRenderer = NULL;
+	TileServer *tileServer = NULL;
+	if(serve){
+		if(TileRenderer::IsSupported()){
+			tileRenderer = new TileRenderer(xmlconfig->m_iTileSize, xmlconfig->m_bTileIsometric);
+			if(tileRenderer->Init()){
+				for(size_t c=0;c<xmlconfig->m_vChapterEntries.size();c++){
+					vector <BSP*> chapterMaps;
+					for(size_t i=0;i<maps.size();i++) if(world->GetMapChapter(i) == c) chapterMaps.push_back(maps[i]);
+					if(!chapterMaps.empty()) tileRenderer->AddChapter(xmlconfig->m_vChapterEntries[c].m_szName, chapterMaps);
+				}
+				tileServer = new TileServer(tileRenderer, (size_t)xmlconfig->m_iTileMemory*1024*1024, xmlconfig->m_szTileCache,
+					(size_t)xmlconfig->m_iTileDisk*1024*1024, xmlconfig->m_iTileQueue, xmlconfig->m_iTileMaxZoom);
+				tileServer->SetContentHash(world->GetContentHash());
+				if(!tileServer->Start(xmlconfig->m_iTilePort, xmlconfig->m_iTileThreads)){
+					delete tileServer;
+					tileServer = NULL;
+				}
+			}else{
+				cout << "Can't create the tile framebuffer, tiles aren't served." << endl;
+			}
+		}else{
+			cout << "Framebuffer objects not available, tiles aren't served." << endl;
+		}
+	}
+	
+	//While capturing a recorded camera path is played back, one frame per line. Otherwise C records one
+	vector <float> cameraPath;
+	size_t cameraFrame = 0;
+	ofstream cameraOut;
+	if(capture != NULL && loadCameraPath(cameraPathFile, cameraPath))
+		cout << "Playing back " << cameraPath.size()/CAMERA_VALUES << " frames of " << cameraPathFile << "." << endl;
 	
 	while(!quit){
 		SDL_Event event;
@@ -82,6 +289,56 @@ int main(int argc, char **argv){
 				
 				if(event.key.keysym.sym == SDLK_LSHIFT) kr=1;
 				if(event.key.keysym.sym == SDLK_LCTRL) kc=1;
+
+				if(event.key.keysym.sym == SDLK_b && batch != NULL) useBatch = !useBatch;
+				if(event.key.keysym.sym == SDLK_o && culler != NULL) useOcclusion = !useOcclusion;
+				if(event.key.keysym.sym == SDLK_f){
+					frontToBack = !frontToBack;
+					cout << "Maps drawn " << (frontToBack ? "front to back" : "in texture order") << (useBatch ? ", without batching." : ".") << endl;
+				}
+				if(event.key.keysym.sym == SDLK_c && cameraPath.empty()){
+					if(cameraOut.is_open()){
+						cameraOut.close();
+						cout << "Camera path saved to " << cameraPathFile << "." << endl;
+					}else{
+						cameraOut.open(cameraPathFile.c_str());
+						cameraOut.precision(9); //Enough digits to play a float back exactly
+						cout << (cameraOut ? "Recording the camera path to " : "Can't write ") << cameraPathFile << "." << endl;
+					}
+				}
+				if(event.key.keysym.sym == SDLK_h){
+					if(overdraw == NULL) overdraw = new OverdrawMeter();
+					showOverdraw = !showOverdraw;
+				}
+				if(event.key.keysym.sym == SDLK_j){
+					jobs->PrintStats(cout);
+					useJobs = !useJobs;
+					cout << "Visibility tests " << (useJobs ? "spread over jobs." : "on the main thread.") << endl;
+				}
+				if(event.key.keysym.sym == SDLK_m){
+					g_gpuMemory.Print(cout);
+					g_hostMemory.Print(cout);
+					g_textureUploader.PrintStats(cout);
+					ScratchArena::PrintStats(cout);
+					g_lightmapUpdates.PrintStats(cout);
+					if(capture != NULL) capture->PrintStats(cout);
+				}
+				if(event.key.keysym.sym == SDLK_r){
+					if(streamer != NULL) streamer->PrintStats();
+					g_mipStreamer.PrintStats(cout);
+					g_textureCache.PrintStats(cout);
+					lock_guard<mutex> lock(texturesMutex);
+					g_textures.PrintStats(cout);
+				}
+				if(event.key.keysym.sym == SDLK_p && picker != NULL){
+					float yaw = rotation[0]*(float)M_PI/180.0f, pitch = rotation[1]*(float)M_PI/180.0f;
+					float dir[3] = {sin(yaw)*cos(pitch), -sin(pitch), -cos(yaw)*cos(pitch)};
+					picker->PrintPick(position, dir, cout);
+				}
+				if(event.key.keysym.sym == SDLK_k && picker != NULL) picker->Benchmark(cout);
+				if(event.key.keysym.sym == SDLK_t && tileServer != NULL) tileServer->PrintStats(cout);
+				if(event.key.keysym.sym == SDLK_LEFTBRACKET && streamer != NULL) streamer->SetHysteresis(streamer->GetHysteresis() - 256.0f);
+				if(event.key.keysym.sym == SDLK_RIGHTBRACKET && streamer != NULL) streamer->SetHysteresis(streamer->GetHysteresis() + 256.0f);
 			}
 			if(event.type==SDL_KEYUP){
 				if(event.key.keysym.sym == SDLK_w) kw=0;
@@ -132,6 +389,21 @@ int main(int argc, char **argv){
 			if(ke) position[1] += vsp;
 			if(kq) position[1] -= vsp;
 		}
+		
+		//Camera path playback ends the run with the path, recording stores where this frame is drawn from
+		if(!cameraPath.empty()){
+			if(cameraFrame*CAMERA_VALUES >= cameraPath.size()) break;
+			const float *v = &cameraPath[cameraFrame*CAMERA_VALUES];
+			position[0] = v[0]; position[1] = v[1]; position[2] = v[2];
+			rotation[0] = v[3]; rotation[1] = v[4];
+			isoBounds = v[5];
+			cameraFrame++;
+		}else if(cameraOut.is_open()){
+			cameraOut << position[0] << " " << position[1] << " " << position[2] << " " << rotation[0] << " " << rotation[1] << " " << isoBounds << "\n";
+		}
+
+		//Tiles go into their own framebuffer, before the frame binds its own
+		if(tileServer != NULL) tileServer->RenderQueued(xmlconfig->m_iTilesPerFrame);
 
 		videosystem->ClearBuffer();
 		
@@ -154,10 +426,92 @@ int main(int argc, char **argv){
 			glRotated(rotation[0], 0.0f, 1.0f, 0.0f);		
 			glTranslatef(-position[0], -position[1], -position[2]);
 		}
+		frustum.Extract();
+		g_textureUploader.Update();
+		
+		//Stream maps in and out around the camera. The batch is rebuilt over the next frames,
+		//maps are drawn one by one until it is done
+		if(streamer != NULL){
+			if(streamer->Update(position, xmlconfig->m_bIsometric ? isoBounds : 0.0f, frustum) && batch != NULL)
+				batch->Build(maps, true);
+		}
+		
+		if(reloader != NULL && reloader->Update()){
+			if(batch != NULL) batch->Build(maps, true);
+			//Tiles of the old files are no longer served
+			if(tileServer != NULL) tileServer->SetContentHash(world->GetContentHash());
+		}
+		
+		//Pick a level per map from its size on screen, and a mip per texture from its distance,
+		//in pixels actually rendered when the resolution is scaled
+		memcpy(lodView.camera, position, sizeof(position));
+		float renderHeight = xmlconfig->m_iHeight*videosystem->GetResolutionScale();
+		if(xmlconfig->m_bIsometric)
+			lodView.scale = renderHeight/(2.0f*isoBounds);
+		else
+			lodView.scale = renderHeight/(2.0f*tan(xmlconfig->m_fFov*(float)M_PI/360.0f));
+		
+		if(batch != NULL) batch->Continue(BATCH_COPY_BYTES);
+		//The batch draws in texture order, ordered and heatmap frames go per map
+		bool batchFrame = useBatch && batch->IsReady() && !frontToBack && !showOverdraw;
+		
+		//Level, frustum and occlusion tests, per map and per (map, texture) draw
+		visibility.Run(frustum, useOcclusion ? culler : NULL, xmlconfig->m_bLod ? &lodView : NULL, position,
+			xmlconfig->m_iOccluderMaps, !batchFrame, useJobs ? jobs : NULL);
+		visibilityMs += visibility.GetTime();
+		
+		//Mip levels for the textures drawn at full detail
+		if(g_mipStreamer.IsEnabled()){
+			for(size_t i=0;i<maps.size();i++){
+				if(visibility.IsVisible(i) && visibility.GetLod(i) == 0) g_mipStreamer.RequestMap(maps[i], visibility.GetClusterVisible(i), lodView);
+			}
+			mipChanges.clear();
+			//Captured frames wait for their levels, so they come out the same every run
+			g_mipStreamer.Update(mipChanges, capture != NULL);
+			if(batch != NULL) batch->UpdateTextures(mipChanges);
+		}
+		
+		//Light styles, for the maps drawn with their lightmaps
+		if(xmlconfig->m_bLightStyles){
+			//Captured frames are a fixed time apart, however long they took
+			g_lightmapUpdates.BeginFrame(capture != NULL ? (unsigned int)(capture->GetFrameCount()*1000ull/capture->GetFps()) : SDL_GetTicks());
+			for(size_t i=0;i<maps.size();i++){
+				if(!visibility.IsVisible(i) || visibility.GetLod(i) > 0) continue;
+				lightRects.clear();
+				maps[i]->UpdateLightStyles(lightRects);
+				for(size_t j=0;j<lightRects.size() && batch != NULL;j++)
+					batch->UpdateLightmap(i, lightRects[j].x, lightRects[j].y, lightRects[j].w, lightRects[j].h);
+			}
+		}
+		
 		//Map render
-		for(size_t i=0;i<maps.size();i++){
-			maps[i]->render();	
+		int drawCalls = 0;
+		if(showOverdraw) overdraw->Begin();
+		if(batchFrame){
+			drawCalls = batch->Render(visibility.GetBatchMask());
+			for(size_t i=0;i<maps.size();i++){
+				if(visibility.IsVisible(i) && visibility.GetLod(i) > 0) drawCalls += maps[i]->render(visibility.GetLod(i));
+			}
+		}else if(frontToBack){
+			//In isometric every face is in front of a point far behind the view
+			VERTEX eye(position[0], position[1], position[2]);
+			if(xmlconfig->m_bIsometric){
+				float yaw = rotation[0]*(float)M_PI/180.0f, pitch = rotation[1]*(float)M_PI/180.0f;
+				eye.x -= sin(yaw)*cos(pitch)*100000.0f;
+				eye.y += sin(pitch)*100000.0f;
+				eye.z += cos(yaw)*cos(pitch)*100000.0f;
+			}
+			sortByDistance(maps, visibility, eye, mapOrder);
+			for(size_t n=0;n<mapOrder.size();n++){
+				size_t i = mapOrder[n].second;
+				drawCalls += maps[i]->render(visibility.GetLod(i), visibility.GetClusterVisible(i), &eye, !showOverdraw);
+			}
+		}else{
+			for(size_t i=0;i<maps.size();i++){
+				if(visibility.IsVisible(i)) drawCalls += maps[i]->render(visibility.GetLod(i), visibility.GetClusterVisible(i), NULL, !showOverdraw);
+			}
 		}
+		if(showOverdraw) overdraw->End();
 
 		videosystem->SwapBuffers();
 
@@ -168,11 +522,55 @@ int main(int argc, char **argv){
 			//FPS calculation
 			int dt = SDL_GetTicks()-oldMs;
 			oldMs = SDL_GetTicks();
-			char bf[64];
-			sprintf(bf, "%.2f FPS - %.2f %.2f %.2f", 30000.0f/(float)dt, position[0], position[1], position[2]);
+			char bf[256];
+			int gpuMB = (int)(g_gpuMemory.GetTotal()/(1024*1024));
+			int threads = useJobs ? jobs->GetThreadCount() : 1;
+			if(useOcclusion)
+				sprintf(bf, "%.2f FPS - %.2f %.2f %.2f - %d draws - %d MB - %d%% occluded, %.2f ms cull on %d threads", 30000.0f/(float)dt, position[0], position[1], position[2], drawCalls, gpuMB,
+					culler->GetTested() ? culler->GetOccluded()*100/culler->GetTested() : 0, visibilityMs/30.0f, threads);
+			else
+				sprintf(bf, "%.2f FPS - %.2f %.2f %.2f - %d draws - %d MB - %.2f ms cull on %d threads", 30000.0f/(float)dt, position[0], position[1], position[2], drawCalls, gpuMB,
+					visibilityMs/30.0f, threads);
+			visibilityMs = 0.0f;
+			if(videosystem->IsDynamicResolution()){
+				int scale = (int)(videosystem->GetResolutionScale()*100.0f + 0.5f);
+				sprintf(bf + strlen(bf), " - %d%% res", scale);
+				char line[80];
+				sprintf(line, "Frame %.2f ms, GPU %.2f ms, resolution %d%%", dt/30.0f, videosystem->GetGpuTime(), scale);
+				cout << line << endl;
+			}
+			if(showOverdraw){
+				sprintf(bf + strlen(bf), " - %.2fx overdraw", overdraw->GetAverage());
+				char line[80];
+				sprintf(line, "Overdraw %.2fx, %s", overdraw->GetAverage(), frontToBack ? "front to back" : "texture order");
+				cout << line << endl;
+			}
+			if(capture != NULL) sprintf(bf + strlen(bf), " - %u frames captured", capture->GetFrameCount());
+			if(tileServer != NULL) sprintf(bf + strlen(bf), " - %u tiles served", tileServer->GetServed());
 			videosystem->SetWindowTitle(bf);
 		}
 	}
+	g_gpuMemory.Print(cout);
+	g_hostMemory.Print(cout);
+	if(capture != NULL){
+		videosystem->SetFrameCapture(NULL);
+		capture->Finish();
+		delete capture;
+	}
+	if(tileServer != NULL) tileServer->PrintStats(cout);
+	delete tileServer;
+	delete tileRenderer;
+	delete overdraw;
+	delete reloader;
+	delete picker;
+	delete culler;
+	delete batch;
+	delete streamer;
+	//Streamed mip levels are read from the world's file system
+	g_mipStreamer.Shutdown();
+	delete world;
+	delete jobs;
+	g_textureUploader.Shutdown();
 	SDL_Quit();
 	
 	return 0;
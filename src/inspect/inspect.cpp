@@ -0,0 +1,168 @@
+//halfmapper-inspect: loads every map of a config without a window or GL, and prints a JSON report
+#include "common.h"
+#include "bsp.h"
+#include "ConfigXML.h"
+#include "JobSystem.h"
+#include "World.h"
+#include "OverlapFinder.h"
+#include <set>
+
+static string quote(const string &s){
+	string r = "\"";
+	for(size_t i=0;i<s.size();i++){
+		unsigned char c = s[i];
+		if(c == '"' || c == '\\'){ r += '\\'; r += c; }
+		else if(c < 0x20 || c >= 0x80) r += '_';
+		else r += c;
+	}
+	return r + "\"";
+}
+
+static string quoteList(const vector<string> &v){
+	string r = "[";
+	for(size_t i=0;i<v.size();i++) r += (i ? "," : "") + quote(v[i]);
+	return r + "]";
+}
+
+int main(int argc, char **argv){
+	//Loader messages go to stderr, stdout only gets the report
+	streambuf *report = cout.rdbuf(cerr.rdbuf());
+	
+	//No backend, nothing is decoded or uploaded
+	World *world = new World();
+	ConfigXML *xmlconfig = world->GetConfig();
+	
+	//halfmapper-inspect [mapconfig.xml] [--threads n] [--overlaps]
+	string mapConfig = "halflife.xml";
+	int threads = xmlconfig->m_iJobThreads;
+	bool overlaps = false;
+	for(int i=1;i<argc;i++){
+		if(string(argv[i]) == "--threads" && i+1 < argc) threads = atoi(argv[++i]);
+		else if(string(argv[i]) == "--overlaps") overlaps = true;
+		else mapConfig = argv[i];
+	}
+	
+	//Overlaps are found from the picking BVHs, so maps keep them
+	if(overlaps) xmlconfig->m_bPicking = true;
+	
+	Uint64 start = SDL_GetPerformanceCounter();
+	
+	//Texture names the WADs provide, and the entities of every map
+	world->Load(mapConfig);
+	const set <string> &wadTextures = world->GetWadTextures();
+	const vector <string> &missingWads = world->GetMissingWads();
+	const map <string, vector<pair<VERTEX,string> > > &landmarks = world->GetLandmarks();
+	vector <BSP*> &maps = world->GetMaps();
+	set <string> mapNames;
+	for(size_t i=0;i<maps.size();i++) mapNames.insert(maps[i]->GetMapId());
+	
+	//Geometry is read and built in parallel, each map is freed once measured unless overlaps are looked for
+	JobSystem *jobs = new JobSystem(threads);
+	world->LoadGeometry(jobs, overlaps);
+	
+	//Offsets are found from the landmarks, in config order like the viewer
+	vector <VERTEX> offsets;
+	for(size_t i=0;i<maps.size();i++) offsets.push_back(world->GetOffset(i));
+	
+	//World geometry of different maps that overlaps once they are placed
+	OverlapFinder finder;
+	if(overlaps) finder.Run(maps, jobs);
+	
+	float totalMs = (SDL_GetPerformanceCounter()-start)*1000.0f/SDL_GetPerformanceFrequency();
+	
+	cout.rdbuf(report);
+	
+	char bf[512];
+	int problems = 0;
+	BSPSTATS totals;
+	
+	cout << "{\n\"config\":" << quote(mapConfig) << ",\n\"threads\":" << jobs->GetThreadCount() << ",\n";
+	cout << "\"wads\":{\"textures\":" << wadTextures.size() << ",\"missing\":" << quoteList(missingWads) << "},\n";
+	cout << "\"maps\":[\n";
+	for(size_t i=0;i<maps.size();i++){
+		BSP *b = maps[i];
+		const BSPSTATS &s = b->GetStats();
+		const string &id = b->GetMapId();
+		
+		//Textures that neither the map nor the WADs have, drawn blank
+		vector <string> missing;
+		for(size_t j=0;j<s.wadTextures.size();j++)
+			if(!wadTextures.count(s.wadTextures[j])) missing.push_back(s.wadTextures[j]);
+		
+		//Landmarks no other map of the config shares, the map can't be placed from them
+		vector <string> unmatched;
+		for(map <string, vector<pair<VERTEX,string> > >::const_iterator it=landmarks.begin(); it!=landmarks.end(); it++){
+			bool mine = false, other = false;
+			for(size_t j=0;j<(*it).second.size();j++){
+				if((*it).second[j].second == id) mine = true;
+				else other = true;
+			}
+			if(mine && !other) unmatched.push_back((*it).first);
+		}
+		
+		//Changelevels to maps that aren't in the config, or that lack the landmark
+		vector <string> changeLevels;
+		const vector<pair<string,string> > &cl = b->GetChangeLevels();
+		for(size_t j=0;j<cl.size();j++){
+			bool found = false;
+			map <string, vector<pair<VERTEX,string> > >::const_iterator it = landmarks.find(cl[j].second);
+			if(mapNames.count(cl[j].first) && it != landmarks.end())
+				for(size_t k=0;k<(*it).second.size();k++) found = found || (*it).second[k].second == cl[j].first;
+			if(!found) changeLevels.push_back(cl[j].first + " " + cl[j].second);
+		}
+		
+		bool loaded = world->IsMapLoaded(i);
+		bool ok = b->IsValid() && loaded && s.atlasOverflow == 0 && missing.empty();
+		if(!ok) problems++;
+		
+		cout << "{\"name\":" << quote(id) << ",\"file\":" << quote(b->GetFilePath()) << ",\"loaded\":" << (loaded ? "true" : "false") << ",\n";
+		sprintf(bf, " \"faces\":%d,\"triangles\":%d,\"vertices\":%d,\"textures\":%d,\"embeddedTextures\":%d,\"lightmaps\":%d,\n",
+			s.faces, s.triangles, s.vertices, s.textures, s.embeddedTextures, s.lightmaps);
+		cout << bf;
+		sprintf(bf, " \"atlas\":{\"occupancy\":%.3f,\"height\":%d,\"overflow\":%d},\n", s.atlasTexels/(1024.0f*1024.0f), s.atlasHeight, s.atlasOverflow);
+		cout << bf;
+		sprintf(bf, " \"offset\":[%.1f,%.1f,%.1f],\n", offsets[i].x, offsets[i].y, offsets[i].z);
+		cout << bf;
+		cout << " \"missingTextures\":" << quoteList(missing) << ",\"unmatchedLandmarks\":" << quoteList(unmatched) << ",\"unmatchedChangelevels\":" << quoteList(changeLevels) << ",\n";
+		sprintf(bf, " \"ms\":{\"entities\":%.2f,\"read\":%.2f,\"textures\":%.2f,\"lightmaps\":%.2f,\"triangles\":%.2f,\"build\":%.2f,\"total\":%.2f}}",
+			world->GetEntitiesMs(i), s.readMs, s.texturesMs, s.lightmapsMs, s.trianglesMs, s.buildMs,
+			world->GetEntitiesMs(i) + s.readMs+ s.texturesMs + s.lightmapsMs + s.trianglesMs + s.buildMs);
+		cout << bf << (i+1 < maps.size() ? ",\n" : "\n");
+		
+		totals.faces += s.faces; totals.triangles += s.triangles; totals.vertices += s.vertices;
+		totals.atlasOverflow += s.atlasOverflow;
+	}
+	cout << "],\n";
+	if(overlaps){
+		const vector <MapOverlap> &found = finder.GetOverlaps();
+		sprintf(bf, "\"overlaps\":{\"candidates\":%d,\"pairs\":%d,\"ms\":%.2f,\"list\":[\n", (int)finder.GetCandidates(), (int)found.size(), finder.GetTime());
+		cout << bf;
+		for(size_t i=0;i<found.size();i++){
+			const MapOverlap &o = found[i];
+			const vector <ChapterEntry> &chapters = xmlconfig->m_vChapterEntries;
+			cout << "{\"maps\":[" << quote(maps[o.uMapA]->GetMapId()) << "," << quote(maps[o.uMapB]->GetMapId()) << "],";
+			cout << "\"chapters\":[" << quote(chapters[world->GetMapChapter(o.uMapA)].m_szName) << "," << quote(chapters[world->GetMapChapter(o.uMapB)].m_szName) << "],\n";
+			sprintf(bf, " \"bounds\":[[%.1f,%.1f,%.1f],[%.1f,%.1f,%.1f]],\"boundsVolume\":%.0f,\"candidates\":%d,\"crossings\":%d,\"crossingLength\":%.1f,\"coplanarArea\":%.1f,\n",
+				o.fMins[0], o.fMins[1], o.fMins[2], o.fMaxs[0], o.fMaxs[1], o.fMaxs[2], o.fBoundsVolume, (int)o.uCandidates, o.iCrossings, o.fCrossingLength, o.fCoplanarArea);
+			cout << bf << " \"regions\":[";
+			for(size_t r=0;r<o.vRegions.size();r++){
+				const OverlapRegion &g = o.vRegions[r];
+				sprintf(bf, "%s\n  {\"mins\":[%.1f,%.1f,%.1f],\"maxs\":[%.1f,%.1f,%.1f],\"volume\":%.0f,\"crossings\":%d,\"crossingLength\":%.1f,\"coplanarArea\":%.1f}",
+					r ? "," : "", g.fMins[0], g.fMins[1], g.fMins[2], g.fMaxs[0], g.fMaxs[1], g.fMaxs[2], g.fVolume, g.iCrossings, g.fCrossingLength, g.fCoplanarArea);
+				cout << bf;
+			}
+			cout << "]}" << (i+1 < found.size() ? ",\n" : "\n");
+		}
+		cout << "]},\n";
+	}
+	sprintf(bf, "\"totals\":{\"maps\":%d,\"faces\":%d,\"triangles\":%d,\"vertices\":%d,\"problems\":%d,\"ms\":%.2f}\n}\n",
+		(int)maps.size(), totals.faces, totals.triangles, totals.vertices, problems, totalMs);
+	cout << bf;
+	
+	bool wadsMissing = !missingWads.empty();
+	delete world;
+	delete jobs;
+	
+	//Non zero when a map can't be loaded, overflows its atlas or misses textures
+	return problems || wadsMissing ? 1 : 0;
+}
@@ -0,0 +1,93 @@
+#include "lod.h"
+
+struct LODCLUSTER{
+	double x,y,z;
+	int count;
+};
+
+//Vertex clustering (Rossignac-Borrel). Every vertex is moved to the average of
+//the vertices sharing its grid cell, so runs of small coplanar faces collapse
+//into a few large triangles and details smaller than a cell disappear, since
+//all their vertices land in the same cluster and every triangle degenerates.
+void buildLod(const vector<LODFACE> &faces, float cellSize, vector<LODVERT> &out){
+	map <long long, int> cellIndex;
+	vector <LODCLUSTER> clusters;
+	vector <int> tris; //Three clusters per triangle
+	vector <const LODFACE*> triFace;
+	map <long long, bool> seen;
+	vector <int> ids; //Cluster of each point of a face, reused for every face
+	
+	for(size_t i=0;i<faces.size();i++){
+		const VERTEX *p = faces[i].points;
+		size_t count = faces[i].pointCount;
+		if(count < 3) continue;
+		
+		ids.resize(count);
+		for(size_t k=0;k<count;k++){
+			long long cx = (long long)floor(p[k].x/cellSize) & 0x1FFFFF;
+			long long cy = (long long)floor(p[k].y/cellSize) & 0x1FFFFF;
+			long long cz = (long long)floor(p[k].z/cellSize) & 0x1FFFFF;
+			long long key = (cx << 42) | (cy << 21) | cz;
+			
+			map <long long, int>::iterator it = cellIndex.find(key);
+			if(it == cellIndex.end()){
+				LODCLUSTER c; c.x = c.y = c.z = 0; c.count = 0;
+				it = cellIndex.insert(make_pair(key, (int)clusters.size())).first;
+				clusters.push_back(c);
+			}
+			ids[k] = (*it).second;
+			clusters[ids[k]].x += p[k].x;
+			clusters[ids[k]].y += p[k].y;
+			clusters[ids[k]].z += p[k].z;
+			clusters[ids[k]].count++;
+		}
+		
+		//Same fan order as the full detail mesh, so culling stays the same
+		for(size_t k=1;k+1<count;k++){
+			int a = ids[0], b = ids[k], c = ids[k+1];
+			if(a == b || b == c || a == c) continue;
+			
+			//Skip triangles already emitted with the same winding
+			int r[3] = {a,b,c};
+			int m = (a < b && a < c) ? 0 : (b < c ? 1 : 2);
+			long long key = ((long long)r[m] << 42) | ((long long)r[(m+1)%3] << 21) | r[(m+2)%3];
+			if(seen.count(key)) continue;
+			seen[key] = true;
+			
+			tris.push_back(a); tris.push_back(b); tris.push_back(c);
+			triFace.push_back(&faces[i]);
+		}
+	}
+	
+	out.clear();
+	out.reserve(tris.size());
+	for(size_t i=0;i<tris.size();i++){
+		const LODCLUSTER &c = clusters[tris[i]];
+		const LODFACE *f = triFace[i/3];
+		LODVERT v;
+		v.x = c.x/c.count; v.y = c.y/c.count; v.z = c.z/c.count;
+		v.r = f->color[0]; v.g = f->color[1]; v.b = f->color[2]; v.a = 255;
+		out.push_back(v);
+	}
+}
+
+//Pick a level from the projected size of a map's bounds
+int selectLod(const VERTEX &mins, const VERTEX &maxs, const LODVIEW &view){
+	float cx = (mins.x+maxs.x)/2, cy = (mins.y+maxs.y)/2, cz = (mins.z+maxs.z)/2;
+	float dx = maxs.x-mins.x, dy = maxs.y-mins.y, dz = maxs.z-mins.z;
+	float radius = sqrt(dx*dx+dy*dy+dz*dz)/2;
+	
+	float pixels;
+	if(view.isometric){
+		pixels = 2*radius*view.scale;
+	}else{
+		float ex = view.camera[0]-cx, ey = view.camera[1]-cy, ez = view.camera[2]-cz;
+		float dist = sqrt(ex*ex+ey*ey+ez*ez);
+		if(dist <= radius) return 0;
+		pixels = 2*radius*view.scale/dist;
+	}
+	
+	for(int l=LOD_LEVELS;l>0;l--)
+		if(pixels < view.minPixels[l-1]) return l;
+	return 0;
+}
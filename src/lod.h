@@ -0,0 +1,36 @@
+#ifndef LOD_H
+#define LOD_H
+
+#include "common.h"
+
+//Simplified levels built for each map, besides the full detail one
+#define LOD_LEVELS 2
+
+//Grid cell size of each simplified level, in world units
+const float lodCellSize[LOD_LEVELS] = {64.0f, 256.0f};
+
+struct LODVERT{
+	float x,y,z;
+	unsigned char r,g,b,a;
+};
+
+//A face to simplify, with its texture and lightmap colour already combined,
+//the points are the loader's scratch memory
+struct LODFACE{
+	const VERTEX *points;
+	int pointCount;
+	unsigned char color[3];
+};
+
+//How the camera sees the world, to pick a level from projected size
+struct LODVIEW{
+	bool isometric;
+	float camera[3];
+	float scale;                 //Pixels per world unit (isometric) or per unit at distance 1 (perspective)
+	float minPixels[LOD_LEVELS]; //Use level i+1 when a map is smaller than this on screen
+};
+
+void buildLod(const vector<LODFACE> &faces, float cellSize, vector<LODVERT> &out);
+int selectLod(const VERTEX &mins, const VERTEX &maxs, const LODVIEW &view);
+
+#endif
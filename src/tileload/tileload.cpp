@@ -0,0 +1,161 @@
+//halfmapper-tileload: requests tiles from a running tile server over several connections, and prints throughput and latency
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include "NetSocket.h"
+
+using namespace std;
+
+struct LOADTEST{
+	string host, chapter;
+	unsigned short port;
+	int zoom, requests;
+	unsigned int seed;
+	mutex lock;
+	vector <float> latencies; //Of the tiles served, in ms
+	int ok, busy, failed, errors;
+};
+
+//Sends a GET and reads the whole response, false when the connection is gone
+static bool httpGet(NetSocket &s, const string &host, const string &path, int &status, string &body){
+	string req = "GET " + path + " HTTP/1.1\r\nHost: " + host + "\r\n\r\n";
+	if(!s.SendAll(req.data(), req.size())) return false;
+	string buf;
+	size_t end;
+	char data[4096];
+	while((end = buf.find("\r\n\r\n")) == string::npos){
+		int n = s.Recv(data, sizeof(data));
+		if(n <= 0) return false;
+		buf.append(data, n);
+	}
+	if(sscanf(buf.c_str(), "HTTP/%*d.%*d %d", &status) != 1) return false;
+	size_t length = 0;
+	string header = buf.substr(0, end);
+	for(size_t i=0;i<header.size();i++) header[i] = (char)tolower((unsigned char)header[i]);
+	size_t field = header.find("\r\ncontent-length:");
+	if(field != string::npos) length = strtoul(header.c_str() + field + 17, NULL, 10);
+	body = buf.substr(end + 4);
+	while(body.size() < length){
+		int n = s.Recv(data, sizeof(data));
+		if(n <= 0) return false;
+		body.append(data, n);
+	}
+	return header.find("\r\nconnection: close") == string::npos;
+}
+
+//Chapter names may have spaces and such
+static string encodePath(const string &s){
+	string r;
+	for(size_t i=0;i<s.size();i++){
+		unsigned char c = s[i];
+		if(isalnum(c) || c == '-' || c == '_' || c == '.') r += c;
+		else{ char hex[4]; snprintf(hex, sizeof(hex), "%%%02X", c); r += hex; }
+	}
+	return r;
+}
+
+//One connection, kept open between requests, tiles picked at random over the zoom level
+static void loadThread(LOADTEST *t, int index, int count){
+	NetSocket s;
+	unsigned int rnd = t->seed + index*7919;
+	int side = 1 << t->zoom;
+	string chapter = encodePath(t->chapter);
+	vector <float> latencies;
+	int ok=0, busy=0, failed=0, errors=0;
+	bool open = false;
+	for(int i=0;i<count;i++){
+		rnd = rnd*1103515245 + 12345;
+		int x = (rnd >> 8) % side;
+		rnd = rnd*1103515245 + 12345;
+		int y = (rnd >> 8) % side;
+		char path[256];
+		snprintf(path, sizeof(path), "/%s/%d/%d/%d.png", chapter.c_str(), t->zoom, x, y);
+		
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		if(!open && !s.Connect(t->host, t->port)){ errors++; continue; }
+		int status = 0;
+		string body;
+		open = httpGet(s, t->host, path, status, body);
+		float ms = chrono::duration<float, milli>(chrono::steady_clock::now() - start).count();
+		if(!open) s.Close();
+		
+		if(status == 200){ ok++; latencies.push_back(ms); }
+		else if(status == 503) busy++;
+		else if(status != 0) failed++;
+		else errors++;
+	}
+	lock_guard<mutex> lock(t->lock);
+	t->latencies.insert(t->latencies.end(), latencies.begin(), latencies.end());
+	t->ok += ok; t->busy += busy; t->failed += failed; t->errors += errors;
+}
+
+static float percentile(const vector<float> &sorted, float p){
+	if(sorted.empty()) return 0;
+	size_t i = (size_t)(p*(sorted.size()-1) + 0.5f);
+	return sorted[min(i, sorted.size()-1)];
+}
+
+int main(int argc, char **argv){
+	//halfmapper-tileload [--host 127.0.0.1] [--port 8080] [--chapter name] [--zoom 3] [--threads 8] [--requests 1000] [--seed 1]
+	LOADTEST t;
+	t.host = "127.0.0.1"; t.port = 8080; t.zoom = 3; t.requests = 1000; t.seed = 1;
+	t.ok = t.busy = t.failed = t.errors = 0;
+	int threads = 8;
+	for(int i=1;i+1<argc;i+=2){
+		string arg = argv[i];
+		if(arg == "--host") t.host = argv[i+1];
+		else if(arg == "--port") t.port = (unsigned short)atoi(argv[i+1]);
+		else if(arg == "--chapter") t.chapter = argv[i+1];
+		else if(arg == "--zoom") t.zoom = max(0, min(atoi(argv[i+1]), 20));
+		else if(arg == "--threads") threads = max(1, atoi(argv[i+1]));
+		else if(arg == "--requests") t.requests = max(1, atoi(argv[i+1]));
+		else if(arg == "--seed") t.seed = (unsigned int)atoi(argv[i+1]);
+	}
+	NetSocket::Startup();
+	
+	//Without a chapter, the first one the server lists
+	if(t.chapter.empty()){
+		NetSocket s;
+		int status = 0;
+		string body;
+		if(!s.Connect(t.host, t.port)){
+			cerr << "Can't connect to " << t.host << ":" << t.port << "." << endl;
+			return 1;
+		}
+		httpGet(s, t.host, "/", status, body);
+		size_t list = body.find("Chapters:\n");
+		if(list != string::npos) t.chapter = body.substr(list + 10, body.find('\n', list + 10) - list - 10);
+		if(t.chapter.empty()){
+			cerr << "The server lists no chapter." << endl;
+			return 1;
+		}
+	}
+	cout << "Requesting " << t.requests << " tiles of " << t.chapter << " at zoom " << t.zoom << " over " << threads << " connections." << endl;
+	
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	vector <thread> workers;
+	for(int i=0;i<threads;i++){
+		int count = t.requests/threads + (i < t.requests%threads ? 1 : 0);
+		workers.push_back(thread(loadThread, &t, i, count));
+	}
+	for(size_t i=0;i<workers.size();i++) workers[i].join();
+	float seconds = chrono::duration<float>(chrono::steady_clock::now() - start).count();
+	
+	sort(t.latencies.begin(), t.latencies.end());
+	char line[256];
+	snprintf(line, sizeof(line), "%d tiles, %d busy (503), %d failed, %d connection errors in %.2f s: %.1f tiles/s",
+		t.ok, t.busy, t.failed, t.errors, seconds, seconds > 0 ? t.ok/seconds : 0.0f);
+	cout << line << endl;
+	snprintf(line, sizeof(line), "Latency ms: p50 %.2f, p90 %.2f, p99 %.2f, max %.2f",
+		percentile(t.latencies, 0.5f), percentile(t.latencies, 0.9f), percentile(t.latencies, 0.99f), t.latencies.empty() ? 0.0f : t.latencies.back());
+	cout << line << endl;
+	return t.ok > 0 ? 0 : 1;
+}
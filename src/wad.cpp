@@ -1,82 +1,260 @@
 #include "bsp.h"
 #include "wad.h"
+#include "MemoryRegistry.h"
+#include "TextureCache.h"
+#include "VirtualFileSystem.h"
+#include "TextureUploader.h"
+#include "TextureRegistry.h"
+#include "ScratchArena.h"
+#include "MipStreamer.h"
 
-int wadLoad(const std::vector<std::string> &szGamePaths, const string &filename) {
-	ifstream inWAD;
+static map <int, string> wadOfTexture; //WAD each texture id was first loaded from
 
-	// Try to open the file from all known gamepaths.
-	for (size_t i = 0; i < szGamePaths.size(); i++) {
-		if (!inWAD.is_open()) {
-			inWAD.open(szGamePaths[i] + filename.c_str(), ios::binary);
-		}
-	}
-
-	// If the WAD wasn't found in any of the gamepaths...
-	if(!inWAD.is_open()){ cerr << "Can't load WAD " << filename << "." << endl; return -1; }
+int wadLoad(const VirtualFileSystem &fs, const string &filename, bool reload, vector<int> *stale) {
+	// Loose, or inside a PAK of any of the gamepaths
+	VfsFile file;
+	if(!fs.Open(filename, file)){ cerr << "Can't load WAD " << filename << "." << endl; return -1; }
+	VfsStream inWAD(file);
 	
 	//Read header
 	WADHEADER wh; inWAD.read((char*)&wh, sizeof(wh));
 	if(wh.szMagic[0] != 'W' || wh.szMagic[1] != 'A' || wh.szMagic[2] != 'D' || wh.szMagic[3] != '3') return -1;
 	
-	//Read directory entries
-	WADDIRENTRY *wdes = new WADDIRENTRY[wh.nDir];
-	inWAD.seekg(wh.nDirOffset, ios::beg);		
-	inWAD.read((char*)wdes, sizeof(WADDIRENTRY)*wh.nDir);
+	//Directory and entries are scratch memory of this load
+	ScratchArena &scratch = ScratchArena::ForThread();
+	scratch.Reset();
 	
-	uint8_t *dataDr = new uint8_t[512*512];	 //Raw texture data 
-	uint8_t *dataUp = new uint8_t[512*512*4]; //32 bit texture 
-	uint8_t *dataPal = new uint8_t[256*3];	//256 color pallete
+	//Read directory entries
+	WADDIRENTRY *wdes = scratch.AllocateZeroed<WADDIRENTRY>(max(wh.nDir, 0));
+	inWAD.seekg(wh.nDirOffset, ios::beg);
+	inWAD.read((char*)wdes, sizeof(WADDIRENTRY)*max(wh.nDir, 0));
 	
 	for(int i=0;i<wh.nDir;i++){
 		inWAD.seekg(wdes[i].nFilePos, ios::beg);
 
 		BSPMIPTEX bmt;
 		inWAD.read((char*)&bmt, sizeof(bmt));
-		if(textures.count(bmt.szName) == 0){ //Only load if it's the first appearance of the texture
-				
+		int id;
+		bool replace;
+		TEXTURE old = TEXTURE();
+		{
+			lock_guard<mutex> lock(texturesMutex);
+			id = g_textures.Find(bmt.szName);
+			map <int, string>::const_iterator owner = wadOfTexture.find(id);
+			replace = reload && owner != wadOfTexture.end() && (*owner).second == filename;
+			if(replace) old = g_textures.Get(id);
+		}
+		if(id < 0 || replace){ //Only load if it's the first appearance of the texture
+			
+			//The whole entry, hashed to look it up in the texture cache, used in place
+			size_t rawOffset = min((size_t)max(wdes[i].nFilePos, 0), file.GetSize());
+			size_t rawSize = min((size_t)max(wdes[i].nDiskSize, 0), file.GetSize() - rawOffset);
+			const uint8_t *raw = file.GetData() + rawOffset;
+			
+			//Pixels already uploaded under another name are shared instead
+			unsigned long long content = miptexContentHash(raw, rawSize);
+			int oldId = id;
+			bool added;
+			{
+				lock_guard<mutex> lock(texturesMutex);
+				//Reloaded pixels only go into the same id when no other name shares it
+				if(replace) id = g_textures.Rebind(bmt.szName, content, bmt.nWidth, bmt.nHeight, true, added);
+				else id = g_textures.InternContent(bmt.szName, content, bmt.nWidth, bmt.nHeight, added);
+			}
+			bool moved = replace && id != oldId;
+			if(moved && stale != NULL) stale->push_back(oldId);
+			unsigned long long hash = TextureCache::Hash(raw, rawSize);
+			MipSource source;
+			source.pFileSystem = &fs; source.szFile = filename; source.uOffset = rawOffset; source.uSize = rawSize;
+			source.uHash = hash; source.szOwner = filename;
+			if(!added){
+				//Same pixels, other entries of the WAD may have moved them
+				if(replace && !moved) g_mipStreamer.MoveSource(id, source);
+				continue;
+			}
+			
 			TEXTURE n;
 			n.w = bmt.nWidth; n.h = bmt.nHeight;
-			glGenTextures(1, &n.texId);		
+			
+			//Decoded straight into upload memory, so the upload of one texture overlaps decoding the next.
+			//When streaming, only the smallest levels are, the others come as the camera gets close.
+			CachedTexture cached;
+			StagingBuffer staging;
+			int first = g_mipStreamer.GetFirstMip();
+			size_t firstOffset = mipChainOffset(n.w, n.h, first);
+			g_textureUploader.Reserve(mipChainOffset(n.w, n.h, MIPLEVELS) - firstOffset, staging, true);
+			
+			if(g_textureCache.Load(hash, cached) && cached.GetWidth() == n.w && cached.GetHeight() == n.h && cached.GetLevels() == MIPLEVELS){
+				memcpy(staging.GetData(), cached.GetMip(first), staging.GetSize());
+				memcpy(n.avg, cached.GetAverage(), 3);
+			}else{
+				if(!decodeMiptex(raw, rawSize, staging.GetData(), n.avg, first)){
+					cerr << "Can't decode " << bmt.szName << " in " << filename << "." << endl;
+					g_textureUploader.Release(staging);
+					continue;
+				}
+				if(first == 0) g_textureCache.Store(hash, n.w, n.h, staging.GetData(), MIPLEVELS, n.avg);
+			}
+			
+			n.mipDrop = g_gpuMemory.MipsToDrop(n.w, n.h, MIPLEVELS);
+			int top = max(n.mipDrop, first);
+			n.baseLevel = top-n.mipDrop;
+			if(replace && !moved){
+				//Same texture object, maps and batches keep pointing at it
+				n.texId = old.texId;
+				g_gpuMemory.ReleaseTexture(n.texId);
+				if(stale != NULL && (old.w != n.w || old.h != n.h)) stale->push_back(id);
+			}else{
+				glGenTextures(1, &n.texId);
+			}
 			glBindTexture(GL_TEXTURE_2D, n.texId);
 			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
 			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 3);
-			
-			//Sizes of each mipmap
-			const int dimensionsSquared[4] = {1,4,16,64};
-			const int dimensions[4] = {1,2,4,8};
-			
-			//Read each mipmap
-			for(int mip=3;mip>=0;mip--){
-				inWAD.seekg(wdes[i].nFilePos+bmt.nOffsets[mip], ios::beg);
-				inWAD.read((char*)dataDr, bmt.nWidth*bmt.nHeight/dimensionsSquared[mip]);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, n.baseLevel);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 3-n.mipDrop);
 			
-				if(mip == 3){
-					//Read the pallete (comes after last mipmap)
-					uint16_t dummy; inWAD.read((char*)&dummy, 2);
-					inWAD.read((char*)dataPal, 256*3);
-				}
-				
-				for(uint32_t y=0;y<bmt.nHeight/dimensions[mip];y++)
-				for(uint32_t x=0;x<bmt.nWidth/dimensions[mip];x++){
-					dataUp[(x+y*bmt.nWidth/dimensions[mip])*4] = dataPal[dataDr[y*bmt.nWidth/dimensions[mip]+x]*3];
-					dataUp[(x+y*bmt.nWidth/dimensions[mip])*4+1] = dataPal[dataDr[y*bmt.nWidth/dimensions[mip]+x]*3+1];
-					dataUp[(x+y*bmt.nWidth/dimensions[mip])*4+2] = dataPal[dataDr[y*bmt.nWidth/dimensions[mip]+x]*3+2];
-					
-					//Do full transparency on blue pixels
-					if(dataUp[(x+y*bmt.nWidth/dimensions[mip])*4] == 0 && dataUp[(x+y*bmt.nWidth/dimensions[mip])*4+1] == 0 && dataUp[(x+y*bmt.nWidth/dimensions[mip])*4+2] == 255)
-						dataUp[(x+y*bmt.nWidth/dimensions[mip])*4+3] = 0;
-					else
-						dataUp[(x+y*bmt.nWidth/dimensions[mip])*4+3] = 255;
-				}
-				
-				glTexImage2D(GL_TEXTURE_2D, mip, GL_RGBA, bmt.nWidth/dimensions[mip], bmt.nHeight/dimensions[mip], 0, GL_RGBA, GL_UNSIGNED_BYTE, dataUp);
+			//Levels over the budget are left out
+			size_t bytes = 0;
+			for(int mip=top;mip<MIPLEVELS;mip++){
+				g_textureUploader.UploadLevel(staging, mipChainOffset(n.w, n.h, mip) - firstOffset, mip-n.mipDrop, GL_RGBA, n.w>>mip, n.h>>mip);
+				bytes += (n.w>>mip)*(n.h>>mip)*4;
 			}
+			g_textureUploader.Release(staging);
+			g_gpuMemory.TrackTexture(n.texId, MemoryRegistry::CATEGORY_TEXTURE, filename, bytes);
 		
-			textures[bmt.szName]=n;				
+			{
+				lock_guard<mutex> lock(texturesMutex);
+				g_textures.Get(id) = n;
+				wadOfTexture[id]=filename;
+			}
+			
+			//Registering again after a reload drops levels streamed from the old pixels
+			g_mipStreamer.Register(id, &g_textures.Get(id), source);
 		}
 	}
 	
-	delete []dataDr; delete []dataUp; delete []dataPal; delete []wdes;
 	return 0;
 }
+
+void releaseTexture(int id){
+	TEXTURE t;
+	{
+		lock_guard<mutex> lock(texturesMutex);
+		t = g_textures.Get(id);
+	}
+	g_mipStreamer.Unregister(id);
+	if(t.texId != 0){
+		g_gpuMemory.ReleaseTexture(t.texId);
+		glDeleteTextures(1, &t.texId);
+	}
+	lock_guard<mutex> lock(texturesMutex);
+	g_textures.Release(id);
+	wadOfTexture.erase(id);
+}
+
+int wadList(const VirtualFileSystem &fs, const string &filename, vector<string> &names){
+	VfsFile file;
+	if(!fs.Open(filename, file)){ cerr << "Can't load WAD " << filename << "." << endl; return -1; }
+	VfsStream inWAD(file);
+	
+	WADHEADER wh; inWAD.read((char*)&wh, sizeof(wh));
+	if(wh.szMagic[0] != 'W' || wh.szMagic[1] != 'A' || wh.szMagic[2] != 'D' || wh.szMagic[3] != '3') return -1;
+	
+	vector <WADDIRENTRY> wdes(max(wh.nDir, 0));
+	inWAD.seekg(wh.nDirOffset, ios::beg);
+	if(!wdes.empty()) inWAD.read((char*)&wdes[0], sizeof(WADDIRENTRY)*wdes.size());
+	
+	//Named by their miptex header, like wadLoad does
+	for(size_t i=0;i<wdes.size();i++){
+		inWAD.seekg(wdes[i].nFilePos, ios::beg);
+		BSPMIPTEX bmt;
+		inWAD.read((char*)&bmt, sizeof(bmt));
+		bmt.szName[MAXTEXTURENAME-1] = 0;
+		names.push_back(bmt.szName);
+	}
+	return 0;
+}
+
+size_t mipChainOffset(int w, int h, int level){
+	size_t offset = 0;
+	for(int mip=0;mip<level;mip++) offset += (size_t)(w>>mip)*(h>>mip)*4;
+	return offset;
+}
+
+//Identity of a miptex for sharing: size, indices of every mip and palette, not the name or layout
+unsigned long long miptexContentHash(const uint8_t *raw, size_t size){
+	if(size < sizeof(BSPMIPTEX)) return 0;
+	BSPMIPTEX bmt;
+	memcpy(&bmt, raw, sizeof(bmt));
+	if(bmt.nWidth == 0 || bmt.nHeight == 0 || bmt.nWidth > 4096 || bmt.nHeight > 4096) return 0;
+	
+	size_t palOffset = (size_t)bmt.nOffsets[3] + (bmt.nWidth/8)*(bmt.nHeight/8) + 2;
+	if(palOffset + 256*3 > size) return 0;
+	
+	//64 bit FNV-1a, like TextureCache::Hash, over each part in turn
+	unsigned long long hash = 14695981039346656037ULL;
+	uint32_t dims[2] = {bmt.nWidth, bmt.nHeight};
+	const uint8_t *parts[MIPLEVELS+2];
+	size_t sizes[MIPLEVELS+2];
+	parts[0] = (const uint8_t*)dims; sizes[0] = sizeof(dims);
+	for(int mip=0;mip<MIPLEVELS;mip++){
+		sizes[mip+1] = (size_t)(bmt.nWidth>>mip)*(bmt.nHeight>>mip);
+		if((size_t)bmt.nOffsets[mip] + sizes[mip+1] > size) return 0;
+		parts[mip+1] = raw + bmt.nOffsets[mip];
+	}
+	parts[MIPLEVELS+1] = raw + palOffset; sizes[MIPLEVELS+1] = 256*3;
+	
+	for(int p=0;p<MIPLEVELS+2;p++){
+		for(size_t j=0;j<sizes[p];j++){
+			hash ^= parts[p][j];
+			hash *= 1099511628211ULL;
+		}
+	}
+	return hash != 0 ? hash : 1; //0 stands for unknown
+}
+
+//Decodes the palettized mips of a miptex to RGBA, raw starts with its BSPMIPTEX
+bool decodeMiptex(const uint8_t *raw, size_t size, uint8_t *chain, unsigned char avg[3], int firstMip){
+	if(size < sizeof(BSPMIPTEX)) return false;
+	BSPMIPTEX bmt;
+	memcpy(&bmt, raw, sizeof(bmt));
+	if(bmt.nWidth == 0 || bmt.nHeight == 0 || bmt.nWidth > 4096 || bmt.nHeight > 4096) return false;
+	
+	//The palette comes after the last mipmap
+	size_t palOffset = (size_t)bmt.nOffsets[3] + (bmt.nWidth/8)*(bmt.nHeight/8) + 2;
+	if(palOffset + 256*3 > size) return false;
+	const uint8_t *pal = &raw[palOffset];
+	
+	size_t first = mipChainOffset(bmt.nWidth, bmt.nHeight, firstMip);
+	for(int mip=firstMip;mip<MIPLEVELS;mip++){
+		size_t pixels = (size_t)(bmt.nWidth>>mip)*(bmt.nHeight>>mip);
+		if((size_t)bmt.nOffsets[mip] + pixels > size) return false;
+		const uint8_t *indices = &raw[bmt.nOffsets[mip]];
+		
+		uint8_t *level = chain + mipChainOffset(bmt.nWidth, bmt.nHeight, mip) - first;
+		for(size_t j=0;j<pixels;j++){
+			uint8_t *px = &level[j*4];
+			px[0] = pal[indices[j]*3];
+			px[1] = pal[indices[j]*3+1];
+			px[2] = pal[indices[j]*3+2];
+			
+			//Do full transparency on blue pixels
+			if(px[0] == 0 && px[1] == 0 && px[2] == 255)
+				px[0] = px[1] = px[2] = px[3] = 0;
+			else
+				px[3] = 255;
+		}
+	}
+	
+	//Average opaque colour of the smallest mipmap, used by the LOD meshes
+	unsigned int sum[3] = {0,0,0}, count = 0;
+	const uint8_t *last = chain + mipChainOffset(bmt.nWidth, bmt.nHeight, MIPLEVELS-1) - first;
+	size_t lastSize = (size_t)(bmt.nWidth>>(MIPLEVELS-1))*(bmt.nHeight>>(MIPLEVELS-1))*4;
+	for(size_t j=0;j<lastSize;j+=4){
+		if(last[j+3] == 0) continue;
+		sum[0] += last[j]; sum[1] += last[j+1]; sum[2] += last[j+2];
+		count++;
+	}
+	for(int c=0;c<3;c++) avg[c] = count ? sum[c]/count : 128;
+	return true;
+}
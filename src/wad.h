@@ -2,6 +2,7 @@
 #define WAD_H
 
 #include <vector>
+#include "bsp.h" //For BSPMIPTEX and MIPLEVELS
 
 //Extracted from http://hlbsp.sourceforge.net/index.php?content=waddef
 
@@ -21,6 +22,21 @@ struct WADDIRENTRY{
 	char szName[16]; // must be null terminated
 };
 
-int wadLoad(const std::vector<std::string> &szGamePaths, const string &filename);
+//Files are read from fs, and streamed mip levels later from the same one
+//With reload, textures first loaded from this WAD are uploaded again into their texture objects, or
+//into new ones when other names share them. Ids maps have to be reloaded for are added to stale: those
+//that changed size, as UVs are normalised by the size, and those a name moved away from
+int wadLoad(const VirtualFileSystem &fs, const string &filename, bool reload = false, vector<int> *stale = NULL);
+//Frees the texture object of an id no name or loaded map uses any more, main thread only
+void releaseTexture(int id);
+//Names of the textures in a WAD, as wadLoad would register them, without decoding or uploading
+int wadList(const VirtualFileSystem &fs, const string &filename, vector<string> &names);
+//Offset of a level in an RGBA mip chain stored level after level, level MIPLEVELS gives the size
+size_t mipChainOffset(int w, int h, int level);
+//Hash of the pixels and palette of a miptex, the same for equal textures under any name, 0 when malformed
+unsigned long long miptexContentHash(const uint8_t *raw, size_t size);
+//Decodes into an RGBA mip chain of mipChainOffset(w, h, MIPLEVELS) bytes, or only the levels from firstMip
+//down into mipChainOffset(w, h, MIPLEVELS) - mipChainOffset(w, h, firstMip) bytes
+bool decodeMiptex(const uint8_t *raw, size_t size, uint8_t *chain, unsigned char avg[3], int firstMip = 0);
 
 #endif